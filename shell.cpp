@@ -1,10 +1,8 @@
 #include <iostream>
 #include <vector>
-#include <windows.h>
 #include <string>
 #include <sstream>
 #include <fstream>
-#include <direct.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <cstdio>
@@ -12,566 +10,7571 @@
 #include <locale>
 #include <codecvt>
 #include <map>
+#include <functional>
 #include <csignal>
-#include <conio.h>
 #include <algorithm>
-#include <io.h>
 #include <cctype>
 #include <cmath>
+#include <climits>
+#include <chrono>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <deque>
+#include <regex>
+#include <charconv>
+#include <cstdarg>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <conio.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#endif
 
 using namespace std;
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 // Global variables
-const string shellPassword = "1234";
-const string notesFile = "shell_notes.txt";
-vector<string> command_history;
-map<string, string> alias_map;
+string shellPassword = "1234";          // these three can be set in the rc file
+string notesFile = "shell_notes.txt";
+string shellPrompt = "Shell> ";
 volatile sig_atomic_t interrupted = 0;
-int history_index = -1;
 
+thread_local int last_status = 0;   // per thread: builtin pipeline stages run on their own
+vector<int> pipe_status;     // exit status of each stage of the last foreground pipeline
+long pipe_buffer_size = 0;   // F_SETPIPE_SZ request for pipeline pipes, 0 = kernel default
+
+// Process handles: a HANDLE from CreateProcess on Windows, the child pid on POSIX.
+#ifdef _WIN32
+typedef HANDLE ProcHandle;
+typedef DWORD ProcId;
+typedef HANDLE IoHandle;
+const IoHandle NO_IO = NULL;
+#else
+typedef pid_t ProcHandle;
+typedef pid_t ProcId;
+typedef int IoHandle;
+const IoHandle NO_IO = -1;
+#endif
+
+// Standard streams for a spawned process; NO_IO inherits the shell's own.
+// err_to_out (2>&1 onto a pipe or the terminal) and out_to_err (1>&2) make
+// the child copy one descriptor onto the other once the rest is in place.
+struct SpawnIO {
+    IoHandle in = NO_IO;
+    IoHandle out = NO_IO;
+    IoHandle err = NO_IO;
+    bool err_to_out = false;
+    bool out_to_err = false;
+};
+
+// CPU time, peak memory and context switches of a finished process.
+struct ProcUsage {
+    double user_sec = 0;
+    double sys_sec = 0;
+    long max_rss_kb = 0;
+    long voluntary_switches = 0;
+    long involuntary_switches = 0;
+};
+
+// Foreground children's usage, added up as they are waited for. "time"
+// takes the difference across a command, so background jobs finishing in
+// the meantime do not count.
+struct ChildTotals {
+    atomic<uint64_t> user_us{0};
+    atomic<uint64_t> sys_us{0};
+    atomic<uint64_t> voluntary{0};
+    atomic<uint64_t> involuntary{0};
+    atomic<long> peak_rss_kb{0};
+
+    void add(const ProcUsage& usage) {
+        user_us += (uint64_t)(usage.user_sec * 1e6);
+        sys_us += (uint64_t)(usage.sys_sec * 1e6);
+        voluntary += usage.voluntary_switches;
+        involuntary += usage.involuntary_switches;
+        long peak = peak_rss_kb;
+        while (usage.max_rss_kb > peak && !peak_rss_kb.compare_exchange_weak(peak, usage.max_rss_kb)) {}
+    }
+};
+ChildTotals child_totals;
+
+struct JobProcess {
+    ProcHandle hProcess;
+    ProcId pid;
+    bool isRunning;
+    int exitCode;
+};
+
+// A background command; a background pipeline is one job with a process
+// per stage. Its exit code is the last stage's, as for foreground pipelines.
 struct Job {
     int id;
-    HANDLE hProcess;
-    DWORD pid;
     string command;
+    vector<JobProcess> processes;
+    size_t running;         // processes not reaped yet
     bool isRunning;
+    bool stopped;
+    int exitCode;
+    ProcUsage usage;        // summed over the finished processes
 };
 
-vector<Job> jobList;
+// Jobs are indexed by ID (a null slot is a free ID). The reaper updates
+// them from its own thread, so every access holds job_mutex. They are
+// shared so that a waiter keeps its job alive while another thread removes
+// it from the table.
+vector<shared_ptr<Job>> jobTable;
+unordered_map<ProcId, int> jobByPid;
+mutex job_mutex;
+condition_variable job_finished;
 int jobCounter = 1;
+int verbosity = 0;          // 1+ traces every dispatched command on stderr
+bool exit_requested = false;
+
+// Arguments of one command: views into the command line or the parse arena,
+// so dispatching a command does not copy its words.
+struct Args {
+    const string_view* items = nullptr;
+    size_t count = 0;
+
+    Args() = default;
+    Args(const string_view* items, size_t count) : items(items), count(count) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const string_view& operator[](size_t i) const { return items[i]; }
+    const string_view& back() const { return items[count - 1]; }
+    const string_view* begin() const { return items; }
+    const string_view* end() const { return items + count; }
+
+    string str(size_t i) const { return string(items[i]); }
+    Args from(size_t first) const { return Args(items + first, count - first); }
+    vector<string> to_vector() const { return vector<string>(begin(), end()); }
+};
+
+// Builtin command metadata; the table itself lives next to execute_command.
+typedef void (*BuiltinHandler)(const Args& args);
+
+enum BuiltinSection { SECTION_GENERAL, SECTION_CUSTOM, SECTION_HINDI };
+
+// What TAB should offer for the arguments of a builtin.
+enum CompletionHint { COMPLETE_NONE, COMPLETE_FILES, COMPLETE_DIRS, COMPLETE_COMMANDS };
+
+struct Builtin {
+    const char* name;
+    BuiltinHandler handler;
+    int min_args;
+    const char* usage;
+    const char* help;
+    BuiltinSection section;
+    CompletionHint completion;
+};
 
 // Forward declarations
 string resolve_alias(const string& input);
-void execute_command(const vector<string>& args);
+inline uint64_t hash_bytes(const char* p, size_t n);
+void run_script_line(string_view line);
+void execute_command(const Args& args, const SpawnIO& io = SpawnIO());
 void print_help();
+const Builtin* find_builtin(const string& name);
+bool runs_in_shell(const string& name);
+const Builtin* builtins_begin();
+const Builtin* builtins_end();
 void autocomplete(string& input);
+void redraw_input(const string& shown, const string& text);
+void history_append(string_view line);
+bool history_previous(size_t& cursor, string& entry);
+bool history_next(size_t& cursor, string& entry);
+size_t history_end();
+bool reverse_search(string& input);
 string get_input_with_features();
 void signal_handler(int signal);
 void init_signals();
-void count_word_in_file(const string& filename, const string& word);
-void word_frequency(const string& filename);
-void calculator(const string& num1_str, const string& op, const string& num2_str);
-void addJob(HANDLE hProcess, DWORD pid, const string& command);
+void word_frequency(const string& filename, size_t top_k, unsigned threads);
+void calc_command(const Args& args);
+bool stdin_is_terminal();
+int addJob(const string& command, const vector<ProcHandle>& handles, const vector<ProcId>& pids);
+void processExited(ProcId pid, int exitCode, const ProcUsage& usage);
 void listJobs();
+void reportFinishedJobs();
 void fg(int jobId);
-void killJob(int jobId);
-void launchBackgroundProcess(const string& command);
-void runPipedCommand(const string& command);
-void runWithRedirection(const string& command);
+void bg(int jobId);
+int waitJob(int jobId);
+void killJob(int jobId, int sig);
+void launchBackgroundProcess(const vector<string>& argv, const string& command);
+bool startPipeline(const vector<vector<string>>& stages, const vector<SpawnIO>& io,
+                   vector<ProcHandle>& handles, vector<ProcId>& pids, vector<bool>& started);
+vector<int> runPipeline(const vector<vector<string>>& stages, const vector<SpawnIO>& io);
 void runPingCommand(const string& host);
-void scheduleCommand(const string& command, int delaySeconds);
 void addNote(const string& note);
 void viewNotes();
 bool authenticateShell();
 void lockShell();
+vector<string> tokenize(const string& input);
+string resolve_executable(const string& name);
+void forget_command(const string& name);
+string search_path(const string& name);
+bool spawnProcess(const vector<string>& argv, const SpawnIO& io, ProcHandle& handle, ProcId& pid);
+IoHandle openRedirect(const string& filename, bool output, bool append = false);
+int waitProcess(ProcHandle handle);
+int waitProcessUsage(ProcHandle handle, ProcUsage& usage);
+void watchProcess(ProcHandle handle, ProcId pid);
+bool signalProcess(ProcHandle handle, int sig);
+int runExternal(const vector<string>& argv, const SpawnIO& io = SpawnIO());
+void runBenchmark(const Args& args);
+void run_command_line(string_view line);
+string capture_output(string_view line);
+string join_args(const Args& args, size_t first, size_t last);
 
-// Helper function to convert string to lowercase
-string to_lower(string str) {
-    transform(str.begin(), str.end(), str.begin(), ::tolower);
-    return str;
-}
-
-// Helper function to split string into words
-vector<string> split_words(const string& text) {
-    vector<string> words;
-    istringstream iss(text);
-    string word;
-    while (iss >> word) {
-        // Remove punctuation
-        word.erase(remove_if(word.begin(), word.end(), ::ispunct), word.end());
-        if (!word.empty()) {
-            words.push_back(to_lower(word));
-        }
+// Writes all of data to fd, retrying short writes. Returns false if a
+// write failed.
+bool write_all(int fd, const char* data, size_t size) {
+    for (size_t done = 0; done < size;) {
+        long n = write(fd, data + done, (unsigned)min<size_t>(size - done, 1 << 30));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
     }
-    return words;
+    return true;
 }
 
-// Signal handler
-void signal_handler(int signal) {
-    if (signal == SIGINT) {
-        interrupted = 1;
-        cout << "\nInterrupt received (Ctrl+C)\n";
-    }
+bool write_all(int fd, const string& data) {
+    return write_all(fd, data.data(), data.size());
 }
 
-void init_signals() {
-    signal(SIGINT, signal_handler);
+// A name next to path for a file that is written and then renamed over it;
+// no other process, or thread of this one, picks the same.
+string temp_path_for(const string& path) {
+    ostringstream name;
+#ifdef _WIN32
+    name << path << ".tmp" << GetCurrentProcessId() << '-' << this_thread::get_id();
+#else
+    name << path << ".tmp" << getpid() << '-' << this_thread::get_id();
+#endif
+    return name.str();
 }
 
-// Alias handling
-string resolve_alias(const string& input) {
-    istringstream iss(input);
-    string first_word;
-    iss >> first_word;
+// Where builtin output goes. The shell's stdout is an FdWriter; cout is
+// rebound in main to forward here, so endl and flush reach line_end().
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    virtual void write(const char* data, size_t size) = 0;
+    virtual void line_end() {}      // endl or cout.flush(): a hint, not a demand
+    virtual void flush() {}         // must reach the file descriptor now
+    virtual int fd() const { return -1; }   // descriptor behind the sink, -1 if in memory
 
-    if (alias_map.count(first_word)) {
-        string replaced = alias_map[first_word] + input.substr(first_word.length());
-        return replaced;
+    // Formatted appends without iostream's locale and sentry overhead.
+    void put(string_view text) { write(text.data(), text.size()); }
+    void put(char c) { write(&c, 1); }
+    void put(long long value) {
+        char digits[24];
+        write(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
     }
-    return input;
-}
+    void put(unsigned long long value) {
+        char digits[24];
+        write(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+    }
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    void printf(const char* format, ...) {
+        char text[512];
+        va_list ap;
+        va_start(ap, format);
+        int n = vsnprintf(text, sizeof(text), format, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < sizeof(text)) {
+            write(text, n);
+            return;
+        }
+        string longer(n + 1, '\0');
+        va_start(ap, format);
+        vsnprintf(&longer[0], longer.size(), format, ap);
+        va_end(ap);
+        write(longer.data(), n);
+    }
+};
+
+inline OutputSink& operator<<(OutputSink& sink, string_view text) { sink.put(text); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, const char* text) { sink.put(string_view(text)); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, const string& text) { sink.put(string_view(text)); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, char c) { sink.put(c); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, int value) { sink.put((long long)value); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, long value) { sink.put((long long)value); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, long long value) { sink.put(value); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, unsigned value) { sink.put((unsigned long long)value); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, unsigned long value) { sink.put((unsigned long long)value); return sink; }
+inline OutputSink& operator<<(OutputSink& sink, unsigned long long value) { sink.put(value); return sink; }
 
-bool handle_alias_command(const vector<string>& args) {
-    if (args.empty() || args[0] != "alias") return false;
+// Counters behind the stats builtin.
+struct OutputStats {
+    atomic<unsigned long long> bytes{0};        // bytes handed to the writer
+    atomic<unsigned long long> writes{0};       // write() calls made
+    atomic<unsigned long long> full{0};         // flushes because the buffer filled
+    atomic<unsigned long long> lines{0};        // flushes at a line end on a terminal
+    atomic<unsigned long long> explicit_{0};    // flushes before the prompt, a child or raw fd output
+    atomic<unsigned long long> hints{0};        // endl/flush requests that needed no write
+};
 
-    string full_command;
-    for (const auto& arg : args) full_command += arg + " ";
-    if (!full_command.empty()) full_command.pop_back(); 
+// Buffers output for one file descriptor. Text is written when the buffer
+// fills, when flush() is called (prompt, child start, exit) and, only while
+// the descriptor is a terminal, at each line end. Output to files and pipes
+// therefore costs one write() per 64 KiB instead of one per endl. The reaper
+// and scheduler threads print too, so every call holds the mutex.
+class FdWriter : public OutputSink {
+public:
+    // An owned descriptor is closed, after a last flush, on destruction.
+    explicit FdWriter(int fd, size_t capacity = 64 * 1024, bool owned = false)
+        : descriptor(fd), capacity(capacity), owned(owned), buffer(new char[capacity]) {
+        refresh_mode();
+    }
 
-    if (args.size() == 1) {
-        for (const auto& pair : alias_map) {
-            cout << "alias " << pair.first << "='" << pair.second << "'\n";
-        }
-    } else {
-        string rest = full_command.substr(6);
-        size_t eq_pos = rest.find('=');
-        if (eq_pos == string::npos) {
-            cerr << "Invalid alias format. Use: alias name='command'\n";
-            return true;
-        }
+    ~FdWriter() {
+        flush();
+        if (owned) close(descriptor);
+    }
 
-        string key = rest.substr(0, eq_pos);
-        string val = rest.substr(eq_pos + 1);
+    // Re-checks for a terminal after the descriptor has been redirected.
+    void refresh_mode() {
+        lock_guard<mutex> lock(m);
+        line_buffered = isatty(descriptor) != 0;
+    }
 
-        if ((val.front() == '\'' && val.back() == '\'') || (val.front() == '"' && val.back() == '"')) {
-            val = val.substr(1, val.size() - 2);
+    void write(const char* data, size_t size) override {
+        lock_guard<mutex> lock(m);
+        stats.bytes += size;
+        if (used + size > capacity) {
+            if (used) drain(stats.full);
+            if (size >= capacity) {
+                stats.writes++;
+                write_all(descriptor, data, size);
+                return;
+            }
         }
+        memcpy(buffer.get() + used, data, size);
+        used += size;
+        if (line_buffered && memchr(data, '\n', size)) drain(stats.lines);
+    }
 
-        alias_map[key] = val;
+    void line_end() override {
+        lock_guard<mutex> lock(m);
+        if (line_buffered && used) drain(stats.lines);
+        else stats.hints++;
     }
 
-    return true;
+    void flush() override {
+        lock_guard<mutex> lock(m);
+        if (used) drain(stats.explicit_);
+    }
+
+    int fd() const override { return descriptor; }
+    bool is_line_buffered() const { return line_buffered; }
+    size_t buffer_size() const { return capacity; }
+
+    OutputStats stats;
+
+private:
+    int descriptor;
+    size_t capacity;
+    bool owned;
+    size_t used = 0;
+    bool line_buffered;
+    unique_ptr<char[]> buffer;
+    mutex m;
+
+    void drain(atomic<unsigned long long>& reason) {
+        reason++;
+        stats.writes++;
+        write_all(descriptor, buffer.get(), used);
+        used = 0;
+    }
+};
+
+// Lives until exit so the atexit flush and the threads can still use it.
+FdWriter& stdout_writer() {
+    static FdWriter* writer = new FdWriter(1);
+    return *writer;
 }
 
-// String conversion helper
-string wide_to_narrow(const wchar_t* wide) {
-    wstring_convert<codecvt_utf8<wchar_t>> converter;
-    return converter.to_bytes(wide);
+// Builtin output redirected to a file is written in blocks this large;
+// with ">>" each block is a single O_APPEND write.
+const size_t REDIRECT_BUFFER_SIZE = 1 << 20;
+
+// Unbuffered, like stderr itself.
+class StderrSink : public OutputSink {
+public:
+    void write(const char* data, size_t size) override { write_all(2, data, size); }
+    int fd() const override { return 2; }
+};
+
+// A builtin pipeline stage or a redirection can point its thread at other
+// sinks; cout and cerr follow.
+thread_local OutputSink* current_output = nullptr;
+thread_local OutputSink* current_error = nullptr;
+
+OutputSink& out() {
+    return current_output ? *current_output : stdout_writer();
 }
 
-void autocomplete(string& input) {
-    size_t last_space = input.find_last_of(" ");
-    string prefix = (last_space == string::npos) ? input : input.substr(last_space + 1);
-    string base = (last_space == string::npos) ? "" : input.substr(0, last_space + 1);
+OutputSink& err() {
+    static StderrSink* standard_error = new StderrSink();
+    return current_error ? *current_error : *standard_error;
+}
 
-    vector<string> suggestions;
+// Writes pending output before anything else touches the descriptor.
+void flush_output() {
+    out().flush();
+    if (current_error) current_error->flush();
+}
 
-    WIN32_FIND_DATAA findFileData;
-    HANDLE hFind = FindFirstFileA("*.*", &findFileData);
+// Unbuffered streambuf that hands everything to out() (or err()); iostream
+// formatting keeps working while the bytes land in the shared buffer.
+class SinkStreamBuf : public streambuf {
+public:
+    explicit SinkStreamBuf(OutputSink& (*sink)()) : sink(sink) {}
 
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            string name = findFileData.cFileName;
-            if (name != "." && name != ".." && name.rfind(prefix, 0) == 0) {
-                suggestions.push_back(name);
-            }
-        } while (FindNextFileA(hFind, &findFileData));
-        FindClose(hFind);
+protected:
+    int_type overflow(int_type c) override {
+        if (c != traits_type::eof()) {
+            char ch = (char)c;
+            sink().write(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+    streamsize xsputn(const char* data, streamsize size) override {
+        sink().write(data, (size_t)size);
+        return size;
+    }
+    int sync() override {
+        sink().line_end();
+        return 0;
     }
 
-    vector<string> commands = {
-        "help", "cd", "pwd", "clear", "history", "ls", "ll", "mkdir",
-        "touch", "rm", "cat", "cp", "mv", "time", "exit", 
-        "banao", "hatao", "dikhhao", "badlo", "count", "wordfreq", "calc"
-    };
+private:
+    OutputSink& (*sink)();
+};
 
-    for (const auto& cmd : commands) {
-        if (cmd.rfind(prefix, 0) == 0) {
-            suggestions.push_back(cmd);
-        }
+void install_output() {
+    static SinkStreamBuf output(out);
+    static SinkStreamBuf errors(err);
+    cout.rdbuf(&output);
+    cerr.rdbuf(&errors);
+    atexit(flush_output);
+}
+
+// Collects output in memory; $(...) captures a command line with one.
+class StringSink : public OutputSink {
+public:
+    void write(const char* data, size_t size) override { text.append(data, size); }
+
+    string text;
+};
+
+// Where builtins read their standard input. Like current_output, a builtin
+// pipeline stage points its thread at a pipe or a ring buffer; otherwise
+// input comes from fd 0.
+class InputSource {
+public:
+    virtual ~InputSource() {}
+    virtual long read(char* data, size_t size) = 0;   // 0 at end of input, -1 on error
+    virtual int fd() const { return -1; }             // descriptor behind it, -1 if in memory
+};
+
+class FdSource : public InputSource {
+public:
+    explicit FdSource(int fd, bool owned = false) : descriptor(fd), owned(owned) {}
+
+    ~FdSource() {
+        if (owned) close(descriptor);
     }
 
-    if (!suggestions.empty()) {
-        input = base + suggestions[0];
-        cout << "\r" << input << string(50, ' ');
+    long read(char* data, size_t size) override {
+        while (true) {
+            long n = ::read(descriptor, data, (unsigned)size);
+            if (n < 0 && errno == EINTR) continue;
+            return n;
+        }
     }
+
+    int fd() const override { return descriptor; }
+
+private:
+    int descriptor;
+    bool owned;
+};
+
+thread_local InputSource* current_input = nullptr;
+
+InputSource& in() {
+    static FdSource* standard_input = new FdSource(0);
+    return current_input ? *current_input : *standard_input;
 }
 
-string get_input_with_features() {
-    string input;
-    char ch;
+bool input_is_terminal() {
+    int fd = in().fd();
+    return fd >= 0 && isatty(fd) != 0;
+}
 
+// Reads the rest of the current input.
+bool read_input(string& data) {
+    char block[65536];
     while (true) {
-        ch = _getch();
-        if (ch == '\r') {
-            cout << endl;
-            break;
-        } else if (ch == '\b') {
-            if (!input.empty()) {
-                input.pop_back();
-                cout << "\b \b";
-            }
-        } else if (ch == 0 || ch == -32) {
-            ch = _getch();
+        long n = in().read(block, sizeof(block));
+        if (n < 0) return false;
+        if (n == 0) return true;
+        data.append(block, n);
+    }
+}
 
-            if (ch == 72) { // Up arrow
-                if (!command_history.empty() && history_index > 0)
-                    history_index--;
-                else if (history_index == -1 && !command_history.empty())
-                    history_index = (int)command_history.size() - 1;
-
-                if (history_index >= 0 && history_index < (int)command_history.size()) {
-                    input = command_history[history_index];
-                    cout << "\r" << input << string(50, ' ');
-                }
-            } else if (ch == 80) { // Down arrow
-                if (!command_history.empty() && history_index < (int)command_history.size() - 1)
-                    history_index++;
-                else
-                    history_index = -1;
-
-                if (history_index >= 0 && history_index < (int)command_history.size()) {
-                    input = command_history[history_index];
-                    cout << "\r" << input << string(50, ' ');
-                } else {
-                    input.clear();
-                    cout << "\r" << string(50, ' ');
-                }
-            }
-        } else if (ch == '\t') {
-            autocomplete(input);
-        } else {
-            input += ch;
-            cout << ch;
+// Bounded byte queue joining two builtin stages that run on different
+// threads. write() blocks while it is full and read() while it is empty, so
+// a producer never gets more than the capacity ahead of its consumer and a
+// pipeline streams in constant memory.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity = 64 * 1024) : capacity(capacity), buffer(new char[capacity]) {}
+
+    // Returns false once the reader has gone; the data is then dropped.
+    bool write(const char* data, size_t size) {
+        unique_lock<mutex> lock(m);
+        while (size > 0) {
+            not_full.wait(lock, [&]() { return used < capacity || reader_closed; });
+            if (reader_closed) return false;
+            size_t tail = (head + used) % capacity;
+            size_t n = min(size, min(capacity - used, capacity - tail));
+            memcpy(buffer.get() + tail, data, n);
+            used += n;
+            data += n;
+            size -= n;
+            not_empty.notify_one();
         }
+        return true;
     }
 
-    if (!input.empty()) {
-        command_history.push_back(input);
-        history_index = -1;
+    long read(char* data, size_t size) {
+        unique_lock<mutex> lock(m);
+        not_empty.wait(lock, [&]() { return used > 0 || writer_closed; });
+        size_t n = min(size, min(used, capacity - head));
+        memcpy(data, buffer.get() + head, n);
+        head = (head + n) % capacity;
+        used -= n;
+        not_full.notify_one();
+        return (long)n;
     }
 
-    return resolve_alias(input);
-}
-
-void count_word_in_file(const string& filename, const string& word) {
-    ifstream file(filename);
-    if (!file) {
-        cerr << "Error: Cannot open file '" << filename << "'" << endl;
-        return;
+    // End of input for the reader.
+    void close_write() {
+        lock_guard<mutex> lock(m);
+        writer_closed = true;
+        not_empty.notify_all();
     }
-    
-    string search_word = to_lower(word);
-    string line;
-    int count = 0;
-    
-    while (getline(file, line)) {
-        vector<string> words = split_words(line);
-        for (const string& w : words) {
-            if (w == search_word) {
-                count++;
-            }
-        }
+
+    // The reader is done; a blocked writer wakes up and stops.
+    void close_read() {
+        lock_guard<mutex> lock(m);
+        reader_closed = true;
+        not_full.notify_all();
     }
-    
-    cout << "Word '" << word << "' appears " << count << " times in '" << filename << "'" << endl;
-    file.close();
-}
 
-void word_frequency(const string& filename) {
-    ifstream file(filename);
-    if (!file) {
-        cerr << "Error: Cannot open file '" << filename << "'" << endl;
-        return;
+private:
+    size_t capacity;
+    unique_ptr<char[]> buffer;
+    size_t head = 0;
+    size_t used = 0;
+    bool writer_closed = false;
+    bool reader_closed = false;
+    mutex m;
+    condition_variable not_empty, not_full;
+};
+
+// Writing side of a ring. Small writes are gathered first so the lock is
+// taken once per 16 KiB rather than once per token.
+class RingSink : public OutputSink {
+public:
+    explicit RingSink(RingBuffer& ring) : ring(ring) {}
+
+    ~RingSink() {
+        close();
     }
-    
-    map<string, int> word_count;
-    string line;
-    
-    while (getline(file, line)) {
-        vector<string> words = split_words(line);
-        for (const string& word : words) {
-            if (!word.empty()) {
-                word_count[word]++;
-            }
-        }
-    }
-    
-    vector<pair<string, int>> freq_pairs(word_count.begin(), word_count.end());
-    
-    sort(freq_pairs.begin(), freq_pairs.end(), 
-         [](const pair<string, int>& a, const pair<string, int>& b) {
-             return a.second > b.second;
-         });
-    
-    cout << "Top 10 most frequent words in '" << filename << "':" << endl;
-    int display_count = min(10, (int)freq_pairs.size());
-    for (int i = 0; i < display_count; i++) {
-        cout << setw(15) << left << freq_pairs[i].first 
-             << ": " << freq_pairs[i].second << endl;
-    }
-    
-    file.close();
-}
 
-void calculator(const string& num1_str, const string& op, const string& num2_str) {
-    try {
-        double num1 = stod(num1_str);
-        double num2 = stod(num2_str);
-        double result = 0;
-        bool valid_op = true;
-        
-        if (op == "+") {
-            result = num1 + num2;
-        } else if (op == "-") {
-            result = num1 - num2;
-        } else if (op == "*" || op == "x") {
-            result = num1 * num2;
-        } else if (op == "/") {
-            if (num2 == 0) {
-                cerr << "Error: Division by zero" << endl;
-                return;
-            }
-            result = num1 / num2;
-        } else if (op == "%") {
-            if (num2 == 0) {
-                cerr << "Error: Division by zero" << endl;
+    void write(const char* data, size_t size) override {
+        if (used + size > sizeof(staging)) {
+            drain();
+            if (size >= sizeof(staging)) {
+                ring.write(data, size);
                 return;
             }
-            result = fmod(num1, num2);
-        } else if (op == "^" || op == "**") {
-            result = pow(num1, num2);
-        } else {
-            valid_op = false;
-            cerr << "Error: Invalid operator '" << op << "'" << endl;
-            cerr << "Supported operators: +, -, *, /, %, ^ (or **)" << endl;
-        }
-        
-        if (valid_op) {
-            cout << num1 << " " << op << " " << num2 << " = " << result << endl;
         }
-    } catch (const invalid_argument& e) {
-        cerr << "Error: Invalid number format" << endl;
-    } catch (const out_of_range& e) {
-        cerr << "Error: Number out of range" << endl;
+        memcpy(staging + used, data, size);
+        used += size;
     }
-}
 
-void addJob(HANDLE hProcess, DWORD pid, const string& command) {
-    Job newJob = { jobCounter++, hProcess, pid, command, true };
-    jobList.push_back(newJob);
-    cout << "[" << newJob.id << "] " << pid << " started in background\n";
-}
+    void flush() override { drain(); }
 
-void listJobs() {
-    cout << "Active Background Jobs:\n";
-    for (auto& job : jobList) {
-        DWORD exitCode;
-        GetExitCodeProcess(job.hProcess, &exitCode);
-        bool stillRunning = (exitCode == STILL_ACTIVE);
-        string status = stillRunning ? "Running" : "Exited";
-        cout << "[" << job.id << "] PID: " << job.pid << " Command: " << job.command << " Status: " << status << endl;
+    void close() {
+        if (closed) return;
+        drain();
+        ring.close_write();
+        closed = true;
     }
-}
 
-void fg(int jobId) {
-    for (auto it = jobList.begin(); it != jobList.end(); ++it) {
-        if (it->id == jobId) {
-            cout << "Bringing job [" << it->id << "] to foreground...\n";
-            WaitForSingleObject(it->hProcess, INFINITE);
-            CloseHandle(it->hProcess);
-            jobList.erase(it);
-            return;
-        }
+private:
+    RingBuffer& ring;
+    char staging[16384];
+    size_t used = 0;
+    bool closed = false;
+
+    void drain() {
+        if (used) ring.write(staging, used);
+        used = 0;
     }
-    cout << "Error: Job ID not found.\n";
-}
+};
 
-void killJob(int jobId) {
-    for (auto it = jobList.begin(); it != jobList.end(); ++it) {
-        if (it->id == jobId) {
-            cout << "Killing job [" << it->id << "]...\n";
-            TerminateProcess(it->hProcess, 0);
-            CloseHandle(it->hProcess);
-            jobList.erase(it);
-            return;
-        }
+class RingSource : public InputSource {
+public:
+    explicit RingSource(RingBuffer& ring) : ring(ring) {}
+
+    ~RingSource() {
+        ring.close_read();
     }
-    cout << "Error: Job ID not found.\n";
-}
 
-void launchBackgroundProcess(const string& command) {
-    STARTUPINFO si = { sizeof(si) };
-    PROCESS_INFORMATION pi;
-    string cmdLine = "cmd.exe /C " + command;
-    char* cmd = _strdup(cmdLine.c_str());
+    long read(char* data, size_t size) override { return ring.read(data, size); }
 
-    BOOL success = CreateProcess(NULL, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
-    if (success) {
-        addJob(pi.hProcess, pi.dwProcessId, command);
-        CloseHandle(pi.hThread);
-    } else {
-        cerr << "Failed to launch process: " << command << endl;
+private:
+    RingBuffer& ring;
+};
+
+// Points this thread's builtin output, input and errors somewhere else for
+// a scope; a null argument leaves that stream as it is.
+class IoScope {
+public:
+    IoScope(OutputSink* sink, InputSource* source, OutputSink* errors = nullptr)
+        : saved_output(current_output), saved_input(current_input), saved_error(current_error) {
+        if (sink) current_output = sink;
+        if (source) current_input = source;
+        if (errors) current_error = errors;
     }
-    free(cmd);
+
+    ~IoScope() {
+        current_output = saved_output;
+        current_input = saved_input;
+        current_error = saved_error;
+    }
+
+private:
+    OutputSink* saved_output;
+    InputSource* saved_input;
+    OutputSink* saved_error;
+};
+
+// Helper function to convert string to lowercase
+string to_lower(string str) {
+    transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return str;
 }
 
-vector<string> split(const string &str, char delimiter) {
-    vector<string> tokens;
-    stringstream ss(str);
-    string token;
-    while (getline(ss, token, delimiter)) {
-        tokens.push_back(token);
+// Signal handler
+void signal_handler(int signal) {
+    if (signal == SIGINT) {
+        interrupted = 1;
+        // Only async-signal-safe calls here; the output buffer takes a lock.
+        static const char message[] = "\nInterrupt received (Ctrl+C)\n";
+        if (write(1, message, sizeof(message) - 1) < 0) {}
     }
-    return tokens;
 }
 
-void runPipedCommand(const string &command) {
-    vector<string> commands = split(command, '|');
-    if (commands.size() != 2) {
-        cout << "Error: Only single pipe supported.\n";
-        return;
+void init_signals() {
+    signal(SIGINT, signal_handler);
+#ifndef _WIN32
+    // A builtin writing into a pipe whose reader has exited gets EPIPE
+    // instead of killing the shell. Children get the default back.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+// Alias handling. Aliases live in a flat open-addressing table: the entries
+// in a deque and a power-of-two array of indexes into it, probed linearly,
+// so a lookup is one hash of the word and usually one string compare. Each
+// entry also caches its value with nested aliases already expanded. The
+// caches are stamped with the table's generation, which every change bumps,
+// so redefining one alias never walks the others.
+//
+// Aliases from the rc snapshot stay frozen in its mapping, in the same
+// layout, and are copied into the table the first time one is looked up.
+// Anything that needs all of them (listing, saving, removing) thaws the
+// rest first.
+struct AliasCharTable {
+    enum : uint8_t {
+        NOT_NAME = 1,       // cannot be part of a plain word
+        ENDS_WORD = 2,      // ends a plain word
+        ENDS_RUN = 4,       // quotes, escapes and command separators
+    };
+    uint8_t flags[256] = {};
+
+    AliasCharTable() {
+        for (char c : string_view(" \t|&;<>()'\"\\$`")) flags[(unsigned char)c] |= NOT_NAME;
+        for (char c : string_view(" \t|&;<>()")) flags[(unsigned char)c] |= ENDS_WORD;
+        for (char c : string_view("'\"\\;|&")) flags[(unsigned char)c] |= ENDS_RUN;
     }
+    bool has(char c, uint8_t flag) const { return flags[(unsigned char)c] & flag; }
+};
+const AliasCharTable alias_chars;
+
+class AliasTable {
+public:
+    struct Alias {
+        string name;
+        string value;
+        mutable string expanded;            // value with nested aliases expanded
+        mutable uint64_t generation = 0;    // of the table when expanded was filled in
+    };
 
-    string cmd1 = "cmd.exe /C " + commands[0];
-    string cmd2 = "cmd.exe /C " + commands[1];
+    struct FrozenAlias {
+        uint32_t name_offset;       // into the strings
+        uint32_t name_length;
+        uint32_t value_offset;
+        uint32_t value_length;
+    };
 
-    HANDLE readPipe, writePipe;
-    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+    struct Frozen {
+        const FrozenAlias* aliases = nullptr;
+        size_t count = 0;
+        const int32_t* slots = nullptr;     // index into aliases, -1 when free
+        size_t slot_count = 0;              // a power of two
+        const char* strings = nullptr;
+        size_t strings_size = 0;
+    };
 
-    if (!CreatePipe(&readPipe, &writePipe, &sa, 0)) {
-        cerr << "Error creating pipe.\n";
-        return;
+    // Lays out name/value pairs (later duplicates win) as a frozen table.
+    static void freeze(const vector<pair<string_view, string_view>>& list, vector<FrozenAlias>& records,
+                       vector<int32_t>& frozen_slots, string& strings) {
+        unordered_map<string_view, size_t> last;
+        for (size_t i = 0; i < list.size(); i++) last[list[i].first] = i;
+        size_t capacity = 16;
+        while (capacity < last.size() * 2) capacity *= 2;
+        frozen_slots.assign(capacity, -1);
+        for (size_t i = 0; i < list.size(); i++) {
+            if (last[list[i].first] != i) continue;
+            FrozenAlias alias;
+            alias.name_offset = (uint32_t)strings.size();
+            alias.name_length = (uint32_t)list[i].first.size();
+            strings.append(list[i].first);
+            alias.value_offset = (uint32_t)strings.size();
+            alias.value_length = (uint32_t)list[i].second.size();
+            strings.append(list[i].second);
+            size_t slot = hash_bytes(list[i].first.data(), list[i].first.size()) & (capacity - 1);
+            while (frozen_slots[slot] >= 0) slot = (slot + 1) & (capacity - 1);
+            frozen_slots[slot] = (int32_t)records.size();
+            records.push_back(alias);
+        }
     }
 
-    STARTUPINFOA si1 = {};
-    PROCESS_INFORMATION pi1 = {};
-    si1.cb = sizeof(si1);
-    si1.dwFlags = STARTF_USESTDHANDLES;
-    si1.hStdOutput = writePipe;
-    si1.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    // The mapping behind frozen has to outlive the table.
+    void attach(const Frozen& frozen) {
+        thaw();
+        this->frozen = frozen;
+    }
 
-    SetHandleInformation(writePipe, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    const Alias* find(string_view name) {
+        int32_t index = find_index(name);
+        if (index >= 0) return &entries[index];
+        const FrozenAlias* alias = find_frozen(name);
+        if (!alias) return nullptr;
+        return &entries[add(name, string_view(frozen.strings + alias->value_offset, alias->value_length))];
+    }
 
-    char* cmdline1 = _strdup(cmd1.c_str());
-    if (!CreateProcessA(NULL, cmdline1, NULL, NULL, TRUE, 0, NULL, NULL, &si1, &pi1)) {
-        cerr << "Error launching first command.\n";
-        CloseHandle(writePipe);
-        CloseHandle(readPipe);
-        free(cmdline1);
-        return;
+    void define(string_view name, string_view value) {
+        generation++;
+        int32_t index = find_index(name);
+        if (index >= 0) {
+            entries[index].value.assign(value);
+            return;
+        }
+        add(name, value);
     }
-    free(cmdline1);
-    CloseHandle(writePipe);
 
-    STARTUPINFOA si2 = {};
-    PROCESS_INFORMATION pi2 = {};
-    si2.cb = sizeof(si2);
-    si2.dwFlags = STARTF_USESTDHANDLES;
-    si2.hStdInput = readPipe;
-    si2.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-    si2.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    bool remove(string_view name) {
+        thaw();
+        int32_t index = find_index(name);
+        if (index < 0) return false;
+        generation++;
+        if ((size_t)index != entries.size() - 1) entries[index] = move(entries.back());
+        entries.pop_back();
+        rebuild();
+        return true;
+    }
 
-    SetHandleInformation(readPipe, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    void clear() {
+        generation++;
+        entries.clear();
+        slots.clear();
+        frozen = Frozen();
+    }
 
-    char* cmdline2 = _strdup(cmd2.c_str());
-    if (!CreateProcessA(NULL, cmdline2, NULL, NULL, TRUE, 0, NULL, NULL, &si2, &pi2)) {
-        cerr << "Error launching second command.\n";
-        CloseHandle(readPipe);
-        free(cmdline2);
-        return;
+    size_t size() {
+        thaw();
+        return entries.size();
     }
-    free(cmdline2);
-    CloseHandle(readPipe);
-
-    WaitForSingleObject(pi1.hProcess, INFINITE);
-    WaitForSingleObject(pi2.hProcess, INFINITE);
-
-    CloseHandle(pi1.hProcess);
-    CloseHandle(pi1.hThread);
-    CloseHandle(pi2.hProcess);
-    CloseHandle(pi2.hThread);
-}
-
-void runWithRedirection(const string &command) {
-    string cmd, filename;
-    bool redirectOutput = false, redirectInput = false;
-    size_t pos;
-    if ((pos = command.find('>')) != string::npos) {
-        cmd = command.substr(0, pos);
-        filename = command.substr(pos + 1);
-        redirectOutput = true;
-    } else if ((pos = command.find('<')) != string::npos) {
-        cmd = command.substr(0, pos);
-        filename = command.substr(pos + 1);
-        redirectInput = true;
-    } else {
-        cmd = command;
+
+    bool empty() const { return entries.empty() && !frozen.count; }
+
+    // By name, for listings that should not change order between runs.
+    vector<const Alias*> sorted() {
+        thaw();
+        vector<const Alias*> list;
+        for (const auto& alias : entries) list.push_back(&alias);
+        sort(list.begin(), list.end(), [](const Alias* a, const Alias* b) { return a->name < b->name; });
+        return list;
     }
-    cmd.erase(cmd.find_last_not_of(" \n\r\t")+1);
-    filename.erase(0, filename.find_first_not_of(" \n\r\t"));
 
-    HANDLE hFile = NULL;
-    if (redirectOutput) {
-        hFile = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    } else if (redirectInput) {
-        hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    // Expands aliases the way sh does: the first word of every simple
+    // command is looked up, and when an expansion ends in a blank the word
+    // after it is looked up too. A name is not expanded again inside its
+    // own expansion, which is what lets "alias ls='ls -F'" work and stops
+    // loops such as a -> b -> a.
+    string expand(string_view line) {
+        string result;
+        result.reserve(line.size() + 64);
+        vector<const Alias*> active;
+        expand_into(line, active, result);
+        return result;
     }
-    if (hFile == INVALID_HANDLE_VALUE) {
-        cerr << "Failed to open file: " << filename << endl;
-        return;
+
+    // One alias per line, name=value with the value stored verbatim, so
+    // that loading is a split at the first '=' with no lexing or unquoting.
+    bool save(const string& path) {
+        string text;
+        for (const Alias* alias : sorted()) {
+            text += alias->name;
+            text += '=';
+            text += alias->value;
+            text += '\n';
+        }
+        string temp = temp_path_for(path);
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+        if (fd < 0) return false;
+        bool written = write_all(fd, text);
+        if (close(fd) != 0 || !written) {
+            ::remove(temp.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        ::remove(path.c_str());
+#endif
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            ::remove(temp.c_str());
+            return false;
+        }
+        return true;
     }
 
-    STARTUPINFOA si = {};
-    PROCESS_INFORMATION pi = {};
-    si.cb = sizeof(si);
-    si.dwFlags |= STARTF_USESTDHANDLES;
-    if (redirectOutput) si.hStdOutput = hFile;
-    if (redirectInput) si.hStdInput = hFile;
-    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
-    SetHandleInformation(hFile, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    bool load(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_BINARY);
+        if (fd < 0) return false;
+        string text;
+        char buffer[64 * 1024];
+        long n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) text.append(buffer, n);
+        close(fd);
+        string_view rest = text;
+        while (!rest.empty()) {
+            size_t end = rest.find('\n');
+            string_view line = rest.substr(0, end);
+            rest = end == string_view::npos ? string_view() : rest.substr(end + 1);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            size_t eq = line.find('=');
+            if (eq != string_view::npos && eq > 0) define(line.substr(0, eq), line.substr(eq + 1));
+        }
+        return true;
+    }
 
-    string fullCmd = "cmd.exe /C " + cmd;
-    char* cmdline = _strdup(fullCmd.c_str());
-    BOOL success = CreateProcessA(NULL, cmdline, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+private:
+    deque<Alias> entries;           // a deque, so finding a frozen alias mid-expansion moves none
+    vector<int32_t> slots;          // index into entries, -1 when free
+    uint64_t generation = 1;
+    Frozen frozen;
 
-    if (!success) cerr << "CreateProcess failed.\n";
-    else {
-        WaitForSingleObject(pi.hProcess, INFINITE);
-        CloseHandle(pi.hProcess);
-        CloseHandle(pi.hThread);
+    int32_t add(string_view name, string_view value) {
+        entries.emplace_back();
+        entries.back().name.assign(name);
+        entries.back().value.assign(value);
+        if (entries.size() * 2 > slots.size()) rebuild();
+        else insert_slot((int32_t)entries.size() - 1);
+        return (int32_t)entries.size() - 1;
     }
 
-    CloseHandle(hFile);
-    free(cmdline);
-}
+    // A damaged snapshot yields no alias rather than a read out of bounds.
+    const FrozenAlias* find_frozen(string_view name) const {
+        if (!frozen.count) return nullptr;
+        size_t mask = frozen.slot_count - 1;
+        for (size_t i = hash_bytes(name.data(), name.size()) & mask, probes = 0; probes < frozen.slot_count;
+             i = (i + 1) & mask, probes++) {
+            int32_t index = frozen.slots[i];
+            if (index < 0 || (size_t)index >= frozen.count) return nullptr;
+            const FrozenAlias& alias = frozen.aliases[index];
+            if ((uint64_t)alias.name_offset + alias.name_length > frozen.strings_size ||
+                (uint64_t)alias.value_offset + alias.value_length > frozen.strings_size) return nullptr;
+            if (name == string_view(frozen.strings + alias.name_offset, alias.name_length)) return &alias;
+        }
+        return nullptr;
+    }
 
-void runPingCommand(const string &host) {
-    string command = "ping " + host;
-    system(command.c_str());
-}
+    // Copies every frozen alias not already looked up or redefined.
+    void thaw() {
+        if (!frozen.count) return;
+        Frozen all = frozen;
+        frozen = Frozen();
+        for (size_t i = 0; i < all.count; i++) {
+            const FrozenAlias& alias = all.aliases[i];
+            if ((uint64_t)alias.name_offset + alias.name_length > all.strings_size ||
+                (uint64_t)alias.value_offset + alias.value_length > all.strings_size) continue;
+            string_view name(all.strings + alias.name_offset, alias.name_length);
+            if (find_index(name) < 0) add(name, string_view(all.strings + alias.value_offset, alias.value_length));
+        }
+    }
 
-void scheduleCommand(const string& command, int delaySeconds) {
-    cout << "Scheduling command: \"" << command << "\" to run after " << delaySeconds << " seconds.\n";
-    Sleep(delaySeconds * 1000);
-    system(command.c_str());
-}
+    int32_t find_index(string_view name) const {
+        if (slots.empty()) return -1;
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash_bytes(name.data(), name.size()) & mask;; i = (i + 1) & mask) {
+            int32_t index = slots[i];
+            if (index < 0 || entries[index].name == name) return index;
+        }
+    }
 
-void addNote(const string& note) {
-    ofstream out(notesFile, ios::app);
-    if (!out) {
-        cerr << "Unable to open notes file.\n";
-        return;
+    void insert_slot(int32_t index) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash_bytes(entries[index].name.data(), entries[index].name.size()) & mask;
+        while (slots[i] >= 0) i = (i + 1) & mask;
+        slots[i] = index;
     }
-    out << note << endl;
-    cout << "Note added.\n";
-}
 
-void viewNotes() {
-    ifstream in(notesFile);
-    string line;
-    cout << "Shell Notes:\n";
-    while (getline(in, line)) {
-        cout << "- " << line << endl;
+    void rebuild() {
+        size_t capacity = 16;
+        while (capacity < entries.size() * 2) capacity *= 2;
+        slots.assign(capacity, -1);
+        for (size_t i = 0; i < entries.size(); i++) insert_slot((int32_t)i);
     }
-}
 
-bool authenticateShell() {
-    string pass;
-    cout << "Enter shell password: ";
-    getline(cin, pass);
-    return pass == shellPassword;
-}
+    static bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+    void expand_into(string_view line, vector<const Alias*>& active, string& result) {
+        bool command_word = true;
+        size_t i = 0, n = line.size();
+        while (i < n) {
+            if (!command_word) {
+                // Inside a command only quotes, escapes and the command
+                // separators matter; everything up to one is copied as is.
+                size_t end = i;
+                while (end < n && !alias_chars.has(line[end], AliasCharTable::ENDS_RUN)) end++;
+                result.append(line.data() + i, end - i);
+                i = end;
+                if (i == n) break;
+            }
+            char c = line[i];
+            if (is_blank(c)) {
+                result += c;
+                i++;
+                continue;
+            }
+            if (command_word) {
+                command_word = false;
+                // Only a plain word is looked up: one with quotes or $ in
+                // it is not an alias name.
+                size_t end = i;
+                while (end < n && !alias_chars.has(line[end], AliasCharTable::NOT_NAME)) end++;
+                const Alias* alias = nullptr;
+                if (end > i && (end == n || alias_chars.has(line[end], AliasCharTable::ENDS_WORD))) {
+                    alias = find(line.substr(i, end - i));
+                }
+                if (alias && std::find(active.begin(), active.end(), alias) == active.end()) {
+                    size_t start = result.size();
+                    append_expansion(*alias, active, result);
+                    command_word = result.size() > start && is_blank(result.back());
+                    i = end;
+                    continue;
+                }
+            }
+            if (c == '\'' || c == '"') {
+                size_t close = i + 1;
+                while (close < n && line[close] != c) close += (c == '"' && line[close] == '\\') ? 2 : 1;
+                close = min(close + 1, n);
+                result.append(line.data() + i, close - i);
+                i = close;
+            } else if (c == '\\') {
+                size_t length = min<size_t>(2, n - i);
+                result.append(line.data() + i, length);
+                i += length;
+            } else {
+                // ;, |, &, && and || start a new command; the & in 2>&1
+                // and &> is part of a redirection.
+                bool redirection = c == '&' && ((i + 1 < n && line[i + 1] == '>') ||
+                                                (i > 0 && (line[i - 1] == '>' || line[i - 1] == '<')));
+                if ((c == ';' || c == '|' || c == '&') && !redirection) command_word = true;
+                result += c;
+                i++;
+            }
+        }
+    }
+
+    // Only expansions made outside any other are cached: inside one, the
+    // names being expanded change what the value expands to.
+    void append_expansion(const Alias& alias, vector<const Alias*>& active, string& result) {
+        if (active.empty() && alias.generation == generation) {
+            result += alias.expanded;
+            return;
+        }
+        size_t start = result.size();
+        active.push_back(&alias);
+        expand_into(alias.value, active, result);
+        active.pop_back();
+        if (active.empty()) {
+            alias.expanded.assign(result, start, string::npos);
+            alias.generation = generation;
+        }
+    }
+};
+
+AliasTable aliases;
+
+// $SHELL_ALIASES, else ~/.shell_aliases.
+string alias_file_path() {
+    if (const char* path = getenv("SHELL_ALIASES")) return path;
+#ifdef _WIN32
+    const char* home = getenv("USERPROFILE");
+#else
+    const char* home = getenv("HOME");
+#endif
+    return home ? string(home) + "/.shell_aliases" : string();
+}
+
+string resolve_alias(const string& input) {
+    if (aliases.empty()) return input;
+    return aliases.expand(input);
+}
+
+// Each name=value argument defines an alias. Quotes were already removed by
+// the lexer; words without '=' extend the previous value, so the unquoted
+// form "alias ll=ls -l" keeps working. A bare name before any definition
+// prints that alias. -s saves every alias to the alias file (or FILE),
+// which the shell loads at startup.
+bool handle_alias_command(const Args& args) {
+    if (args.empty()) return false;
+    last_status = 0;
+
+    if (args.size() == 1) {
+        for (const AliasTable::Alias* alias : aliases.sorted()) {
+            cout << "alias " << alias->name << "='" << alias->value << "'\n";
+        }
+        return true;
+    }
+
+    if (args[1] == "-s") {
+        string path = args.size() > 2 ? args.str(2) : alias_file_path();
+        if (path.empty() || !aliases.save(path)) {
+            cerr << "alias: cannot write '" << path << "'\n";
+            last_status = 1;
+            return true;
+        }
+        cout << "Saved " << aliases.size() << " aliases to " << path << "\n";
+        return true;
+    }
+
+    string name, value;
+    bool defining = false;
+    auto finish = [&]() {
+        if (defining) aliases.define(name, value);
+        defining = false;
+    };
+    for (size_t i = 1; i < args.size(); i++) {
+        size_t eq_pos = args[i].find('=');
+        if (eq_pos != string_view::npos) {
+            finish();
+            name.assign(args[i].substr(0, eq_pos));
+            value.assign(args[i].substr(eq_pos + 1));
+            defining = true;
+        } else if (defining) {
+            value += ' ';
+            value.append(args[i]);
+        } else if (const AliasTable::Alias* alias = aliases.find(args[i])) {
+            cout << "alias " << alias->name << "='" << alias->value << "'\n";
+        } else {
+            flush_output();
+            cerr << "alias: " << args[i] << ": not found\n";
+            last_status = 1;
+        }
+    }
+    finish();
+    return true;
+}
+
+// unalias <name...> | -a
+void unalias_command(const Args& args) {
+    last_status = 0;
+    if (args.size() == 2 && args[1] == "-a") {
+        aliases.clear();
+        return;
+    }
+    for (size_t i = 1; i < args.size(); i++) {
+        if (!aliases.remove(args[i])) {
+            cerr << "unalias: " << args[i] << ": not found\n";
+            last_status = 1;
+        }
+    }
+}
+
+#ifdef _WIN32
+// String conversion helper (UTF-16 to UTF-8)
+string wide_to_narrow(const wchar_t* wide) {
+    int n = WideCharToMultiByte(CP_UTF8, 0, wide, -1, NULL, 0, NULL, NULL);
+    if (n <= 1) return string();
+    string narrow(n - 1, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, wide, -1, &narrow[0], n, NULL, NULL);
+    return narrow;
+}
+#endif
+
+#ifdef _WIN32
+int read_key() {
+    flush_output();
+    return _getch();
+}
+#else
+// Puts the terminal into non-canonical, no-echo mode for the lifetime of the
+// object so keys can be read one at a time like _getch() does on Windows.
+struct RawTerminal {
+    termios saved;
+    bool active = false;
+    RawTerminal() {
+        if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0) {
+            termios raw = saved;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 1;
+            raw.c_cc[VTIME] = 0;
+            active = tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0;
+        }
+    }
+    ~RawTerminal() {
+        if (active) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+};
+
+// Reads one key and translates it to the _getch() protocol used by the input
+// loop: Enter is '\r', Backspace is '\b' and arrow keys arrive as 0 followed
+// by the Windows scan code (72 up, 80 down). Returns EOF when input ends.
+int read_key() {
+    static int pending = -1;
+    if (pending != -1) {
+        int key = pending;
+        pending = -1;
+        return key;
+    }
+
+    // Echoed characters and the prompt sit in stdout's line buffer until here.
+    flush_output();
+    // Reads go through stdio so they share stdin's buffer with getline(cin, ...).
+    int c = getchar();
+    if (c == EOF) return EOF;
+    if (c == '\n') return '\r';
+    if (c == 127) return '\b';
+    if (c == 27) {
+        if (getchar() != '[') return 27;
+        int code = getchar();
+        if (code == 'A') { pending = 72; return 0; }
+        if (code == 'B') { pending = 80; return 0; }
+        return read_key();
+    }
+    return c;
+}
+#endif
+
+string get_input_with_features() {
+    string input;
+    int ch;
+    size_t history_cursor = SIZE_MAX;   // Up/Down position in the history log
+#ifndef _WIN32
+    RawTerminal raw;
+#endif
+
+    while (true) {
+        ch = read_key();
+        if (ch == EOF) {
+            if (input.empty()) return "exit";
+            cout << endl;
+            break;
+        } else if (ch == '\r') {
+            cout << endl;
+            break;
+        } else if (ch == '\b') {
+            if (!input.empty()) {
+                input.pop_back();
+                cout << "\b \b";
+            }
+        } else if (ch == 0 || ch == 224) {
+            ch = read_key();
+
+            string entry;
+            if (ch == 72) { // Up arrow
+                if (history_previous(history_cursor, entry)) {
+                    redraw_input(input, entry);
+                    input = entry;
+                }
+            } else if (ch == 80) { // Down arrow
+                if (!history_next(history_cursor, entry)) {
+                    history_cursor = history_end();
+                    entry.clear();
+                }
+                redraw_input(input, entry);
+                input = entry;
+            }
+        } else if (ch == 18) { // Ctrl-R
+            if (reverse_search(input)) {
+                cout << endl;
+                break;
+            }
+        } else if (ch == '\t') {
+            autocomplete(input);
+        } else {
+            input += (char)ch;
+            cout << (char)ch;
+        }
+    }
+
+    if (!input.empty()) history_append(input);
+
+    return resolve_alias(input);
+}
+
+// Directory listing helper shared by the file builtins
+struct DirEntry {
+    string name;
+    bool is_dir;                // follows symbolic links
+    bool is_link = false;
+};
+
+bool read_directory(const string& path, vector<DirEntry>& entries) {
+#ifdef _WIN32
+    string pattern = path + "\\*";
+    WIN32_FIND_DATAA findFileData;
+    HANDLE hFind = FindFirstFileA(pattern.c_str(), &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) return false;
+    do {
+        string name = findFileData.cFileName;
+        if (name == "." || name == "..") continue;
+        entries.push_back({ name, (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 });
+    } while (FindNextFileA(hFind, &findFileData));
+    FindClose(hFind);
+#else
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return false;
+    while (dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        bool is_dir = (entry->d_type == DT_DIR);
+        bool is_link = (entry->d_type == DT_LNK);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            string child = path + "/" + name;
+            struct stat st;
+            if (entry->d_type == DT_UNKNOWN) is_link = lstat(child.c_str(), &st) == 0 && S_ISLNK(st.st_mode);
+            is_dir = stat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        entries.push_back({ name, is_dir, is_link });
+    }
+    closedir(dir);
+#endif
+    return true;
+}
+
+bool is_directory(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR;
+}
+
+// Tab completion. Every directory completed in keeps a sorted index of its
+// entries that is reused until the directory's mtime changes, so a TAB
+// costs one stat and a binary search instead of a full directory scan.
+struct DirectoryIndex {
+    long long mtime = -1;
+    vector<DirEntry> entries;   // sorted by name
+};
+
+// Modification time in nanoseconds (100 ns units on Windows).
+bool directory_mtime(const string& path, long long& mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) return false;
+    if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) return false;
+    mtime = ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+const DirectoryIndex* directory_index(const string& path) {
+    static unordered_map<string, DirectoryIndex> cache;
+    const size_t MAX_CACHED_DIRECTORIES = 64;
+
+    long long mtime;
+    if (!directory_mtime(path, mtime)) return nullptr;
+    auto it = cache.find(path);
+    if (it != cache.end() && it->second.mtime == mtime) return &it->second;
+
+    if (it == cache.end()) {
+        if (cache.size() >= MAX_CACHED_DIRECTORIES) cache.clear();
+        it = cache.emplace(path, DirectoryIndex()).first;
+    }
+    DirectoryIndex& index = it->second;
+    index.entries.clear();
+    if (!read_directory(path, index.entries)) {
+        cache.erase(it);
+        return nullptr;
+    }
+    sort(index.entries.begin(), index.entries.end(),
+         [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+    index.mtime = mtime;
+    return &index;
+}
+
+// Names of the executables on PATH, rebuilt when PATH or the modification
+// time of one of its directories changes.
+const vector<string>& path_executables() {
+    static string indexed_path;
+    static vector<long long> indexed_mtimes;
+    static vector<string> names;
+
+#ifdef _WIN32
+    const char separator = ';';
+#else
+    const char separator = ':';
+#endif
+    const char* env = getenv("PATH");
+    string path_var = env ? env : "";
+    vector<string> dirs;
+    vector<long long> mtimes;
+    for (size_t start = 0; start <= path_var.size();) {
+        size_t end = path_var.find(separator, start);
+        if (end == string::npos) end = path_var.size();
+        string dir = path_var.substr(start, end - start);
+        long long mtime;
+        if (!dir.empty() && directory_mtime(dir, mtime)) {
+            dirs.push_back(dir);
+            mtimes.push_back(mtime);
+        }
+        start = end + 1;
+    }
+    if (path_var == indexed_path && mtimes == indexed_mtimes) return names;
+
+    names.clear();
+    vector<DirEntry> entries;
+    for (const auto& dir : dirs) {
+        entries.clear();
+        read_directory(dir, entries);
+        for (const auto& entry : entries) {
+            if (entry.is_dir) continue;
+#ifdef _WIN32
+            size_t dot = entry.name.rfind('.');
+            string ext = (dot == string::npos) ? "" : to_lower(entry.name.substr(dot));
+            if (ext != ".exe" && ext != ".bat" && ext != ".cmd" && ext != ".com") continue;
+            names.push_back(entry.name.substr(0, dot));
+#else
+            if (access((dir + "/" + entry.name).c_str(), X_OK) != 0) continue;
+            names.push_back(entry.name);
+#endif
+        }
+    }
+    sort(names.begin(), names.end());
+    names.erase(unique(names.begin(), names.end()), names.end());
+    indexed_path = path_var;
+    indexed_mtimes = mtimes;
+    return names;
+}
+
+// At most this many candidates are offered per source; cycling through more
+// than that by pressing TAB is not useful.
+const size_t MAX_COMPLETIONS = 1000;
+
+void add_prefixed(const vector<string>& sorted, const string& prefix, vector<string>& out) {
+    auto it = lower_bound(sorted.begin(), sorted.end(), prefix);
+    for (size_t n = 0; it != sorted.end() && it->compare(0, prefix.size(), prefix) == 0 && n < MAX_COMPLETIONS; ++it, ++n) {
+        out.push_back(*it);
+    }
+}
+
+// Completes a (possibly multi-component) path. Directories get a trailing
+// separator so the next TAB continues inside them.
+void complete_path(const string& word, bool dirs_only, vector<string>& out) {
+    size_t slash = word.find_last_of("/\\");
+    string dir_part = (slash == string::npos) ? "" : word.substr(0, slash + 1);
+    string name_prefix = (slash == string::npos) ? word : word.substr(slash + 1);
+    string dir = dir_part.empty() ? "." : dir_part;
+    if (dir.size() > 1 && dir[0] == '~' && (dir[1] == '/' || dir[1] == '\\')) {
+        const char* home = getenv("HOME");
+        if (home) dir = home + dir.substr(1);
+    }
+
+    const DirectoryIndex* index = directory_index(dir);
+    if (!index) return;
+    auto it = lower_bound(index->entries.begin(), index->entries.end(), name_prefix,
+                          [](const DirEntry& e, const string& key) { return e.name < key; });
+    bool show_hidden = !name_prefix.empty() && name_prefix[0] == '.';
+    for (size_t n = 0; it != index->entries.end() && n < MAX_COMPLETIONS; ++it) {
+        if (it->name.compare(0, name_prefix.size(), name_prefix) != 0) break;
+        if (dirs_only && !it->is_dir) continue;
+        if (!show_hidden && it->name[0] == '.') continue;
+        out.push_back(dir_part + it->name + (it->is_dir ? "/" : ""));
+        n++;
+    }
+}
+
+// Candidates for the last word of a command line, best first: for the
+// command word builtins and PATH executables come before files.
+vector<string> completion_candidates(const string& input, size_t word_start) {
+    string word = input.substr(word_start);
+    vector<string> candidates;
+
+    CompletionHint hint = COMPLETE_COMMANDS;
+    if (word_start > 0) {
+        const Builtin* builtin = find_builtin(to_lower(input.substr(0, input.find(' '))));
+        hint = builtin ? builtin->completion : COMPLETE_FILES;
+    }
+    if (hint == COMPLETE_NONE) return candidates;
+
+    bool is_path = word.find_first_of("/\\") != string::npos;
+    if (hint == COMPLETE_COMMANDS && !is_path) {
+        vector<string> commands;
+        for (const Builtin* b = builtins_begin(); b != builtins_end(); ++b) {
+            if (string_view(b->name).substr(0, word.size()) == word) commands.push_back(b->name);
+        }
+        add_prefixed(path_executables(), word, commands);
+        sort(commands.begin(), commands.end());
+        commands.erase(unique(commands.begin(), commands.end()), commands.end());
+        candidates = move(commands);
+    }
+    complete_path(word, hint == COMPLETE_DIRS, candidates);
+    return candidates;
+}
+
+// Rewrites the edited line on screen with as little output as possible.
+void redraw_input(const string& shown, const string& text) {
+    size_t common = 0;
+    while (common < shown.size() && common < text.size() && shown[common] == text[common]) common++;
+    cout << string(shown.size() - common, '\b') << text.substr(common);
+    if (text.size() < shown.size()) {
+        size_t extra = shown.size() - text.size();
+        cout << string(extra, ' ') << string(extra, '\b');
+    }
+    flush_output();
+}
+
+// TAB completes the last word with the best candidate; pressing TAB again
+// without editing cycles through the others.
+void autocomplete(string& input) {
+    static string cycle_line;
+    static size_t cycle_word_start = 0;
+    static vector<string> cycle_candidates;
+    static size_t cycle_next = 0;
+
+    string completed;
+    if (!cycle_candidates.empty() && input == cycle_line) {
+        cycle_next = (cycle_next + 1) % cycle_candidates.size();
+        completed = input.substr(0, cycle_word_start) + cycle_candidates[cycle_next];
+    } else {
+        size_t last_space = input.find_last_of(' ');
+        size_t word_start = (last_space == string::npos) ? 0 : last_space + 1;
+        cycle_candidates = completion_candidates(input, word_start);
+        if (cycle_candidates.empty()) return;
+        cycle_word_start = word_start;
+        cycle_next = 0;
+        completed = input.substr(0, word_start) + cycle_candidates[0];
+    }
+
+    redraw_input(input, completed);
+    input = completed;
+    cycle_line = input;
+}
+
+// Read-only memory mapping of a whole file.
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    string input;               // contents of "-"
+    bool from_input = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // "-" reads the current input into memory instead.
+    bool open(const string& path) {
+        if (path == "-") {
+            if (!read_input(input)) return false;
+            from_input = true;
+            data = input.data();
+            size = input.size();
+            return true;
+        }
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(file, &length)) return false;
+        size = (size_t)length.QuadPart;
+        if (size == 0) return true;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping) return false;
+        data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return data != nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        if (size > 0) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const char*)p;
+                madvise(p, size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+        return size == 0 || data != nullptr;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    void close() {
+        if (from_input) {
+            string().swap(input);
+            from_input = false;
+            data = nullptr;
+            size = 0;
+            return;
+        }
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+// Word classes used by the scanners: words are separated by whitespace,
+// punctuation inside a word is dropped and letters are folded to lowercase,
+// as the original line tokenizer did.
+enum CharClass : unsigned char { CH_SPACE, CH_PUNCT, CH_WORD, CH_UPPER };
+
+struct CharClassTable {
+    unsigned char cls[256];
+    CharClassTable() {
+        for (int c = 0; c < 256; c++) {
+            if (c < 128 && isspace(c)) cls[c] = CH_SPACE;
+            else if (c < 128 && ispunct(c)) cls[c] = CH_PUNCT;
+            else if (c >= 'A' && c <= 'Z') cls[c] = CH_UPPER;
+            else cls[c] = CH_WORD;
+        }
+    }
+};
+const CharClassTable char_classes;
+
+inline uint64_t hash_bytes(const char* p, size_t n) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ull;
+    }
+    return h ^ (h >> 29);
+}
+
+// Command history, shared by every shell through an append-only log file
+// (~/.shell_history, or $SHELL_HISTORY). One entry per line. An append
+// takes an exclusive lock and is a single O_APPEND write, so concurrent
+// shells never interleave entries. Reads go through a memory mapping that
+// is refreshed when the file grows; nothing is loaded at startup.
+//
+// Reverse search uses an index built on the first Ctrl-R and extended as
+// the log grows. Each distinct command is stored once with the sequence
+// number of its latest use, and a trigram -> command posting list answers
+// substring queries. When nothing contains the query, a fuzzy pass accepts
+// commands that contain its characters in order.
+class HistoryLog {
+public:
+    HistoryLog() {
+        const char* path_env = getenv("SHELL_HISTORY");
+#ifdef _WIN32
+        const char* home = getenv("USERPROFILE");
+#else
+        const char* home = getenv("HOME");
+#endif
+        if (path_env) path = path_env;
+        else if (home) path = string(home) + "/.shell_history";
+        else path = "shell_history.txt";
+    }
+
+    explicit HistoryLog(const string& path) : path(path) {}
+
+    void append(string_view line) {
+        int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0600);
+        if (fd < 0) return;
+        string entry(line);
+        entry += '\n';
+        lock_file(fd, true);
+        if (write(fd, entry.data(), entry.size()) < 0) {
+            // History is best effort; a full disk must not break the prompt.
+        }
+        lock_file(fd, false);
+        close(fd);
+    }
+
+    // Byte offset just past the last entry; Up/Down cursors start here.
+    size_t end() {
+        refresh();
+        return map.size;
+    }
+
+    // Moves cursor (the start offset of an entry, or end()) one entry back.
+    bool previous(size_t& cursor, string& entry) {
+        refresh();
+        if (cursor > map.size) cursor = map.size;
+        if (cursor == 0) return false;
+        size_t line_end = cursor - 1;   // the '\n' that ends the previous entry
+        size_t start = line_start(line_end);
+        entry.assign(map.data + start, line_end - start);
+        cursor = start;
+        return true;
+    }
+
+    // Moves cursor one entry forward; false when it reaches the end.
+    bool next(size_t& cursor, string& entry) {
+        refresh();
+        if (cursor >= map.size) return false;
+        const char* nl = (const char*)memchr(map.data + cursor, '\n', map.size - cursor);
+        if (!nl) return false;
+        cursor = nl - map.data + 1;
+        if (cursor >= map.size) return false;
+        const char* line_end = (const char*)memchr(map.data + cursor, '\n', map.size - cursor);
+        entry.assign(map.data + cursor, line_end ? line_end - (map.data + cursor) : map.size - cursor);
+        return true;
+    }
+
+    // The last count entries, oldest first, with their entry numbers.
+    vector<pair<size_t, string>> tail(size_t count) {
+        refresh();
+        vector<pair<size_t, string>> entries;
+        size_t cursor = map.size;
+        string entry;
+        while (entries.size() < count && previous(cursor, entry)) entries.emplace_back(0, entry);
+        reverse(entries.begin(), entries.end());
+        size_t number = (size_t)std::count(map.data, map.data + cursor, '\n');
+        for (auto& e : entries) e.first = ++number;
+        return entries;
+    }
+
+    // Finds the skip-th most recent distinct command matching query.
+    bool search(string_view query, size_t skip, string& result, bool& fuzzy) {
+        update_index();
+        string folded = fold(query);
+        uint32_t id;
+        fuzzy = false;
+        bool found = substring_search(folded, skip, id);
+        if (!found && !folded.empty() && (skip == 0 || !substring_search(folded, 0, id))) {
+            fuzzy = true;
+            found = recency_search(folded, skip, true, id);
+        }
+        if (!found) return false;
+        result.assign(map.data + commands[id].offset, commands[id].length);
+        return true;
+    }
+
+    size_t distinct_commands() {
+        update_index();
+        return commands.size();
+    }
+
+private:
+    struct HistoryCommand {
+        uint64_t offset;        // latest occurrence in the log
+        uint32_t length;
+        uint64_t last_seen;     // entry sequence number of that occurrence
+        uint64_t mask;          // which characters occur, for fuzzy rejection
+    };
+
+    string path;
+    MappedFile map;
+    size_t indexed_end = 0;
+    vector<HistoryCommand> commands;
+    vector<uint32_t> recent;    // command of every entry, oldest first
+    unordered_map<uint64_t, uint32_t> by_hash;
+    unordered_map<uint32_t, vector<uint32_t>> trigrams;
+    vector<bool> bigrams = vector<bool>(1 << 16);   // pairs that occur anywhere
+
+    static void lock_file(int fd, bool lock) {
+#ifdef _WIN32
+        HANDLE h = (HANDLE)_get_osfhandle(fd);
+        OVERLAPPED ov = {};
+        if (lock) LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ov);
+        else UnlockFileEx(h, 0, MAXDWORD, MAXDWORD, &ov);
+#else
+        while (flock(fd, lock ? LOCK_EX : LOCK_UN) != 0 && errno == EINTR) {}
+#endif
+    }
+
+    void refresh() {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            map.close();
+            return;
+        }
+        if ((size_t)st.st_size == map.size && (map.data || map.size == 0)) return;
+        map.close();
+        map.open(path);
+        if (map.size < indexed_end) {
+            // The log was truncated or replaced: start the index over.
+            indexed_end = 0;
+            commands.clear();
+            recent.clear();
+            bigrams.assign(bigrams.size(), false);
+            by_hash.clear();
+            trigrams.clear();
+        }
+    }
+
+    size_t line_start(size_t line_end) const {
+        const char* p = map.data;
+        size_t i = line_end;
+        while (i > 0 && p[i - 1] != '\n') i--;
+        return i;
+    }
+
+    static string fold(string_view text) {
+        string folded(text);
+        for (auto& c : folded) c = (char)tolower((unsigned char)c);
+        return folded;
+    }
+
+    static uint64_t char_mask(string_view folded) {
+        uint64_t mask = 0;
+        for (unsigned char c : folded) mask |= 1ull << (c & 63);
+        return mask;
+    }
+
+    static uint32_t trigram(const char* p) {
+        return ((uint32_t)(unsigned char)tolower((unsigned char)p[0]) << 16) |
+               ((uint32_t)(unsigned char)tolower((unsigned char)p[1]) << 8) |
+               (uint32_t)(unsigned char)tolower((unsigned char)p[2]);
+    }
+
+    void update_index() {
+        refresh();
+        const char* p = map.data + indexed_end;
+        const char* end = map.data + map.size;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) break;     // a partial line is indexed once it is complete
+            if (nl > p) add_entry((size_t)(p - map.data), (size_t)(nl - p));
+            p = nl + 1;
+        }
+        indexed_end = p - map.data;
+    }
+
+    void add_entry(size_t offset, size_t length) {
+        const char* text = map.data + offset;
+        uint64_t h = hash_bytes(text, length);
+        while (true) {
+            auto it = by_hash.find(h);
+            if (it == by_hash.end()) break;
+            HistoryCommand& existing = commands[it->second];
+            if (existing.length == length && memcmp(map.data + existing.offset, text, length) == 0) {
+                existing.offset = offset;
+                existing.last_seen = recent.size();
+                recent.push_back(it->second);
+                return;
+            }
+            h++;    // hash collision with a different command
+        }
+
+        uint32_t id = (uint32_t)commands.size();
+        string folded = fold(string_view(text, length));
+        commands.push_back({ offset, (uint32_t)length, recent.size(), char_mask(folded) });
+        recent.push_back(id);
+        by_hash[h] = id;
+
+        for (size_t i = 0; i + 2 <= length; i++) {
+            bigrams[((unsigned char)folded[i] << 8) | (unsigned char)folded[i + 1]] = true;
+        }
+        vector<uint32_t> seen;
+        for (size_t i = 0; i + 3 <= length; i++) seen.push_back(trigram(text + i));
+        sort(seen.begin(), seen.end());
+        seen.erase(unique(seen.begin(), seen.end()), seen.end());
+        for (uint32_t t : seen) trigrams[t].push_back(id);
+    }
+
+    // Queries of three or more characters only look at commands that
+    // contain every trigram of the query. Posting lists are sorted by ID,
+    // so they intersect by merging, smallest list first. Shorter queries
+    // walk the log from the newest entry and stop at the first match.
+    bool substring_search(const string& folded, size_t skip, uint32_t& id) {
+        if (folded.size() == 2 && !bigrams[((unsigned char)folded[0] << 8) | (unsigned char)folded[1]]) return false;
+        if (folded.size() < 3) return recency_search(folded, skip, false, id);
+
+        vector<const vector<uint32_t>*> lists;
+        for (size_t i = 0; i + 3 <= folded.size(); i++) {
+            auto it = trigrams.find(trigram(folded.data() + i));
+            if (it == trigrams.end()) return false;
+            lists.push_back(&it->second);
+        }
+        sort(lists.begin(), lists.end(), [](const vector<uint32_t>* a, const vector<uint32_t>* b) { return a->size() < b->size(); });
+        vector<uint32_t> candidates = *lists[0], merged;
+        for (size_t k = 1; k < lists.size() && !candidates.empty(); k++) {
+            const vector<uint32_t>& list = *lists[k];
+            merged.clear();
+            if (candidates.size() * 16 < list.size()) {
+                // Much longer list: binary search it instead of merging.
+                for (uint32_t candidate : candidates) {
+                    if (binary_search(list.begin(), list.end(), candidate)) merged.push_back(candidate);
+                }
+            } else {
+                set_intersection(candidates.begin(), candidates.end(), list.begin(), list.end(), back_inserter(merged));
+            }
+            candidates.swap(merged);
+        }
+        if (candidates.empty()) return false;
+
+        // Many candidates: walking the log newest first finds the answer
+        // almost at once. Few: order them by recency and verify.
+        if (candidates.size() * 64 > commands.size()) {
+            vector<bool> marked(commands.size());
+            for (uint32_t candidate : candidates) marked[candidate] = true;
+            return recency_search(folded, skip, false, id, &marked);
+        }
+        sort(candidates.begin(), candidates.end(),
+             [this](uint32_t a, uint32_t b) { return commands[a].last_seen > commands[b].last_seen; });
+        for (uint32_t candidate : candidates) {
+            if (!contains(candidate, folded)) continue;
+            if (skip-- == 0) {
+                id = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Walks the log newest first, visiting each command at its latest use.
+    // Only commands set in `only` are considered when it is given.
+    bool recency_search(const string& folded, size_t skip, bool fuzzy, uint32_t& id,
+                        const vector<bool>* only = nullptr) {
+        uint64_t mask = char_mask(folded);
+        for (size_t seq = recent.size(); seq-- > 0;) {
+            uint32_t candidate = recent[seq];
+            const HistoryCommand& cmd = commands[candidate];
+            if (cmd.last_seen != seq || (cmd.mask & mask) != mask) continue;
+            if (only && !(*only)[candidate]) continue;
+            if (!(fuzzy ? subsequence(candidate, folded) : contains(candidate, folded))) continue;
+            if (skip-- == 0) {
+                id = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool contains(uint32_t id, const string& folded) const {
+        const HistoryCommand& cmd = commands[id];
+        const char* text = map.data + cmd.offset;
+        if (folded.size() > cmd.length) return false;
+        for (size_t i = 0; i + folded.size() <= cmd.length; i++) {
+            size_t k = 0;
+            while (k < folded.size() && tolower((unsigned char)text[i + k]) == (unsigned char)folded[k]) k++;
+            if (k == folded.size()) return true;
+        }
+        return false;
+    }
+
+    bool subsequence(uint32_t id, const string& folded) const {
+        const HistoryCommand& cmd = commands[id];
+        const char* text = map.data + cmd.offset;
+        size_t k = 0;
+        for (size_t i = 0; i < cmd.length && k < folded.size(); i++) {
+            if (tolower((unsigned char)text[i]) == (unsigned char)folded[k]) k++;
+        }
+        return k == folded.size();
+    }
+};
+
+HistoryLog& history_log() {
+    static HistoryLog log;
+    return log;
+}
+
+void history_append(string_view line) {
+    history_log().append(line);
+}
+
+bool history_previous(size_t& cursor, string& entry) {
+    return history_log().previous(cursor, entry);
+}
+
+bool history_next(size_t& cursor, string& entry) {
+    return history_log().next(cursor, entry);
+}
+
+size_t history_end() {
+    return history_log().end();
+}
+
+// Ctrl-R: incremental reverse search. Every keystroke re-runs the query;
+// Ctrl-R again steps to the next older match, Enter runs the match, Ctrl-G
+// cancels and any other control key keeps the match for editing.
+// Returns true if the line should be run right away.
+bool reverse_search(string& input) {
+    string query, match;
+    size_t skip = 0;
+    size_t drawn = 0;
+    bool found = false, fuzzy = false;
+    bool matched = false;       // match holds a history entry, not the initial ""
+
+    auto draw = [&]() {
+        string line = string(found ? "" : "failed ") + (fuzzy ? "fuzzy" : "reverse-i") +
+                      "-search)`" + query + "': " + match;
+        line = "(" + line;
+        cout << "\r" << line;
+        if (line.size() < drawn) cout << string(drawn - line.size(), ' ') << string(drawn - line.size(), '\b');
+        flush_output();
+        drawn = line.size();
+    };
+    auto finish = [&](const string& text) {
+        cout << "\r" << string(drawn, ' ') << "\r" << shellPrompt << text;
+        flush_output();
+    };
+
+    found = true;
+    draw();
+    while (true) {
+        int ch = read_key();
+        if (ch == 18) {
+            skip++;
+        } else if (ch == '\b') {
+            if (!query.empty()) query.pop_back();
+            skip = 0;
+        } else if (ch == 7 || ch == EOF) {
+            finish(input);
+            return false;
+        } else if (ch == '\r') {
+            if (found && matched) input = match;
+            finish(input);
+            return true;
+        } else if (ch == 0 || ch == 224 || (ch < 32 && ch != '\t')) {
+            if (ch == 0 || ch == 224) read_key();
+            if (found && matched) input = match;
+            finish(input);
+            return false;
+        } else {
+            query += (char)ch;
+            skip = 0;
+        }
+
+        string result;
+        found = history_log().search(query, skip, result, fuzzy);
+        if (found) {
+            match = result;
+            matched = true;
+        } else if (skip > 0) {
+            skip--;     // no older match: stay on the oldest one
+            found = true;
+        }
+        draw();
+    }
+}
+
+// Open-addressing (linear probing) word -> count table. Keys are views into
+// the mapped file when the word needs no normalisation, otherwise into the
+// table's own arena, so counting does not allocate per word.
+class WordCountTable {
+public:
+    struct Slot {
+        string_view key;
+        uint64_t hash;
+        uint64_t count;
+    };
+
+    WordCountTable() : slots(1024), used(0) {}
+
+    void add(string_view word, uint64_t hash, uint64_t count, bool stable_key) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].count != 0) {
+            if (slots[i].hash == hash && slots[i].key == word) {
+                slots[i].count += count;
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        slots[i] = { stable_key ? word : store(word), hash, count };
+        if (++used * 10 > slots.size() * 7) grow();
+    }
+
+    void merge(const WordCountTable& other) {
+        for (const auto& slot : other.slots) {
+            if (slot.count) add(slot.key, slot.hash, slot.count, true);
+        }
+    }
+
+    const vector<Slot>& entries() const { return slots; }
+    size_t distinct() const { return used; }
+
+private:
+    vector<Slot> slots;
+    size_t used;
+    vector<unique_ptr<char[]>> arena;
+    size_t arena_left = 0;
+    char* arena_pos = nullptr;
+
+    string_view store(string_view word) {
+        if (word.size() > arena_left) {
+            size_t block = max<size_t>(64 * 1024, word.size());
+            arena.emplace_back(new char[block]);
+            arena_pos = arena.back().get();
+            arena_left = block;
+        }
+        memcpy(arena_pos, word.data(), word.size());
+        string_view stored(arena_pos, word.size());
+        arena_pos += word.size();
+        arena_left -= word.size();
+        return stored;
+    }
+
+    void grow() {
+        vector<Slot> old(slots.size() * 2);
+        old.swap(slots);
+        size_t mask = slots.size() - 1;
+        for (const auto& slot : old) {
+            if (!slot.count) continue;
+            size_t i = slot.hash & mask;
+            while (slots[i].count != 0) i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+    }
+};
+
+// Counts the words in [begin, end), which must start and end on word boundaries.
+void count_words_range(const char* begin, const char* end, WordCountTable& table) {
+    const unsigned char* cls = char_classes.cls;
+    string scratch;
+    const char* p = begin;
+    while (p < end) {
+        while (p < end && cls[(unsigned char)*p] == CH_SPACE) p++;
+        const char* start = p;
+        bool clean = true;
+        while (p < end && cls[(unsigned char)*p] != CH_SPACE) {
+            clean &= cls[(unsigned char)*p] == CH_WORD;
+            p++;
+        }
+        if (start == p) break;
+
+        if (clean) {
+            table.add(string_view(start, p - start), hash_bytes(start, p - start), 1, true);
+            continue;
+        }
+        scratch.clear();
+        for (const char* q = start; q < p; q++) {
+            unsigned char c = (unsigned char)*q;
+            if (cls[c] == CH_WORD) scratch += (char)c;
+            else if (cls[c] == CH_UPPER) scratch += (char)(c + ('a' - 'A'));
+        }
+        if (!scratch.empty()) {
+            table.add(scratch, hash_bytes(scratch.data(), scratch.size()), 1, false);
+        }
+    }
+}
+
+// Splits [data, data + size) into up to `parts` ranges that end on whitespace.
+vector<pair<const char*, const char*>> split_on_word_boundaries(const char* data, size_t size, unsigned parts) {
+    vector<pair<const char*, const char*>> ranges;
+    const char* end = data + size;
+    const char* start = data;
+    for (unsigned i = 1; i <= parts && start < end; i++) {
+        const char* cut = (i == parts) ? end : data + size / parts * i;
+        if (cut < start) cut = start;
+        while (cut < end && char_classes.cls[(unsigned char)*cut] != CH_SPACE) cut++;
+        ranges.push_back({ start, cut });
+        start = cut;
+    }
+    return ranges;
+}
+
+unsigned default_thread_count(size_t bytes) {
+    unsigned hw = max(1u, thread::hardware_concurrency());
+    // Below a few MB thread startup costs more than it saves.
+    return (unsigned)min<size_t>(hw, max<size_t>(1, bytes / (4 << 20)));
+}
+
+// Counts every word of a buffer on `threads` threads and merges the results.
+void count_words_parallel(const char* data, size_t size, unsigned threads, vector<WordCountTable>& tables) {
+    auto ranges = split_on_word_boundaries(data, size, max(1u, threads));
+    tables.clear();
+    tables.resize(max<size_t>(1, ranges.size()));
+    vector<thread> workers;
+    for (size_t i = 1; i < ranges.size(); i++) {
+        workers.emplace_back(count_words_range, ranges[i].first, ranges[i].second, ref(tables[i]));
+    }
+    if (!ranges.empty()) count_words_range(ranges[0].first, ranges[0].second, tables[0]);
+    for (auto& worker : workers) worker.join();
+    for (size_t i = 1; i < tables.size(); i++) tables[0].merge(tables[i]);
+}
+
+// Picks the k most frequent words with a bounded min-heap; ties go to the
+// alphabetically smaller word.
+vector<pair<string_view, uint64_t>> top_k_words(const WordCountTable& table, size_t k) {
+    typedef pair<string_view, uint64_t> Entry;
+    auto better = [](const Entry& a, const Entry& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    };
+    vector<Entry> heap;
+    if (k == 0) return heap;
+    heap.reserve(k + 1);
+    for (const auto& slot : table.entries()) {
+        if (!slot.count) continue;
+        Entry e(slot.key, slot.count);
+        if (heap.size() < k) {
+            heap.push_back(e);
+            push_heap(heap.begin(), heap.end(), better);
+        } else if (better(e, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = e;
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    }
+    sort_heap(heap.begin(), heap.end(), better);
+    return heap;
+}
+
+// On-disk cache of wordfreq and count results. An entry is named after the
+// file's identity (device, inode) and the query, and holds the counts for
+// the file up to its last whitespace byte, the boundary, together with the
+// size and mtime it was computed for. When those still match, only the
+// bytes after the boundary (a partial last word, usually nothing) are
+// counted. When the file has grown and the 4 KiB before the old boundary
+// are unchanged, it was appended to: counting resumes at the old boundary
+// and the entry is rewritten. Anything else is a rescan.
+//
+// Entries are a fixed header, the query text and a binary payload, read
+// back with mmap. The directory ($SHELL_CACHE_DIR, else ~/.cache/shell) is
+// kept under a size cap by dropping the least recently used entries;
+// recency is the entry's mtime, which every hit refreshes.
+struct FileIdentity {
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+};
+
+bool file_identity(const string& path, FileIdentity& id) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(file, &info) != 0;
+    CloseHandle(file);
+    if (!ok) return false;
+    id.device = info.dwVolumeSerialNumber;
+    id.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    id.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    id.mtime_ns = (int64_t)((((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime) * 100);
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    id.device = st.st_dev;
+    id.inode = st.st_ino;
+    id.size = st.st_size;
+    id.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+enum CacheKind : uint32_t { CACHE_WORDFREQ = 1, CACHE_COUNT = 2 };
+
+struct CacheHeader {
+    char magic[4];              // "SHRC"
+    uint32_t version;
+    uint32_t kind;
+    uint32_t query_length;      // the query text follows the header
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t boundary;          // counts cover [0, boundary)
+    uint64_t tail_hash;         // of the TAIL_CHECK bytes before boundary
+    uint64_t records;
+};
+
+// Payload of a wordfreq entry: `records` of these, then the words.
+struct CachedWord {
+    uint64_t count;
+    uint32_t offset;            // into the words
+    uint32_t length;
+};
+
+class ResultCache {
+public:
+    static const uint32_t VERSION = 1;
+    static constexpr size_t TAIL_CHECK = 4096;
+
+    bool enabled = true;
+    string dir;
+    uint64_t max_bytes = 256ull << 20;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> resumes{0};
+    atomic<uint64_t> misses{0};
+
+    ResultCache() {
+        const char* dir_env = getenv("SHELL_CACHE_DIR");
+#ifdef _WIN32
+        const char* home = getenv("USERPROFILE");
+#else
+        const char* home = getenv("HOME");
+#endif
+        if (dir_env) dir = dir_env;
+        else if (home) dir = string(home) + "/.cache/shell";
+        else enabled = false;
+        if (const char* limit = getenv("SHELL_CACHE_MAX_MB")) max_bytes = strtoull(limit, nullptr, 10) << 20;
+    }
+
+    // Where the counts cover up to: just past the last whitespace byte.
+    static uint64_t boundary_of(const char* data, size_t size) {
+        size_t end = size;
+        while (end > 0 && char_classes.cls[(unsigned char)data[end - 1]] != CH_SPACE) end--;
+        return end;
+    }
+
+    static uint64_t tail_hash(const char* data, uint64_t boundary) {
+        size_t n = (size_t)min<uint64_t>(boundary, TAIL_CHECK);
+        return hash_bytes(data + boundary - n, n);
+    }
+
+    // Maps the entry for (file, query) into entry if it can be used for
+    // the file as it is now, whose contents are data. Returns false on a
+    // miss; otherwise header() says how far its counts go.
+    bool lookup(const FileIdentity& id, CacheKind kind, const string& query, const char* data, MappedFile& entry) {
+        if (!enabled) return false;
+        string path = entry_path(id, kind, query);
+        if (!entry.open(path) || entry.size < sizeof(CacheHeader)) {
+            misses++;
+            return false;
+        }
+        const CacheHeader* h = (const CacheHeader*)entry.data;
+        bool usable = memcmp(h->magic, "SHRC", 4) == 0 && h->version == VERSION && h->kind == kind &&
+                      h->device == id.device && h->inode == id.inode && h->query_length == query.size() &&
+                      entry.size >= sizeof(CacheHeader) + query.size() &&
+                      memcmp(entry.data + sizeof(CacheHeader), query.data(), query.size()) == 0 &&
+                      h->boundary <= h->size && valid_payload(entry);
+        if (usable && h->size == id.size && h->mtime_ns == id.mtime_ns) {
+            hits++;
+            touch(path);
+            return true;
+        }
+        if (usable && id.size > h->size && tail_hash(data, h->boundary) == h->tail_hash) {
+            resumes++;
+            return true;
+        }
+        entry.close();
+        misses++;
+        return false;
+    }
+
+    static const CacheHeader& header(const MappedFile& entry) {
+        return *(const CacheHeader*)entry.data;
+    }
+
+    static const char* payload(const MappedFile& entry) {
+        return entry.data + sizeof(CacheHeader) + header(entry).query_length;
+    }
+
+    // Writes an entry atomically (temporary file, then rename) and trims
+    // the directory if that took it over the cap.
+    void store(const FileIdentity& id, CacheKind kind, const string& query, const char* data,
+               uint64_t boundary, uint64_t records, const string& payload) {
+        if (!enabled || !make_directory()) return;
+        CacheHeader h;
+        memcpy(h.magic, "SHRC", 4);
+        h.version = VERSION;
+        h.kind = kind;
+        h.query_length = (uint32_t)query.size();
+        h.device = id.device;
+        h.inode = id.inode;
+        h.size = id.size;
+        h.mtime_ns = id.mtime_ns;
+        h.boundary = boundary;
+        h.tail_hash = tail_hash(data, boundary);
+        h.records = records;
+
+        string path = entry_path(id, kind, query);
+        string temp = temp_path_for(path);
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+        if (fd < 0) return;
+        bool written = write_all(fd, (const char*)&h, sizeof(h)) && write_all(fd, query.data(), query.size()) &&
+                       write_all(fd, payload.data(), payload.size());
+        if (close(fd) != 0 || !written) {
+            remove(temp.c_str());
+            return;
+        }
+#ifdef _WIN32
+        remove(path.c_str());
+#endif
+        if (rename(temp.c_str(), path.c_str()) != 0) {
+            remove(temp.c_str());
+            return;
+        }
+        evict();
+    }
+
+    struct Usage {
+        size_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+    Usage usage() {
+        Usage total;
+        for (const auto& entry : list_entries()) {
+            total.entries++;
+            total.bytes += entry.size;
+        }
+        return total;
+    }
+
+    void clear() {
+        for (const auto& entry : list_entries()) remove((dir + "/" + entry.name).c_str());
+    }
+
+    // Drops least recently used entries until the directory fits the cap.
+    void evict() {
+        lock_guard<mutex> lock(evict_lock);
+        vector<EntryFile> entries = list_entries();
+        uint64_t total = 0;
+        for (const auto& entry : entries) total += entry.size;
+        if (total <= max_bytes) return;
+        sort(entries.begin(), entries.end(), [](const EntryFile& a, const EntryFile& b) { return a.mtime < b.mtime; });
+        for (const auto& entry : entries) {
+            if (total <= max_bytes) break;
+            if (remove((dir + "/" + entry.name).c_str()) == 0) total -= entry.size;
+        }
+    }
+
+    bool make_directory() {
+        for (size_t slash = 1; slash != string::npos; slash = dir.find('/', slash + 1)) {
+            string part = dir.substr(0, slash);
+#ifdef _WIN32
+            _mkdir(part.c_str());
+#else
+            mkdir(part.c_str(), 0700);
+#endif
+        }
+#ifdef _WIN32
+        _mkdir(dir.c_str());
+#else
+        mkdir(dir.c_str(), 0700);
+#endif
+        return is_directory(dir);
+    }
+
+private:
+    struct EntryFile {
+        string name;
+        uint64_t size;
+        long long mtime;
+    };
+
+    mutex evict_lock;
+
+    // Whether every record the header promises lies inside the entry; a
+    // truncated or damaged file is a miss rather than a read past the map.
+    static bool valid_payload(const MappedFile& entry) {
+        const CacheHeader& h = header(entry);
+        uint64_t room = entry.size - sizeof(CacheHeader) - h.query_length;
+        if (h.kind == CACHE_COUNT) return h.records == room / sizeof(uint64_t) && room % sizeof(uint64_t) == 0;
+        if (h.records > room / sizeof(CachedWord)) return false;
+        const CachedWord* records = (const CachedWord*)payload(entry);
+        uint64_t words = room - h.records * sizeof(CachedWord);
+        for (uint64_t i = 0; i < h.records; i++) {
+            if (records[i].offset > words || records[i].length > words - records[i].offset) return false;
+        }
+        return true;
+    }
+
+    string entry_path(const FileIdentity& id, CacheKind kind, const string& query) const {
+        uint64_t key = hash_bytes(query.data(), query.size());
+        key ^= (id.device * 0x9e3779b97f4a7c15ull) ^ (id.inode * 0xc2b2ae3d27d4eb4full) ^ kind;
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.rc", (unsigned long long)key);
+        return dir + name;
+    }
+
+    static void touch(const string& path) {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        if (file == INVALID_HANDLE_VALUE) return;
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, NULL, NULL, &now);
+        CloseHandle(file);
+#else
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+#endif
+    }
+
+    // The .rc files in the directory, with sizes and mtimes.
+    vector<EntryFile> list_entries() {
+        vector<EntryFile> entries;
+        if (!is_directory(dir)) return entries;
+        vector<DirEntry> names;
+        read_directory(dir, names);
+        for (const auto& name : names) {
+            if (name.is_dir || name.name.size() < 3 || name.name.compare(name.name.size() - 3, 3, ".rc") != 0) continue;
+            struct stat st;
+            if (stat((dir + "/" + name.name).c_str(), &st) != 0) continue;
+            entries.push_back({ name.name, (uint64_t)st.st_size, (long long)st.st_mtime });
+        }
+        return entries;
+    }
+};
+
+ResultCache& result_cache() {
+    static ResultCache cache;
+    return cache;
+}
+
+// Serializes a word table as a wordfreq cache payload.
+bool serialize_words(const WordCountTable& table, string& payload, uint64_t& records) {
+    vector<CachedWord> index;
+    string words;
+    for (const auto& slot : table.entries()) {
+        if (!slot.count) continue;
+        if (words.size() + slot.key.size() > UINT32_MAX) return false;
+        index.push_back({ slot.count, (uint32_t)words.size(), (uint32_t)slot.key.size() });
+        words.append(slot.key);
+    }
+    records = index.size();
+    payload.assign((const char*)index.data(), index.size() * sizeof(CachedWord));
+    payload += words;
+    return true;
+}
+
+void word_frequency(const string& filename, size_t top_k, unsigned threads) {
+    MappedFile file;
+    if (!file.open(filename)) {
+        cerr << "Error: Cannot open file '" << filename << "'" << endl;
+        return;
+    }
+
+    // Cached counts cover [0, from); [from, boundary) is counted and
+    // cached now, and whatever follows the boundary is counted every time.
+    ResultCache& cache = result_cache();
+    FileIdentity id;
+    bool cacheable = cache.enabled && filename != "-" && file_identity(filename, id) && id.size == file.size;
+    uint64_t boundary = cacheable ? ResultCache::boundary_of(file.data, file.size) : file.size;
+    MappedFile entry;
+    uint64_t from = 0;
+    if (cacheable && cache.lookup(id, CACHE_WORDFREQ, "", file.data, entry)) from = ResultCache::header(entry).boundary;
+
+    if (threads == 0) threads = default_thread_count(boundary - from);
+    vector<WordCountTable> tables;
+    count_words_parallel(file.data + from, boundary - from, threads, tables);
+    if (entry.data) {
+        const CachedWord* records = (const CachedWord*)ResultCache::payload(entry);
+        const char* words = (const char*)(records + ResultCache::header(entry).records);
+        for (uint64_t i = 0; i < ResultCache::header(entry).records; i++) {
+            string_view word(words + records[i].offset, records[i].length);
+            tables[0].add(word, hash_bytes(word.data(), word.size()), records[i].count, true);
+        }
+    }
+    string payload;
+    uint64_t records = 0;
+    bool store = cacheable && from < boundary && serialize_words(tables[0], payload, records);
+    count_words_range(file.data + boundary, file.data + file.size, tables[0]);
+
+    OutputSink& sink = out();
+    sink << "Top " << top_k << " most frequent words in '" << filename << "':\n";
+    for (const auto& word : top_k_words(tables[0], top_k)) {
+        sink << word.first;
+        for (size_t pad = word.first.size(); pad < 15; pad++) sink << ' ';
+        sink << ": " << (unsigned long long)word.second << '\n';
+    }
+    tables.clear();
+    entry.close();
+    if (store) cache.store(id, CACHE_WORDFREQ, "", file.data, boundary, records, payload);
+}
+
+void word_frequency_command(const Args& args) {
+    size_t top_k = 10;
+    unsigned threads = 0;
+    string filename;
+    try {
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "-k" && i + 1 < args.size()) top_k = stoul(args.str(++i));
+            else if (args[i] == "-j" && i + 1 < args.size()) threads = stoul(args.str(++i));
+            else filename = args[i];
+        }
+    } catch (const exception&) {
+        filename.clear();
+    }
+    if (filename.empty()) {
+        cerr << "Usage: wordfreq [-k N] [-j THREADS] <filename>" << endl;
+        cerr << "Example: wordfreq -k 20 myfile.txt" << endl;
+        return;
+    }
+    word_frequency(filename, top_k, threads);
+}
+
+// Pattern scanning kernel used by count. Candidates are found by comparing
+// the first pattern byte against 16 (SSE2) or 32 (AVX2) bytes at a time and
+// then verified byte by byte. For letters the comparison is done on
+// (byte | 0x20), which folds case inside the vector.
+typedef size_t (*FindByteFn)(const char* data, size_t n, unsigned char lower, bool fold);
+
+size_t find_byte_scalar(const char* data, size_t n, unsigned char lower, bool fold) {
+    const unsigned char mask = fold ? 0x20 : 0;
+    for (size_t i = 0; i < n; i++) {
+        if (((unsigned char)data[i] | mask) == lower) return i;
+    }
+    return n;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define SHELL_HAVE_X86_SIMD 1
+
+__attribute__((target("sse2")))
+size_t find_byte_sse2(const char* data, size_t n, unsigned char lower, bool fold) {
+    const __m128i needle = _mm_set1_epi8((char)lower);
+    const __m128i mask = _mm_set1_epi8(fold ? 0x20 : 0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)), mask);
+        int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (bits) return i + __builtin_ctz(bits);
+    }
+    return i + find_byte_scalar(data + i, n - i, lower, fold);
+}
+
+__attribute__((target("avx2")))
+size_t find_byte_avx2(const char* data, size_t n, unsigned char lower, bool fold) {
+    const __m256i needle = _mm256_set1_epi8((char)lower);
+    const __m256i mask = _mm256_set1_epi8(fold ? 0x20 : 0);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(data + i)), mask);
+        unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (bits) return i + __builtin_ctz(bits);
+    }
+    return i + find_byte_sse2(data + i, n - i, lower, fold);
+}
+#endif
+
+struct ScanKernel {
+    const char* name;
+    FindByteFn find;
+};
+
+// Widest instruction set the CPU supports, chosen once at startup.
+ScanKernel select_scan_kernel(const string& requested = "") {
+    vector<ScanKernel> available = { { "scalar", find_byte_scalar } };
+#ifdef SHELL_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) available.push_back({ "sse2", find_byte_sse2 });
+    if (__builtin_cpu_supports("avx2")) available.push_back({ "avx2", find_byte_avx2 });
+#endif
+    if (requested.empty()) return available.back();
+    for (const auto& kernel : available) {
+        if (requested == kernel.name) return kernel;
+    }
+    return { nullptr, nullptr };
+}
+
+ScanKernel scan_kernel = select_scan_kernel();
+
+struct FoldTable {
+    unsigned char lower[256];
+    FoldTable() {
+        for (int c = 0; c < 256; c++) lower[c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+};
+const FoldTable fold_table;
+
+enum CountMode { COUNT_WHOLE_WORD, COUNT_SUBSTRING };
+
+// Counts matches of a lowercase pattern whose first byte lies in
+// [begin, end); verification may read on up to limit, and the whole-word
+// check looks back as far as data_start. If stop is given it receives where
+// scanning ended, past end when the last match runs over it, so that the
+// next block can start there and not count a piece of that match again.
+//
+// Whole-word mode keeps the old split_words() semantics: a match is a
+// whitespace-delimited token whose letters, with punctuation removed and
+// case folded, equal the pattern. Substring mode counts case-insensitive,
+// non-overlapping occurrences.
+uint64_t count_pattern_range(const char* data_start, const char* begin, const char* end, const char* limit,
+                             const string& pattern, CountMode mode, FindByteFn find, const char** stop = nullptr) {
+    if (stop) *stop = max(begin, end);
+    if (pattern.empty()) return 0;
+    const unsigned char* cls = char_classes.cls;
+    const unsigned char* lower = fold_table.lower;
+    const unsigned char first = (unsigned char)pattern[0];
+    const bool fold = first >= 'a' && first <= 'z';
+    uint64_t count = 0;
+
+    const char* p = begin;
+    while (p < end) {
+        p += find(p, end - p, first, fold);
+        if (p >= end) break;
+
+        if (mode == COUNT_SUBSTRING) {
+            size_t len = pattern.size();
+            size_t i = 1;
+            if ((size_t)(limit - p) >= len) {
+                while (i < len && lower[(unsigned char)p[i]] == (unsigned char)pattern[i]) i++;
+            }
+            if (i == len) {
+                count++;
+                p += len;
+            } else {
+                p++;
+            }
+            continue;
+        }
+
+        const char* q = p;
+        bool match = true;
+        for (const char* b = p; b > data_start && cls[(unsigned char)b[-1]] != CH_SPACE; b--) {
+            if (cls[(unsigned char)b[-1]] != CH_PUNCT) {
+                match = false;
+                break;
+            }
+        }
+        for (size_t i = 0; match && i < pattern.size(); i++) {
+            while (q < limit && cls[(unsigned char)*q] == CH_PUNCT) q++;
+            match = q < limit && lower[(unsigned char)*q] == (unsigned char)pattern[i];
+            q++;
+        }
+        for (; match && q < limit && cls[(unsigned char)*q] != CH_SPACE; q++) {
+            match = cls[(unsigned char)*q] == CH_PUNCT;
+        }
+        if (match) count++;
+        p = match ? q : p + 1;
+    }
+    if (stop) *stop = max(p, end);
+    return count;
+}
+
+struct CountJob {
+    string filename;
+    vector<uint64_t> counts;
+    bool ok = false;
+};
+
+// Counts every pattern in one file, in 1 MiB blocks so that all patterns
+// are checked while a block is still in cache. Counts up to the file's last
+// whitespace go through the result cache (see ResultCache).
+void count_patterns_in_file(CountJob& job, const vector<string>& patterns, CountMode mode,
+                            FindByteFn find, unsigned threads) {
+    MappedFile file;
+    job.counts.assign(patterns.size(), 0);
+    if (!file.open(job.filename)) return;
+    job.ok = true;
+    if (file.size == 0) return;
+
+    // Adds the matches starting in [begin, end) to job.counts, reading no
+    // further than end, split over `threads` threads. Blocks only bound
+    // where a match may start: the whole-word check looks back to the start
+    // of the file, and a block starts after any match running into it.
+    auto count_range = [&](const char* begin, const char* end, unsigned threads) {
+        auto scan = [&](const char* b0, const char* e0, vector<uint64_t>& counts) {
+            const size_t block = 1 << 20;
+            vector<const char*> next(patterns.size(), b0);
+            for (const char* b = b0; b < e0; b += min<size_t>(block, e0 - b)) {
+                const char* e = b + min<size_t>(block, e0 - b);
+                for (size_t k = 0; k < patterns.size(); k++) {
+                    counts[k] += count_pattern_range(file.data, max(b, next[k]), e, end, patterns[k], mode, find, &next[k]);
+                }
+            }
+        };
+        auto ranges = split_on_word_boundaries(begin, end - begin, max(1u, threads));
+        vector<vector<uint64_t>> partial(ranges.size(), vector<uint64_t>(patterns.size(), 0));
+        vector<thread> workers;
+        for (size_t i = 1; i < ranges.size(); i++) {
+            workers.emplace_back(scan, ranges[i].first, ranges[i].second, ref(partial[i]));
+        }
+        if (!ranges.empty()) scan(ranges[0].first, ranges[0].second, partial[0]);
+        for (auto& worker : workers) worker.join();
+        for (const auto& counts : partial) {
+            for (size_t k = 0; k < patterns.size(); k++) job.counts[k] += counts[k];
+        }
+    };
+
+    // A pattern with whitespace could match across the boundary.
+    string query(1, mode == COUNT_WHOLE_WORD ? 'w' : 's');
+    bool cacheable = job.filename != "-";
+    for (const auto& pattern : patterns) {
+        query += '\0';
+        query += pattern;
+        for (unsigned char c : pattern) cacheable &= char_classes.cls[c] != CH_SPACE;
+    }
+    ResultCache& cache = result_cache();
+    FileIdentity id;
+    cacheable = cacheable && cache.enabled && file_identity(job.filename, id) && id.size == file.size;
+    uint64_t boundary = cacheable ? ResultCache::boundary_of(file.data, file.size) : file.size;
+    MappedFile entry;
+    uint64_t from = 0;
+    if (cacheable && cache.lookup(id, CACHE_COUNT, query, file.data, entry) &&
+        ResultCache::header(entry).records == patterns.size()) {
+        const uint64_t* cached = (const uint64_t*)ResultCache::payload(entry);
+        for (size_t k = 0; k < patterns.size(); k++) job.counts[k] = cached[k];
+        from = ResultCache::header(entry).boundary;
+        entry.close();
+    }
+    if (from < boundary) {
+        count_range(file.data + from, file.data + boundary, threads);
+        if (cacheable) {
+            string payload((const char*)job.counts.data(), job.counts.size() * sizeof(uint64_t));
+            cache.store(id, CACHE_COUNT, query, file.data, boundary, patterns.size(), payload);
+        }
+    }
+    count_range(file.data + boundary, file.data + file.size, 1);
+}
+
+void collect_files(const string& path, vector<string>& files) {
+    if (!is_directory(path)) {
+        files.push_back(path);
+        return;
+    }
+    vector<DirEntry> entries;
+    if (!read_directory(path, entries)) {
+        cerr << "Error: Cannot read directory '" << path << "'" << endl;
+        return;
+    }
+    sort(entries.begin(), entries.end(), [](const DirEntry& a, const DirEntry& b) { return a.name < b.name; });
+    for (const auto& entry : entries) {
+        string child = path + "/" + entry.name;
+        // A link to a directory is not followed; it could lead back up.
+        if (entry.is_dir && entry.is_link) continue;
+        if (entry.is_dir) collect_files(child, files);
+        else files.push_back(child);
+    }
+}
+
+void count_word_in_file(const vector<string>& paths, const vector<string>& words, CountMode mode,
+                        unsigned threads, FindByteFn find) {
+    // As before, the word is only lowercased. Tokens lose their punctuation
+    // before they are compared, so in whole-word mode a word with
+    // punctuation or spaces in it never matches; its pattern is left empty.
+    vector<string> patterns;
+    for (const auto& word : words) {
+        string pattern;
+        for (unsigned char c : word) {
+            if (mode == COUNT_WHOLE_WORD && (char_classes.cls[c] == CH_PUNCT || char_classes.cls[c] == CH_SPACE)) {
+                pattern.clear();
+                break;
+            }
+            pattern += (char)fold_table.lower[c];
+        }
+        patterns.push_back(pattern);
+    }
+
+    vector<CountJob> jobs;
+    for (const auto& path : paths) {
+        vector<string> files;
+        collect_files(path, files);
+        for (const auto& f : files) jobs.push_back({ f, {}, false });
+    }
+    if (jobs.empty()) return;
+
+    // Many files: one file per worker. One file: split it across workers.
+    if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+    if (jobs.size() == 1) {
+        MappedFile probe;
+        unsigned per_file = (jobs[0].filename == "-") ? threads
+                          : probe.open(jobs[0].filename) ? min(threads, default_thread_count(probe.size)) : 1;
+        count_patterns_in_file(jobs[0], patterns, mode, find, per_file);
+    } else {
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                count_patterns_in_file(jobs[i], patterns, mode, find, 1);
+            }
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < min<size_t>(threads, jobs.size()); t++) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+    }
+
+    const char* label = (mode == COUNT_WHOLE_WORD) ? "Word" : "Substring";
+    if (jobs.size() == 1 && words.size() == 1) {
+        if (!jobs[0].ok) {
+            cerr << "Error: Cannot open file '" << jobs[0].filename << "'" << endl;
+            return;
+        }
+        cout << label << " '" << words[0] << "' appears " << jobs[0].counts[0]
+             << " times in '" << jobs[0].filename << "'" << endl;
+        return;
+    }
+
+    vector<uint64_t> totals(words.size(), 0);
+    for (const auto& job : jobs) {
+        if (!job.ok) {
+            cerr << "Error: Cannot open file '" << job.filename << "'" << endl;
+            continue;
+        }
+        cout << job.filename << ":";
+        for (size_t k = 0; k < words.size(); k++) {
+            cout << (k ? ", '" : " '") << words[k] << "' " << job.counts[k];
+            totals[k] += job.counts[k];
+        }
+        cout << endl;
+    }
+    if (jobs.size() > 1) {
+        cout << "Total (" << jobs.size() << " files):";
+        for (size_t k = 0; k < words.size(); k++) {
+            cout << (k ? ", '" : " '") << words[k] << "' " << totals[k];
+        }
+        cout << endl;
+    }
+}
+
+void count_command(const Args& args) {
+    CountMode mode = COUNT_WHOLE_WORD;
+    unsigned threads = 0;
+    FindByteFn find = scan_kernel.find;
+    vector<string> words, paths;
+    try {
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "-s") mode = COUNT_SUBSTRING;
+            else if (args[i] == "-w") mode = COUNT_WHOLE_WORD;
+            else if (args[i] == "-e" && i + 1 < args.size()) words.emplace_back(args[++i]);
+            else if (args[i] == "-j" && i + 1 < args.size()) threads = stoul(args.str(++i));
+            else if (args[i] == "--isa" && i + 1 < args.size()) {
+                ScanKernel kernel = select_scan_kernel(args.str(++i));
+                if (!kernel.find) {
+                    cerr << "Error: Instruction set '" << args[i] << "' is not available" << endl;
+                    return;
+                }
+                find = kernel.find;
+            }
+            else paths.emplace_back(args[i]);
+        }
+    } catch (const exception&) {
+        paths.clear();
+    }
+    // Without -e the last argument is the word, as in "count <file> <word>".
+    if (words.empty() && paths.size() >= 2) {
+        words.push_back(paths.back());
+        paths.pop_back();
+    }
+    if (paths.empty() || words.empty()) {
+        cerr << "Usage: count [-s] [-j THREADS] [--isa scalar|sse2|avx2] <file|dir>... <word>" << endl;
+        cerr << "       count [-s] -e <word> [-e <word>]... <file|dir>..." << endl;
+        cerr << "Example: count myfile.txt hello" << endl;
+        return;
+    }
+    count_word_in_file(paths, words, mode, threads, find);
+}
+
+// Expression engine for calc. An expression is compiled once into bytecode
+// for a small stack machine and cached by its source text, so evaluating
+// the same expression over many input lines only runs the machine. One
+// compiler serves three number types: double (default), 64-bit integers
+// (-i, overflow is an error) and arbitrary-precision integers (-b).
+
+struct CalcError : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+// Arbitrary-precision integer in base 10^9 limbs, least significant first.
+struct BigInt {
+    static const uint32_t BASE = 1000000000;
+    bool negative = false;
+    vector<uint32_t> limbs;     // empty is zero
+
+    BigInt() = default;
+    BigInt(long long value) {
+        negative = value < 0;
+        unsigned long long magnitude = negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+        for (; magnitude; magnitude /= BASE) limbs.push_back((uint32_t)(magnitude % BASE));
+    }
+
+    bool is_zero() const { return limbs.empty(); }
+
+    void trim() {
+        while (!limbs.empty() && limbs.back() == 0) limbs.pop_back();
+        if (limbs.empty()) negative = false;
+    }
+
+    static int compare_magnitude(const BigInt& a, const BigInt& b) {
+        if (a.limbs.size() != b.limbs.size()) return a.limbs.size() < b.limbs.size() ? -1 : 1;
+        for (size_t i = a.limbs.size(); i-- > 0;) {
+            if (a.limbs[i] != b.limbs[i]) return a.limbs[i] < b.limbs[i] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    static int compare(const BigInt& a, const BigInt& b) {
+        if (a.negative != b.negative) return a.negative ? -1 : 1;
+        int c = compare_magnitude(a, b);
+        return a.negative ? -c : c;
+    }
+
+    static BigInt add_magnitude(const BigInt& a, const BigInt& b) {
+        const vector<uint32_t>& x = a.limbs.size() >= b.limbs.size() ? a.limbs : b.limbs;
+        const vector<uint32_t>& y = a.limbs.size() >= b.limbs.size() ? b.limbs : a.limbs;
+        BigInt r;
+        r.limbs.resize(x.size() + 1);
+        uint32_t carry = 0;
+        for (size_t i = 0; i < x.size(); i++) {
+            uint32_t sum = x[i] + (i < y.size() ? y[i] : 0) + carry;
+            carry = sum >= BASE;
+            r.limbs[i] = carry ? sum - BASE : sum;
+        }
+        r.limbs[x.size()] = carry;
+        r.trim();
+        return r;
+    }
+
+    // |a| - |b| for |a| >= |b|.
+    static BigInt sub_magnitude(const BigInt& a, const BigInt& b) {
+        BigInt r;
+        r.limbs.resize(a.limbs.size());
+        int64_t borrow = 0;
+        for (size_t i = 0; i < a.limbs.size(); i++) {
+            int64_t d = (int64_t)a.limbs[i] - (i < b.limbs.size() ? b.limbs[i] : 0) - borrow;
+            borrow = d < 0;
+            r.limbs[i] = (uint32_t)(borrow ? d + BASE : d);
+        }
+        r.trim();
+        return r;
+    }
+
+    void mul_small(uint32_t factor) {
+        uint64_t carry = 0;
+        for (uint32_t& limb : limbs) {
+            uint64_t cur = (uint64_t)limb * factor + carry;
+            limb = (uint32_t)(cur % BASE);
+            carry = cur / BASE;
+        }
+        if (carry) limbs.push_back((uint32_t)carry);
+        trim();
+    }
+
+    BigInt operator-() const {
+        BigInt r = *this;
+        if (!r.is_zero()) r.negative = !r.negative;
+        return r;
+    }
+
+    friend BigInt operator+(const BigInt& a, const BigInt& b) {
+        if (a.negative == b.negative) {
+            BigInt r = add_magnitude(a, b);
+            r.negative = a.negative && !r.is_zero();
+            return r;
+        }
+        int c = compare_magnitude(a, b);
+        if (c == 0) return BigInt();
+        BigInt r = c > 0 ? sub_magnitude(a, b) : sub_magnitude(b, a);
+        r.negative = c > 0 ? a.negative : b.negative;
+        return r;
+    }
+
+    friend BigInt operator-(const BigInt& a, const BigInt& b) { return a + (-b); }
+
+    friend BigInt operator*(const BigInt& a, const BigInt& b) {
+        if (a.is_zero() || b.is_zero()) return BigInt();
+        vector<uint64_t> acc(a.limbs.size() + b.limbs.size() + 1, 0);
+        for (size_t i = 0; i < a.limbs.size(); i++) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < b.limbs.size(); j++) {
+                uint64_t cur = acc[i + j] + (uint64_t)a.limbs[i] * b.limbs[j] + carry;
+                acc[i + j] = cur % BASE;
+                carry = cur / BASE;
+            }
+            for (size_t k = i + b.limbs.size(); carry; k++) {
+                uint64_t cur = acc[k] + carry;
+                acc[k] = cur % BASE;
+                carry = cur / BASE;
+            }
+        }
+        BigInt r;
+        r.limbs.assign(acc.begin(), acc.end());
+        r.negative = a.negative != b.negative;
+        r.trim();
+        return r;
+    }
+
+    // Truncating division; the remainder takes the dividend's sign, as in C.
+    static void divmod(const BigInt& a, const BigInt& b, BigInt& quotient, BigInt& remainder) {
+        if (b.is_zero()) throw CalcError("Division by zero");
+        BigInt divisor = b;
+        divisor.negative = false;
+        BigInt rem;
+        BigInt q;
+        q.limbs.assign(a.limbs.size(), 0);
+        for (size_t i = a.limbs.size(); i-- > 0;) {
+            rem.limbs.insert(rem.limbs.begin(), a.limbs[i]);
+            rem.trim();
+            // Largest digit d with divisor * d <= rem, by bisection.
+            uint32_t lo = 0, hi = (compare_magnitude(rem, divisor) < 0) ? 0 : BASE - 1;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo + 1) / 2;
+                BigInt product = divisor;
+                product.mul_small(mid);
+                if (compare_magnitude(product, rem) <= 0) lo = mid;
+                else hi = mid - 1;
+            }
+            if (lo) {
+                BigInt product = divisor;
+                product.mul_small(lo);
+                rem = sub_magnitude(rem, product);
+            }
+            q.limbs[i] = lo;
+        }
+        q.negative = a.negative != b.negative;
+        q.trim();
+        rem.negative = a.negative;
+        rem.trim();
+        quotient = move(q);
+        remainder = move(rem);
+    }
+
+    static bool parse(string_view text, BigInt& value) {
+        if (text.empty()) return false;
+        for (char c : text) if (c < '0' || c > '9') return false;
+        value = BigInt();
+        for (size_t end = text.size(); end > 0;) {
+            size_t start = end > 9 ? end - 9 : 0;
+            uint32_t limb = 0;
+            for (size_t i = start; i < end; i++) limb = limb * 10 + (text[i] - '0');
+            value.limbs.push_back(limb);
+            end = start;
+        }
+        value.trim();
+        return true;
+    }
+
+    void format(OutputSink& sink) const {
+        if (is_zero()) {
+            sink.put('0');
+            return;
+        }
+        if (negative) sink.put('-');
+        sink.put((unsigned long long)limbs.back());
+        for (size_t i = limbs.size() - 1; i-- > 0;) sink.printf("%09u", limbs[i]);
+    }
+};
+
+template<class T>
+struct CalcFunction {
+    const char* name;
+    int min_args;
+    int max_args;
+    T (*call)(const T* args, int argc);
+};
+
+// Arithmetic, parsing and functions for each number type.
+template<class T> struct CalcTraits;
+
+template<>
+struct CalcTraits<double> {
+    static bool parse(string_view text, double& value) {
+        if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            unsigned long long bits = 0;
+            auto result = from_chars(text.data() + 2, text.data() + text.size(), bits, 16);
+            value = (double)bits;
+            return result.ec == errc() && result.ptr == text.data() + text.size();
+        }
+        if (!text.empty() && text[0] == '+') text.remove_prefix(1);
+        auto result = from_chars(text.data(), text.data() + text.size(), value);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+    static bool constant(string_view name, double& value) {
+        if (name == "pi") value = 3.14159265358979323846;
+        else if (name == "e") value = 2.71828182845904523536;
+        else return false;
+        return true;
+    }
+    static double neg(double a) { return -a; }
+    static double add(double a, double b) { return a + b; }
+    static double sub(double a, double b) { return a - b; }
+    static double mul(double a, double b) { return a * b; }
+    static double div(double a, double b) {
+        if (b == 0) throw CalcError("Division by zero");
+        return a / b;
+    }
+    static double mod(double a, double b) {
+        if (b == 0) throw CalcError("Division by zero");
+        return fmod(a, b);
+    }
+    static double power(double a, double b) { return pow(a, b); }
+    static bool less(double a, double b) { return a < b; }
+    static bool equal(double a, double b) { return a == b; }
+    static double from_bool(bool b) { return b ? 1 : 0; }
+    static void format(double value, OutputSink& sink) {
+        char text[32];
+        auto result = to_chars(text, text + sizeof(text), value, chars_format::general, 15);
+        sink.write(text, result.ptr - text);
+    }
+    static const CalcFunction<double>* functions(size_t& count);
+};
+
+template<>
+struct CalcTraits<long long> {
+    static bool parse(string_view text, long long& value) {
+        int base = 10;
+        if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            text.remove_prefix(2);
+            base = 16;
+        } else if (!text.empty() && text[0] == '+') {
+            text.remove_prefix(1);
+        }
+        auto result = from_chars(text.data(), text.data() + text.size(), value, base);
+        return result.ec == errc() && result.ptr == text.data() + text.size();
+    }
+    static bool constant(string_view, long long&) { return false; }
+    static long long neg(long long a) {
+        if (a == LLONG_MIN) throw CalcError("Integer overflow");
+        return -a;
+    }
+    static long long add(long long a, long long b) {
+        long long r;
+        if (__builtin_add_overflow(a, b, &r)) throw CalcError("Integer overflow");
+        return r;
+    }
+    static long long sub(long long a, long long b) {
+        long long r;
+        if (__builtin_sub_overflow(a, b, &r)) throw CalcError("Integer overflow");
+        return r;
+    }
+    static long long mul(long long a, long long b) {
+        long long r;
+        if (__builtin_mul_overflow(a, b, &r)) throw CalcError("Integer overflow");
+        return r;
+    }
+    static long long div(long long a, long long b) {
+        if (b == 0) throw CalcError("Division by zero");
+        if (a == LLONG_MIN && b == -1) throw CalcError("Integer overflow");
+        return a / b;
+    }
+    static long long mod(long long a, long long b) {
+        if (b == 0) throw CalcError("Division by zero");
+        return (b == -1) ? 0 : a % b;
+    }
+    static long long power(long long base, long long exponent) {
+        if (exponent < 0) throw CalcError("Negative exponent in integer mode");
+        long long result = 1;
+        while (exponent) {
+            if (exponent & 1) result = mul(result, base);
+            exponent >>= 1;
+            if (exponent) base = mul(base, base);
+        }
+        return result;
+    }
+    static bool less(long long a, long long b) { return a < b; }
+    static bool equal(long long a, long long b) { return a == b; }
+    static long long from_bool(bool b) { return b ? 1 : 0; }
+    static void format(long long value, OutputSink& sink) { sink.put(value); }
+    static const CalcFunction<long long>* functions(size_t& count);
+};
+
+template<>
+struct CalcTraits<BigInt> {
+    static bool parse(string_view text, BigInt& value) {
+        if (!text.empty() && text[0] == '+') text.remove_prefix(1);
+        return BigInt::parse(text, value);
+    }
+    static bool constant(string_view, BigInt&) { return false; }
+    static BigInt neg(const BigInt& a) { return -a; }
+    static BigInt add(const BigInt& a, const BigInt& b) { return a + b; }
+    static BigInt sub(const BigInt& a, const BigInt& b) { return a - b; }
+    static BigInt mul(const BigInt& a, const BigInt& b) { return a * b; }
+    static BigInt div(const BigInt& a, const BigInt& b) {
+        BigInt q, r;
+        BigInt::divmod(a, b, q, r);
+        return q;
+    }
+    static BigInt mod(const BigInt& a, const BigInt& b) {
+        BigInt q, r;
+        BigInt::divmod(a, b, q, r);
+        return r;
+    }
+    static BigInt power(const BigInt& base, const BigInt& exponent) {
+        if (exponent.negative) throw CalcError("Negative exponent in integer mode");
+        if (exponent.limbs.size() > 1) throw CalcError("Exponent too large");
+        uint32_t e = exponent.is_zero() ? 0 : exponent.limbs[0];
+        // Keep results to about ten million digits.
+        if (base.limbs.size() > 1 || (!base.is_zero() && base.limbs[0] > 1)) {
+            double digits = e * log10((double)base.limbs.back() + 1) + e * 9.0 * (base.limbs.size() - 1);
+            if (digits > 1e7) throw CalcError("Result too large");
+        }
+        BigInt result(1), square = base;
+        while (e) {
+            if (e & 1) result = result * square;
+            e >>= 1;
+            if (e) square = square * square;
+        }
+        return result;
+    }
+    static bool less(const BigInt& a, const BigInt& b) { return BigInt::compare(a, b) < 0; }
+    static bool equal(const BigInt& a, const BigInt& b) { return BigInt::compare(a, b) == 0; }
+    static BigInt from_bool(bool b) { return BigInt(b ? 1 : 0); }
+    static void format(const BigInt& value, OutputSink& sink) { value.format(sink); }
+    static const CalcFunction<BigInt>* functions(size_t& count);
+};
+
+template<class T> T calc_min(const T* args, int argc) {
+    T best = args[0];
+    for (int i = 1; i < argc; i++) if (CalcTraits<T>::less(args[i], best)) best = args[i];
+    return best;
+}
+
+template<class T> T calc_max(const T* args, int argc) {
+    T best = args[0];
+    for (int i = 1; i < argc; i++) if (CalcTraits<T>::less(best, args[i])) best = args[i];
+    return best;
+}
+
+template<class T> T calc_abs(const T* args, int) {
+    return CalcTraits<T>::less(args[0], T(0)) ? CalcTraits<T>::neg(args[0]) : args[0];
+}
+
+template<class T> T calc_gcd(const T* args, int) {
+    T a = calc_abs(&args[0], 1), b = calc_abs(&args[1], 1);
+    while (!CalcTraits<T>::equal(b, T(0))) {
+        T r = CalcTraits<T>::mod(a, b);
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+template<class T> T calc_pow(const T* args, int) {
+    return CalcTraits<T>::power(args[0], args[1]);
+}
+
+#define CALC_MATH1(fn) [](const double* a, int) { return fn(a[0]); }
+#define CALC_MATH2(fn) [](const double* a, int) { return fn(a[0], a[1]); }
+
+const CalcFunction<double>* CalcTraits<double>::functions(size_t& count) {
+    static const CalcFunction<double> table[] = {
+        { "abs", 1, 1, calc_abs<double> },
+        { "min", 1, 255, calc_min<double> },
+        { "max", 1, 255, calc_max<double> },
+        { "pow", 2, 2, calc_pow<double> },
+        { "sqrt", 1, 1, CALC_MATH1(sqrt) },
+        { "cbrt", 1, 1, CALC_MATH1(cbrt) },
+        { "exp", 1, 1, CALC_MATH1(exp) },
+        { "ln", 1, 1, CALC_MATH1(log) },
+        { "log", 1, 1, CALC_MATH1(log) },
+        { "log2", 1, 1, CALC_MATH1(log2) },
+        { "log10", 1, 1, CALC_MATH1(log10) },
+        { "sin", 1, 1, CALC_MATH1(sin) },
+        { "cos", 1, 1, CALC_MATH1(cos) },
+        { "tan", 1, 1, CALC_MATH1(tan) },
+        { "asin", 1, 1, CALC_MATH1(asin) },
+        { "acos", 1, 1, CALC_MATH1(acos) },
+        { "atan", 1, 1, CALC_MATH1(atan) },
+        { "atan2", 2, 2, CALC_MATH2(atan2) },
+        { "hypot", 2, 2, CALC_MATH2(hypot) },
+        { "floor", 1, 1, CALC_MATH1(floor) },
+        { "ceil", 1, 1, CALC_MATH1(ceil) },
+        { "round", 1, 1, CALC_MATH1(round) },
+        { "trunc", 1, 1, CALC_MATH1(trunc) },
+    };
+    count = sizeof(table) / sizeof(table[0]);
+    return table;
+}
+
+#undef CALC_MATH1
+#undef CALC_MATH2
+
+const CalcFunction<long long>* CalcTraits<long long>::functions(size_t& count) {
+    static const CalcFunction<long long> table[] = {
+        { "abs", 1, 1, calc_abs<long long> },
+        { "min", 1, 255, calc_min<long long> },
+        { "max", 1, 255, calc_max<long long> },
+        { "pow", 2, 2, calc_pow<long long> },
+        { "gcd", 2, 2, calc_gcd<long long> },
+    };
+    count = sizeof(table) / sizeof(table[0]);
+    return table;
+}
+
+const CalcFunction<BigInt>* CalcTraits<BigInt>::functions(size_t& count) {
+    static const CalcFunction<BigInt> table[] = {
+        { "abs", 1, 1, calc_abs<BigInt> },
+        { "min", 1, 255, calc_min<BigInt> },
+        { "max", 1, 255, calc_max<BigInt> },
+        { "pow", 2, 2, calc_pow<BigInt> },
+        { "gcd", 2, 2, calc_gcd<BigInt> },
+    };
+    count = sizeof(table) / sizeof(table[0]);
+    return table;
+}
+
+enum CalcOpcode : uint8_t {
+    CALC_CONST, CALC_LOAD, CALC_COLUMN, CALC_STORE, CALC_CALL, CALC_NEG,
+    CALC_ADD, CALC_SUB, CALC_MUL, CALC_DIV, CALC_MOD, CALC_POW,
+    CALC_LT, CALC_LE, CALC_GT, CALC_GE, CALC_EQ, CALC_NE
+};
+
+struct CalcInsn {
+    CalcOpcode op;
+    uint8_t argc;           // CALC_CALL
+    uint32_t operand;       // constant, variable slot, column or function index
+};
+
+const size_t CALC_MAX_STACK = 64;
+const size_t CALC_MAX_NESTING = 256;    // parentheses, unary signs and calls, which the compiler recurses on
+
+template<class T>
+struct CalcProgram {
+    vector<CalcInsn> code;
+    vector<T> constants;
+    size_t max_stack = 0;
+    uint32_t columns = 0;       // highest $N referenced
+    bool pure = true;           // no assignment, so input rows are independent
+    bool variables = false;     // reads or assigns a variable
+};
+
+// Variables and compiled programs of one number type; they last for the
+// whole session, so "calc x = 4" can be used by a later "calc x * 2".
+// Two calc stages of one pipeline run on different threads, so the lock
+// covers both: compiling takes it, and so does running a program that
+// reads or assigns a variable.
+template<class T>
+struct CalcState {
+    mutex lock;
+    unordered_map<string, unique_ptr<CalcProgram<T>>> cache;
+    unordered_map<string, uint32_t> slots;
+    deque<string> names;
+    deque<T> values;
+    deque<char> defined;
+
+    uint32_t slot(string_view name) {
+        auto it = slots.find(string(name));
+        if (it != slots.end()) return it->second;
+        uint32_t index = (uint32_t)names.size();
+        slots.emplace(string(name), index);
+        names.emplace_back(name);
+        values.emplace_back();
+        defined.push_back(0);
+        return index;
+    }
+};
+
+template<class T>
+CalcState<T>& calc_state() {
+    static CalcState<T> state;
+    return state;
+}
+
+const size_t CALC_CACHE_LIMIT = 4096;
+
+// Pratt parser emitting bytecode directly. Binding powers, low to high:
+// comparisons, + -, * / %, unary minus, then ^ (right associative), so
+// -2^2 is -4 and 2^3^2 is 512.
+template<class T>
+class CalcCompiler {
+public:
+    CalcCompiler(string_view source, CalcState<T>& state) : source(source), state(state) {}
+
+    unique_ptr<CalcProgram<T>> compile(string& error) {
+        program.reset(new CalcProgram<T>());
+        try {
+            next();
+            size_t mark = pos;
+            if (kind == TOKEN_NAME) {
+                string_view name = text;
+                next();
+                if (kind == TOKEN_OP && text == "=") {
+                    T ignored;
+                    if (CalcTraits<T>::constant(name, ignored)) fail("cannot assign to constant '" + string(name) + "'");
+                    next();
+                    expression(0);
+                    emit(CALC_STORE, state.slot(name));
+                    program->pure = false;
+                } else {
+                    pos = mark - name.size();
+                    next();
+                    expression(0);
+                }
+            } else {
+                expression(0);
+            }
+            if (kind != TOKEN_END) fail("unexpected '" + string(text) + "'");
+        } catch (const CalcError& e) {
+            error = e.what();
+            return nullptr;
+        }
+        return move(program);
+    }
+
+private:
+    enum TokenKind { TOKEN_END, TOKEN_NUMBER, TOKEN_NAME, TOKEN_COLUMN, TOKEN_OP };
+
+    string_view source;
+    CalcState<T>& state;
+    unique_ptr<CalcProgram<T>> program;
+    size_t pos = 0;
+    size_t depth = 0;
+    size_t nesting = 0;
+    TokenKind kind = TOKEN_END;
+    string_view text;
+
+    [[noreturn]] void fail(const string& message) {
+        throw CalcError(message + " at column " + to_string(pos - text.size() + 1));
+    }
+
+    void next() {
+        while (pos < source.size() && isspace((unsigned char)source[pos])) pos++;
+        size_t start = pos;
+        if (pos == source.size()) {
+            kind = TOKEN_END;
+            text = string_view();
+            return;
+        }
+        char c = source[pos];
+        auto is_name = [](char ch) { return isalnum((unsigned char)ch) || ch == '_'; };
+        if (isdigit((unsigned char)c) || (c == '.' && pos + 1 < source.size() && isdigit((unsigned char)source[pos + 1]))) {
+            kind = TOKEN_NUMBER;
+            if (c == '0' && pos + 1 < source.size() && (source[pos + 1] == 'x' || source[pos + 1] == 'X')) {
+                pos += 2;
+                while (pos < source.size() && isxdigit((unsigned char)source[pos])) pos++;
+            } else {
+                while (pos < source.size() && (isdigit((unsigned char)source[pos]) || source[pos] == '.')) pos++;
+                if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+                    size_t exp = pos + 1;
+                    if (exp < source.size() && (source[exp] == '+' || source[exp] == '-')) exp++;
+                    if (exp < source.size() && isdigit((unsigned char)source[exp])) {
+                        pos = exp;
+                        while (pos < source.size() && isdigit((unsigned char)source[pos])) pos++;
+                    }
+                }
+            }
+        } else if (is_name(c)) {
+            kind = TOKEN_NAME;
+            while (pos < source.size() && is_name(source[pos])) pos++;
+        } else if (c == '$') {
+            kind = TOKEN_COLUMN;
+            pos++;
+            while (pos < source.size() && isdigit((unsigned char)source[pos])) pos++;
+        } else {
+            kind = TOKEN_OP;
+            static const char* const two_char[] = { "**", "==", "!=", "<=", ">=" };
+            pos++;
+            for (const char* op : two_char) {
+                if (source.compare(start, 2, op) == 0) {
+                    pos = start + 2;
+                    break;
+                }
+            }
+        }
+        text = source.substr(start, pos - start);
+    }
+
+    void emit(CalcOpcode op, uint32_t operand = 0, uint8_t argc = 0) {
+        program->code.push_back({ op, argc, operand });
+        if (op == CALC_LOAD || op == CALC_STORE) program->variables = true;
+        if (op == CALC_CONST || op == CALC_LOAD || op == CALC_COLUMN) {
+            if (++depth > CALC_MAX_STACK) fail("expression too complex");
+            program->max_stack = max(program->max_stack, depth);
+        } else if (op == CALC_CALL) {
+            depth = depth - argc + 1;
+        } else if (op >= CALC_ADD) {
+            depth--;
+        }
+    }
+
+    // Left binding power and opcode of the current token as a binary operator.
+    int binary(CalcOpcode& op, bool& right) const {
+        right = false;
+        if (kind != TOKEN_OP) return -1;
+        if (text == "+") { op = CALC_ADD; return 20; }
+        if (text == "-") { op = CALC_SUB; return 20; }
+        if (text == "*") { op = CALC_MUL; return 30; }
+        if (text == "/") { op = CALC_DIV; return 30; }
+        if (text == "%") { op = CALC_MOD; return 30; }
+        if (text == "^" || text == "**") { op = CALC_POW; right = true; return 50; }
+        if (text == "<") { op = CALC_LT; return 10; }
+        if (text == "<=") { op = CALC_LE; return 10; }
+        if (text == ">") { op = CALC_GT; return 10; }
+        if (text == ">=") { op = CALC_GE; return 10; }
+        if (text == "==") { op = CALC_EQ; return 10; }
+        if (text == "!=") { op = CALC_NE; return 10; }
+        return -1;
+    }
+
+    void expression(int min_power) {
+        if (++nesting > CALC_MAX_NESTING) fail("expression nested too deeply");
+        prefix();
+        while (true) {
+            CalcOpcode op = CALC_ADD;
+            bool right;
+            int power = binary(op, right);
+            if (power <= min_power) break;
+            next();
+            expression(right ? power - 1 : power);
+            emit(op);
+        }
+        nesting--;
+    }
+
+    void prefix() {
+        if (kind == TOKEN_NUMBER) {
+            T value;
+            if (!CalcTraits<T>::parse(text, value)) fail("invalid number '" + string(text) + "'");
+            program->constants.push_back(value);
+            emit(CALC_CONST, (uint32_t)program->constants.size() - 1);
+            next();
+        } else if (kind == TOKEN_COLUMN) {
+            unsigned column = 0;
+            from_chars(text.data() + 1, text.data() + text.size(), column);
+            if (column == 0 || column > 4096) fail("invalid column '" + string(text) + "'");
+            program->columns = max(program->columns, (uint32_t)column);
+            emit(CALC_COLUMN, column);
+            next();
+        } else if (kind == TOKEN_NAME) {
+            string_view name = text;
+            next();
+            if (kind == TOKEN_OP && text == "(") {
+                call(name);
+                return;
+            }
+            T value;
+            if (CalcTraits<T>::constant(name, value)) {
+                program->constants.push_back(value);
+                emit(CALC_CONST, (uint32_t)program->constants.size() - 1);
+            } else {
+                emit(CALC_LOAD, state.slot(name));
+            }
+        } else if (kind == TOKEN_OP && (text == "-" || text == "+")) {
+            bool negate = text == "-";
+            next();
+            expression(40);
+            if (negate) emit(CALC_NEG);
+        } else if (kind == TOKEN_OP && text == "(") {
+            next();
+            expression(0);
+            if (kind != TOKEN_OP || text != ")") fail("expected ')'");
+            next();
+        } else if (kind == TOKEN_END) {
+            fail("unexpected end of expression");
+        } else {
+            fail("unexpected '" + string(text) + "'");
+        }
+    }
+
+    void call(string_view name) {
+        next();     // '('
+        int argc = 0;
+        if (!(kind == TOKEN_OP && text == ")")) {
+            while (true) {
+                expression(0);
+                argc++;
+                if (kind == TOKEN_OP && text == ",") {
+                    next();
+                    continue;
+                }
+                break;
+            }
+        }
+        if (kind != TOKEN_OP || text != ")") fail("expected ')'");
+        size_t count;
+        const CalcFunction<T>* functions = CalcTraits<T>::functions(count);
+        for (size_t i = 0; i < count; i++) {
+            if (name != functions[i].name) continue;
+            if (argc < functions[i].min_args || argc > functions[i].max_args) {
+                fail("wrong number of arguments to " + string(name) + "()");
+            }
+            emit(CALC_CALL, (uint32_t)i, (uint8_t)argc);
+            next();
+            return;
+        }
+        fail("unknown function '" + string(name) + "'");
+    }
+};
+
+// Returns the cached program for source, compiling it on first use.
+template<class T>
+const CalcProgram<T>* calc_compile(string_view source, string& error) {
+    CalcState<T>& state = calc_state<T>();
+    static thread_local string key;
+    key.assign(source.data(), source.size());
+    lock_guard<mutex> lock(state.lock);
+    auto it = state.cache.find(key);
+    if (it != state.cache.end()) return it->second.get();
+    unique_ptr<CalcProgram<T>> program = CalcCompiler<T>(source, state).compile(error);
+    if (!program) return nullptr;
+    if (state.cache.size() >= CALC_CACHE_LIMIT) state.cache.clear();
+    return state.cache.emplace(key, move(program)).first->second.get();
+}
+
+template<class T>
+T calc_run(const CalcProgram<T>& program, const T* columns) {
+    typedef CalcTraits<T> Traits;
+    CalcState<T>& state = calc_state<T>();
+    unique_lock<mutex> lock(state.lock, defer_lock);
+    if (program.variables) lock.lock();
+    T stack[CALC_MAX_STACK];
+    size_t sp = 0;
+    for (const CalcInsn& insn : program.code) {
+        switch (insn.op) {
+        case CALC_CONST: stack[sp++] = program.constants[insn.operand]; break;
+        case CALC_LOAD:
+            if (!state.defined[insn.operand]) throw CalcError("undefined variable '" + state.names[insn.operand] + "'");
+            stack[sp++] = state.values[insn.operand];
+            break;
+        case CALC_COLUMN: stack[sp++] = columns[insn.operand - 1]; break;
+        case CALC_STORE:
+            state.values[insn.operand] = stack[sp - 1];
+            state.defined[insn.operand] = 1;
+            break;
+        case CALC_CALL: {
+            size_t count;
+            sp -= insn.argc;
+            stack[sp] = Traits::functions(count)[insn.operand].call(&stack[sp], insn.argc);
+            sp++;
+            break;
+        }
+        case CALC_NEG: stack[sp - 1] = Traits::neg(stack[sp - 1]); break;
+        case CALC_ADD: sp--; stack[sp - 1] = Traits::add(stack[sp - 1], stack[sp]); break;
+        case CALC_SUB: sp--; stack[sp - 1] = Traits::sub(stack[sp - 1], stack[sp]); break;
+        case CALC_MUL: sp--; stack[sp - 1] = Traits::mul(stack[sp - 1], stack[sp]); break;
+        case CALC_DIV: sp--; stack[sp - 1] = Traits::div(stack[sp - 1], stack[sp]); break;
+        case CALC_MOD: sp--; stack[sp - 1] = Traits::mod(stack[sp - 1], stack[sp]); break;
+        case CALC_POW: sp--; stack[sp - 1] = Traits::power(stack[sp - 1], stack[sp]); break;
+        case CALC_LT: sp--; stack[sp - 1] = Traits::from_bool(Traits::less(stack[sp - 1], stack[sp])); break;
+        case CALC_LE: sp--; stack[sp - 1] = Traits::from_bool(!Traits::less(stack[sp], stack[sp - 1])); break;
+        case CALC_GT: sp--; stack[sp - 1] = Traits::from_bool(Traits::less(stack[sp], stack[sp - 1])); break;
+        case CALC_GE: sp--; stack[sp - 1] = Traits::from_bool(!Traits::less(stack[sp - 1], stack[sp])); break;
+        case CALC_EQ: sp--; stack[sp - 1] = Traits::from_bool(Traits::equal(stack[sp - 1], stack[sp])); break;
+        case CALC_NE: sp--; stack[sp - 1] = Traits::from_bool(!Traits::equal(stack[sp - 1], stack[sp])); break;
+        }
+    }
+    return stack[0];
+}
+
+const size_t CALC_BATCH = 256;
+
+// Runs a pure double program over CALC_BATCH-row column slices, one opcode
+// at a time across all rows; the element loops compile to SIMD code. Throws
+// CalcError if any row would fail, and the caller then redoes the batch row
+// by row to report it.
+void calc_run_batch(const CalcProgram<double>& program, const vector<vector<double>>& columns,
+                    size_t rows, vector<double>& scratch, double* results) {
+    CalcState<double>& state = calc_state<double>();
+    unique_lock<mutex> lock(state.lock, defer_lock);
+    if (program.variables) lock.lock();
+    scratch.resize(program.max_stack * CALC_BATCH);
+    size_t sp = 0;
+    auto slot = [&](size_t index) { return scratch.data() + index * CALC_BATCH; };
+    for (const CalcInsn& insn : program.code) {
+        double* top = sp ? slot(sp - 1) : nullptr;
+        double* b = top;
+        double* a = (sp > 1) ? slot(sp - 2) : nullptr;
+        switch (insn.op) {
+        case CALC_CONST:
+            fill(slot(sp), slot(sp) + rows, program.constants[insn.operand]);
+            sp++;
+            break;
+        case CALC_LOAD:
+            if (!state.defined[insn.operand]) throw CalcError("undefined variable");
+            fill(slot(sp), slot(sp) + rows, state.values[insn.operand]);
+            sp++;
+            break;
+        case CALC_COLUMN:
+            memcpy(slot(sp), columns[insn.operand - 1].data(), rows * sizeof(double));
+            sp++;
+            break;
+        case CALC_STORE:
+            throw CalcError("assignment in a batch");
+        case CALC_CALL: {
+            size_t count;
+            const CalcFunction<double>& function = CalcTraits<double>::functions(count)[insn.operand];
+            sp -= insn.argc;
+            double args[255];
+            for (size_t row = 0; row < rows; row++) {
+                for (int i = 0; i < insn.argc; i++) args[i] = slot(sp + i)[row];
+                slot(sp)[row] = function.call(args, insn.argc);
+            }
+            sp++;
+            break;
+        }
+        case CALC_NEG:
+            for (size_t i = 0; i < rows; i++) top[i] = -top[i];
+            break;
+        case CALC_ADD: for (size_t i = 0; i < rows; i++) a[i] += b[i]; sp--; break;
+        case CALC_SUB: for (size_t i = 0; i < rows; i++) a[i] -= b[i]; sp--; break;
+        case CALC_MUL: for (size_t i = 0; i < rows; i++) a[i] *= b[i]; sp--; break;
+        case CALC_DIV:
+        case CALC_MOD: {
+            bool zero = false;
+            for (size_t i = 0; i < rows; i++) zero |= (b[i] == 0);
+            if (zero) throw CalcError("Division by zero");
+            if (insn.op == CALC_DIV) for (size_t i = 0; i < rows; i++) a[i] /= b[i];
+            else for (size_t i = 0; i < rows; i++) a[i] = fmod(a[i], b[i]);
+            sp--;
+            break;
+        }
+        case CALC_POW: for (size_t i = 0; i < rows; i++) a[i] = pow(a[i], b[i]); sp--; break;
+        case CALC_LT: for (size_t i = 0; i < rows; i++) a[i] = a[i] < b[i]; sp--; break;
+        case CALC_LE: for (size_t i = 0; i < rows; i++) a[i] = a[i] <= b[i]; sp--; break;
+        case CALC_GT: for (size_t i = 0; i < rows; i++) a[i] = a[i] > b[i]; sp--; break;
+        case CALC_GE: for (size_t i = 0; i < rows; i++) a[i] = a[i] >= b[i]; sp--; break;
+        case CALC_EQ: for (size_t i = 0; i < rows; i++) a[i] = a[i] == b[i]; sp--; break;
+        case CALC_NE: for (size_t i = 0; i < rows; i++) a[i] = a[i] != b[i]; sp--; break;
+        }
+    }
+    memcpy(results, slot(0), rows * sizeof(double));
+}
+
+// Splits the first `count` fields of a line (separated by blanks or commas)
+// and parses them. Returns 0 on success, else the 1-based failing column.
+template<class T>
+size_t calc_columns(string_view line, size_t count, T* values, bool& missing) {
+    size_t pos = 0;
+    for (size_t column = 0; column < count; column++) {
+        while (pos < line.size() && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == ',')) pos++;
+        size_t start = pos;
+        while (pos < line.size() && line[pos] != ' ' && line[pos] != '\t' && line[pos] != ',') pos++;
+        missing = start == pos;
+        if (missing || !CalcTraits<T>::parse(line.substr(start, pos - start), values[column])) return column + 1;
+    }
+    return 0;
+}
+
+struct CalcOptions {
+    string expression;      // applied to every line; empty means each line is an expression
+    bool sum = false;       // print only the total
+    bool vectorize = true;
+};
+
+// Evaluates text line by line. Blank lines and lines starting with '#' are
+// skipped; bad lines are reported with their number and do not stop the run.
+template<class T>
+bool calc_lines(string_view input, const CalcOptions& options) {
+    typedef CalcTraits<T> Traits;
+    OutputSink& sink = out();
+    bool ok = true;
+    T total = T(0);
+    auto emit = [&](const T& value) {
+        if (options.sum) {
+            total = Traits::add(total, value);
+        } else {
+            Traits::format(value, sink);
+            sink.put('\n');
+        }
+    };
+    auto report = [&](size_t line_number, const string& message) {
+        cerr << "calc: line " << line_number << ": " << message << '\n';
+        ok = false;
+    };
+
+    const CalcProgram<T>* fixed = nullptr;
+    string error;
+    if (!options.expression.empty()) {
+        fixed = calc_compile<T>(options.expression, error);
+        if (!fixed) {
+            cerr << "calc: " << error << '\n';
+            return false;
+        }
+    }
+
+    bool batched = fixed && options.vectorize && is_same<T, double>::value && fixed->pure && fixed->columns > 0;
+    vector<vector<T>> columns(fixed ? fixed->columns : 0, vector<T>(batched ? CALC_BATCH : 1));
+    vector<T> row(fixed ? fixed->columns : 0);
+    vector<size_t> batch_lines;
+    vector<double> scratch;
+    double results[CALC_BATCH];
+
+    auto run_row = [&](const T* values, size_t line_number) {
+        try {
+            emit(calc_run(*fixed, values));
+        } catch (const CalcError& e) {
+            report(line_number, e.what());
+        }
+    };
+    auto flush_batch = [&]() {
+        size_t rows = batch_lines.size();
+        if (!rows) return;
+        if constexpr (is_same<T, double>::value) {
+            try {
+                calc_run_batch(*fixed, columns, rows, scratch, results);
+                for (size_t i = 0; i < rows; i++) emit(results[i]);
+            } catch (const CalcError&) {
+                for (size_t i = 0; i < rows; i++) {
+                    for (size_t c = 0; c < row.size(); c++) row[c] = columns[c][i];
+                    run_row(row.data(), batch_lines[i]);
+                }
+            }
+        }
+        batch_lines.clear();
+    };
+
+    size_t line_number = 0;
+    for (size_t pos = 0; pos < input.size();) {
+        size_t end = input.find('\n', pos);
+        if (end == string_view::npos) end = input.size();
+        string_view line = input.substr(pos, end - pos);
+        pos = end + 1;
+        line_number++;
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        size_t first = line.find_first_not_of(" \t");
+        if (first == string_view::npos || line[first] == '#') continue;
+
+        if (!fixed) {
+            const CalcProgram<T>* program = calc_compile<T>(line, error);
+            if (!program) {
+                report(line_number, error);
+            } else if (program->columns) {
+                report(line_number, "$N columns need an expression argument");
+            } else {
+                try {
+                    emit(calc_run(*program, (const T*)nullptr));
+                } catch (const CalcError& e) {
+                    report(line_number, e.what());
+                }
+            }
+            continue;
+        }
+
+        bool missing = false;
+        size_t bad = calc_columns(line, row.size(), row.data(), missing);
+        if (bad) {
+            report(line_number, (missing ? "no column $" : "column $") + to_string(bad) + (missing ? "" : " is not a number"));
+            continue;
+        }
+        if (!batched) {
+            run_row(row.data(), line_number);
+            continue;
+        }
+        size_t index = batch_lines.size();
+        for (size_t c = 0; c < row.size(); c++) columns[c][index] = row[c];
+        batch_lines.push_back(line_number);
+        if (batch_lines.size() == CALC_BATCH) flush_batch();
+    }
+    flush_batch();
+
+    if (options.sum) {
+        Traits::format(total, sink);
+        sink.put('\n');
+    }
+    return ok;
+}
+
+// Evaluates one expression given on the command line and prints the result.
+template<class T>
+bool calc_expression(const string& source) {
+    string error;
+    const CalcProgram<T>* program = calc_compile<T>(source, error);
+    if (!program) {
+        cerr << "Error: " << error << '\n';
+        return false;
+    }
+    if (program->columns) {
+        cerr << "Error: $N columns need input from -f or stdin\n";
+        return false;
+    }
+    try {
+        T value = calc_run(*program, (const T*)nullptr);
+        CalcTraits<T>::format(value, out());
+        out().put('\n');
+    } catch (const CalcError& e) {
+        cerr << "Error: " << e.what() << '\n';
+        return false;
+    }
+    return true;
+}
+
+// calc [-i | -b] <expression>
+// calc [-i | -b] [-s] -f <file | -> [expression]
+// "calc <num> <op> <num>" keeps its "a op b = result" output.
+void calc_command(const Args& args) {
+    static const char* usage =
+        "Usage: calc [-i | -b] <expression>\n"
+        "       calc [-i | -b] [-s] -f <file | -> [expression]   ($1, $2... are columns)\n";
+    char mode = 'd';
+    CalcOptions options;
+    string path;
+    size_t i = 1;
+    for (; i < args.size(); i++) {
+        if (args[i] == "-i") mode = 'i';
+        else if (args[i] == "-b") mode = 'b';
+        else if (args[i] == "-s") options.sum = true;
+        else if (args[i] == "-f" && i + 1 < args.size()) path = args.str(++i);
+        else break;
+    }
+    for (; i < args.size(); i++) {
+        if (!options.expression.empty()) options.expression += ' ';
+        options.expression.append(args[i]);
+    }
+
+    if (args.size() == 4 && mode == 'd') {
+        static const char* const legacy_ops[] = { "+", "-", "*", "x", "/", "%", "^", "**" };
+        double a, b;
+        for (const char* op : legacy_ops) {
+            if (args[2] != op) continue;
+            if (!CalcTraits<double>::parse(args[1], a) || !CalcTraits<double>::parse(args[3], b)) break;
+            try {
+                string source = string(args[1]) + " " + (args[2] == "x" ? "*" : op) + " " + string(args[3]);
+                string error;
+                const CalcProgram<double>* program = calc_compile<double>(source, error);
+                if (!program) throw CalcError(error);
+                double result = calc_run(*program, (const double*)nullptr);
+                cout << a << " " << op << " " << b << " = " << result << '\n';
+            } catch (const CalcError& e) {
+                cerr << "Error: " << e.what() << '\n';
+                last_status = 1;
+            }
+            return;
+        }
+    }
+
+    if (path.empty() && options.expression.empty()) {
+        if (input_is_terminal()) {
+            cerr << usage;
+            last_status = 2;
+            return;
+        }
+        path = "-";
+    }
+
+    bool ok;
+    if (path.empty()) {
+        if (mode == 'i') ok = calc_expression<long long>(options.expression);
+        else if (mode == 'b') ok = calc_expression<BigInt>(options.expression);
+        else ok = calc_expression<double>(options.expression);
+    } else {
+        string buffer;
+        MappedFile file;
+        string_view input;
+        if (path == "-") {
+            flush_output();
+            read_input(buffer);
+            input = buffer;
+        } else if (file.open(path)) {
+            input = string_view(file.data, file.size);
+        } else {
+            cerr << "Error: Cannot open file '" << path << "'\n";
+            last_status = 1;
+            return;
+        }
+        if (mode == 'i') ok = calc_lines<long long>(input, options);
+        else if (mode == 'b') ok = calc_lines<BigInt>(input, options);
+        else ok = calc_lines<double>(input, options);
+    }
+    last_status = ok ? 0 : 1;
+}
+
+// Bump allocator for everything parsed from one command line. reset() keeps
+// the blocks, so steady-state parsing does not touch the heap at all.
+// Only trivially destructible objects may live here.
+class Arena {
+public:
+    explicit Arena(size_t block_size = 16 * 1024) : block_size(block_size) {}
+
+    void* allocate(size_t size, size_t align) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (block >= blocks.size() || offset + size > capacity(block)) {
+            next_block(size + align);
+            offset = 0;
+        }
+        used = offset + size;
+        return blocks[block].data.get() + offset;
+    }
+
+    template <class T>
+    T* allocate_array(size_t count) {
+        return static_cast<T*>(allocate(sizeof(T) * max<size_t>(count, 1), alignof(T)));
+    }
+
+    // NUL-terminated copy, so the result can be used as a C string.
+    string_view copy(string_view text) {
+        char* p = allocate_array<char>(text.size() + 1);
+        memcpy(p, text.data(), text.size());
+        p[text.size()] = '\0';
+        return string_view(p, text.size());
+    }
+
+    void reset() {
+        block = 0;
+        used = 0;
+    }
+
+private:
+    struct Block {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+    vector<Block> blocks;
+    size_t block_size;
+    size_t block = 0;
+    size_t used = 0;
+
+    size_t capacity(size_t i) const { return blocks[i].size; }
+
+    void next_block(size_t min_size) {
+        size_t i = (block < blocks.size()) ? block + 1 : 0;
+        while (i < blocks.size() && capacity(i) < min_size) i++;
+        if (i >= blocks.size()) {
+            size_t size = max(block_size, min_size);
+            blocks.push_back({ unique_ptr<char[]>(new char[size]), size });
+            i = blocks.size() - 1;
+        }
+        block = i;
+        used = 0;
+    }
+};
+
+// Growable array whose storage lives in an Arena.
+template <class T>
+struct ArenaVector {
+    T* data = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    void push_back(Arena& arena, const T& value) {
+        if (size == capacity) {
+            size_t grown = capacity ? capacity * 2 : 4;
+            T* fresh = arena.allocate_array<T>(grown);
+            if (size) memcpy((void*)fresh, (const void*)data, size * sizeof(T));
+            data = fresh;
+            capacity = grown;
+        }
+        data[size++] = value;
+    }
+};
+
+// Syntax tree of one command line; all nodes live in the parse arena.
+//   [n]<  file        REDIRECT_IN            <<< word   REDIRECT_HERE_STRING
+//   [n]>  file        REDIRECT_OUT           [n]>&m     REDIRECT_DUP (target is m)
+//   [n]>> file        REDIRECT_APPEND        &> &>>     OUT or APPEND on 1, then 2>&1
+enum RedirectKind { REDIRECT_IN, REDIRECT_OUT, REDIRECT_APPEND, REDIRECT_DUP, REDIRECT_HERE_STRING };
+
+struct Redirect {
+    RedirectKind kind;
+    int fd;                 // the stream redirected: 0, 1 or 2
+    string_view target;
+    bool expand;            // target holds a $(...), kept with its quotes
+    Redirect* next;
+};
+
+struct SimpleCommand {
+    string_view* words;
+    size_t word_count;
+    const bool* expand;     // per word, as for Redirect; null if none has one
+    Redirect* redirects;
+};
+
+struct Pipeline {
+    SimpleCommand* stages;
+    size_t stage_count;
+};
+
+// How a list item is joined to the one before it.
+enum ListConnector { CONNECT_SEQ, CONNECT_AND, CONNECT_OR };
+
+struct ListItem {
+    Pipeline pipeline;
+    ListConnector connector;
+    bool background;
+};
+
+struct CommandList {
+    ListItem* items;
+    size_t count;
+};
+
+enum TokenKind {
+    TOK_WORD, TOK_PIPE, TOK_AND, TOK_OR, TOK_SEMI, TOK_AMP,
+    TOK_REDIRECT, TOK_END, TOK_ERROR
+};
+
+struct Token {
+    TokenKind kind;
+    string_view text;
+    bool expand = false;    // a word with $(...): text is raw, expanded when run
+};
+
+// Splits a command line into words and operators. A word without quotes or
+// escapes is a view into the line itself; otherwise its unquoted text is
+// built in the arena. Double quotes allow \" \\ \$ escapes, single quotes
+// are literal, and outside quotes a backslash escapes the next character
+// (except on Windows, where it is the path separator). '#' starts a comment.
+// A word containing $(...), bare or inside double quotes, is returned raw
+// with expand set; quotes are removed when it is expanded at run time.
+class Lexer {
+public:
+    Lexer(string_view line, Arena& arena) : line(line), arena(arena) {}
+
+    const char* error = nullptr;
+
+#ifdef _WIN32
+    static const bool backslash_escapes = false;
+#else
+    static const bool backslash_escapes = true;
+#endif
+
+    // One past the ')' closing the "$(" at text[at], or npos if it is not
+    // closed. Parentheses nest and quoted text inside is skipped.
+    static size_t substitution_end(string_view text, size_t at) {
+        int depth = 0;
+        for (size_t i = at + 1; i < text.size(); i++) {
+            char c = text[i];
+            if (c == '(') {
+                depth++;
+            } else if (c == ')') {
+                if (--depth == 0) return i + 1;
+            } else if (c == '\\' && backslash_escapes) {
+                i++;
+            } else if (c == '\'' || c == '"') {
+                size_t close = i + 1;
+                while (close < text.size() && text[close] != c) {
+                    close += (c == '"' && text[close] == '\\') ? 2 : 1;
+                }
+                if (close >= text.size()) return string_view::npos;
+                i = close;
+            }
+        }
+        return string_view::npos;
+    }
+
+    Token next() {
+        while (pos < line.size() && isspace((unsigned char)line[pos])) pos++;
+        if (pos >= line.size() || line[pos] == '#') return { TOK_END, string_view() };
+
+        size_t start = pos;
+        char c = line[pos];
+        char following = (pos + 1 < line.size()) ? line[pos + 1] : '\0';
+        switch (c) {
+        case '|':
+            pos += (following == '|') ? 2 : 1;
+            return { following == '|' ? TOK_OR : TOK_PIPE, line.substr(start, pos - start) };
+        case '&':
+            if (following == '>') return redirect();
+            pos += (following == '&') ? 2 : 1;
+            return { following == '&' ? TOK_AND : TOK_AMP, line.substr(start, pos - start) };
+        case ';':
+            pos++;
+            return { TOK_SEMI, line.substr(start, 1) };
+        case '<':
+        case '>':
+            return redirect();
+        }
+        if (isdigit((unsigned char)c) && (following == '<' || following == '>')) return redirect();
+        return word();
+    }
+
+private:
+    string_view line;
+    Arena& arena;
+    size_t pos = 0;
+
+    static bool is_operator(char c) {
+        return c == '|' || c == '&' || c == ';' || c == '<' || c == '>';
+    }
+
+    // One redirection operator: [n]< [n]> [n]>> [n]>&m <<< &> &>>.
+    Token redirect() {
+        size_t start = pos;
+        auto peek = [&](size_t at) { return at < line.size() ? line[at] : '\0'; };
+        if (line[pos] == '&' || isdigit((unsigned char)line[pos])) pos++;
+        if (line[pos] == '<') {
+            pos++;
+            if (peek(pos) == '<') {
+                if (peek(pos + 1) != '<' || pos - 1 != start) {
+                    error = "here-documents are not supported";
+                    return { TOK_ERROR, line.substr(start) };
+                }
+                pos += 2;
+            }
+        } else {
+            pos++;
+            if (peek(pos) == '>') {
+                pos++;
+            } else if (peek(pos) == '&' && line[start] != '&') {
+                if (!isdigit((unsigned char)peek(pos + 1))) {
+                    error = ">& needs a descriptor number";
+                    return { TOK_ERROR, line.substr(start) };
+                }
+                pos += 2;
+            }
+        }
+        return { TOK_REDIRECT, line.substr(start, pos - start) };
+    }
+
+    bool at_substitution(size_t i) const {
+        return line[i] == '$' && i + 1 < line.size() && line[i + 1] == '(';
+    }
+
+    Token word() {
+        size_t start = pos;
+        bool plain = true;
+        bool expand = false;
+        while (pos < line.size()) {
+            char c = line[pos];
+            if (isspace((unsigned char)c) || is_operator(c)) break;
+            if (at_substitution(pos)) {
+                size_t end = substitution_end(line, pos);
+                if (end == string_view::npos) {
+                    error = "unterminated $(";
+                    return { TOK_ERROR, line.substr(start) };
+                }
+                expand = true;
+                pos = end;
+            } else if (c == '\'' || c == '"') {
+                plain = false;
+                size_t close = pos + 1;
+                while (close < line.size() && line[close] != c) {
+                    if (c == '"' && at_substitution(close)) {
+                        size_t end = substitution_end(line, close);
+                        if (end == string_view::npos) {
+                            close = line.size();
+                            break;
+                        }
+                        expand = true;
+                        close = end;
+                        continue;
+                    }
+                    close += (c == '"' && line[close] == '\\' && close + 1 < line.size()) ? 2 : 1;
+                }
+                if (close >= line.size()) {
+                    error = "unterminated quote";
+                    return { TOK_ERROR, line.substr(start) };
+                }
+                pos = close + 1;
+            } else if (c == '\\' && backslash_escapes && pos + 1 < line.size()) {
+                plain = false;
+                pos += 2;
+            } else {
+                pos++;
+            }
+        }
+
+        string_view raw = line.substr(start, pos - start);
+        if (expand) return { TOK_WORD, raw, true };
+        if (plain) return { TOK_WORD, raw };
+
+        char* out = arena.allocate_array<char>(raw.size() + 1);
+        size_t n = 0;
+        for (size_t i = 0; i < raw.size(); i++) {
+            char c = raw[i];
+            if (c == '\'') {
+                while (raw[++i] != '\'') out[n++] = raw[i];
+            } else if (c == '"') {
+                while (raw[++i] != '"') {
+                    if (raw[i] == '\\' && i + 1 < raw.size() &&
+                        (raw[i + 1] == '"' || raw[i + 1] == '\\' || raw[i + 1] == '$')) i++;
+                    out[n++] = raw[i];
+                }
+            } else if (c == '\\' && backslash_escapes && i + 1 < raw.size()) {
+                out[n++] = raw[++i];
+            } else {
+                out[n++] = c;
+            }
+        }
+        out[n] = '\0';
+        return { TOK_WORD, string_view(out, n) };
+    }
+};
+
+// Recursive-descent parser for:
+//   list     := pipeline ((';' | '&' | '&&' | '||') pipeline)* [';' | '&']
+//   pipeline := command ('|' command)*
+//   command  := (word | redirection)+, redirections as in RedirectKind
+class Parser {
+public:
+    Parser(string_view line, Arena& arena) : lexer(line, arena), arena(arena) {
+        advance();
+    }
+
+    string error;
+
+    bool parse(CommandList& list) {
+        ArenaVector<ListItem> items;
+        ListConnector connector = CONNECT_SEQ;
+        while (current.kind != TOK_END) {
+            ListItem item = { {}, connector, false };
+            if (!parse_pipeline(item.pipeline)) return false;
+            connector = CONNECT_SEQ;
+            if (current.kind == TOK_SEMI || current.kind == TOK_AMP) {
+                item.background = (current.kind == TOK_AMP);
+                advance();
+            } else if (current.kind == TOK_AND || current.kind == TOK_OR) {
+                connector = (current.kind == TOK_AND) ? CONNECT_AND : CONNECT_OR;
+                advance();
+                if (current.kind == TOK_END) return fail("unexpected end of line");
+            } else if (current.kind != TOK_END) {
+                return unexpected();
+            }
+            items.push_back(arena, item);
+        }
+        list.items = items.data;
+        list.count = items.size;
+        return true;
+    }
+
+private:
+    Lexer lexer;
+    Arena& arena;
+    Token current;
+
+    void advance() {
+        current = lexer.next();
+    }
+
+    bool fail(const string& message) {
+        error = "syntax error: " + message;
+        return false;
+    }
+
+    bool unexpected() {
+        if (current.kind == TOK_ERROR) return fail(lexer.error);
+        if (current.kind == TOK_END) return fail("unexpected end of line");
+        return fail("unexpected token '" + string(current.text) + "'");
+    }
+
+    bool parse_pipeline(Pipeline& pipeline) {
+        ArenaVector<SimpleCommand> stages;
+        while (true) {
+            SimpleCommand command;
+            if (!parse_command(command)) return false;
+            stages.push_back(arena, command);
+            if (current.kind != TOK_PIPE) break;
+            advance();
+        }
+        pipeline.stages = stages.data;
+        pipeline.stage_count = stages.size;
+        return true;
+    }
+
+    Redirect* add_redirect(Redirect**& tail, RedirectKind kind, int fd, string_view target, bool expand) {
+        Redirect* redirect = arena.allocate_array<Redirect>(1);
+        *redirect = { kind, fd, target, expand, nullptr };
+        *tail = redirect;
+        tail = &redirect->next;
+        return redirect;
+    }
+
+    // Decodes the operator the lexer matched and takes its target word.
+    // "&> file" becomes "> file 2>&1".
+    bool parse_redirect(Redirect**& tail) {
+        string_view op = current.text;
+        bool both = (op[0] == '&');
+        int fd = -1;
+        if (both) op.remove_prefix(1);
+        else if (isdigit((unsigned char)op[0])) {
+            fd = op[0] - '0';
+            op.remove_prefix(1);
+        }
+        if (fd > 2) return fail("only descriptors 0, 1 and 2 can be redirected");
+        advance();
+
+        RedirectKind kind;
+        if (op == "<") kind = REDIRECT_IN;
+        else if (op == "<<<") kind = REDIRECT_HERE_STRING;
+        else if (op == ">") kind = REDIRECT_OUT;
+        else if (op == ">>") kind = REDIRECT_APPEND;
+        else {
+            // ">&m": the descriptor is part of the operator.
+            if (op[2] - '0' > 2) return fail("only descriptors 0, 1 and 2 can be duplicated");
+            add_redirect(tail, REDIRECT_DUP, fd < 0 ? 1 : fd, op.substr(2), false);
+            return true;
+        }
+        if (fd < 0) fd = (kind == REDIRECT_IN || kind == REDIRECT_HERE_STRING) ? 0 : 1;
+        if (current.kind != TOK_WORD) return unexpected();
+        add_redirect(tail, kind, fd, current.text, current.expand);
+        if (both) add_redirect(tail, REDIRECT_DUP, 2, "1", false);
+        advance();
+        return true;
+    }
+
+    bool parse_command(SimpleCommand& command) {
+        ArenaVector<string_view> words;
+        ArenaVector<bool> expand;
+        bool any_expand = false;
+        Redirect* first = nullptr;
+        Redirect** tail = &first;
+        while (true) {
+            if (current.kind == TOK_WORD) {
+                words.push_back(arena, current.text);
+                expand.push_back(arena, current.expand);
+                any_expand |= current.expand;
+                advance();
+            } else if (current.kind == TOK_REDIRECT) {
+                if (!parse_redirect(tail)) return false;
+            } else {
+                break;
+            }
+        }
+        if (words.size == 0 && !first) return unexpected();
+        command.words = words.data;
+        command.word_count = words.size;
+        command.expand = any_expand ? expand.data : nullptr;
+        command.redirects = first;
+        return true;
+    }
+};
+
+// Splits a command line into arguments with the shell's quoting rules.
+vector<string> tokenize(const string& input) {
+    Arena arena(1024);
+    Lexer lexer(input, arena);
+    vector<string> args;
+    for (Token token = lexer.next(); token.kind != TOK_END && token.kind != TOK_ERROR; token = lexer.next()) {
+        args.emplace_back(token.text);
+    }
+    return args;
+}
+
+// Process backend. Windows keeps running commands through cmd.exe so its
+// internal commands (dir, type, ...) still work; POSIX resolves the program
+// itself and starts it with posix_spawn, without an intermediate shell.
+#ifdef _WIN32
+// Searches PATH for a program, without the command hash.
+string search_path(const string& name) {
+    char path[MAX_PATH];
+    if (SearchPathA(NULL, name.c_str(), ".exe", MAX_PATH, path, NULL) == 0) return "";
+    return path;
+}
+
+bool spawnProcess(const vector<string>& argv, const SpawnIO& io, ProcHandle& handle, ProcId& pid) {
+    string cmdLine = "cmd.exe /C";
+    for (const auto& arg : argv) {
+        cmdLine += (arg.find(' ') != string::npos) ? " \"" + arg + "\"" : " " + arg;
+    }
+
+    STARTUPINFOA si = {};
+    PROCESS_INFORMATION pi = {};
+    si.cb = sizeof(si);
+    if (io.in != NO_IO || io.out != NO_IO || io.err != NO_IO || io.err_to_out || io.out_to_err) {
+        si.dwFlags |= STARTF_USESTDHANDLES;
+        si.hStdInput = (io.in != NO_IO) ? io.in : GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = (io.out != NO_IO) ? io.out : GetStdHandle(STD_OUTPUT_HANDLE);
+        si.hStdError = (io.err != NO_IO) ? io.err : GetStdHandle(STD_ERROR_HANDLE);
+        if (io.err_to_out) si.hStdError = si.hStdOutput;
+        else if (io.out_to_err) si.hStdOutput = si.hStdError;
+        SetHandleInformation(si.hStdInput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        SetHandleInformation(si.hStdOutput, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        SetHandleInformation(si.hStdError, HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+    }
+
+    char* cmd = _strdup(cmdLine.c_str());
+    BOOL success = CreateProcessA(NULL, cmd, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+    free(cmd);
+
+    // Pipe ends handed to this child must not leak into the next one, or
+    // readers further down a pipeline never see end-of-file.
+    if (io.in != NO_IO) SetHandleInformation(io.in, HANDLE_FLAG_INHERIT, 0);
+    if (io.out != NO_IO) SetHandleInformation(io.out, HANDLE_FLAG_INHERIT, 0);
+    if (io.err != NO_IO) SetHandleInformation(io.err, HANDLE_FLAG_INHERIT, 0);
+    if (!success) return false;
+
+    CloseHandle(pi.hThread);
+    handle = pi.hProcess;
+    pid = pi.dwProcessId;
+    return true;
+}
+
+// Waits for a foreground process and adds its usage to child_totals.
+int waitProcess(ProcHandle handle) {
+    ProcUsage usage;
+    int code = waitProcessUsage(handle, usage);
+    child_totals.add(usage);
+    return code;
+}
+
+static double filetime_seconds(const FILETIME& t) {
+    return (((unsigned long long)t.dwHighDateTime << 32) | t.dwLowDateTime) / 1e7;
+}
+
+// Waits for a process, collects its CPU times and closes the handle.
+int waitProcessUsage(ProcHandle handle, ProcUsage& usage) {
+    DWORD code = 0;
+    WaitForSingleObject(handle, INFINITE);
+    GetExitCodeProcess(handle, &code);
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(handle, &created, &exited, &kernel, &user)) {
+        usage.user_sec = filetime_seconds(user);
+        usage.sys_sec = filetime_seconds(kernel);
+    }
+    CloseHandle(handle);
+    return (int)code;
+}
+
+// Reports a background process to the job table when it exits. The handle
+// is closed here, after the job no longer counts it as running.
+void watchProcess(ProcHandle handle, ProcId pid) {
+    thread([handle, pid]() {
+        ProcUsage usage;
+        int code = waitProcessUsage(handle, usage);
+        processExited(pid, code, usage);
+    }).detach();
+}
+
+// Windows can only terminate; stop and continue are not supported.
+bool signalProcess(ProcHandle handle, int sig) {
+    if (sig != SIGTERM && sig != SIGINT) return false;
+    return TerminateProcess(handle, 128 + sig) != 0;
+}
+
+bool createPipe(IoHandle& readEnd, IoHandle& writeEnd) {
+    SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, FALSE };
+    return CreatePipe(&readEnd, &writeEnd, &sa, (DWORD)pipe_buffer_size) != 0;
+}
+
+// Waits for every started process, recording exit codes in the order they finish.
+void reapAsTheyExit(const vector<ProcHandle>& handles, const vector<bool>& started, vector<int>& statuses) {
+    vector<HANDLE> pending;
+    vector<size_t> owner;
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (started[i]) {
+            pending.push_back(handles[i]);
+            owner.push_back(i);
+        }
+    }
+    while (!pending.empty()) {
+        DWORD count = (DWORD)min(pending.size(), (size_t)MAXIMUM_WAIT_OBJECTS);
+        DWORD result = WaitForMultipleObjects(count, pending.data(), FALSE, INFINITE);
+        if (result >= WAIT_OBJECT_0 + count) break;
+        size_t k = result - WAIT_OBJECT_0;
+        statuses[owner[k]] = waitProcess(pending[k]);
+        pending.erase(pending.begin() + k);
+        owner.erase(owner.begin() + k);
+    }
+}
+
+IoHandle openRedirect(const string& filename, bool output, bool append) {
+    HANDLE hFile;
+    if (output && append) {
+        hFile = CreateFileA(filename.c_str(), FILE_APPEND_DATA, FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    } else if (output) {
+        hFile = CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    } else {
+        hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    }
+    return (hFile == INVALID_HANDLE_VALUE) ? NO_IO : hFile;
+}
+
+void closeIo(IoHandle h) {
+    if (h != NO_IO) CloseHandle(h);
+}
+
+// A second handle for the same file or pipe, not inherited by children.
+IoHandle duplicateIo(IoHandle h) {
+    HANDLE copy;
+    if (!DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &copy, 0, FALSE, DUPLICATE_SAME_ACCESS)) return NO_IO;
+    return copy;
+}
+
+// Returns bytes read, 0 at end of input (the writer closed the pipe).
+long readIo(IoHandle h, char* buffer, size_t size) {
+    DWORD n = 0;
+    if (!ReadFile(h, buffer, (DWORD)size, &n, NULL)) return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+    return (long)n;
+}
+
+// Writes everything; false once the reader has gone.
+bool writeIo(IoHandle h, const char* data, size_t size) {
+    while (size > 0) {
+        DWORD n = 0;
+        if (!WriteFile(h, data, (DWORD)min<size_t>(size, 1 << 30), &n, NULL)) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+IoHandle fd_handle(int fd) {
+    return (IoHandle)_get_osfhandle(fd);
+}
+
+// A new descriptor for a handle; the caller closes it.
+int dup_handle_fd(IoHandle h) {
+    HANDLE copy;
+    if (!DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &copy, 0, FALSE, DUPLICATE_SAME_ACCESS)) return -1;
+    return _open_osfhandle((intptr_t)copy, 0);
+}
+#else
+extern char** environ;
+
+// Searches PATH for a program, without the command hash.
+string search_path(const string& name) {
+    const char* path_env = getenv("PATH");
+    string path_list = path_env ? path_env : "/usr/local/bin:/usr/bin:/bin";
+    size_t start = 0;
+    while (start <= path_list.size()) {
+        size_t end = path_list.find(':', start);
+        if (end == string::npos) end = path_list.size();
+        string dir = path_list.substr(start, end - start);
+        string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+bool spawnProcess(const vector<string>& argv, const SpawnIO& io, ProcHandle& handle, ProcId& pid) {
+    if (argv.empty()) return false;
+    string path = resolve_executable(argv[0]);
+    if (path.empty()) {
+        cerr << argv[0] << ": command not found" << endl;
+        return false;
+    }
+
+    vector<char*> cargv;
+    cargv.reserve(argv.size() + 1);
+    for (const auto& arg : argv) cargv.push_back(const_cast<char*>(arg.c_str()));
+    cargv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (io.in != NO_IO) posix_spawn_file_actions_adddup2(&actions, io.in, STDIN_FILENO);
+    // stderr first: for "2>&1 > file" it is the shell's stdout, which the
+    // file is about to replace.
+    if (io.err != NO_IO) posix_spawn_file_actions_adddup2(&actions, io.err, STDERR_FILENO);
+    if (io.out != NO_IO) posix_spawn_file_actions_adddup2(&actions, io.out, STDOUT_FILENO);
+    if (io.err_to_out) posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    else if (io.out_to_err) posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+    // The shell ignores SIGPIPE; "yes | head" relies on the default.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    // Pending output must reach the terminal before the child writes its own.
+    flush_output();
+    int rc = posix_spawn(&pid, path.c_str(), &actions, &attr, cargv.data(), environ);
+    if (rc == ENOENT && argv[0].find('/') == string::npos) {
+        // The program went away since it was hashed; look it up again.
+        forget_command(argv[0]);
+        path = resolve_executable(argv[0]);
+        if (!path.empty()) rc = posix_spawn(&pid, path.c_str(), &actions, &attr, cargv.data(), environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        cerr << argv[0] << ": " << strerror(rc) << endl;
+        return false;
+    }
+    handle = pid;
+    return true;
+}
+
+static int decode_wait_status(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return status;
+}
+
+// Waits for a foreground child and adds its usage to child_totals.
+int waitProcess(ProcHandle handle) {
+    ProcUsage usage;
+    int code = waitProcessUsage(handle, usage);
+    if (code >= 0) child_totals.add(usage);
+    return code;
+}
+
+bool signalProcess(ProcHandle handle, int sig) {
+    return kill(handle, sig) == 0;
+}
+
+bool createPipe(IoHandle& readEnd, IoHandle& writeEnd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return false;
+    readEnd = fds[0];
+    writeEnd = fds[1];
+#ifdef F_SETPIPE_SZ
+    if (pipe_buffer_size > 0 && fcntl(writeEnd, F_SETPIPE_SZ, (int)pipe_buffer_size) < 0) {
+        static bool warned = false;
+        if (!warned) {
+            cerr << "Warning: cannot set pipe size to " << pipe_buffer_size << " bytes ("
+                 << strerror(errno) << "), see /proc/sys/fs/pipe-max-size\n";
+            warned = true;
+        }
+    }
+#endif
+    return true;
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Waits for every started process, recording exit statuses in the order the
+// children finish. Each child gets a pidfd so only our own children are
+// reaped; kernels without pidfd_open fall back to waiting in stage order.
+void reapAsTheyExit(const vector<ProcHandle>& handles, const vector<bool>& started, vector<int>& statuses) {
+    vector<pollfd> pending;
+    vector<size_t> owner;
+    vector<size_t> blocking;
+    for (size_t i = 0; i < handles.size(); i++) {
+        if (!started[i]) continue;
+        int fd = open_pidfd(handles[i]);
+        if (fd < 0) {
+            blocking.push_back(i);
+            continue;
+        }
+        pending.push_back({ fd, POLLIN, 0 });
+        owner.push_back(i);
+    }
+
+    while (!pending.empty()) {
+        if (poll(pending.data(), pending.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (size_t k = pending.size(); k-- > 0;) {
+            if (pending[k].revents == 0) continue;
+            statuses[owner[k]] = waitProcess(handles[owner[k]]);
+            close(pending[k].fd);
+            pending.erase(pending.begin() + k);
+            owner.erase(owner.begin() + k);
+        }
+    }
+    for (size_t k = 0; k < pending.size(); k++) {
+        close(pending[k].fd);
+        blocking.push_back(owner[k]);
+    }
+    for (size_t i : blocking) statuses[i] = waitProcess(handles[i]);
+}
+
+// Waits for a child and collects its CPU times, peak memory and context
+// switches.
+int waitProcessUsage(ProcHandle handle, ProcUsage& usage) {
+    int status;
+    rusage ru;
+    pid_t result;
+    do {
+        result = wait4(handle, &status, 0, &ru);
+    } while (result < 0 && errno == EINTR);
+    if (result != handle) return -1;
+
+    usage.user_sec = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    usage.sys_sec = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    usage.max_rss_kb = ru.ru_maxrss;
+    usage.voluntary_switches = ru.ru_nvcsw;
+    usage.involuntary_switches = ru.ru_nivcsw;
+    return decode_wait_status(status);
+}
+
+static void reap_child(pid_t pid) {
+    ProcUsage usage;
+    int code = waitProcessUsage(pid, usage);
+    if (code >= 0) processExited(pid, code, usage);
+}
+
+// Background children are reaped by one thread that waits on their pidfds
+// with epoll, so a job's status and rusage are recorded as soon as it
+// exits. Without pidfd_open each child gets a thread blocked in wait4().
+static int reaper_epoll = -1;
+
+static void reaper_loop() {
+    epoll_event events[64];
+    while (true) {
+        int n = epoll_wait(reaper_epoll, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = (int)(events[i].data.u64 >> 32);
+            pid_t pid = (pid_t)(uint32_t)events[i].data.u64;
+            epoll_ctl(reaper_epoll, EPOLL_CTL_DEL, fd, nullptr);
+            close(fd);
+            reap_child(pid);
+        }
+    }
+}
+
+static bool start_reaper() {
+    static once_flag started;
+    call_once(started, []() {
+        reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (reaper_epoll >= 0) thread(reaper_loop).detach();
+    });
+    return reaper_epoll >= 0;
+}
+
+void watchProcess(ProcHandle handle, ProcId pid) {
+    (void)handle;
+    int fd = open_pidfd(pid);
+    if (fd >= 0 && start_reaper()) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)(uint32_t)fd << 32) | (uint32_t)pid;
+        if (epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, fd, &event) == 0) return;
+    }
+    if (fd >= 0) close(fd);
+    thread(reap_child, pid).detach();
+}
+
+// ">>" opens with O_APPEND, so every write lands at the end of the file
+// even with other writers.
+IoHandle openRedirect(const string& filename, bool output, bool append) {
+    int flags = !output ? O_RDONLY : (O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC));
+    return open(filename.c_str(), flags | O_CLOEXEC, 0644);
+}
+
+void closeIo(IoHandle h) {
+    if (h != NO_IO) close(h);
+}
+
+// A second descriptor for the same file or pipe, closed on exec.
+IoHandle duplicateIo(IoHandle h) {
+    return fcntl(h, F_DUPFD_CLOEXEC, 0);
+}
+
+long readIo(IoHandle h, char* buffer, size_t size) {
+    long n;
+    do {
+        n = read(h, buffer, size);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Writes everything; false once the reader has gone.
+bool writeIo(IoHandle h, const char* data, size_t size) {
+    while (size > 0) {
+        long n = write(h, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+IoHandle fd_handle(int fd) {
+    return fd;
+}
+
+// A new descriptor for a handle; the caller closes it.
+int dup_handle_fd(IoHandle h) {
+    return fcntl(h, F_DUPFD_CLOEXEC, 0);
+}
+#endif
+
+// Command hash. Looking a name up on PATH costs a stat per directory, so
+// each resolved name is remembered. The table is dropped when PATH changes
+// or when a PATH directory's mtime changes (checked at most once a second),
+// which catches programs added earlier on PATH or removed. Names that are
+// not found are not remembered, so a new program is seen right away.
+class CommandHash {
+public:
+    struct Entry {
+        string path;
+        unsigned long hits = 0;
+    };
+
+    string lookup(const string& name, bool count_hit = true) {
+        lock_guard<mutex> lock(m);
+        validate();
+        auto it = table.find(name);
+        if (it == table.end()) {
+            string path = search_path(name);
+            if (path.empty()) return path;
+            it = table.emplace(name, Entry{ path, 0 }).first;
+        }
+        if (count_hit) it->second.hits++;
+        return it->second.path;
+    }
+
+    bool contains(const string& name) {
+        lock_guard<mutex> lock(m);
+        validate();
+        return table.count(name) != 0;
+    }
+
+    void forget(const string& name) {
+        lock_guard<mutex> lock(m);
+        table.erase(name);
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m);
+        table.clear();
+    }
+
+    vector<pair<string, Entry>> entries() {
+        lock_guard<mutex> lock(m);
+        validate();
+        vector<pair<string, Entry>> list(table.begin(), table.end());
+        sort(list.begin(), list.end(), [](const pair<string, Entry>& a, const pair<string, Entry>& b) { return a.first < b.first; });
+        return list;
+    }
+
+private:
+    mutex m;
+    unordered_map<string, Entry> table;
+    string path_var;
+    vector<long long> mtimes;
+    chrono::steady_clock::time_point checked;
+
+    vector<long long> directory_mtimes() const {
+#ifdef _WIN32
+        const char separator = ';';
+#else
+        const char separator = ':';
+#endif
+        vector<long long> result;
+        for (size_t start = 0; start <= path_var.size();) {
+            size_t end = path_var.find(separator, start);
+            if (end == string::npos) end = path_var.size();
+            string dir = path_var.substr(start, end - start);
+            long long mtime = -1;
+            directory_mtime(dir.empty() ? "." : dir, mtime);
+            result.push_back(mtime);
+            start = end + 1;
+        }
+        return result;
+    }
+
+    void validate() {
+        const char* env = getenv("PATH");
+        if (path_var != (env ? env : "")) {
+            path_var = env ? env : "";
+            table.clear();
+            mtimes = directory_mtimes();
+            checked = chrono::steady_clock::now();
+            return;
+        }
+        auto now = chrono::steady_clock::now();
+        if (now - checked < chrono::seconds(1)) return;
+        checked = now;
+        vector<long long> current = directory_mtimes();
+        if (current != mtimes) {
+            table.clear();
+            mtimes.swap(current);
+        }
+    }
+};
+
+CommandHash& command_hash() {
+    static CommandHash* hash = new CommandHash();
+    return *hash;
+}
+
+// Absolute path of a program, or "" if it cannot be found. Names with a
+// directory part are used as they are.
+string resolve_executable(const string& name) {
+    if (name.empty()) return "";
+#ifdef _WIN32
+    if (name.find_first_of("/\\") != string::npos) return search_path(name);
+#else
+    if (name.find('/') != string::npos) {
+        return (access(name.c_str(), X_OK) == 0) ? name : "";
+    }
+#endif
+    return command_hash().lookup(name);
+}
+
+void forget_command(const string& name) {
+    command_hash().forget(name);
+}
+
+// A duplicate made before the stream it copies was redirected, as in
+// "2>&1 > file", keeps that stream as it was: the stage's pipe if it has one,
+// otherwise the shell's stdout (ChildStreams::attach_kept_error swaps in a
+// builtin sink, such as a $(...) capture).
+void keep_original_streams(SpawnIO& stage, const SpawnIO& redirects, IoHandle pipe_out) {
+    if (redirects.err_to_out && redirects.out != NO_IO) {
+        stage.err_to_out = false;
+        stage.err = (pipe_out != NO_IO) ? pipe_out : fd_handle(1);
+    }
+    if (redirects.out_to_err && redirects.err != NO_IO) stage.out_to_err = false;
+}
+
+// Connects the streams a foreground child would inherit to this thread's
+// builtin sink and source. One backed by a descriptor is handed over as it
+// is; an in-memory one (a ring buffer, a $(...) capture) is joined through a
+// pipe that start()/finish() copy while the child runs.
+class ChildStreams {
+public:
+    ChildStreams() = default;
+    ChildStreams(const ChildStreams&) = delete;
+    ChildStreams& operator=(const ChildStreams&) = delete;
+
+    ~ChildStreams() {
+        closeIo(child_out);
+        closeIo(child_in);
+        closeIo(drain);
+        closeIo(feed);
+    }
+
+    // target is the child's stdout slot; it is only set if it would inherit.
+    void attach_output(IoHandle& target) {
+        if (target != NO_IO || !current_output) return;
+        int fd = current_output->fd();
+        if (fd >= 0) target = fd_handle(fd);
+        else if (createPipe(drain, child_out)) target = child_out;
+    }
+
+    // stderr is never pumped: a builtin's 2>&1 makes it follow stdout, and
+    // an error sink with a descriptor is handed over.
+    static void attach_error(SpawnIO& io) {
+        if (io.err != NO_IO || io.err_to_out || !current_error) return;
+        if (current_error == current_output) io.err_to_out = true;
+        else if (current_error->fd() >= 0) io.err = fd_handle(current_error->fd());
+    }
+
+    // The stderr keep_original_streams sent to the shell's stdout goes to
+    // this thread's sink instead when there is one. stdout itself went to a
+    // file, so the pipe is free.
+    void attach_kept_error(SpawnIO& io, const SpawnIO& redirects) {
+        if (!redirects.err_to_out || redirects.out == NO_IO || !current_output) return;
+        io.err = NO_IO;
+        attach_output(io.err);
+    }
+
+    void attach_input(IoHandle& target) {
+        if (target != NO_IO || !current_input) return;
+        int fd = current_input->fd();
+        if (fd >= 0) target = fd_handle(fd);
+        else if (createPipe(child_in, feed)) target = child_in;
+    }
+
+    // Call once the children are started: drops our copies of their pipe
+    // ends and starts feeding input.
+    void start() {
+        closeIo(child_out);
+        closeIo(child_in);
+        child_out = child_in = NO_IO;
+        if (feed == NO_IO) return;
+        InputSource* source = &in();
+        IoHandle target = feed;
+        feed = NO_IO;
+        feeder = thread([source, target]() {
+            char block[16384];
+            long n;
+            while ((n = source->read(block, sizeof(block))) > 0 && writeIo(target, block, n)) {}
+            closeIo(target);
+        });
+    }
+
+    // Copies the child's output into this thread's sink until it closes.
+    void finish() {
+        if (drain != NO_IO) {
+            OutputSink& sink = out();
+            char block[65536];
+            long n;
+            while ((n = readIo(drain, block, sizeof(block))) > 0) sink.write(block, n);
+            closeIo(drain);
+            drain = NO_IO;
+        }
+        if (feeder.joinable()) feeder.join();
+    }
+
+private:
+    IoHandle child_out = NO_IO, child_in = NO_IO;   // the children's ends
+    IoHandle drain = NO_IO, feed = NO_IO;           // ours
+    thread feeder;
+};
+
+// Runs an external program in the foreground and returns its exit status.
+int runExternal(const vector<string>& argv, const SpawnIO& io) {
+    SpawnIO child = io;
+    keep_original_streams(child, io, NO_IO);
+    ChildStreams streams;
+    streams.attach_output(child.out);
+    streams.attach_input(child.in);
+    streams.attach_kept_error(child, io);
+    streams.attach_error(child);
+    ProcHandle handle;
+    ProcId pid;
+    bool started = spawnProcess(argv, child, handle, pid);
+    streams.start();
+    streams.finish();
+    return started ? waitProcess(handle) : 127;
+}
+
+// Path of the running shell binary, used to start copies of it.
+string self_executable() {
+#ifdef _WIN32
+    char path[MAX_PATH];
+    DWORD n = GetModuleFileNameA(NULL, path, MAX_PATH);
+    return string(path, n);
+#else
+    char path[4096];
+    ssize_t n = readlink("/proc/self/exe", path, sizeof(path));
+    return (n > 0) ? string(path, n) : string("shell");
+#endif
+}
+
+// Job control. Callers hold job_mutex.
+static Job* findJob(int jobId) {
+    if (jobId <= 0 || jobId >= (int)jobTable.size()) return nullptr;
+    return jobTable[jobId].get();
+}
+
+// Drops a finished job. IDs start again from 1 once the table is empty.
+static void removeJob(int jobId) {
+    Job* job = findJob(jobId);
+    if (!job) return;
+    for (const auto& proc : job->processes) jobByPid.erase(proc.pid);
+    jobTable[jobId].reset();
+    if (jobByPid.empty() && none_of(jobTable.begin(), jobTable.end(), [](const shared_ptr<Job>& j) { return j != nullptr; })) {
+        jobTable.clear();
+        jobCounter = 1;
+    }
+}
+
+static string jobStatusText(const Job& job) {
+    ostringstream out;
+    if (job.isRunning) {
+        out << (job.stopped ? "Stopped" : "Running");
+    } else {
+        out << "Exited (" << job.exitCode << ") user " << fixed << setprecision(2) << job.usage.user_sec
+            << "s sys " << job.usage.sys_sec << "s";
+        if (job.usage.max_rss_kb) out << " rss " << job.usage.max_rss_kb << " KB";
+    }
+    return out.str();
+}
+
+// Registers the started processes of a background command as one job and
+// hands them to the reaper. Returns the new job ID.
+int addJob(const string& command, const vector<ProcHandle>& handles, const vector<ProcId>& pids) {
+    lock_guard<mutex> lock(job_mutex);
+    unique_ptr<Job> job(new Job{ jobCounter++, command, {}, handles.size(), true, false, 0, ProcUsage() });
+    for (size_t i = 0; i < handles.size(); i++) {
+        job->processes.push_back({ handles[i], pids[i], true, 0 });
+        jobByPid[pids[i]] = job->id;
+    }
+    int id = job->id;
+    if (jobTable.size() <= (size_t)id) jobTable.resize(id + 1);
+    jobTable[id] = move(job);
+    for (size_t i = 0; i < handles.size(); i++) watchProcess(handles[i], pids[i]);
+    cout << "[" << id << "] " << pids.back() << " started in background\n";
+    return id;
+}
+
+// A foreground builtin that starts many children (parallel) is listed as
+// one job while it works. It waits for the children itself instead of the
+// reaper, and each child is listed only while it runs.
+int beginJob(const string& command) {
+    lock_guard<mutex> lock(job_mutex);
+    unique_ptr<Job> job(new Job{ jobCounter++, command, {}, 0, true, false, 0, ProcUsage() });
+    int id = job->id;
+    if (jobTable.size() <= (size_t)id) jobTable.resize(id + 1);
+    jobTable[id] = move(job);
+    return id;
+}
+
+void jobProcessStarted(int jobId, ProcHandle handle, ProcId pid) {
+    lock_guard<mutex> lock(job_mutex);
+    Job* job = findJob(jobId);
+    if (!job) return;
+    job->processes.push_back({ handle, pid, true, 0 });
+    job->running++;
+}
+
+void jobProcessFinished(int jobId, ProcId pid, const ProcUsage& usage) {
+    lock_guard<mutex> lock(job_mutex);
+    Job* job = findJob(jobId);
+    if (!job) return;
+    for (size_t i = 0; i < job->processes.size(); i++) {
+        if (job->processes[i].pid != pid) continue;
+        job->processes[i] = job->processes.back();
+        job->processes.pop_back();
+        job->running--;
+        break;
+    }
+    job->usage.user_sec += usage.user_sec;
+    job->usage.sys_sec += usage.sys_sec;
+    job->usage.max_rss_kb = max(job->usage.max_rss_kb, usage.max_rss_kb);
+}
+
+// Finishes a job from beginJob and removes it. Returns its summed usage.
+ProcUsage endJob(int jobId, int exitCode) {
+    lock_guard<mutex> lock(job_mutex);
+    Job* job = findJob(jobId);
+    if (!job) return ProcUsage();
+    job->isRunning = false;
+    job->exitCode = exitCode;
+    ProcUsage usage = job->usage;
+    job_finished.notify_all();
+    removeJob(jobId);
+    return usage;
+}
+
+// Called by the reaper when a background process exits.
+void processExited(ProcId pid, int exitCode, const ProcUsage& usage) {
+    lock_guard<mutex> lock(job_mutex);
+    auto it = jobByPid.find(pid);
+    if (it == jobByPid.end()) return;
+    Job* job = findJob(it->second);
+    jobByPid.erase(it);
+    if (!job) return;
+
+    for (auto& proc : job->processes) {
+        if (proc.pid != pid) continue;
+        proc.isRunning = false;
+        proc.exitCode = exitCode;
+    }
+    job->usage.user_sec += usage.user_sec;
+    job->usage.sys_sec += usage.sys_sec;
+    job->usage.max_rss_kb = max(job->usage.max_rss_kb, usage.max_rss_kb);
+    if (--job->running == 0) {
+        job->isRunning = false;
+        job->exitCode = job->processes.back().exitCode;
+        job_finished.notify_all();
+    }
+}
+
+// Lists every job. Finished jobs are dropped once they have been shown.
+void listJobs() {
+    lock_guard<mutex> lock(job_mutex);
+    OutputSink& sink = out();
+    sink << "Active Background Jobs:\n";
+    vector<int> finished;
+    for (const auto& job : jobTable) {
+        if (!job) continue;
+        sink << "[" << job->id << "] PID:";
+        for (size_t i = 0; i < job->processes.size(); i++) sink << (i ? ',' : ' ') << (long long)job->processes[i].pid;
+        sink << " Command: " << job->command << " Status: " << jobStatusText(*job) << '\n';
+        if (!job->isRunning) finished.push_back(job->id);
+    }
+    for (int id : finished) removeJob(id);
+}
+
+// Interactive mode prints finished jobs before the next prompt.
+void reportFinishedJobs() {
+    lock_guard<mutex> lock(job_mutex);
+    vector<int> finished;
+    for (const auto& job : jobTable) {
+        if (!job || job->isRunning) continue;
+        out() << "[" << job->id << "] Done: " << job->command << " Status: " << jobStatusText(*job) << '\n';
+        finished.push_back(job->id);
+    }
+    for (int id : finished) removeJob(id);
+}
+
+static void signalJob(Job& job, int sig) {
+    for (const auto& proc : job.processes) {
+        if (proc.isRunning) signalProcess(proc.hProcess, sig);
+    }
+}
+
+// Waits for a job without polling and removes it. Returns its exit code,
+// or 127 if there is no such job.
+int waitJob(int jobId) {
+    unique_lock<mutex> lock(job_mutex);
+    if (!findJob(jobId)) return 127;
+    shared_ptr<Job> job = jobTable[jobId];
+    job_finished.wait(lock, [&job]() { return !job->isRunning; });
+    int exitCode = job->exitCode;
+    // jobs or the prompt may have dropped it already, and the ID since
+    // gone to a new job.
+    if (findJob(jobId) == job.get()) removeJob(jobId);
+    return exitCode;
+}
+
+void fg(int jobId) {
+    {
+        lock_guard<mutex> lock(job_mutex);
+        Job* job = findJob(jobId);
+        if (!job) {
+            cout << "Error: Job ID not found.\n";
+            last_status = 1;
+            return;
+        }
+        cout << "Bringing job [" << job->id << "] to foreground...\n";
+#ifndef _WIN32
+        if (job->stopped) signalJob(*job, SIGCONT);
+#endif
+        job->stopped = false;
+    }
+    last_status = waitJob(jobId);
+}
+
+void bg(int jobId) {
+    lock_guard<mutex> lock(job_mutex);
+    Job* job = findJob(jobId);
+    if (!job) {
+        cout << "Error: Job ID not found.\n";
+        last_status = 1;
+        return;
+    }
+#ifdef _WIN32
+    cout << "Error: bg is not supported on this platform.\n";
+    last_status = 1;
+#else
+    if (job->stopped) signalJob(*job, SIGCONT);
+    job->stopped = false;
+    cout << "[" << job->id << "] " << job->command << " &\n";
+#endif
+}
+
+void killJob(int jobId, int sig) {
+    lock_guard<mutex> lock(job_mutex);
+    Job* job = findJob(jobId);
+    if (!job) {
+        cout << "Error: Job ID not found.\n";
+        last_status = 1;
+        return;
+    }
+    if (!job->isRunning) return;
+    if (sig == SIGTERM) {
+        cout << "Killing job [" << job->id << "]...\n";
+    } else {
+        cout << "Sending signal " << sig << " to job [" << job->id << "]...\n";
+    }
+    signalJob(*job, sig);
+#ifndef _WIN32
+    if (sig == SIGSTOP || sig == SIGTSTP) job->stopped = true;
+    if (sig == SIGCONT) job->stopped = false;
+#endif
+}
+
+void launchBackgroundProcess(const vector<string>& argv, const string& command) {
+    if (argv.empty()) return;
+
+    ProcHandle handle;
+    ProcId pid;
+    if (spawnProcess(argv, SpawnIO(), handle, pid)) {
+        addJob(command, { handle }, { pid });
+    } else {
+        cerr << "Failed to launch process: " << command << endl;
+    }
+}
+
+// Creates every pipe and starts every stage of a pipeline without waiting.
+// io[i] overrides the pipe ends of stage i (redirections). A stage that
+// cannot be started is left with started[i] == false.
+bool startPipeline(const vector<vector<string>>& stages, const vector<SpawnIO>& io,
+                   vector<ProcHandle>& handles, vector<ProcId>& pids, vector<bool>& started) {
+    size_t n = stages.size();
+    vector<IoHandle> readEnds(n, NO_IO), writeEnds(n, NO_IO);
+    for (size_t i = 0; i + 1 < n; i++) {
+        if (!createPipe(readEnds[i], writeEnds[i])) {
+            cerr << "Error creating pipe.\n";
+            for (size_t j = 0; j < i; j++) {
+                closeIo(readEnds[j]);
+                closeIo(writeEnds[j]);
+            }
+            return false;
+        }
+    }
+
+    handles.assign(n, ProcHandle());
+    pids.assign(n, ProcId());
+    started.assign(n, false);
+    for (size_t i = 0; i < n; i++) {
+        SpawnIO stage_io;
+        if (i > 0) stage_io.in = readEnds[i - 1];
+        if (i + 1 < n) stage_io.out = writeEnds[i];
+        if (io[i].in != NO_IO) stage_io.in = io[i].in;
+        if (io[i].out != NO_IO) stage_io.out = io[i].out;
+        if (io[i].err != NO_IO) stage_io.err = io[i].err;
+        stage_io.err_to_out = io[i].err_to_out;
+        stage_io.out_to_err = io[i].out_to_err;
+        keep_original_streams(stage_io, io[i], (i + 1 < n) ? writeEnds[i] : NO_IO);
+        started[i] = spawnProcess(stages[i], stage_io, handles[i], pids[i]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        closeIo(readEnds[i]);
+        closeIo(writeEnds[i]);
+    }
+    return true;
+}
+
+// Runs stages connected by pipes. Every pipe is created and every stage is
+// started before the first wait, then statuses are collected as children
+// exit. A stage that cannot be started reports 127, like other shells.
+vector<int> runPipeline(const vector<vector<string>>& stages, const vector<SpawnIO>& io) {
+    vector<ProcHandle> handles;
+    vector<ProcId> pids;
+    vector<bool> started;
+    vector<int> statuses(stages.size(), 127);
+    if (!startPipeline(stages, io, handles, pids, started)) return vector<int>(stages.size(), 1);
+    reapAsTheyExit(handles, started, statuses);
+    return statuses;
+}
+
+// File copy engine used by cat, dikhhao and cp. On Linux data is moved by the
+// kernel (copy_file_range between files, splice into pipes, sendfile to
+// anything else); the buffered loop is only the fallback.
+const size_t COPY_BUFFER_SIZE = 1 << 20;
+
+struct AlignedBuffer {
+    char* data;
+    explicit AlignedBuffer(size_t size) {
+#ifdef _WIN32
+        data = (char*)_aligned_malloc(size, 4096);
+#else
+        if (posix_memalign((void**)&data, 4096, size) != 0) data = nullptr;
+#endif
+    }
+    ~AlignedBuffer() {
+#ifdef _WIN32
+        _aligned_free(data);
+#else
+        free(data);
+#endif
+    }
+};
+
+long long copy_buffered(int in, int out) {
+    static thread_local AlignedBuffer buffer(COPY_BUFFER_SIZE);
+    if (!buffer.data) return -1;
+
+    long long total = 0;
+    while (true) {
+        long n = read(in, buffer.data, COPY_BUFFER_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return total;
+        for (long done = 0; done < n;) {
+            long w = write(out, buffer.data + done, n - done);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += w;
+        }
+        total += n;
+    }
+}
+
+#ifdef _WIN32
+long long copy_fd(int in, int out) {
+    return copy_buffered(in, out);
+}
+#else
+enum CopyMethod { COPY_FILE_RANGE, COPY_SPLICE, COPY_SENDFILE };
+
+// Returns 1 at end of input, 0 if the method is not supported for this pair
+// of descriptors, -1 on a real error. Bytes moved are added to total.
+static int kernel_copy(CopyMethod method, int in, int out, long long& total) {
+    const size_t chunk = 1 << 30;
+    while (true) {
+        ssize_t n;
+        if (method == COPY_FILE_RANGE) {
+            n = copy_file_range(in, nullptr, out, nullptr, chunk, 0);
+        } else if (method == COPY_SPLICE) {
+            n = splice(in, nullptr, out, nullptr, COPY_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = sendfile(out, in, nullptr, chunk);
+        }
+        if (n > 0) {
+            total += n;
+            continue;
+        }
+        if (n == 0) return 1;
+        if (errno == EINTR) continue;
+        // copy_file_range reports EBADF for an O_APPEND destination.
+        if (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP) return 0;
+        if (errno == EBADF && method == COPY_FILE_RANGE) return 0;
+        return -1;
+    }
+}
+
+long long copy_fd(int in, int out) {
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0) return copy_buffered(in, out);
+
+    vector<CopyMethod> methods;
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        methods = { COPY_FILE_RANGE, COPY_SENDFILE };
+    } else if (S_ISFIFO(out_st.st_mode) || S_ISFIFO(in_st.st_mode)) {
+        methods = { COPY_SPLICE };
+    } else if (S_ISREG(in_st.st_mode)) {
+        methods = { COPY_SENDFILE };
+    }
+
+    long long total = 0;
+    for (CopyMethod method : methods) {
+        int result = kernel_copy(method, in, out, total);
+        if (result == 1) return total;
+        if (result < 0) return -1;
+    }
+    long long rest = copy_buffered(in, out);
+    return (rest < 0) ? -1 : total + rest;
+}
+#endif
+
+// Copies everything from fd to the current output. A sink backed by a
+// descriptor gets the kernel copy; an in-memory one (a pipeline ring, a
+// $(...) capture) is written block by block.
+long long copy_to_output(int fd) {
+    OutputSink& sink = out();
+    sink.flush();
+    if (sink.fd() >= 0) return copy_fd(fd, sink.fd());
+    char block[65536];
+    long long total = 0;
+    while (true) {
+        long n = read(fd, block, sizeof(block));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) return total;
+        sink.write(block, n);
+        total += n;
+    }
+}
+
+enum CatResult { CAT_DONE, CAT_OPEN_FAILED, CAT_COPY_FAILED };
+
+// Streams a file to the current output. On failure errno says why.
+CatResult cat_file(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_BINARY);
+    if (fd < 0) return CAT_OPEN_FAILED;
+    long long copied = copy_to_output(fd);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return (copied >= 0) ? CAT_DONE : CAT_COPY_FAILED;
+}
+
+// Copies one regular file; the destination keeps the source's permissions.
+bool copy_file(const string& src, const string& dst, long long& bytes) {
+    int in = open(src.c_str(), O_RDONLY | O_BINARY);
+    if (in < 0) return false;
+    struct stat st;
+    int mode = (fstat(in, &st) == 0) ? (st.st_mode & 0777) : 0644;
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, mode);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    long long copied = copy_fd(in, out);
+    close(in);
+    close(out);
+    if (copied < 0) return false;
+    bytes += copied;
+    return true;
+}
+
+// Symbolic links are copied as links, like cp -r does, so a link to a
+// directory is not followed into.
+bool copy_tree(const string& src, const string& dst, long& files, long long& bytes) {
+#ifndef _WIN32
+    struct stat link_st;
+    if (lstat(src.c_str(), &link_st) == 0 && S_ISLNK(link_st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlink(src.c_str(), target, sizeof(target) - 1);
+        if (n < 0 || (target[n] = '\0', symlink(target, dst.c_str()) != 0)) {
+            cerr << "Error: Could not copy link '" << src << "' to '" << dst << "'.\n";
+            return false;
+        }
+        files++;
+        return true;
+    }
+#endif
+    if (!is_directory(src)) {
+        if (!copy_file(src, dst, bytes)) {
+            cerr << "Error: Could not copy '" << src << "' to '" << dst << "'.\n";
+            return false;
+        }
+        files++;
+        return true;
+    }
+
+#ifdef _WIN32
+    _mkdir(dst.c_str());
+#else
+    mkdir(dst.c_str(), 0777);
+#endif
+    vector<DirEntry> entries;
+    if (!read_directory(src, entries)) {
+        cerr << "Error: Cannot read directory '" << src << "'.\n";
+        return false;
+    }
+    bool ok = true;
+    for (const auto& entry : entries) {
+        ok &= copy_tree(src + "/" + entry.name, dst + "/" + entry.name, files, bytes);
+    }
+    return ok;
+}
+
+// Whether path, or the part of it that exists, lies inside directory dir:
+// walks up from path through ".." comparing device and inode with dir's.
+bool path_is_inside(const string& dir, const string& path) {
+#ifdef _WIN32
+    (void)dir;
+    (void)path;
+    return false;
+#else
+    struct stat dir_st, st;
+    if (stat(dir.c_str(), &dir_st) != 0) return false;
+    string current = path;
+    while (stat(current.c_str(), &st) != 0) {
+        while (current.size() > 1 && current.back() == '/') current.pop_back();
+        size_t slash = current.find_last_of('/');
+        if (slash == string::npos) current = ".";
+        else current.resize(slash == 0 ? 1 : slash);
+    }
+    for (int depth = 0; depth < 4096; depth++) {
+        if (st.st_dev == dir_st.st_dev && st.st_ino == dir_st.st_ino) return true;
+        current += "/..";
+        struct stat parent;
+        if (stat(current.c_str(), &parent) != 0) return false;
+        if (parent.st_dev == st.st_dev && parent.st_ino == st.st_ino) return false;    // reached /
+        st = parent;
+    }
+    return false;
+#endif
+}
+
+string base_name(const string& path) {
+    string trimmed = path;
+    while (trimmed.size() > 1 && (trimmed.back() == '/' || trimmed.back() == '\\')) trimmed.pop_back();
+    size_t slash = trimmed.find_last_of("/\\");
+    return (slash == string::npos) ? trimmed : trimmed.substr(slash + 1);
+}
+
+void copy_command(const Args& args) {
+    bool recursive = false;
+    vector<string> paths;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "-r" || args[i] == "-R") recursive = true;
+        else paths.emplace_back(args[i]);
+    }
+    if (paths.size() != 2) {
+        cerr << "Error: cp requires source and destination filenames.\n";
+        return;
+    }
+
+    string src = paths[0];
+    string dst = paths[1];
+    bool src_is_dir = is_directory(src);
+    if (src_is_dir && !recursive) {
+        cerr << "Error: '" << src << "' is a directory (use cp -r).\n";
+        return;
+    }
+    if (is_directory(dst)) dst += "/" + base_name(src);
+    if (src_is_dir && path_is_inside(src, dst)) {
+        cerr << "Error: cannot copy '" << src << "' into itself ('" << dst << "').\n";
+        return;
+    }
+
+    long files = 0;
+    long long bytes = 0;
+    if (!src_is_dir) {
+        if (!copy_file(src, dst, bytes)) {
+            cerr << "Error: Could not copy file.\n";
+            return;
+        }
+        cout << "File copied from '" << src << "' to '" << dst << "'.\n";
+        return;
+    }
+    if (copy_tree(src, dst, files, bytes)) {
+        cout << "Directory copied from '" << src << "' to '" << dst << "' ("
+             << files << " files, " << bytes << " bytes).\n";
+    }
+}
+
+// Directory listing for ls/ll. On Linux names come from getdents64 in
+// 1 MiB batches and, when sizes or times are needed, statx runs on a small
+// thread pool. Rows are formatted into one buffer that is written with a
+// single call.
+struct ListEntry {
+    string name;
+    bool is_dir = false;
+    bool is_link = false;
+    unsigned long long size = 0;
+    long long mtime = 0;        // seconds since the epoch
+};
+
+enum ListSort { SORT_NAME, SORT_SIZE, SORT_TIME };
+
+struct ListOptions {
+    bool long_format = false;
+    bool recursive = false;
+    bool reverse = false;
+    ListSort sort = SORT_NAME;
+};
+
+#ifdef _WIN32
+// FindFirstFileEx already returns sizes and times, so there is nothing to stat.
+bool scan_directory(const string& path, vector<ListEntry>& entries, bool need_stat) {
+    (void)need_stat;
+    string pattern = path;
+    if (pattern.back() != '\\' && pattern.back() != '/') pattern += '\\';
+    pattern += '*';
+    int n = MultiByteToWideChar(CP_UTF8, 0, pattern.c_str(), -1, NULL, 0);
+    wstring wpattern(n, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, pattern.c_str(), -1, &wpattern[0], n);
+
+    WIN32_FIND_DATAW data;
+    HANDLE hFind = FindFirstFileExW(wpattern.c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        DWORD err = GetLastError();
+        if (err == ERROR_FILE_NOT_FOUND) return true;
+        cerr << "Error: Cannot access directory (code " << err << ").\n";
+        return false;
+    }
+    do {
+        if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) continue;
+        ListEntry entry;
+        entry.name = wide_to_narrow(data.cFileName);
+        entry.is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        entry.is_link = (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+        entry.size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        unsigned long long t = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        entry.mtime = (long long)(t / 10000000ULL) - 11644473600LL;
+        entries.push_back(move(entry));
+    } while (FindNextFileW(hFind, &data));
+    FindClose(hFind);
+    return true;
+}
+#else
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Fills in type, size and mtime with statx (following symlinks, like the
+// old stat call), splitting the entries over up to eight threads.
+void stat_entries(int dirfd, vector<ListEntry>& entries) {
+    auto stat_one = [dirfd](ListEntry& entry) {
+#ifdef STATX_SIZE
+        struct statx stx;
+        if (statx(dirfd, entry.name.c_str(), AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) != 0) return;
+        entry.is_dir = S_ISDIR(stx.stx_mode);
+        entry.size = stx.stx_size;
+        entry.mtime = stx.stx_mtime.tv_sec;
+#else
+        struct stat st;
+        if (fstatat(dirfd, entry.name.c_str(), &st, 0) != 0) return;
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+#endif
+    };
+
+    const size_t CHUNK = 512;
+    unsigned threads = (unsigned)min<size_t>(min(8u, max(1u, thread::hardware_concurrency())), entries.size() / CHUNK);
+    if (threads <= 1) {
+        for (auto& entry : entries) stat_one(entry);
+        return;
+    }
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t begin; (begin = next.fetch_add(CHUNK)) < entries.size();) {
+            size_t end = min(entries.size(), begin + CHUNK);
+            for (size_t i = begin; i < end; i++) stat_one(entries[i]);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+}
+
+// Reads every entry of an open directory in getdents64 batches of the
+// buffer's size. Entries whose type the file system did not report are
+// listed in unknown.
+void read_dirents(int fd, char* buffer, size_t size, vector<ListEntry>& entries, vector<size_t>& unknown) {
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buffer, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (long offset = 0; offset < n;) {
+            const linux_dirent64* d = (const linux_dirent64*)(buffer + offset);
+            offset += d->d_reclen;
+            const char* name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            ListEntry entry;
+            entry.name = name;
+            entry.is_dir = (d->d_type == DT_DIR);
+            entry.is_link = (d->d_type == DT_LNK);
+            if (d->d_type == DT_UNKNOWN) unknown.push_back(entries.size());
+            entries.push_back(move(entry));
+        }
+    }
+}
+
+bool scan_directory(const string& path, vector<ListEntry>& entries, bool need_stat) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        const char* reason = strerror(errno);
+        cerr << "Error: Cannot access directory (" << reason << ").\n";
+        return false;
+    }
+    AlignedBuffer buffer(COPY_BUFFER_SIZE);
+    if (!buffer.data) {
+        close(fd);
+        return false;
+    }
+    vector<size_t> unknown;
+    read_dirents(fd, buffer.data, COPY_BUFFER_SIZE, entries, unknown);
+
+    if (need_stat) {
+        stat_entries(fd, entries);
+    } else {
+        for (size_t i : unknown) {
+            struct stat st;
+            if (fstatat(fd, entries[i].name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                entries[i].is_dir = S_ISDIR(st.st_mode);
+                entries[i].is_link = S_ISLNK(st.st_mode);
+            }
+        }
+    }
+    close(fd);
+    return true;
+}
+#endif
+
+void sort_entries(vector<ListEntry>& entries, const ListOptions& options) {
+    auto by_name = [](const ListEntry& a, const ListEntry& b) { return a.name < b.name; };
+    switch (options.sort) {
+    case SORT_NAME:
+        sort(entries.begin(), entries.end(), by_name);
+        break;
+    case SORT_SIZE:
+        sort(entries.begin(), entries.end(), [&](const ListEntry& a, const ListEntry& b) {
+            return a.size != b.size ? a.size > b.size : by_name(a, b);
+        });
+        break;
+    case SORT_TIME:
+        sort(entries.begin(), entries.end(), [&](const ListEntry& a, const ListEntry& b) {
+            return a.mtime != b.mtime ? a.mtime > b.mtime : by_name(a, b);
+        });
+        break;
+    }
+    if (options.reverse) reverse(entries.begin(), entries.end());
+}
+
+void append_entry(string& out, const ListEntry& entry, bool long_format) {
+    if (!long_format) {
+        out += entry.name;
+        out += "  ";
+        return;
+    }
+    char line[96];
+    out += entry.is_dir ? "[D] " : "[F] ";
+    out += entry.name;
+    if (entry.name.size() < 30) out.append(30 - entry.name.size(), ' ');
+    if (entry.is_dir) {
+        out.append(14, ' ');
+    } else {
+        snprintf(line, sizeof(line), " %10llu KB", entry.size / 1024);
+        out += line;
+    }
+    time_t t = (time_t)entry.mtime;
+    tm local;
+#ifdef _WIN32
+    localtime_s(&local, &t);
+#else
+    localtime_r(&t, &local);
+#endif
+    strftime(line, sizeof(line), "  %Y-%m-%d %H:%M", &local);
+    out += line;
+    out += '\n';
+}
+
+// Lists one directory into out; with -R, subdirectories follow in order.
+void list_into(const string& path, const ListOptions& options, bool header, string& out) {
+    vector<ListEntry> entries;
+    bool need_stat = options.long_format || options.sort != SORT_NAME;
+    if (!scan_directory(path, entries, need_stat)) return;
+    sort_entries(entries, options);
+
+    if (header) out += path + ":\n";
+    for (const auto& entry : entries) append_entry(out, entry, options.long_format);
+    if (!options.long_format) out += '\n';
+
+    if (!options.recursive) return;
+    string prefix = path;
+    if (prefix.back() != '/' && prefix.back() != '\\') prefix += '/';
+    for (const auto& entry : entries) {
+        if (!entry.is_dir || entry.is_link) continue;
+        out += '\n';
+        list_into(prefix + entry.name, options, true, out);
+    }
+}
+
+void list_directory(const string& path, const ListOptions& options) {
+    string listing;
+    list_into(path, options, options.recursive, listing);
+    out().put(listing);
+}
+
+// ls [-l] [-R] [-S | -t] [-r] [dir]; ll is ls -l.
+void list_command(const Args& args, bool long_format) {
+    ListOptions options;
+    options.long_format = long_format;
+    string path = ".";
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i].size() > 1 && args[i][0] == '-') {
+            for (char flag : args[i].substr(1)) {
+                switch (flag) {
+                case 'l': options.long_format = true; break;
+                case 'R': options.recursive = true; break;
+                case 'r': options.reverse = true; break;
+                case 'S': options.sort = SORT_SIZE; break;
+                case 't': options.sort = SORT_TIME; break;
+                default: throw invalid_argument("unknown option");
+                }
+            }
+        } else {
+            path = args.str(i);
+        }
+    }
+    list_directory(path, options);
+}
+
+// One deque per worker. A worker takes from the front of its own deque and,
+// once that is empty, steals from the back of another's.
+template<class T>
+class StealingQueue {
+public:
+    explicit StealingQueue(size_t workers) : queues(workers) {}
+
+    void push(size_t worker, T item) {
+        lock_guard<mutex> lock(queues[worker].m);
+        queues[worker].items.push_back(move(item));
+    }
+
+    bool pop(size_t worker, T& item) {
+        {
+            Deque& own = queues[worker];
+            lock_guard<mutex> lock(own.m);
+            if (!own.items.empty()) {
+                item = move(own.items.front());
+                own.items.pop_front();
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++) {
+            Deque& victim = queues[(worker + k) % queues.size()];
+            lock_guard<mutex> lock(victim.m);
+            if (victim.items.empty()) continue;
+            item = move(victim.items.back());
+            victim.items.pop_back();
+            steals++;
+            return true;
+        }
+        return false;
+    }
+
+    atomic<size_t> steals{0};
+
+private:
+    struct Deque {
+        mutex m;
+        deque<T> items;
+    };
+    vector<Deque> queues;
+};
+
+// Shell glob as used by find -name and .gitignore: *, ?, [set], [!set] and
+// backslash escapes. With slash_stops, * and ? do not cross '/', and only
+// "**" matches across directories ("a/**/b" also matches "a/b").
+bool glob_match(const char* p, const char* t, bool slash_stops, bool fold = false) {
+    const unsigned char* lower = fold_table.lower;
+    while (*p) {
+        if (*p == '*') {
+            int stars = 0;
+            while (*p == '*') {
+                p++;
+                stars++;
+            }
+            bool across = !slash_stops || stars > 1;
+            if (across && slash_stops && *p == '/') {
+                p++;
+                if (glob_match(p, t, slash_stops, fold)) return true;
+                for (; *t; t++) {
+                    if (*t == '/' && glob_match(p, t + 1, slash_stops, fold)) return true;
+                }
+                return false;
+            }
+            if (!*p) return across || !strchr(t, '/');
+            for (; *t; t++) {
+                if (glob_match(p, t, slash_stops, fold)) return true;
+                if (!across && *t == '/') return false;
+            }
+            return false;
+        }
+        if (!*t) return false;
+        if (*p == '?') {
+            if (slash_stops && *t == '/') return false;
+        } else if (*p == '[' && strchr(p + 1, ']')) {
+            const char* q = p + 1;
+            bool negate = *q == '!' || *q == '^';
+            if (negate) q++;
+            bool matched = false;
+            unsigned char c = fold ? lower[(unsigned char)*t] : (unsigned char)*t;
+            // A ']' right after the opening bracket is a member, not the end.
+            do {
+                unsigned char lo = fold ? lower[(unsigned char)*q] : (unsigned char)*q, hi = lo;
+                if (q[1] == '-' && q[2] && q[2] != ']') {
+                    hi = fold ? lower[(unsigned char)q[2]] : (unsigned char)q[2];
+                    q += 2;
+                }
+                if (c >= lo && c <= hi) matched = true;
+                q++;
+            } while (*q && *q != ']');
+            if (!*q || matched == negate) return false;
+            p = q;
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            if (fold ? lower[(unsigned char)*p] != lower[(unsigned char)*t] : *p != *t) return false;
+        }
+        p++;
+        t++;
+    }
+    return !*t;
+}
+
+// The rules of one .gitignore file, chained to those of the directories
+// above it. The last matching rule wins and a deeper file overrides a
+// shallower one, as in git.
+struct IgnoreRules {
+    struct Rule {
+        string glob;
+        bool negate = false;
+        bool dir_only = false;      // trailing '/'
+        bool anchored = false;      // contains '/': matched against the path, not the name
+    };
+
+    shared_ptr<const IgnoreRules> parent;
+    string base;                    // directory of the file relative to the walk root, "" at the root
+    vector<Rule> rules;
+
+    void parse(string_view text) {
+        while (!text.empty()) {
+            size_t eol = text.find('\n');
+            string_view line = text.substr(0, eol);
+            text = eol == string_view::npos ? string_view() : text.substr(eol + 1);
+            while (!line.empty() && (line.back() == '\r' || (line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\')))) {
+                line.remove_suffix(1);
+            }
+            if (line.empty() || line[0] == '#') continue;
+            Rule rule;
+            if (line[0] == '!') {
+                rule.negate = true;
+                line.remove_prefix(1);
+            } else if (line[0] == '\\' && line.size() > 1 && (line[1] == '#' || line[1] == '!')) {
+                line.remove_prefix(1);
+            }
+            if (!line.empty() && line.back() == '/') {
+                rule.dir_only = true;
+                line.remove_suffix(1);
+            }
+            if (line.find('/') != string_view::npos) rule.anchored = true;
+            if (!line.empty() && line[0] == '/') line.remove_prefix(1);
+            if (line.empty()) continue;
+            rule.glob = string(line);
+            rules.push_back(move(rule));
+        }
+    }
+
+    // rel is the entry's path relative to the walk root, name its last part.
+    bool ignored(const string& rel, const string& name, bool is_dir) const {
+        for (const IgnoreRules* level = this; level; level = level->parent.get()) {
+            const char* sub = rel.c_str();
+            if (!level->base.empty()) sub += level->base.size() + 1;
+            for (size_t i = level->rules.size(); i-- > 0;) {
+                const Rule& rule = level->rules[i];
+                if (rule.dir_only && !is_dir) continue;
+                if (glob_match(rule.glob.c_str(), rule.anchored ? sub : name.c_str(), true)) return !rule.negate;
+            }
+        }
+        return false;
+    }
+};
+
+struct WalkOptions {
+    unsigned threads = 0;       // 0: one per CPU
+    bool gitignore = false;     // honour .gitignore files and skip .git
+    bool sorted = false;        // hold all output and print it sorted by key
+    int max_depth = -1;         // -1: no limit; 0: the roots only
+};
+
+// Parallel directory walker for find and grep -r. Each directory is a work
+// item on a StealingQueue: a worker lists it with its own getdents buffer,
+// reports every entry to visit() and queues the subdirectories on its own
+// deque, so idle workers steal whole subtrees from busy ones. Symbolic
+// links are reported but not followed.
+//
+// visit() runs on the workers. What it writes with output() is collected
+// per worker and handed to the caller's sink after each directory, or,
+// when sorted, kept and printed in key order at the end.
+class TreeWalker {
+public:
+    function<void(unsigned worker, const string& path, const ListEntry& entry, int depth)> visit;
+
+    // command prefixes the error messages.
+    TreeWalker(const WalkOptions& options, const char* command)
+        : options(options), command(command), sink(out()), errors(err()),
+          workers(options.threads ? options.threads : max(1u, thread::hardware_concurrency())),
+          buffers(workers), held(workers) {}
+
+    unsigned worker_count() const { return workers; }
+
+    void output(unsigned worker, const string& key, string_view text) {
+        if (options.sorted) held[worker].emplace_back(key, string(text));
+        else buffers[worker].append(text.data(), text.size());
+    }
+
+    void error(const string& path, const char* reason) {
+        lock_guard<mutex> lock(output_lock);
+        errors.printf("%s: %s: %s\n", command, path.c_str(), reason);
+        failed = true;
+    }
+
+    // Returns false if anything could not be read.
+    bool run(const vector<string>& roots) {
+        interrupted = 0;
+        StealingQueue<WalkDir> queue(workers);
+        atomic<size_t> pending(0);
+        for (size_t i = 0; i < roots.size(); i++) {
+            ListEntry entry;
+            entry.name = roots[i];
+            if (!stat_root(roots[i], entry)) {
+                error(roots[i], strerror(errno));
+                continue;
+            }
+            visit(0, roots[i], entry, 0);
+            flush(0);
+            if (entry.is_dir && options.max_depth != 0) {
+                pending++;
+                queue.push(i % workers, WalkDir{ roots[i], "", 0, nullptr });
+            }
+        }
+
+        auto worker = [&](unsigned self) {
+            AlignedBuffer buffer(WALK_BUFFER_SIZE);
+            vector<ListEntry> entries;
+            WalkDir dir;
+            while (true) {
+                // Read before trying the queues, so work queued after a
+                // failed pop always counts as new.
+                size_t seen;
+                {
+                    lock_guard<mutex> lock(idle_lock);
+                    seen = posts;
+                }
+                if (queue.pop(self, dir)) {
+                    if (!interrupted) list(self, dir, buffer.data, entries, queue, pending);
+                    if (--pending == 0) post();
+                    continue;
+                }
+                // Someone is still listing and may queue more.
+                unique_lock<mutex> lock(idle_lock);
+                work_posted.wait(lock, [&]() { return posts != seen || pending == 0; });
+                if (pending == 0) break;
+            }
+            flush(self);
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < workers; t++) pool.emplace_back(worker, t);
+        worker(0);
+        for (auto& t : pool) t.join();
+        steals = queue.steals;
+
+        if (options.sorted) {
+            vector<pair<string, string>> all;
+            for (auto& lines : held) {
+                move(lines.begin(), lines.end(), back_inserter(all));
+                lines.clear();
+            }
+            sort(all.begin(), all.end());
+            for (const auto& item : all) sink.put(item.second);
+        }
+        return !failed;
+    }
+
+    size_t steals = 0;
+
+private:
+    static const size_t WALK_BUFFER_SIZE = 256 << 10;
+
+    struct WalkDir {
+        string path;
+        string rel;                 // relative to the root, for .gitignore
+        int depth;
+        shared_ptr<const IgnoreRules> rules;
+    };
+
+    const WalkOptions options;
+    const char* command;
+    OutputSink& sink;
+    OutputSink& errors;
+    unsigned workers;
+    mutex output_lock;
+    vector<string> buffers;
+    vector<vector<pair<string, string>>> held;
+    atomic<bool> failed{false};
+    mutex idle_lock;
+    condition_variable work_posted;
+    size_t posts = 0;               // bumped when directories are queued or the walk ends
+
+    // Wakes idle workers to look at the queues again.
+    void post() {
+        {
+            lock_guard<mutex> lock(idle_lock);
+            posts++;
+        }
+        work_posted.notify_all();
+    }
+
+    void flush(unsigned worker) {
+        string& buffer = buffers[worker];
+        if (buffer.empty()) return;
+        lock_guard<mutex> lock(output_lock);
+        sink.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    static bool stat_root(const string& path, ListEntry& entry) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        entry.is_dir = S_ISDIR(st.st_mode);
+        entry.size = st.st_size;
+        return true;
+    }
+
+    // Lists dir into entries with every type known, and reads its
+    // .gitignore into gitignore when asked to.
+    bool read_dir(const string& path, char* buffer, vector<ListEntry>& entries, string* gitignore) {
+#ifdef _WIN32
+        (void)buffer;
+        if (!scan_directory(path, entries, false)) return false;
+        if (gitignore) {
+            ifstream file(path + "/.gitignore", ios::binary);
+            if (file) gitignore->assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        }
+        return true;
+#else
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return false;
+        vector<size_t> unknown;
+        read_dirents(fd, buffer, WALK_BUFFER_SIZE, entries, unknown);
+        for (size_t i : unknown) {
+            struct stat st;
+            if (fstatat(fd, entries[i].name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                entries[i].is_dir = S_ISDIR(st.st_mode);
+                entries[i].is_link = S_ISLNK(st.st_mode);
+            }
+        }
+        if (gitignore) {
+            int file = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+            if (file >= 0) {
+                char chunk[4096];
+                long n;
+                while ((n = read(file, chunk, sizeof(chunk))) > 0) gitignore->append(chunk, n);
+                close(file);
+            }
+        }
+        close(fd);
+        return true;
+#endif
+    }
+
+    void list(unsigned self, const WalkDir& dir, char* buffer, vector<ListEntry>& entries,
+              StealingQueue<WalkDir>& queue, atomic<size_t>& pending) {
+        entries.clear();
+        string gitignore;
+        if (!read_dir(dir.path, buffer, entries, options.gitignore ? &gitignore : nullptr)) {
+            error(dir.path, strerror(errno));
+            return;
+        }
+        shared_ptr<const IgnoreRules> rules = dir.rules;
+        if (!gitignore.empty()) {
+            auto own = make_shared<IgnoreRules>();
+            own->parent = dir.rules;
+            own->base = dir.rel;
+            own->parse(gitignore);
+            rules = move(own);
+        }
+
+        const int depth = dir.depth + 1;
+        const bool descend = options.max_depth < 0 || depth < options.max_depth;
+        string prefix = dir.path;
+        if (prefix.back() != '/') prefix += '/';
+        bool queued = false;
+        for (const ListEntry& entry : entries) {
+            string rel;
+            if (options.gitignore) {
+                if (entry.is_dir && entry.name == ".git") continue;
+                rel = dir.rel.empty() ? entry.name : dir.rel + "/" + entry.name;
+                if (rules && rules->ignored(rel, entry.name, entry.is_dir)) continue;
+            }
+            string path = prefix + entry.name;
+            visit(self, path, entry, depth);
+            if (entry.is_dir && !entry.is_link && descend) {
+                pending++;
+                queue.push(self, WalkDir{ move(path), move(rel), depth, rules });
+                queued = true;
+            }
+        }
+        if (queued) post();
+        flush(self);
+    }
+};
+
+// Reads "-j N", "--gitignore" and "--sort" for find and grep; returns
+// false if args[i] is none of them.
+bool parse_walk_option(const Args& args, size_t& i, WalkOptions& options) {
+    if (args[i] == "--gitignore") options.gitignore = true;
+    else if (args[i] == "--sort") options.sorted = true;
+    else if (args[i] == "-j" && i + 1 < args.size()) options.threads = stoul(args.str(++i));
+    else return false;
+    return true;
+}
+
+// find [path...] [-name GLOB] [-iname GLOB] [-type f|d|l] [-maxdepth N]
+//      [-mindepth N] [--gitignore] [--sort] [-j N]
+// Anything else goes to the system find.
+void find_command(const Args& args) {
+    WalkOptions options;
+    vector<string> roots;
+    string name;
+    bool fold = false;
+    char type = 0;
+    int min_depth = 0;
+    size_t i = 1;
+    for (; i < args.size() && (args[i].empty() || args[i][0] != '-'); i++) roots.push_back(args.str(i));
+    try {
+        for (; i < args.size(); i++) {
+            if (parse_walk_option(args, i, options)) continue;
+            if ((args[i] == "-name" || args[i] == "-iname") && i + 1 < args.size()) {
+                fold = args[i] == "-iname";
+                name = args.str(++i);
+            } else if (args[i] == "-type" && i + 1 < args.size() && args[i + 1].size() == 1 && strchr("fdl", args[i + 1][0])) {
+                type = args[++i][0];
+            } else if (args[i] == "-maxdepth" && i + 1 < args.size()) {
+                options.max_depth = stoi(args.str(++i));
+            } else if (args[i] == "-mindepth" && i + 1 < args.size()) {
+                min_depth = stoi(args.str(++i));
+            } else if (args[i] != "-print") {
+                break;
+            }
+        }
+    } catch (const exception&) {
+        cerr << "find: invalid number for " << args[i - 1] << endl;
+        last_status = 1;
+        return;
+    }
+    if (i < args.size()) {
+        last_status = runExternal(args.to_vector());
+        return;
+    }
+    if (roots.empty()) roots.push_back(".");
+
+    TreeWalker walker(options, "find");
+    walker.visit = [&](unsigned worker, const string& path, const ListEntry& entry, int depth) {
+        if (depth < min_depth) return;
+        if (type == 'f' && (entry.is_dir || entry.is_link)) return;
+        if (type == 'd' && !entry.is_dir) return;
+        if (type == 'l' && !entry.is_link) return;
+        if (!name.empty() && !glob_match(name.c_str(), entry.name.c_str(), false, fold)) return;
+        string line = path;
+        line += '\n';
+        walker.output(worker, path, line);
+    };
+    last_status = walker.run(roots) ? 0 : 1;
+}
+
+// A grep pattern. Literals (-F, or a regular expression without special
+// characters) are found with the scan kernel: candidate first bytes come
+// from the vector search and the rest is compared directly, folding case
+// with -i. Other expressions go to std::regex, but only for lines that
+// contain the longest literal run the expression requires, when it has one.
+class GrepMatcher {
+public:
+    bool compile(const string& pattern, bool fixed, bool ignore_case, string& error) {
+        fold = ignore_case;
+        const char* special = ".[]()*+?{}^$\\|";
+        use_regex = !fixed && pattern.find_first_of(special) != string::npos;
+        literal = use_regex ? required_literal(pattern) : pattern;
+        if (fold) {
+            for (char& c : literal) c = (char)fold_table.lower[(unsigned char)c];
+        }
+        if (use_regex) {
+            try {
+                auto flags = regex::ECMAScript | regex::optimize;
+                if (ignore_case) flags |= regex::icase;
+                expression = regex(pattern, flags);
+            } catch (const regex_error& e) {
+                error = e.what();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Calls on_line(begin, end) for each matching line of [data, data + size)
+    // until it returns false. end excludes the newline.
+    template<class F>
+    void scan(const char* data, size_t size, F on_line) const {
+        const char* limit = data + size;
+        if (literal.empty()) {
+            for (const char* line = data; line < limit;) {
+                const char* eol = (const char*)memchr(line, '\n', limit - line);
+                if (!eol) eol = limit;
+                if (match_line(line, eol) && !on_line(line, eol)) return;
+                line = eol + 1;
+            }
+            return;
+        }
+        const unsigned char* lower = fold_table.lower;
+        const unsigned char first = (unsigned char)literal[0];
+        const bool fold_first = fold && first >= 'a' && first <= 'z';
+        const size_t len = literal.size();
+        for (const char* p = data; p < limit;) {
+            p += scan_kernel.find(p, limit - p, first, fold_first);
+            if (p >= limit) break;
+            if ((size_t)(limit - p) < len) break;
+            size_t k = 1;
+            if (fold) while (k < len && lower[(unsigned char)p[k]] == (unsigned char)literal[k]) k++;
+            else while (k < len && p[k] == literal[k]) k++;
+            if (k < len) {
+                p++;
+                continue;
+            }
+            const char* line = p;
+            while (line > data && line[-1] != '\n') line--;
+            const char* eol = (const char*)memchr(p, '\n', limit - p);
+            if (!eol) eol = limit;
+            if ((!use_regex || regex_search(line, eol, expression)) && !on_line(line, eol)) return;
+            p = eol + 1;
+        }
+    }
+
+private:
+    string literal;
+    bool fold = false;
+    bool use_regex = false;
+    regex expression;
+
+    bool match_line(const char* begin, const char* end) const {
+        return !use_regex || regex_search(begin, end, expression);
+    }
+
+    // Longest run of plain characters every match must contain. Gives up on
+    // alternation and groups; a character followed by a quantifier that
+    // allows zero of it ends the run without being part of it.
+    static string required_literal(const string& pattern) {
+        if (pattern.find_first_of("|(") != string::npos) return "";
+        string best, run;
+        auto end_run = [&]() {
+            if (run.size() > best.size()) best = run;
+            run.clear();
+        };
+        for (size_t i = 0; i < pattern.size(); i++) {
+            char c = pattern[i];
+            if (c == '*' || c == '?' || c == '{') {
+                if (!run.empty()) run.pop_back();
+                end_run();
+                if (c == '{') i = min(pattern.find('}', i), pattern.size() - 1);
+            } else if (c == '+') {
+                end_run();
+            } else if (c == '[') {
+                end_run();
+                size_t close = pattern.find(']', i + 2);
+                i = close == string::npos ? pattern.size() : close;
+            } else if (c == '\\' && i + 1 < pattern.size() && strchr(".[]()*+?{}^$\\|/-", pattern[i + 1])) {
+                run += pattern[++i];
+            } else if (c == '\\' || c == '.' || c == '^' || c == '$') {
+                if (c == '\\') i++;
+                end_run();
+            } else {
+                run += c;
+            }
+        }
+        end_run();
+        return best;
+    }
+};
+
+struct GrepOptions {
+    bool recursive = false;
+    bool ignore_case = false;
+    bool fixed = false;
+    bool line_numbers = false;
+    bool count_only = false;
+    bool files_only = false;
+    bool invert = false;
+    bool with_names = false;
+    bool no_names = false;
+    WalkOptions walk;
+};
+
+// Greps one buffer, appending what grep prints for it to text. Returns the
+// number of matching (or, with -v, non-matching) lines.
+size_t grep_buffer(const GrepMatcher& matcher, const GrepOptions& options, const string& name,
+                   const char* data, size_t size, string& text, size_t first_line = 1) {
+    size_t matches = 0;
+    size_t line_no = first_line;
+    const char* counted = data;
+    const bool names = options.with_names && !options.no_names;
+    auto print = [&](const char* begin, const char* end) {
+        if (names) {
+            text += name;
+            text += ':';
+        }
+        if (options.line_numbers) {
+            line_no += count(counted, begin, '\n');
+            counted = begin;
+            char digits[24];
+            text.append(digits, to_chars(digits, digits + sizeof(digits), line_no).ptr - digits);
+            text += ':';
+        }
+        text.append(begin, end);
+        text += '\n';
+    };
+
+    // Binary files (a NUL early on) only say whether they match.
+    const bool binary = size && memchr(data, '\0', min<size_t>(size, 8192));
+    const bool print_lines = !options.count_only && !options.files_only && !binary;
+    const bool stop_at_first = options.files_only || (binary && !options.count_only);
+    if (!options.invert) {
+        matcher.scan(data, size, [&](const char* begin, const char* end) {
+            matches++;
+            if (print_lines) print(begin, end);
+            return !stop_at_first;
+        });
+    } else {
+        const char* next = data;
+        const char* limit = data + size;
+        auto emit_until = [&](const char* stop) {
+            while (next < stop) {
+                const char* eol = (const char*)memchr(next, '\n', stop - next);
+                if (!eol) eol = stop;
+                matches++;
+                if (print_lines) print(next, eol);
+                next = eol + 1;
+                if (stop_at_first) return false;
+            }
+            return true;
+        };
+        bool more = true;
+        matcher.scan(data, size, [&](const char* begin, const char* end) {
+            more = emit_until(begin);
+            next = end + 1;
+            return more;
+        });
+        if (more) emit_until(limit);
+    }
+    if (binary && matches && !options.count_only && !options.files_only) text += "Binary file " + name + " matches\n";
+    if (options.files_only && matches) text += name + "\n";
+    if (options.count_only) {
+        if (names) text += name + ":";
+        text += to_string(matches) + "\n";
+    }
+    return matches;
+}
+
+// Small files are read into buffer, since mapping and unmapping them costs
+// more than the copy; larger ones are mapped into file.
+bool load_grep_file(const string& path, string& buffer, MappedFile& file, string_view& data) {
+#ifndef _WIN32
+    const size_t SMALL_FILE = 256 << 10;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < SMALL_FILE) {
+        buffer.resize(st.st_size);
+        size_t total = 0;
+        long n;
+        while (total < buffer.size() && (n = read(fd, &buffer[total], buffer.size() - total)) > 0) total += n;
+        close(fd);
+        data = string_view(buffer.data(), total);
+        return true;
+    }
+    close(fd);
+#else
+    (void)buffer;
+#endif
+    if (!file.open(path)) return false;
+    data = string_view(file.data, file.size);
+    return true;
+}
+
+// grep without files: reads the input in 1 MiB chunks and greps the
+// complete lines of each as it arrives.
+size_t grep_input(const GrepMatcher& matcher, const GrepOptions& options) {
+    GrepOptions streaming = options;
+    streaming.count_only = false;
+    streaming.files_only = false;
+    string pending, text;
+    vector<char> chunk(1 << 20);
+    size_t matches = 0, line_no = 1;
+    bool more = true;
+    while (more) {
+        long n = in().read(chunk.data(), chunk.size());
+        more = n > 0;
+        if (more) pending.append(chunk.data(), n);
+        size_t end = pending.size();
+        if (more) {
+            end = pending.rfind('\n');
+            if (end == string::npos) continue;
+            end++;
+        }
+        size_t found = grep_buffer(matcher, streaming, "(standard input)", pending.data(), end, text, line_no);
+        matches += found;
+        if (options.line_numbers) line_no += count(pending.data(), pending.data() + end, '\n');
+        if (!options.count_only && !options.files_only) out().put(text);
+        text.clear();
+        pending.erase(0, end);
+        if (options.files_only && matches) break;
+    }
+    if (options.files_only && matches) cout << "(standard input)" << '\n';
+    if (options.count_only) cout << matches << '\n';
+    return matches;
+}
+
+// grep [-r] [-i] [-v] [-n] [-c] [-l] [-F] [-E] [-H|-h] [--gitignore] [--sort]
+//      [-j N] <pattern> [path...]
+// Files, and with -r whole trees on the parallel walker; other options go
+// to the system grep.
+void grep_command(const Args& args) {
+    GrepOptions options;
+    string pattern;
+    bool have_pattern = false;
+    vector<string> paths;
+    bool options_done = false;
+    try {
+        for (size_t i = 1; i < args.size(); i++) {
+            string_view arg = args[i];
+            if (options_done || arg.size() < 2 || arg[0] != '-') {
+                if (!have_pattern) {
+                    pattern = string(arg);
+                    have_pattern = true;
+                } else {
+                    paths.emplace_back(arg);
+                }
+                continue;
+            }
+            if (arg == "--") {
+                options_done = true;
+                continue;
+            }
+            if (parse_walk_option(args, i, options.walk)) continue;
+            if (arg == "-e" && i + 1 < args.size() && !have_pattern) {
+                pattern = args.str(++i);
+                have_pattern = true;
+                continue;
+            }
+            for (char flag : arg.substr(1)) {
+                switch (flag) {
+                case 'r': case 'R': options.recursive = true; break;
+                case 'i': options.ignore_case = true; break;
+                case 'v': options.invert = true; break;
+                case 'n': options.line_numbers = true; break;
+                case 'c': options.count_only = true; break;
+                case 'l': options.files_only = true; break;
+                case 'F': options.fixed = true; break;
+                case 'E': break;
+                case 'H': options.with_names = true; break;
+                case 'h': options.no_names = true; break;
+                default: throw invalid_argument("unknown option");
+                }
+            }
+        }
+    } catch (const exception&) {
+        last_status = runExternal(args.to_vector());
+        return;
+    }
+    if (!have_pattern) {
+        cerr << "Usage: grep [-rivnclFHh] [--gitignore] [--sort] [-j N] <pattern> [path...]" << endl;
+        last_status = 2;
+        return;
+    }
+
+    GrepMatcher matcher;
+    string error;
+    if (!matcher.compile(pattern, options.fixed, options.ignore_case, error)) {
+        cerr << "grep: " << error << endl;
+        last_status = 2;
+        return;
+    }
+    // With no path -r searches ".", and names files without the "./".
+    bool implicit_root = paths.empty() && options.recursive;
+    if (implicit_root) paths.push_back(".");
+    if (paths.empty()) {
+        last_status = grep_input(matcher, options) ? 0 : 1;
+        return;
+    }
+    // Like GNU grep: names once there are several files, which a directory
+    // searched with -r may hold.
+    if (paths.size() > 1 || (options.recursive && is_directory(paths[0]))) options.with_names = true;
+
+    if (!options.recursive) options.walk.max_depth = 0;
+    atomic<size_t> matched(0);
+    TreeWalker walker(options.walk, "grep");
+    vector<string> texts(walker.worker_count()), contents(walker.worker_count());
+    walker.visit = [&](unsigned worker, const string& path, const ListEntry& entry, int depth) {
+        if (entry.is_dir) {
+            if (depth == 0 && !options.recursive) walker.error(path, "Is a directory");
+            return;
+        }
+        if (entry.is_link && depth > 0) return;
+        MappedFile file;
+        string_view data;
+        if (!load_grep_file(path, contents[worker], file, data)) {
+            walker.error(path, strerror(errno));
+            return;
+        }
+        string& text = texts[worker];
+        string stripped;
+        const string& name = (implicit_root && depth > 0) ? (stripped = path.substr(2)) : path;
+        if (grep_buffer(matcher, options, name, data.data(), data.size(), text)) matched++;
+        if (!text.empty()) walker.output(worker, name, text);
+        text.clear();
+    };
+    bool ok = walker.run(paths);
+    last_status = !ok ? 2 : matched ? 0 : 1;
+}
+
+void runPingCommand(const string &host) {
+#ifdef _WIN32
+    string command = "ping " + host;
+    system(command.c_str());
+#else
+    last_status = runExternal({"ping", "-c", "4", host});
+#endif
+}
+
+// Delayed and recurring commands. One scheduler thread sleeps on a
+// condition variable until the earliest task in a min-heap is due, then
+// starts the command as a background job running "shell -c <command>", so
+// the prompt never waits and builtins can be scheduled as well.
+struct ScheduledTask {
+    int id;
+    string command;
+    chrono::steady_clock::time_point due;
+    int interval;       // seconds between runs, 0 for a one-shot task
+    long runs;
+};
+
+class Scheduler {
+public:
+    int add(const string& command, chrono::steady_clock::time_point due, int interval) {
+        lock_guard<mutex> guard(lock);
+        int id = next_id++;
+        tasks[id] = { id, command, due, interval, 0 };
+        push(due, id);
+        if (!started) {
+            started = true;
+            thread(&Scheduler::loop, this).detach();
+        }
+        changed.notify_one();
+        return id;
+    }
+
+    bool cancel(int id) {
+        lock_guard<mutex> guard(lock);
+        // The heap entry stays behind and is skipped when it comes up.
+        return tasks.erase(id) > 0;
+    }
+
+    vector<ScheduledTask> snapshot() {
+        lock_guard<mutex> guard(lock);
+        vector<ScheduledTask> result;
+        for (const auto& entry : tasks) result.push_back(entry.second);
+        sort(result.begin(), result.end(), [](const ScheduledTask& a, const ScheduledTask& b) { return a.due < b.due; });
+        return result;
+    }
+
+private:
+    typedef pair<chrono::steady_clock::time_point, int> HeapEntry;
+
+    mutex lock;
+    condition_variable changed;
+    unordered_map<int, ScheduledTask> tasks;
+    vector<HeapEntry> heap;     // min-heap on due time
+    int next_id = 1;
+    bool started = false;
+
+    void push(chrono::steady_clock::time_point due, int id) {
+        heap.emplace_back(due, id);
+        push_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+    }
+
+    void loop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            if (heap.empty()) {
+                changed.wait(guard);
+                continue;
+            }
+            HeapEntry next = heap.front();
+            if (chrono::steady_clock::now() < next.first) {
+                changed.wait_until(guard, next.first);
+                continue;
+            }
+            pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+            heap.pop_back();
+
+            auto it = tasks.find(next.second);
+            if (it == tasks.end() || it->second.due != next.first) continue;
+            ScheduledTask& task = it->second;
+            task.runs++;
+            string command = task.command;
+            if (task.interval > 0) {
+                task.due += chrono::seconds(task.interval);
+                auto now = chrono::steady_clock::now();
+                if (task.due < now) task.due = now + chrono::seconds(task.interval);
+                push(task.due, task.id);
+            } else {
+                tasks.erase(it);
+            }
+
+            guard.unlock();
+            run_scheduled(command);
+            guard.lock();
+        }
+    }
+
+    static void run_scheduled(const string& command) {
+        ProcHandle handle;
+        ProcId pid;
+        if (spawnProcess({ self_executable(), "-c", command }, SpawnIO(), handle, pid)) {
+            addJob(command, { handle }, { pid });
+        } else {
+            cerr << "schedule: failed to start \"" << command << "\"\n";
+        }
+    }
+};
+
+// Never destroyed: the scheduler thread may still be waiting at exit.
+Scheduler& scheduler() {
+    static Scheduler* instance = new Scheduler();
+    return *instance;
+}
+
+// Parses HH:MM or HH:MM:SS and returns how many seconds remain until that
+// wall-clock time, today or tomorrow. Returns -1 if it is not a time.
+long seconds_until(string_view text) {
+    int hours, minutes, seconds = 0;
+    string value(text);
+    int used = 0, more = 0;
+    if (sscanf(value.c_str(), "%d:%d%n", &hours, &minutes, &used) != 2) return -1;
+    if (value[used] == ':' && sscanf(value.c_str() + used, ":%d%n", &seconds, &more) == 1) used += more;
+    if ((size_t)used != value.size()) return -1;
+    if (hours < 0 || hours > 23 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 59) return -1;
+
+    time_t now = time(nullptr);
+    tm local = *localtime(&now);
+    long current = local.tm_hour * 3600L + local.tm_min * 60L + local.tm_sec;
+    long target = hours * 3600L + minutes * 60L + seconds;
+    return (target > current) ? target - current : target - current + 24 * 3600L;
+}
+
+// Quotes a word so that it survives being parsed again by the lexer.
+string shell_quote(string_view word) {
+    bool plain = !word.empty();
+    for (char c : word) {
+        if (!isalnum((unsigned char)c) && !strchr("-_./:=,+%@", c)) plain = false;
+    }
+    if (plain) return string(word);
+    string quoted = "'";
+    for (char c : word) {
+        if (c == '\'') quoted += "'\"'\"'";
+        else quoted += c;
+    }
+    return quoted + "'";
+}
+
+// parallel runs one command per input with at most -j children at a time.
+// Inputs are dealt round-robin to one deque per worker. A worker takes from
+// the front of its own deque and, once that is empty, steals from the back
+// of another's, so one slow task does not hold up the items queued behind
+// it. Each task's stdout and stderr go through a pipe into a buffer, and
+// the calling thread prints the buffers in input order (or as tasks finish).
+struct ParallelOptions {
+    unsigned jobs = 0;          // concurrent children, 0 = one per CPU
+    bool keep_order = true;
+    int retries = 0;            // further attempts for a task that fails
+};
+
+struct ParallelTask {
+    vector<string> argv;
+    string output;
+    int status = 0;
+    int attempts = 0;
+    double latency_us = 0;      // first start to final exit
+    bool done = false;
+};
+
+// Runs one attempt of a task with its output captured. Returns the exit
+// status, 127 if the command could not be started.
+static int run_parallel_task(ParallelTask& task, IoHandle null_input, int jobId) {
+    IoHandle readEnd, writeEnd;
+    if (!createPipe(readEnd, writeEnd)) return 127;
+    SpawnIO io;
+    io.in = null_input;
+    io.out = writeEnd;
+    io.err = writeEnd;
+    ProcHandle handle;
+    ProcId pid;
+    bool started = spawnProcess(task.argv, io, handle, pid);
+    closeIo(writeEnd);
+    if (!started) {
+        closeIo(readEnd);
+        return 127;
+    }
+    jobProcessStarted(jobId, handle, pid);
+
+    task.output.clear();
+    char buffer[16384];
+    long n;
+    while ((n = readIo(readEnd, buffer, sizeof(buffer))) > 0) task.output.append(buffer, n);
+    closeIo(readEnd);
+
+    ProcUsage usage;
+    int status = waitProcessUsage(handle, usage);
+    child_totals.add(usage);
+    jobProcessFinished(jobId, pid, usage);
+    return status;
+}
+
+// Runs every task and prints their output. Returns how many failed after
+// all their attempts.
+size_t run_parallel(vector<ParallelTask>& tasks, const ParallelOptions& options, const string& command) {
+    if (tasks.empty()) return 0;
+    unsigned workers = options.jobs ? options.jobs : max(1u, thread::hardware_concurrency());
+    workers = (unsigned)min<size_t>(workers, tasks.size());
+
+    StealingQueue<size_t> queue(workers);
+    for (size_t i = 0; i < tasks.size(); i++) queue.push(i % workers, i);
+
+#ifdef _WIN32
+    IoHandle null_input = openRedirect("NUL", false);
+#else
+    IoHandle null_input = openRedirect("/dev/null", false);
+#endif
+    int jobId = beginJob(command);
+    mutex m;
+    condition_variable finished;
+    vector<size_t> completion_order;
+    size_t active = workers;
+    interrupted = 0;
+
+    auto worker = [&](size_t self) {
+        size_t index;
+        while (!interrupted && queue.pop(self, index)) {
+            ParallelTask& task = tasks[index];
+            auto start = chrono::steady_clock::now();
+            do {
+                task.status = run_parallel_task(task, null_input, jobId);
+                task.attempts++;
+            } while (task.status != 0 && task.attempts <= options.retries && !interrupted);
+            task.latency_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+            lock_guard<mutex> lock(m);
+            task.done = true;
+            completion_order.push_back(index);
+            finished.notify_one();
+        }
+        lock_guard<mutex> lock(m);
+        active--;
+        finished.notify_one();
+    };
+    vector<thread> threads;
+    for (unsigned i = 0; i < workers; i++) threads.emplace_back(worker, i);
+
+    // Print from this thread; a builtin's output may be redirected here.
+    OutputSink& sink = out();
+    size_t failed = 0;
+    size_t printed = 0;
+    unique_lock<mutex> lock(m);
+    while (printed < tasks.size()) {
+        size_t index;
+        if (options.keep_order) {
+            finished.wait(lock, [&]() { return tasks[printed].done || active == 0; });
+            if (!tasks[printed].done) break;
+            index = printed;
+        } else {
+            finished.wait(lock, [&]() { return printed < completion_order.size() || active == 0; });
+            if (printed == completion_order.size()) break;
+            index = completion_order[printed];
+        }
+        printed++;
+        lock.unlock();
+        ParallelTask& task = tasks[index];
+        if (task.status != 0) failed++;
+        sink.put(task.output);
+        string().swap(task.output);
+        lock.lock();
+    }
+    lock.unlock();
+    for (auto& t : threads) t.join();
+    closeIo(null_input);
+    endJob(jobId, failed ? 1 : 0);
+    failed += tasks.size() - printed;
+    if (verbosity > 0) {
+        cerr << "[DEBUG] parallel: " << tasks.size() << " tasks on " << workers << " workers, "
+             << queue.steals.load() << " stolen\n";
+    }
+    return failed;
+}
+
+// Substitutes an input into the command template: every {} is replaced,
+// and without any {} the input is appended as the last argument.
+static vector<string> expand_template(const vector<string>& words, const string& input) {
+    vector<string> argv;
+    bool placed = false;
+    for (const auto& word : words) {
+        string expanded;
+        size_t from = 0, at;
+        while ((at = word.find("{}", from)) != string::npos) {
+            expanded.append(word, from, at - from).append(input);
+            from = at + 2;
+            placed = true;
+        }
+        argv.push_back(expanded.append(word, from, string::npos));
+    }
+    if (!placed) argv.push_back(input);
+    return argv;
+}
+
+// A builtin that has to be a process of its own runs in a copy of the shell.
+vector<string> shell_argv(const vector<string>& argv) {
+    if (argv.empty() || !runs_in_shell(argv[0])) return argv;
+    string line;
+    for (const auto& word : argv) line += (line.empty() ? "" : " ") + shell_quote(word);
+    return { self_executable(), "-c", line };
+}
+
+// Builtins run in a copy of the shell, since tasks are separate processes.
+static vector<string> parallel_argv(const vector<string>& words, const string& input) {
+    return shell_argv(expand_template(words, input));
+}
+
+// parallel [-j N] [--completed] [--retries N] <command> [::: input...]
+// Without ::: the inputs are read from stdin, one per line.
+void parallel_command(const Args& args) {
+    ParallelOptions options;
+    size_t i = 1;
+    for (; i < args.size(); i++) {
+        if (args[i] == "-j" && i + 1 < args.size()) options.jobs = (unsigned)stoul(args.str(++i));
+        else if (args[i] == "--completed") options.keep_order = false;
+        else if (args[i] == "--retries" && i + 1 < args.size()) options.retries = stoi(args.str(++i));
+        else break;
+    }
+    vector<string> words;
+    for (; i < args.size() && args[i] != ":::"; i++) words.push_back(args.str(i));
+    if (words.empty()) {
+        cerr << "Usage: parallel [-j N] [--completed] [--retries N] <command> [::: input...]\n";
+        last_status = 2;
+        return;
+    }
+
+    vector<string> inputs;
+    if (i < args.size()) {
+        for (i++; i < args.size(); i++) inputs.push_back(args.str(i));
+    } else {
+        string data;
+        flush_output();
+        read_input(data);
+        size_t start = 0;
+        while (start < data.size()) {
+            size_t end = data.find('\n', start);
+            if (end == string::npos) end = data.size();
+            string line = data.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) inputs.push_back(line);
+            start = end + 1;
+        }
+    }
+
+    vector<ParallelTask> tasks(inputs.size());
+    for (size_t k = 0; k < inputs.size(); k++) tasks[k].argv = parallel_argv(words, inputs[k]);
+    size_t failed = run_parallel(tasks, options, join_args(args, 0, args.size()));
+    flush_output();
+    if (failed) cerr << "parallel: " << failed << " of " << tasks.size() << " tasks failed\n";
+    last_status = failed ? 1 : 0;
+}
+
+// Startup configuration. The rc file ($SHELL_RC, else ~/.shellrc) holds one
+// setting per line:
+//
+//   alias ll='ls -l'
+//   export EDITOR=vim
+//   function greet { echo hello $1 }
+//   prompt 'dev> '
+//   notes ~/notes.txt
+//   password secret
+//
+// Parsing yields settings that point into the rc text. They are written to
+// a binary snapshot next to the result cache ($SHELL_RC_SNAPSHOT overrides
+// the path; "0" turns snapshots off): a header stamped with the rc file's
+// size, mtime and hash, fixed-size records for everything but aliases, the
+// aliases as a frozen AliasTable, then the strings. The next start maps the
+// snapshot, applies the few records and hands the aliases to the table as
+// they are, so a start costs the same with ten aliases or ten thousand. If
+// only the mtime changed and the hash still matches, the snapshot is used
+// and restamped; any other change means a parse.
+enum RcKind : uint32_t { RC_ALIAS, RC_EXPORT, RC_FUNCTION, RC_PROMPT, RC_NOTES, RC_PASSWORD };
+
+struct RcSetting {
+    RcKind kind;
+    string_view name;           // empty for prompt, notes and password
+    string_view value;
+};
+
+struct RcSnapshotHeader {
+    char magic[4];              // "SHSN"
+    uint32_t version;
+    uint64_t rc_size;
+    int64_t rc_mtime_ns;
+    uint64_t rc_hash;
+    uint64_t records;
+    uint64_t aliases;
+    uint64_t alias_slots;
+    uint64_t strings;           // bytes of string data at the end
+};
+
+struct RcRecord {
+    uint32_t kind;
+    uint32_t name_offset;       // into the string data
+    uint32_t name_length;
+    uint32_t value_offset;
+    uint32_t value_length;
+};
+
+const uint32_t RC_SNAPSHOT_VERSION = 1;
+
+// Shell functions, from the rc file. A call runs the body as a command line
+// with $0..$9, $# and $@ replaced by the call's words. A builtin of the
+// same name wins.
+unordered_map<string, string> shell_functions;
+
+bool runs_in_shell(const string& name) {
+    return find_builtin(to_lower(name)) || (!shell_functions.empty() && shell_functions.count(name));
+}
+
+string rc_file_path() {
+    if (const char* path = getenv("SHELL_RC")) return path;
+#ifdef _WIN32
+    const char* home = getenv("USERPROFILE");
+#else
+    const char* home = getenv("HOME");
+#endif
+    return home ? string(home) + "/.shellrc" : string();
+}
+
+string rc_snapshot_path(const string& rc_path) {
+    if (const char* path = getenv("SHELL_RC_SNAPSHOT")) return strcmp(path, "0") == 0 ? string() : string(path);
+    const string& dir = result_cache().dir;
+    if (dir.empty()) return string();
+    char name[40];
+    snprintf(name, sizeof(name), "/startup-%016llx.snap", (unsigned long long)hash_bytes(rc_path.data(), rc_path.size()));
+    return dir + name;
+}
+
+void set_environment(const string& name, const string& value) {
+#ifdef _WIN32
+    _putenv_s(name.c_str(), value.c_str());
+#else
+    setenv(name.c_str(), value.c_str(), 1);
+#endif
+}
+
+void unset_environment(const string& name) {
+#ifdef _WIN32
+    _putenv_s(name.c_str(), "");
+#else
+    unsetenv(name.c_str());
+#endif
+}
+
+static string_view trim_blanks(string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r')) text.remove_suffix(1);
+    return text;
+}
+
+// One level of surrounding quotes, so that 'dev> ' keeps its blank.
+static string_view unquote(string_view text) {
+    if (text.size() >= 2 && (text[0] == '\'' || text[0] == '"') && text.back() == text[0]) {
+        return text.substr(1, text.size() - 2);
+    }
+    return text;
+}
+
+void parse_rc(string_view text, const string& path, vector<RcSetting>& settings) {
+    size_t number = 0;
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        string_view line = trim_blanks(text.substr(0, end));
+        text = end == string_view::npos ? string_view() : text.substr(end + 1);
+        number++;
+        if (line.empty() || line[0] == '#') continue;
+
+        size_t split = line.find_first_of(" \t");
+        string_view keyword = line.substr(0, split);
+        string_view rest = split == string_view::npos ? string_view() : trim_blanks(line.substr(split));
+        auto fail = [&](const char* reason) {
+            cerr << path << ":" << number << ": " << reason << "\n";
+        };
+        if (keyword == "alias" || keyword == "export") {
+            size_t eq = rest.find('=');
+            if (eq == string_view::npos || eq == 0) {
+                fail("expected name=value");
+                continue;
+            }
+            settings.push_back({ keyword == "alias" ? RC_ALIAS : RC_EXPORT, rest.substr(0, eq), unquote(rest.substr(eq + 1)) });
+        } else if (keyword == "function") {
+            size_t brace = rest.find('{');
+            string_view name = trim_blanks(rest.substr(0, brace));
+            if (brace == string_view::npos || name.empty() || rest.back() != '}') {
+                fail("expected function NAME { COMMANDS }");
+                continue;
+            }
+            string_view body = trim_blanks(rest.substr(brace + 1, rest.size() - brace - 2));
+            while (!body.empty() && (body.back() == ';' || body.back() == ' ')) body.remove_suffix(1);
+            settings.push_back({ RC_FUNCTION, name, body });
+        } else if (keyword == "prompt" || keyword == "notes" || keyword == "password") {
+            RcKind kind = keyword == "prompt" ? RC_PROMPT : keyword == "notes" ? RC_NOTES : RC_PASSWORD;
+            settings.push_back({ kind, string_view(), unquote(rest) });
+        } else {
+            fail(("unknown setting '" + string(keyword) + "'").c_str());
+        }
+    }
+}
+
+void apply_rc(const vector<RcSetting>& settings) {
+    for (const auto& setting : settings) {
+        switch (setting.kind) {
+        case RC_ALIAS: aliases.define(setting.name, setting.value); break;
+        case RC_EXPORT: set_environment(string(setting.name), string(setting.value)); break;
+        case RC_FUNCTION: shell_functions[string(setting.name)].assign(setting.value); break;
+        case RC_PROMPT: shellPrompt.assign(setting.value); break;
+        case RC_NOTES: notesFile.assign(setting.value); break;
+        case RC_PASSWORD: shellPassword.assign(setting.value); break;
+        }
+    }
+}
+
+// Written atomically, like result cache entries. The file may hold the
+// password, so it is only readable by its owner.
+bool store_rc_snapshot(const string& path, const FileIdentity& id, uint64_t hash, const vector<RcSetting>& settings) {
+    string strings;
+    vector<RcRecord> records;
+    vector<pair<string_view, string_view>> alias_list;
+    for (const auto& setting : settings) {
+        if (setting.kind == RC_ALIAS) {
+            alias_list.emplace_back(setting.name, setting.value);
+            continue;
+        }
+        RcRecord record;
+        record.kind = setting.kind;
+        record.name_offset = (uint32_t)strings.size();
+        record.name_length = (uint32_t)setting.name.size();
+        strings.append(setting.name);
+        record.value_offset = (uint32_t)strings.size();
+        record.value_length = (uint32_t)setting.value.size();
+        strings.append(setting.value);
+        records.push_back(record);
+    }
+    vector<AliasTable::FrozenAlias> frozen;
+    vector<int32_t> alias_slots;
+    AliasTable::freeze(alias_list, frozen, alias_slots, strings);
+    if (strings.size() > UINT32_MAX) return false;
+    RcSnapshotHeader header;
+    memcpy(header.magic, "SHSN", 4);
+    header.version = RC_SNAPSHOT_VERSION;
+    header.rc_size = id.size;
+    header.rc_mtime_ns = id.mtime_ns;
+    header.rc_hash = hash;
+    header.records = records.size();
+    header.aliases = frozen.size();
+    header.alias_slots = alias_slots.size();
+    header.strings = strings.size();
+
+    string temp = temp_path_for(path);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (fd < 0) return false;
+    bool written = write_all(fd, (const char*)&header, sizeof(header)) &&
+                   write_all(fd, (const char*)records.data(), records.size() * sizeof(RcRecord)) &&
+                   write_all(fd, (const char*)frozen.data(), frozen.size() * sizeof(AliasTable::FrozenAlias)) &&
+                   write_all(fd, (const char*)alias_slots.data(), alias_slots.size() * sizeof(int32_t)) &&
+                   write_all(fd, strings);
+    if (close(fd) != 0 || !written) {
+        remove(temp.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Settings and frozen aliases pointing into a mapped snapshot; false if its
+// sections do not add up. Frozen aliases are bounds-checked as they are
+// used.
+bool read_rc_snapshot(const MappedFile& snapshot, vector<RcSetting>& settings, AliasTable::Frozen& frozen) {
+    const RcSnapshotHeader& header = *(const RcSnapshotHeader*)snapshot.data;
+    uint64_t space = snapshot.size - sizeof(header);
+    if (header.records > space / sizeof(RcRecord) || header.aliases > space / sizeof(AliasTable::FrozenAlias) ||
+        header.alias_slots > space / sizeof(int32_t) || header.strings > space ||
+        header.records * sizeof(RcRecord) + header.aliases * sizeof(AliasTable::FrozenAlias) +
+        header.alias_slots * sizeof(int32_t) + header.strings != space ||
+        (header.alias_slots & (header.alias_slots - 1)) != 0 || (header.aliases && !header.alias_slots)) return false;
+    const RcRecord* records = (const RcRecord*)(snapshot.data + sizeof(header));
+    frozen.aliases = (const AliasTable::FrozenAlias*)(records + header.records);
+    frozen.count = header.aliases;
+    frozen.slots = (const int32_t*)(frozen.aliases + header.aliases);
+    frozen.slot_count = header.alias_slots;
+    const char* strings = (const char*)(frozen.slots + header.alias_slots);
+    frozen.strings = strings;
+    frozen.strings_size = header.strings;
+    settings.clear();
+    settings.reserve(header.records);
+    for (uint64_t i = 0; i < header.records; i++) {
+        const RcRecord& record = records[i];
+        if (record.kind > RC_PASSWORD || (uint64_t)record.name_offset + record.name_length > header.strings ||
+            (uint64_t)record.value_offset + record.value_length > header.strings) return false;
+        settings.push_back({ (RcKind)record.kind, string_view(strings + record.name_offset, record.name_length),
+                             string_view(strings + record.value_offset, record.value_length) });
+    }
+    return true;
+}
+
+// Same contents under a new mtime: only the header changes.
+void restamp_rc_snapshot(const string& path, const RcSnapshotHeader& header, const FileIdentity& id) {
+    RcSnapshotHeader stamped = header;
+    stamped.rc_mtime_ns = id.mtime_ns;
+    int fd = open(path.c_str(), O_WRONLY | O_BINARY);
+    if (fd < 0) return;
+    bool written = write_all(fd, (const char*)&stamped, sizeof(stamped));
+    if (close(fd) != 0 || !written) remove(path.c_str());     // parsed again next time
+}
+
+// What load_rc did, for --startup-profile.
+struct RcLoad {
+    string path;
+    const char* source = "none";    // "snapshot", "parsed" or "none"
+    size_t settings = 0;
+};
+
+RcLoad load_rc() {
+    RcLoad load;
+    load.path = rc_file_path();
+    FileIdentity id;
+    if (load.path.empty() || !file_identity(load.path, id)) return load;
+    string snapshot_path = rc_snapshot_path(load.path);
+
+    // Frozen aliases live in the mapping until the next load.
+    static MappedFile snapshot;
+    aliases.attach(AliasTable::Frozen());
+    snapshot.close();
+    const RcSnapshotHeader* header = nullptr;
+    if (!snapshot_path.empty() && snapshot.open(snapshot_path) && snapshot.size >= sizeof(RcSnapshotHeader)) {
+        header = (const RcSnapshotHeader*)snapshot.data;
+        if (memcmp(header->magic, "SHSN", 4) != 0 || header->version != RC_SNAPSHOT_VERSION || header->rc_size != id.size) {
+            header = nullptr;
+        }
+    }
+    vector<RcSetting> settings;
+    AliasTable::Frozen frozen;
+    MappedFile rc;
+    if (header && header->rc_mtime_ns == id.mtime_ns && read_rc_snapshot(snapshot, settings, frozen)) {
+        load.source = "snapshot";
+    } else if (rc.open(load.path)) {
+        string_view text(rc.data ? rc.data : "", rc.size);
+        uint64_t hash = hash_bytes(text.data(), text.size());
+        if (header && header->rc_hash == hash && read_rc_snapshot(snapshot, settings, frozen)) {
+            load.source = "snapshot";
+            restamp_rc_snapshot(snapshot_path, *header, id);
+        } else {
+            settings.clear();
+            frozen = AliasTable::Frozen();
+            parse_rc(text, load.path, settings);
+            load.source = "parsed";
+            if (!snapshot_path.empty()) {
+                if (!getenv("SHELL_RC_SNAPSHOT")) result_cache().make_directory();
+                store_rc_snapshot(snapshot_path, id, hash, settings);
+            }
+        }
+    }
+    apply_rc(settings);
+    if (frozen.count) aliases.attach(frozen);
+    load.settings = settings.size() + frozen.count;
+    return load;
+}
+
+// $1..$9 and $0 become the call's words, $@ and $* all of its arguments
+// and $# their number. Outside quotes a word is shell-quoted; inside double
+// quotes it is escaped for them. Nothing is replaced inside single quotes.
+string function_line(const string& body, const Args& args) {
+    string line;
+    char quote = 0;
+    auto append_word = [&](string_view word) {
+        if (quote != '"') {
+            line += shell_quote(word);
+            return;
+        }
+        for (char c : word) {
+            if (c == '"' || c == '\\' || c == '$') line += '\\';
+            line += c;
+        }
+    };
+    for (size_t i = 0; i < body.size(); i++) {
+        char c = body[i];
+        if (c == '\\' && quote != '\'' && i + 1 < body.size()) {
+            line += c;
+            line += body[++i];
+            continue;
+        }
+        if ((c == '\'' || c == '"') && (!quote || quote == c)) quote = quote ? 0 : c;
+        if (c != '$' || quote == '\'' || i + 1 == body.size()) {
+            line += c;
+            continue;
+        }
+        char next = body[i + 1];
+        if (next >= '0' && next <= '9') {
+            size_t n = next - '0';
+            if (n < args.size()) append_word(args[n]);
+        } else if (next == '@' || next == '*') {
+            for (size_t k = 1; k < args.size(); k++) {
+                if (k > 1) line += ' ';
+                append_word(args[k]);
+            }
+        } else if (next == '#') {
+            line += to_string(args.size() - 1);
+        } else {
+            line += c;
+            continue;
+        }
+        i++;
+    }
+    return line;
+}
+
+void run_function(const string& body, const Args& args) {
+    static thread_local int depth = 0;
+    if (depth >= 100) {
+        cerr << args[0] << ": maximum function nesting level exceeded\n";
+        last_status = 1;
+        return;
+    }
+    depth++;
+    run_command_line(function_line(body, args));
+    depth--;
+}
+
+// --startup-profile: where the time from process start to the first
+// command went, printed on stderr just before that command runs.
+struct StartupProfile {
+    bool enabled = false;
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    chrono::steady_clock::time_point last = start;
+    string report;
+
+    void mark(const string& phase) {
+        if (!enabled) return;
+        auto now = chrono::steady_clock::now();
+        char line[128];
+        snprintf(line, sizeof(line), "  %-30s %8.3f ms\n", phase.c_str(), chrono::duration<double, milli>(now - last).count());
+        report += line;
+        last = now;
+    }
+
+    void print() {
+        if (!enabled) return;
+        enabled = false;
+        flush_output();
+        cerr << "startup: " << fixed << setprecision(3)
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms\n" << report;
+        cerr.unsetf(ios::fixed);
+    }
+};
+
+StartupProfile startup_profile;
+
+void addNote(const string& note) {
+    ofstream out(notesFile, ios::app);
+    if (!out) {
+        cerr << "Unable to open notes file.\n";
+        return;
+    }
+    out << note << endl;
+    cout << "Note added.\n";
+}
+
+void viewNotes() {
+    ifstream in(notesFile);
+    string line;
+    OutputSink& sink = out();
+    sink << "Shell Notes:\n";
+    while (getline(in, line)) {
+        sink << "- " << line << '\n';
+    }
+}
+
+bool authenticateShell() {
+    string pass;
+    cout << "Enter shell password: ";
+    getline(cin, pass);
+    return pass == shellPassword;
+}
 
 void lockShell() {
     string pass;
@@ -584,60 +7587,1327 @@ void lockShell() {
     cout << "Shell unlocked.\n";
 }
 
+// Command instrumentation. Every command that goes through execute_command
+// is counted: calls, total and maximum latency, and a histogram with one
+// bucket per power of two microseconds. Builtins have a fixed slot each,
+// so timing one costs two clock reads and a few relaxed atomic adds.
+// Programs are looked up by name under a lock; that cost is small next to
+// a spawn. The most recent commands are also kept in a ring of trace
+// events, which "stats --trace" writes out as Chrome trace-event JSON
+// (chrome://tracing, Perfetto).
+const size_t MAX_BUILTINS = 128;
+const int LATENCY_BUCKETS = 24;         // the last one holds everything from 2^22 us (~4 s) up
+const size_t TRACE_CAPACITY = 1 << 16;
+
+bool command_stats_enabled = true;
+
+struct CommandCounter {
+    const char* name = nullptr;
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> total_ns{0};
+    atomic<uint64_t> max_ns{0};
+    atomic<uint64_t> buckets[LATENCY_BUCKETS] = {};
+
+    void record(uint64_t ns) {
+        calls.fetch_add(1, memory_order_relaxed);
+        total_ns.fetch_add(ns, memory_order_relaxed);
+        uint64_t seen = max_ns.load(memory_order_relaxed);
+        while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, memory_order_relaxed)) {}
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+        while (us && bucket < LATENCY_BUCKETS - 1) {
+            us >>= 1;
+            bucket++;
+        }
+        buckets[bucket].fetch_add(1, memory_order_relaxed);
+    }
+
+    void reset() {
+        calls = 0;
+        total_ns = 0;
+        max_ns = 0;
+        for (auto& bucket : buckets) bucket = 0;
+    }
+
+    // Upper bound in microseconds of the bucket holding the given fraction
+    // of calls.
+    uint64_t percentile_us(double fraction) const {
+        uint64_t wanted = (uint64_t)ceil(calls.load() * fraction), seen = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            seen += buckets[b].load();
+            if (seen >= wanted) return 1ull << b;
+        }
+        return 1ull << (LATENCY_BUCKETS - 1);
+    }
+};
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    int64_t start_us;       // since the shell started
+    uint32_t duration_us;
+    uint32_t thread;
+};
+
+struct CommandStats {
+    CommandCounter builtins[MAX_BUILTINS];
+    mutex programs_lock;
+    unordered_map<string, unique_ptr<CommandCounter>> programs;
+    TraceEvent trace[TRACE_CAPACITY];
+    atomic<uint64_t> trace_next{0};
+    atomic<uint32_t> next_thread{0};
+    const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+
+    CommandStats() {
+        for (const Builtin* b = builtins_begin(); b != builtins_end(); b++) builtins[b - builtins_begin()].name = b->name;
+    }
+
+    CommandCounter& program(const string& name) {
+        lock_guard<mutex> lock(programs_lock);
+        auto& counter = programs[name];
+        if (!counter) {
+            counter.reset(new CommandCounter());
+            counter->name = programs.find(name)->first.c_str();
+        }
+        return *counter;
+    }
+
+    uint32_t thread_number() {
+        static thread_local uint32_t number = ++next_thread;
+        return number;
+    }
+};
+
+CommandStats& command_stats() {
+    static CommandStats* stats = new CommandStats();
+    return *stats;
+}
+
+// Times one command into its counter and the trace ring.
+class CommandTimer {
+public:
+    CommandTimer(CommandCounter& counter, const char* category)
+        : counter(command_stats_enabled ? &counter : nullptr), category(category) {
+        if (this->counter) start = chrono::steady_clock::now();
+    }
+
+    ~CommandTimer() {
+        if (!counter) return;
+        auto end = chrono::steady_clock::now();
+        uint64_t ns = (uint64_t)chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+        counter->record(ns);
+        CommandStats& stats = command_stats();
+        TraceEvent& event = stats.trace[stats.trace_next.fetch_add(1, memory_order_relaxed) % TRACE_CAPACITY];
+        event.name = counter->name;
+        event.category = category;
+        event.start_us = chrono::duration_cast<chrono::microseconds>(start - stats.epoch).count();
+        event.duration_us = (uint32_t)min<uint64_t>(ns / 1000, UINT32_MAX);
+        event.thread = stats.thread_number();
+    }
+
+private:
+    CommandCounter* counter;
+    const char* category;
+    chrono::steady_clock::time_point start;
+};
+
+string format_latency(double us) {
+    char text[32];
+    if (us < 1) snprintf(text, sizeof(text), "%.0fns", us * 1000);
+    else if (us < 1000) snprintf(text, sizeof(text), "%.1fus", us);
+    else if (us < 1e6) snprintf(text, sizeof(text), "%.1fms", us / 1000);
+    else snprintf(text, sizeof(text), "%.2fs", us / 1e6);
+    return text;
+}
+
+// Counters that have been used, busiest (by total time) first.
+vector<const CommandCounter*> used_counters() {
+    CommandStats& stats = command_stats();
+    vector<const CommandCounter*> used;
+    for (const auto& counter : stats.builtins) {
+        if (counter.calls) used.push_back(&counter);
+    }
+    lock_guard<mutex> lock(stats.programs_lock);
+    for (const auto& program : stats.programs) {
+        if (program.second->calls) used.push_back(program.second.get());
+    }
+    sort(used.begin(), used.end(), [](const CommandCounter* a, const CommandCounter* b) {
+        return a->total_ns.load() > b->total_ns.load();
+    });
+    return used;
+}
+
+void print_command_stats(OutputSink& sink) {
+    auto used = used_counters();
+    sink << "Commands: instrumentation " << (command_stats_enabled ? "on" : "off") << '\n';
+    if (used.empty()) return;
+    sink.printf("  %-14s %8s %10s %10s %10s %10s\n", "command", "calls", "mean", "p50 <=", "p99 <=", "max");
+    for (const CommandCounter* counter : used) {
+        uint64_t calls = counter->calls;
+        sink.printf("  %-14s %8lu %10s %10s %10s %10s\n", counter->name, (unsigned long)calls,
+                    format_latency(counter->total_ns / 1000.0 / calls).c_str(),
+                    format_latency((double)counter->percentile_us(0.5)).c_str(),
+                    format_latency((double)counter->percentile_us(0.99)).c_str(),
+                    format_latency(counter->max_ns / 1000.0).c_str());
+    }
+}
+
+// One command's latency histogram; returns false if it has not run.
+bool print_command_histogram(OutputSink& sink, const string& name) {
+    const CommandCounter* counter = nullptr;
+    for (const CommandCounter* c : used_counters()) {
+        if (name == c->name) counter = c;
+    }
+    if (!counter) return false;
+    uint64_t peak = 0;
+    int first = LATENCY_BUCKETS, last = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        uint64_t n = counter->buckets[b];
+        if (!n) continue;
+        peak = max(peak, n);
+        first = min(first, b);
+        last = b;
+    }
+    sink << name << ": " << (unsigned long long)counter->calls.load() << " calls, "
+         << format_latency(counter->total_ns / 1000.0) << " total\n";
+    for (int b = first; b <= last; b++) {
+        uint64_t n = counter->buckets[b];
+        string range = b == 0 ? "< 1us" : "< " + format_latency((double)(1ull << b));
+        sink.printf("  %10s %8lu %s\n", range.c_str(), (unsigned long)n, string((size_t)(n * 40 / peak), '#').c_str());
+    }
+    return true;
+}
+
+void reset_command_stats() {
+    CommandStats& stats = command_stats();
+    for (auto& counter : stats.builtins) counter.reset();
+    lock_guard<mutex> lock(stats.programs_lock);
+    for (auto& program : stats.programs) program.second->reset();
+    stats.trace_next = 0;
+}
+
+// Writes the trace ring, oldest event first, as Chrome trace-event JSON.
+bool write_command_trace(const string& path) {
+    ofstream file(path, ios::binary);
+    if (!file) return false;
+    CommandStats& stats = command_stats();
+    uint64_t end = stats.trace_next;
+    uint64_t begin = end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0;
+#ifdef _WIN32
+    long pid = (long)GetCurrentProcessId();
+#else
+    long pid = (long)getpid();
+#endif
+    file << "{\"traceEvents\":[";
+    for (uint64_t i = begin; i < end; i++) {
+        const TraceEvent& event = stats.trace[i % TRACE_CAPACITY];
+        file << (i == begin ? "\n" : ",\n") << "{\"name\":\"";
+        for (const char* c = event.name; *c; c++) {
+            if (*c == '"' || *c == '\\') file << '\\';
+            if ((unsigned char)*c >= 0x20) file << *c;
+        }
+        file << "\",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"ts\":" << event.start_us
+             << ",\"dur\":" << event.duration_us << ",\"pid\":" << pid << ",\"tid\":" << event.thread << '}';
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return (bool)file;
+}
+
+// CPU time and context switches of the shell itself (whose threads run
+// builtins) plus those of its foreground children.
+struct ResourceSnapshot {
+    chrono::steady_clock::time_point wall;
+    uint64_t user_us = 0;
+    uint64_t sys_us = 0;
+    uint64_t voluntary = 0;
+    uint64_t involuntary = 0;
+    long self_rss_kb = 0;
+
+    static ResourceSnapshot take() {
+        ResourceSnapshot snapshot;
+        snapshot.wall = chrono::steady_clock::now();
+#ifdef _WIN32
+        FILETIME created, exited, kernel, user;
+        if (GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) {
+            snapshot.user_us = (((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime) / 10;
+            snapshot.sys_us = (((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 10;
+        }
+#else
+        rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            snapshot.user_us = ru.ru_utime.tv_sec * 1000000ull + ru.ru_utime.tv_usec;
+            snapshot.sys_us = ru.ru_stime.tv_sec * 1000000ull + ru.ru_stime.tv_usec;
+            snapshot.voluntary = ru.ru_nvcsw;
+            snapshot.involuntary = ru.ru_nivcsw;
+            snapshot.self_rss_kb = ru.ru_maxrss;
+        }
+#endif
+        snapshot.user_us += child_totals.user_us;
+        snapshot.sys_us += child_totals.sys_us;
+        snapshot.voluntary += child_totals.voluntary;
+        snapshot.involuntary += child_totals.involuntary;
+        return snapshot;
+    }
+};
+
+// "time <command>": prints what the command used on stderr when it goes
+// out of scope. The peak RSS is the largest foreground child's, or the
+// shell's own if the command ran entirely in-process.
+class TimeReport {
+public:
+    TimeReport() : saved_peak(child_totals.peak_rss_kb.exchange(0)), before(ResourceSnapshot::take()) {}
+
+    ~TimeReport() {
+        ResourceSnapshot after = ResourceSnapshot::take();
+        long peak = child_totals.peak_rss_kb;
+        long seen = peak;
+        while (saved_peak > seen && !child_totals.peak_rss_kb.compare_exchange_weak(seen, saved_peak)) {}
+        flush_output();
+        OutputSink& sink = err();
+        sink.printf("real    %.3fs\n", chrono::duration<double>(after.wall - before.wall).count());
+        sink.printf("user    %.3fs\n", (after.user_us - before.user_us) / 1e6);
+        sink.printf("sys     %.3fs\n", (after.sys_us - before.sys_us) / 1e6);
+#ifndef _WIN32
+        if (peak) sink.printf("maxrss  %ld KiB\n", peak);
+        else sink.printf("maxrss  %ld KiB (shell)\n", after.self_rss_kb);
+        sink.printf("csw     %lu voluntary, %lu involuntary\n",
+                    (unsigned long)(after.voluntary - before.voluntary),
+                    (unsigned long)(after.involuntary - before.involuntary));
+#endif
+        sink.flush();
+    }
+
+private:
+    long saved_peak;
+    ResourceSnapshot before;
+};
+
+// Micro-benchmarks, run with "bench <case> [args]"
+typedef void (*BenchFn)(const Args& args);
+
+struct BenchCase {
+    const char* name;
+    const char* usage;
+    BenchFn run;
+};
+
+double elapsed_us(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+void print_bench_line(const string& label, double total_us, long iterations) {
+    out().printf("  %-26s %10.1f ms total, %8.2f us/op\n", label.c_str(), total_us / 1000.0, total_us / iterations);
+}
+
+void bench_spawn(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench spawn: not supported on this platform\n";
+#else
+    long iterations = (args.size() > 2) ? stol(args.str(2)) : 10000;
+    if (iterations <= 0) return;
+
+    // "Before" is the old behaviour: every command went through a shell.
+    auto run = [iterations](const vector<string>& argv) {
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) runExternal(argv);
+        return elapsed_us(start);
+    };
+    double before = run({"/bin/sh", "-c", "true"});
+    double after = run({"true"});
+
+    cout << "spawn: " << iterations << " launches of 'true'\n";
+    print_bench_line("via /bin/sh -c (before)", before, iterations);
+    print_bench_line("posix_spawn (after)", after, iterations);
+    out().printf("  speedup: %.2fx\n", before / after);
+#endif
+}
+
+string bench_temp_path(const string& name) {
+    const char* tmp = getenv("TMPDIR");
+#ifdef _WIN32
+    if (!tmp) tmp = getenv("TEMP");
+#endif
+    return string(tmp ? tmp : "/tmp") + "/" + name;
+}
+
+// Creates a file of the given size filled with text-like data.
+bool bench_make_file(const string& path, long long bytes) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) return false;
+    string block;
+    while (block.size() < COPY_BUFFER_SIZE) block += "the quick brown fox jumps over the lazy dog 0123456789\n";
+    for (long long done = 0; done < bytes;) {
+        size_t n = (size_t)min<long long>(block.size(), bytes - done);
+        if (write(fd, block.data(), n) != (long)n) {
+            close(fd);
+            return false;
+        }
+        done += n;
+    }
+    close(fd);
+    return true;
+}
+
+#ifndef _WIN32
+// Times run() with the shell's stdout pointed at /dev/null, output flushed.
+double bench_to_null(const function<void()>& run) {
+    flush_output();
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int saved = dup(1);
+    dup2(null_fd, 1);
+    close(null_fd);
+    stdout_writer().refresh_mode();
+    auto start = chrono::steady_clock::now();
+    run();
+    flush_output();
+    fflush(stdout);
+    double us = elapsed_us(start);
+    dup2(saved, 1);
+    close(saved);
+    stdout_writer().refresh_mode();
+    return us;
+}
+#endif
+
+void bench_copy(const Args& args) {
+    long long megabytes = (args.size() > 2) ? stoll(args.str(2)) : 256;
+    if (megabytes <= 0) return;
+    string src = bench_temp_path("shell_bench_copy.src");
+    string dst = bench_temp_path("shell_bench_copy.dst");
+#ifdef _WIN32
+    const char* null_device = "NUL";
+#else
+    const char* null_device = "/dev/null";
+#endif
+    if (!bench_make_file(src, megabytes << 20)) {
+        cerr << "bench copy: cannot create " << src << endl;
+        return;
+    }
+
+    auto run = [&](const char* target, bool truncate, long long (*copier)(int, int)) {
+        int in = open(src.c_str(), O_RDONLY | O_BINARY);
+        int out = open(target, O_WRONLY | O_CREAT | O_BINARY | (truncate ? O_TRUNC : 0), 0644);
+        auto start = chrono::steady_clock::now();
+        long long copied = (in >= 0 && out >= 0) ? copier(in, out) : -1;
+        double us = elapsed_us(start);
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+        return (copied > 0) ? (copied / 1048576.0) / (us / 1e6) : 0.0;
+    };
+
+    cout << "copy: " << megabytes << " MB file (page cache warm)\n";
+    out().printf("  %-28s %10.1f MB/s\n", "file -> file, buffered", run(dst.c_str(), true, copy_buffered));
+    out().printf("  %-28s %10.1f MB/s\n", "file -> file, copy engine", run(dst.c_str(), true, copy_fd));
+    out().printf("  %-28s %10.1f MB/s\n", "file -> null, buffered", run(null_device, false, copy_buffered));
+    out().printf("  %-28s %10.1f MB/s\n", "file -> null, copy engine", run(null_device, false, copy_fd));
+    remove(src.c_str());
+    remove(dst.c_str());
+}
+
+// Output throughput: "cat" of a large file through the copy engine, then
+// the file printed line by line as notes and history do, once flushed per
+// line the way endl used to and once through the output writer.
+void bench_cat(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench cat: not supported on this platform\n";
+#else
+    long long megabytes = (args.size() > 2) ? stoll(args.str(2)) : 1024;
+    if (megabytes <= 0) return;
+    string src = bench_temp_path("shell_bench_cat.txt");
+    if (!bench_make_file(src, megabytes << 20)) {
+        cerr << "bench cat: cannot create " << src << endl;
+        return;
+    }
+    string command = "cat " + shell_quote(src);
+    double cat_us = bench_to_null([&]() { run_command_line(command); });
+
+    // Per-line flushing costs a write() per line, so it gets a bounded slice.
+    long long line_megabytes = min(megabytes, 128LL);
+    MappedFile file;
+    if (!file.open(src)) {
+        cerr << "bench cat: cannot map " << src << endl;
+        remove(src.c_str());
+        return;
+    }
+    size_t limit = (size_t)min<long long>(file.size, line_megabytes << 20);
+    long lines = 0;
+    auto each_line = [&](const function<void(const char*, size_t)>& emit) {
+        lines = 0;
+        const char* p = file.data;
+        const char* end = file.data + limit;
+        while (p < end) {
+            const char* nl = (const char*)memchr(p, '\n', end - p);
+            if (!nl) nl = end;
+            emit(p, nl - p);
+            lines++;
+            p = nl + 1;
+        }
+    };
+    double endl_us = bench_to_null([&]() {
+        each_line([](const char* line, size_t size) {
+            fwrite(line, 1, size, stdout);
+            fputc('\n', stdout);
+            fflush(stdout);
+        });
+    });
+    unsigned long long writes = stdout_writer().stats.writes;
+    double writer_us = bench_to_null([&]() {
+        OutputSink& sink = out();
+        each_line([&](const char* line, size_t size) {
+            sink.write(line, size);
+            sink.put('\n');
+        });
+    });
+    writes = stdout_writer().stats.writes - writes;
+    file.close();
+    remove(src.c_str());
+
+    auto rate = [](long long mb, double us) { return mb / (us / 1e6); };
+    cout << "cat: " << megabytes << " MB file to /dev/null (page cache warm)\n";
+    out().printf("  %-28s %10.1f MB/s\n", "cat (copy engine)", rate(megabytes, cat_us));
+    cout << "lines: " << lines << " lines (" << line_megabytes << " MB) to /dev/null\n";
+    out().printf("  %-28s %10.1f MB/s %10ld writes\n", "flush per line (before)", rate(line_megabytes, endl_us), lines);
+    out().printf("  %-28s %10.1f MB/s %10llu writes\n", "output writer (after)", rate(line_megabytes, writer_us), writes);
+    out().printf("  speedup: %.2fx\n", endl_us / writer_us);
+#endif
+}
+
+// calc over a column file: the old one-command-per-line use, then -f with
+// a compiled expression row by row and vectorized, and one expression per line.
+void bench_calc(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench calc: not supported on this platform\n";
+#else
+    long lines = (args.size() > 2) ? stol(args.str(2)) : 2000000;
+    if (lines <= 0) return;
+    string columns, expressions;
+    for (long i = 0; i < lines; i++) {
+        string a = to_string(i % 10007), b = to_string(i % 97) + ".5";
+        columns += a + " " + b + "\n";
+        expressions += a + " * " + b + " + 1\n";
+    }
+
+    long legacy_lines = min(lines, 100000L);
+    double legacy = bench_to_null([&]() {
+        for (long i = 0; i < legacy_lines; i++) {
+            run_command_line("calc " + to_string(i % 10007) + " * " + to_string(i % 97) + ".5");
+        }
+    });
+    CalcOptions options;
+    options.expression = "$1 * $2 + 1";
+    options.vectorize = false;
+    double scalar = bench_to_null([&]() { calc_lines<double>(columns, options); });
+    options.vectorize = true;
+    double vector = bench_to_null([&]() { calc_lines<double>(columns, options); });
+    // -s prints one line, which leaves parsing and the VM.
+    options.sum = true;
+    options.vectorize = false;
+    double scalar_sum = bench_to_null([&]() { calc_lines<double>(columns, options); });
+    options.vectorize = true;
+    double vector_sum = bench_to_null([&]() { calc_lines<double>(columns, options); });
+    options.sum = false;
+    options.expression.clear();
+    double per_line = bench_to_null([&]() { calc_lines<double>(expressions, options); });
+
+    auto report = [](const char* label, long count, double us) {
+        out().printf("  %-32s %12.0f lines/s\n", label, count / (us / 1e6));
+    };
+    cout << "calc: " << lines << " lines of two columns, $1 * $2 + 1, output to /dev/null\n";
+    report("calc a * b per line (before)", legacy_lines, legacy);
+    report("-f, compiled, row by row", lines, scalar);
+    report("-f, compiled, vectorized", lines, vector);
+    report("-f -s, compiled, row by row", lines, scalar_sum);
+    report("-f -s, compiled, vectorized", lines, vector_sum);
+    report("-f, one expression per line", lines, per_line);
+#endif
+}
+
+// Cold start to first command: launches "shell -c 'exit 0'" repeatedly.
+// An rc file with `lines` settings, nearly all aliases, the way a team's
+// shared rc files look.
+bool bench_make_rc(const string& path, long lines) {
+    string text = "# generated by bench\nprompt 'bench> '\nnotes /tmp/bench_notes.txt\n";
+    for (long i = 0; i < lines; i++) {
+        if (i % 100 == 1) text += "export BENCH_VAR" + to_string(i) + "=value" + to_string(i) + "\n";
+        else if (i % 100 == 2) text += "function bench_fn" + to_string(i) + " { echo $1 | cat; ls -l \"$2\" }\n";
+        else text += "alias bench" + to_string(i) + "='ls -l --color=auto /srv/project" + to_string(i) + "/src'\n";
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) return false;
+    write_all(fd, text);
+    close(fd);
+    return true;
+}
+
+// Launches of "shell -c 'exit 0'": without an rc file, then with a large
+// one parsed on every launch and loaded from its snapshot.
+void bench_startup(const Args& args) {
+    long iterations = (args.size() > 2) ? stol(args.str(2)) : 200;
+    long rc_lines = (args.size() > 3) ? stol(args.str(3)) : 5000;
+    if (iterations <= 0) return;
+    const double target_ms = 2.0;
+    string self = self_executable();
+
+    auto run = [iterations](const vector<string>& argv) {
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) runExternal(argv);
+        return elapsed_us(start);
+    };
+#ifdef _WIN32
+    double reference = run({"cmd.exe", "/C", "exit 0"});
+    const char* reference_label = "cmd.exe /C (reference)";
+#else
+    double reference = run({"/bin/sh", "-c", "exit 0"});
+    const char* reference_label = "/bin/sh -c (reference)";
+#endif
+    string saved_rc = getenv("SHELL_RC") ? getenv("SHELL_RC") : "";
+    string saved_snapshot = getenv("SHELL_RC_SNAPSHOT") ? getenv("SHELL_RC_SNAPSHOT") : "";
+    string rc_path = bench_temp_path("shell_bench.shellrc");
+    string snapshot_path = bench_temp_path("shell_bench.snap");
+    set_environment("SHELL_RC", bench_temp_path("shell_bench_no_rc"));
+    double shell = run({self, "-c", "exit 0"});
+    double parsed = -1, snapshot = -1;
+    if (rc_lines > 0 && bench_make_rc(rc_path, rc_lines)) {
+        set_environment("SHELL_RC", rc_path);
+        set_environment("SHELL_RC_SNAPSHOT", "0");
+        parsed = run({self, "-c", "exit 0"});
+        set_environment("SHELL_RC_SNAPSHOT", snapshot_path);
+        runExternal({self, "-c", "exit 0"});
+        snapshot = run({self, "-c", "exit 0"});
+        remove(rc_path.c_str());
+        remove(snapshot_path.c_str());
+    }
+    if (saved_rc.empty()) unset_environment("SHELL_RC");
+    else set_environment("SHELL_RC", saved_rc);
+    if (saved_snapshot.empty()) unset_environment("SHELL_RC_SNAPSHOT");
+    else set_environment("SHELL_RC_SNAPSHOT", saved_snapshot);
+
+    cout << "startup: " << iterations << " launches running 'exit 0'\n";
+    print_bench_line(reference_label, reference, iterations);
+    print_bench_line("shell -c, no rc", shell, iterations);
+    if (parsed >= 0) {
+        print_bench_line("rc parsed (" + to_string(rc_lines) + " lines)", parsed, iterations);
+        print_bench_line("rc snapshot", snapshot, iterations);
+    }
+    double ms = (snapshot >= 0 ? snapshot : shell) / iterations / 1000.0;
+    out().printf("  target %.1f ms: %s (%.2f ms)\n", target_ms, ms <= target_ms ? "met" : "MISSED", ms);
+}
+
+// Latency percentile of a set of samples (p in [0, 1]).
+double percentile(vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    size_t k = min(samples.size() - 1, (size_t)(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+// Creates a directory holding `entries` empty files named f0000000, f0000001...
+bool bench_make_directory(const string& dir, long entries) {
+#ifdef _WIN32
+    _mkdir(dir.c_str());
+#else
+    mkdir(dir.c_str(), 0755);
+#endif
+    char name[32];
+    for (long i = 0; i < entries; i++) {
+        snprintf(name, sizeof(name), "/f%07ld", i);
+        int fd = open((dir + name).c_str(), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0) return false;
+        close(fd);
+    }
+    return true;
+}
+
+void bench_remove_directory(const string& dir, long entries) {
+    char name[32];
+    for (long i = 0; i < entries; i++) {
+        snprintf(name, sizeof(name), "/f%07ld", i);
+        remove((dir + name).c_str());
+    }
+#ifdef _WIN32
+    _rmdir(dir.c_str());
+#else
+    rmdir(dir.c_str());
+#endif
+}
+
+// TAB latency in a large directory: the old full readdir() scan per TAB
+// against the cached sorted index.
+void bench_complete(const Args& args) {
+    long entries = (args.size() > 2) ? stol(args.str(2)) : 200000;
+    if (entries <= 0) return;
+    string dir = bench_temp_path("shell_bench_complete");
+    if (!bench_make_directory(dir, entries)) {
+        cerr << "bench complete: cannot create files in " << dir << endl;
+        return;
+    }
+    char name[32];
+
+    // Prefixes that each match about a hundred entries.
+    vector<string> prefixes;
+    for (long i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "f%07ld", (i * 7919) % entries);
+        prefixes.push_back(string(name).substr(0, max<size_t>(1, strlen(name) - 2)));
+    }
+
+    auto legacy = [&](const string& prefix) {
+        vector<DirEntry> listing;
+        vector<string> suggestions;
+        read_directory(dir, listing);
+        for (const auto& entry : listing) {
+            if (entry.name.rfind(prefix, 0) == 0) suggestions.push_back(entry.name);
+        }
+        return suggestions.size();
+    };
+
+    vector<double> before, after;
+    size_t found = 0;
+    for (size_t i = 0; i < 20; i++) {
+        auto start = chrono::steady_clock::now();
+        found += legacy(prefixes[i]);
+        before.push_back(elapsed_us(start));
+    }
+
+    auto start = chrono::steady_clock::now();
+    found += completion_candidates("cat " + dir + "/" + prefixes[0], 4).size();
+    double cold = elapsed_us(start);
+    for (const auto& prefix : prefixes) {
+        string line = "cat " + dir + "/" + prefix;
+        start = chrono::steady_clock::now();
+        found += completion_candidates(line, 4).size();
+        after.push_back(elapsed_us(start));
+    }
+
+    cout << "complete: " << entries << " entries (" << found << " candidates)\n";
+    out().printf("  %-26s p50 %10.1f us   p99 %10.1f us\n", "readdir scan (before)", percentile(before, 0.5), percentile(before, 0.99));
+    out().printf("  %-26s p50 %10.1f us   p99 %10.1f us\n", "cached index (after)", percentile(after, 0.5), percentile(after, 0.99));
+    out().printf("  %-26s %10.1f us\n", "first TAB (builds index)", cold);
+
+    bench_remove_directory(dir, entries);
+}
+
+// Ctrl-R latency on a large history: a scan over every entry, newest
+// first, against the trigram index. Each query is typed one key at a time.
+void bench_history(const Args& args) {
+    long entries = (args.size() > 2) ? stol(args.str(2)) : 1000000;
+    if (entries <= 0) return;
+    string path = bench_temp_path("shell_bench_history");
+    {
+        static const char* verbs[] = { "git status", "git commit -m", "make -j8", "ls -l", "cd src/module",
+                                       "grep -r TODO", "ssh build-host", "docker run --rm", "cat notes.txt", "vim main.cpp" };
+        ofstream out(path, ios::binary | ios::trunc);
+        for (long i = 0; i < entries; i++) {
+            out << verbs[i % 10] << ' ' << "arg" << (i * 2654435761u) % 50021 << '\n';
+        }
+    }
+
+    MappedFile raw;
+    raw.open(path);
+    vector<string_view> lines;
+    for (const char* p = raw.data; p < raw.data + raw.size;) {
+        const char* nl = (const char*)memchr(p, '\n', raw.data + raw.size - p);
+        lines.emplace_back(p, nl - p);
+        p = nl + 1;
+    }
+
+    HistoryLog log(path);
+    auto start = chrono::steady_clock::now();
+    size_t distinct = log.distinct_commands();
+    double build = elapsed_us(start);
+
+    const string queries[] = { "docker run --rm arg4711", "grep -r TODO arg31", "mk8", "vim main.cpp arg9" };
+    vector<double> before, after;
+    size_t hits = 0;
+    string result;
+    bool fuzzy;
+    for (const auto& query : queries) {
+        for (size_t n = 1; n <= query.size(); n++) {
+            string typed = query.substr(0, n);
+            start = chrono::steady_clock::now();
+            for (size_t i = lines.size(); i-- > 0;) {
+                if (lines[i].find(typed) != string_view::npos) {
+                    hits++;
+                    break;
+                }
+            }
+            before.push_back(elapsed_us(start));
+
+            start = chrono::steady_clock::now();
+            hits += log.search(typed, 0, result, fuzzy);
+            after.push_back(elapsed_us(start));
+        }
+    }
+
+    cout << "history: " << entries << " entries, " << distinct << " distinct (" << hits << " hits)\n";
+    out().printf("  %-26s %10.1f ms\n", "index build (first Ctrl-R)", build / 1000.0);
+    out().printf("  %-26s p50 %10.1f us   p99 %10.1f us\n", "linear scan (before)", percentile(before, 0.5), percentile(before, 0.99));
+    out().printf("  %-26s p50 %10.1f us   p99 %10.1f us\n", "trigram index (after)", percentile(after, 0.5), percentile(after, 0.99));
+    remove(path.c_str());
+}
+
+#ifndef _WIN32
+// The ll loop the shell had before the listing engine, kept so "bench ls"
+// can compare against it: readdir, one stat per name, iostream output.
+void legacy_list_directory(const string& path) {
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    while (dirent* entry = readdir(dir)) {
+        string filename = entry->d_name;
+        if (filename == "." || filename == "..") continue;
+        struct stat st;
+        string full = path + "/" + filename;
+        bool is_dir = (stat(full.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+        cout << (is_dir ? "[D] " : "[F] ");
+        cout << setw(30) << left << filename;
+        if (!is_dir) cout << " " << setw(10) << right << (st.st_size / 1024) << " KB";
+        cout << endl;
+    }
+    closedir(dir);
+}
+#endif
+
+// ll on a large directory, output to /dev/null: the old loop, the listing
+// engine and coreutils "ls -l".
+void bench_ls(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench ls: not supported on this platform\n";
+#else
+    long entries = (args.size() > 2) ? stol(args.str(2)) : 200000;
+    if (entries <= 0) return;
+    string dir = bench_temp_path("shell_bench_ls");
+    if (!bench_make_directory(dir, entries)) {
+        cerr << "bench ls: cannot create files in " << dir << endl;
+        return;
+    }
+
+    ListOptions long_listing;
+    long_listing.long_format = true;
+    double before = bench_to_null([&]() { legacy_list_directory(dir); });
+    double after = bench_to_null([&]() { list_directory(dir, long_listing); });
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    SpawnIO io;
+    io.out = null_fd;
+    auto start = chrono::steady_clock::now();
+    runExternal({ "ls", "-l", dir }, io);
+    double coreutils = elapsed_us(start);
+    close(null_fd);
+
+    cout << "ls: ll of " << entries << " entries, output to /dev/null\n";
+    out().printf("  %-26s %10.1f ms\n", "readdir + stat (before)", before / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "getdents64 + statx (after)", after / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "coreutils ls -l", coreutils / 1000.0);
+    bench_remove_directory(dir, entries);
+#endif
+}
+
+// grep -r over a tree: a serial walk reading files line by line against the
+// walker with one worker and with one per CPU, and the system grep.
+void bench_grep(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench grep: not supported on this platform\n";
+#else
+    string dir = (args.size() > 2) ? args.str(2) : ".";
+    string pattern = (args.size() > 3) ? args.str(3) : "include";
+    double serial = bench_to_null([&]() {
+        vector<string> files;
+        collect_files(dir, files);
+        for (const auto& file : files) {
+            ifstream in(file, ios::binary);
+            string line;
+            while (getline(in, line)) {
+                if (line.find(pattern) != string::npos) cout << file << ':' << line << '\n';
+            }
+        }
+    });
+    unsigned cpus = max(1u, thread::hardware_concurrency());
+    double one = bench_to_null([&]() { run_command_line("grep -r -j 1 " + pattern + " " + dir); });
+    double all = bench_to_null([&]() { run_command_line("grep -r -j " + to_string(cpus) + " " + pattern + " " + dir); });
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    SpawnIO io;
+    io.out = null_fd;
+    auto start = chrono::steady_clock::now();
+    runExternal({ "grep", "-r", pattern, dir }, io);
+    double system_grep = elapsed_us(start);
+    close(null_fd);
+
+    cout << "grep: '" << pattern << "' under " << dir << ", output to /dev/null\n";
+    out().printf("  %-26s %10.1f ms\n", "serial walk + getline", serial / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "walker, 1 worker", one / 1000.0);
+    if (cpus > 1) out().printf("  %-26s %10.1f ms\n", ("walker, " + to_string(cpus) + " workers").c_str(), all / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "system grep -r", system_grep / 1000.0);
+#endif
+}
+
+// The line splitting the shell did before the parser existed, kept so
+// "bench parse" can compare against it.
+vector<vector<string>> legacy_split_line(const string& line) {
+    vector<string> parts;
+    string current;
+    bool in_quotes = false;
+    for (char c : line) {
+        if (c == '"') in_quotes = !in_quotes;
+        if (c == '|' && !in_quotes) {
+            parts.push_back(current);
+            current.clear();
+        } else {
+            current += c;
+        }
+    }
+    parts.push_back(current);
+
+    vector<vector<string>> stages;
+    for (const auto& part : parts) {
+        vector<string> words;
+        string word;
+        in_quotes = false;
+        for (char c : part) {
+            if (c == '"') {
+                in_quotes = !in_quotes;
+                continue;
+            }
+            if (isspace((unsigned char)c) && !in_quotes) {
+                if (!word.empty()) {
+                    words.push_back(word);
+                    word.clear();
+                }
+            } else {
+                word += c;
+            }
+        }
+        if (!word.empty()) words.push_back(word);
+        stages.push_back(words);
+    }
+    return stages;
+}
+
+void bench_parse(const Args& args) {
+    long iterations = (args.size() > 2) ? stol(args.str(2)) : 200000;
+    if (iterations <= 0) return;
+    const string lines[] = {
+        "ls -l",
+        "cat access.log | grep \"GET /index\" | sort | uniq -c | sort -rn | head -20",
+        "count -w -j 4 -e foo -e bar 'my notes.txt' docs",
+        "make -j8 && echo done || echo failed; wordfreq build.log > /tmp/top.txt",
+    };
+    const size_t line_count = sizeof(lines) / sizeof(lines[0]);
+    size_t bytes = 0;
+    for (const auto& line : lines) bytes += line.size();
+
+    size_t sink = 0;
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        for (const auto& line : lines) sink += legacy_split_line(line).size();
+    }
+    double before = elapsed_us(start);
+
+    Arena arena;
+    start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        for (const auto& line : lines) {
+            Parser parser(line, arena);
+            CommandList list;
+            if (parser.parse(list)) sink += list.count;
+            arena.reset();
+        }
+    }
+    double after = elapsed_us(start);
+
+    long parsed = iterations * (long)line_count;
+    auto report = [&](const char* label, double us) {
+        out().printf("  %-26s %10.0f lines/s %8.1f MB/s\n", label, parsed / (us / 1e6),
+               (bytes * (double)iterations / 1048576.0) / (us / 1e6));
+    };
+    cout << "parse: " << parsed << " command lines (" << sink << " items)\n";
+    report("split + tokenize (before)", before);
+    report("lexer + parser (after)", after);
+    out().printf("  speedup: %.2fx\n", before / after);
+}
+
+// Many tiny tasks: one after another the way a loop of commands runs,
+// then through the parallel executor at one and four children per CPU.
+void bench_parallel(const Args& args) {
+    long count = (args.size() > 2) ? stol(args.str(2)) : 100000;
+    if (count <= 0) return;
+    unsigned cpus = max(1u, thread::hardware_concurrency());
+
+    vector<double> latencies;
+    latencies.reserve(count);
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < count; i++) {
+        auto task_start = chrono::steady_clock::now();
+        runExternal({ "true" });
+        latencies.push_back(elapsed_us(task_start));
+    }
+    double sequential = elapsed_us(start);
+
+    auto report = [count](const string& label, double total_us, const vector<double>& samples) {
+        out().printf("  %-24s %9.0f tasks/s   p50 %8.1f us   p99 %8.1f us   max %9.1f us\n", label.c_str(),
+                     count / (total_us / 1e6), percentile(samples, 0.5), percentile(samples, 0.99),
+                     percentile(samples, 1.0));
+    };
+    cout << "parallel: " << count << " runs of 'true'\n";
+    report("sequential (before)", sequential, latencies);
+    for (unsigned jobs : { cpus, cpus * 4 }) {
+        vector<ParallelTask> tasks(count);
+        for (auto& task : tasks) task.argv = { "true" };
+        ParallelOptions options;
+        options.jobs = jobs;
+        start = chrono::steady_clock::now();
+        run_parallel(tasks, options, "bench parallel");
+        double total = elapsed_us(start);
+        latencies.clear();
+        for (const auto& task : tasks) latencies.push_back(task.latency_us);
+        report("parallel -j " + to_string(jobs), total, latencies);
+    }
+}
+
+// Resolving command names: a PATH walk per command vs the command hash.
+void bench_hash(const Args& args) {
+    long iterations = (args.size() > 2) ? stol(args.str(2)) : 200000;
+    if (iterations <= 0) return;
+    const vector<string> names = { "ls", "grep", "sort", "true", "sh", "cat" };
+
+    auto run = [&](string (*resolve)(const string&)) {
+        size_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < iterations; i++) found += !resolve(names[i % names.size()]).empty();
+        double us = elapsed_us(start);
+        return found ? us : -1.0;
+    };
+    double before = run(search_path);
+    resolve_executable(names[0]);
+    double after = run(resolve_executable);
+
+    const char* path = getenv("PATH");
+    size_t dirs = path ? count(path, path + strlen(path), ':') + 1 : 0;
+    cout << "hash: " << iterations << " lookups of common commands, " << dirs << " PATH directories\n";
+    print_bench_line("PATH search (before)", before, iterations);
+    print_bench_line("command hash (after)", after, iterations);
+    out().printf("  speedup: %.2fx\n", before / after);
+}
+
+// Cost of the always-on command counters: the timer on its own, and a
+// trivial builtin and a trivial program dispatched with instrumentation off
+// and on, alternating so that drift in the machine's speed hits both.
+void bench_stats(const Args& args) {
+    long iterations = (args.size() > 2) ? stol(args.str(2)) : 200000;
+    if (iterations <= 0) return;
+    long spawns = max(1L, iterations / 100);
+    bool enabled = command_stats_enabled;
+
+    CommandCounter scratch;
+    scratch.name = "bench";
+    command_stats_enabled = true;
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) CommandTimer timer(scratch, "bench");
+    double timer_us = elapsed_us(start) / iterations;
+
+    auto compare = [&](const Args& command, long count, const char* label) {
+        double off = 0, on = 0;
+        for (int round = 0; round < 4; round++) {
+            for (bool instrumented : { false, true }) {
+                command_stats_enabled = instrumented;
+                auto begin = chrono::steady_clock::now();
+                for (long i = 0; i < count; i++) execute_command(command);
+                (instrumented ? on : off) += elapsed_us(begin);
+            }
+        }
+        off /= 4 * count;
+        on /= 4 * count;
+        out().printf("  %-26s %10.2f us off, %10.2f us on, timer %.2f%% of it\n", label, off, on, timer_us / off * 100);
+    };
+
+    const string_view cd_words[] = { "cd", "." };
+    const string_view true_words[] = { "true" };
+    cout << "stats: command timer " << fixed << setprecision(3) << timer_us << " us per command\n";
+    compare(Args(cd_words, 2), iterations, "builtin 'cd .'");
+    compare(Args(true_words, 1), spawns, "program 'true'");
+    cout.unsetf(ios::fixed);
+    command_stats_enabled = enabled;
+}
+
+// wordfreq on a large file: a full scan, a cache hit, and a resume after
+// an append.
+void bench_cache(const Args& args) {
+    long long megabytes = (args.size() > 2) ? stoll(args.str(2)) : 256;
+    if (megabytes <= 0) return;
+    string path = bench_temp_path("shell_bench_cache.txt");
+    if (!bench_make_file(path, megabytes << 20)) {
+        cerr << "bench cache: cannot create " << path << endl;
+        return;
+    }
+    ResultCache& cache = result_cache();
+    bool enabled = cache.enabled;
+    cache.enabled = !cache.dir.empty();
+    StringSink discard;
+    auto run = [&]() {
+        IoScope scope(&discard, nullptr);
+        auto start = chrono::steady_clock::now();
+        word_frequency(path, 10, 0);
+        return elapsed_us(start);
+    };
+    cache.enabled = false;
+    double scan = run();
+    cache.enabled = !cache.dir.empty();
+    double first = run();
+    double hit = run();
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_BINARY);
+    if (fd >= 0) {
+        write_all(fd, "appended words here\n", 20);
+        close(fd);
+    }
+    double resume = run();
+    cache.enabled = enabled;
+    remove(path.c_str());
+
+    cout << "cache: wordfreq of " << megabytes << " MB (" << cache.dir << ")\n";
+    out().printf("  %-26s %10.1f ms\n", "no cache", scan / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "miss (scan and store)", first / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "hit", hit / 1000.0);
+    out().printf("  %-26s %10.1f ms\n", "resume after append", resume / 1000.0);
+}
+
+// Alias expansion against a large table: single lookups and whole lines,
+// the old ordered map against the flat table, and loading the aliases from
+// the alias file against defining them with one alias command per line.
+void bench_alias(const Args& args) {
+    long count = (args.size() > 2) ? stol(args.str(2)) : 10000;
+    if (count <= 0) return;
+    const long lookups = 1000000;
+    AliasTable saved = move(aliases);
+    aliases = AliasTable();
+    map<string, string, less<>> ordered;
+    string script;
+    for (long i = 0; i < count; i++) {
+        string name = "alias" + to_string(i * 7919 % count);
+        string value = "ls -l --color=auto dir" + to_string(i);
+        ordered[name] = value;
+        aliases.define(name, value);
+        script += "alias " + name + "='" + value + "'\n";
+    }
+    aliases.define("ll", "ls -l ");
+    aliases.define("lt", "ll -t ");
+    aliases.define("root", "/ ");
+    ordered["ll"] = "ls -l ";
+
+    vector<string> names;
+    for (long i = 0; i < 1024; i++) names.push_back("alias" + to_string(i * 31 % count));
+    vector<string> missing;
+    for (long i = 0; i < 1024; i++) missing.push_back("command" + to_string(i));
+    size_t found = 0;
+    auto time_lookups = [&](const vector<string>& words, auto lookup) {
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < lookups; i++) found += lookup(string_view(words[i & 1023]));
+        return elapsed_us(start);
+    };
+    auto in_map = [&](string_view name) { return ordered.find(name) != ordered.end(); };
+    auto in_table = [&](string_view name) { return aliases.find(name) != nullptr; };
+    double map_hit = time_lookups(names, in_map);
+    double table_hit = time_lookups(names, in_table);
+    double map_miss = time_lookups(missing, in_map);
+    double table_miss = time_lookups(missing, in_table);
+
+    // The old resolve_alias: first word through the map, one level.
+    auto one_level = [&](const string& input) {
+        size_t start = input.find_first_not_of(" \t");
+        if (start == string::npos) return input;
+        size_t end = input.find_first_of(" \t", start);
+        if (end == string::npos) end = input.size();
+        auto it = ordered.find(string_view(input).substr(start, end - start));
+        if (it == ordered.end()) return input;
+        return it->second + input.substr(end);
+    };
+    const string line = names[17] + " -R | grep .txt";
+    const string chained = "lt root";
+    auto time_lines = [&](const string& input, auto expand) {
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < lookups; i++) found += expand(input).size();
+        return elapsed_us(start);
+    };
+    double map_line = time_lines(line, one_level);
+    double table_line = time_lines(line, resolve_alias);
+    double table_chained = time_lines(chained, resolve_alias);
+
+    string path = bench_temp_path("shell_bench_aliases");
+    aliases.save(path);
+    aliases = AliasTable();
+    StringSink discard;
+    auto start = chrono::steady_clock::now();
+    {
+        IoScope scope(&discard, nullptr);
+        size_t begin = 0;
+        for (size_t end; (end = script.find('\n', begin)) != string::npos; begin = end + 1) {
+            run_script_line(string_view(script).substr(begin, end - begin));
+        }
+    }
+    double parsed_us = elapsed_us(start);
+    size_t defined = aliases.size();
+    aliases = AliasTable();
+    start = chrono::steady_clock::now();
+    aliases.load(path);
+    double loaded_us = elapsed_us(start);
+    size_t loaded = aliases.size();
+    remove(path.c_str());
+    string expanded = resolve_alias(chained);
+    aliases = move(saved);
+
+    cout << "alias: " << count << " aliases, " << lookups << " lookups (" << found << ")\n";
+    print_bench_line("hit, ordered map (before)", map_hit, lookups);
+    print_bench_line("hit, flat table (after)", table_hit, lookups);
+    print_bench_line("miss, ordered map (before)", map_miss, lookups);
+    print_bench_line("miss, flat table (after)", table_miss, lookups);
+    print_bench_line("line, one level (before)", map_line, lookups);
+    print_bench_line("line, recursive (after)", table_line, lookups);
+    print_bench_line("line, chained (after)", table_chained, lookups);
+    out().printf("  %-26s '%s' -> '%s'\n", "chained expansion", chained.c_str(), expanded.c_str());
+    out().printf("  %-26s %10.1f ms (%zu aliases)\n", "alias commands (before)", parsed_us / 1000, defined);
+    out().printf("  %-26s %10.1f ms (%zu aliases)\n", "alias file load (after)", loaded_us / 1000, loaded);
+}
+
+// Builtin pipelines and $(...): a three-stage builtin pipeline run the old
+// way, each builtin a copy of the shell joined by pipes, against stages on
+// threads joined by ring buffers; then the cost of capturing a builtin's
+// output, through a child shell and a pipe against in memory.
+void bench_pipe(const Args& args) {
+#ifdef _WIN32
+    (void)args;
+    cerr << "bench pipe: not supported on this platform\n";
+#else
+    long long megabytes = (args.size() > 2) ? stoll(args.str(2)) : 64;
+    if (megabytes <= 0) return;
+    string src = bench_temp_path("shell_bench_pipe.txt");
+    if (!bench_make_file(src, megabytes << 20)) {
+        cerr << "bench pipe: cannot create " << src << endl;
+        return;
+    }
+    const vector<vector<string>> stages = {
+        shell_argv({ "cat", src }), shell_argv({ "cat" }), shell_argv({ "wordfreq", "-k", "3", "-" })
+    };
+    string line = "cat " + shell_quote(src) + " | cat | wordfreq -k 3 -";
+    double process_us = bench_to_null([&]() { runPipeline(stages, vector<SpawnIO>(stages.size())); });
+    double ring_us = bench_to_null([&]() { run_command_line(line); });
+
+    const int captures = 200;
+    vector<string> child = shell_argv({ "pwd" });
+    size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < captures; i++) {
+        IoHandle readEnd, writeEnd;
+        if (!createPipe(readEnd, writeEnd)) break;
+        SpawnIO io;
+        io.out = writeEnd;
+        ProcHandle handle;
+        ProcId pid;
+        bool started = spawnProcess(child, io, handle, pid);
+        closeIo(writeEnd);
+        char buffer[4096];
+        long n;
+        while ((n = readIo(readEnd, buffer, sizeof(buffer))) > 0) bytes += n;
+        closeIo(readEnd);
+        if (started) waitProcess(handle);
+    }
+    double child_us = elapsed_us(start);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < captures; i++) bytes += capture_output("pwd").size();
+    double memory_us = elapsed_us(start);
+
+    cout << "pipe: cat | cat | wordfreq over " << megabytes << " MB\n";
+    out().printf("  %-26s %10.1f ms total, %8.1f MB/s\n", "child shells (before)", process_us / 1000,
+                 megabytes / (process_us / 1e6));
+    out().printf("  %-26s %10.1f ms total, %8.1f MB/s\n", "ring buffers (after)", ring_us / 1000,
+                 megabytes / (ring_us / 1e6));
+    cout << "$(pwd): " << captures << " captures\n";
+    print_bench_line("child shell (before)", child_us, captures);
+    print_bench_line("in memory (after)", memory_us, captures);
+    out().printf("  speedup: %.2fx pipeline, %.2fx capture\n", process_us / ring_us, child_us / memory_us);
+    remove(src.c_str());
+#endif
+}
+
+const BenchCase bench_cases[] = {
+    { "spawn", "bench spawn [count]  - Process launch latency, shell wrapper vs direct", bench_spawn },
+    { "copy", "bench copy [MB]      - cat/cp throughput, buffered loop vs copy engine", bench_copy },
+    { "calc", "bench calc [lines]   - Column arithmetic, per-line calc vs compiled and vectorized -f", bench_calc },
+    { "cat", "bench cat [MB]       - cat to /dev/null, and line output flushed per line vs buffered", bench_cat },
+    { "hash", "bench hash [count]   - Command resolution, PATH search vs command hash", bench_hash },
+    { "parallel", "bench parallel [count] - Tiny tasks, one at a time vs the parallel executor", bench_parallel },
+    { "pipe", "bench pipe [MB]      - Builtin pipeline and $(...), child shells vs in-process", bench_pipe },
+    { "startup", "bench startup [count] [rc lines] - Cold start of 'shell -c', rc file parsed vs snapshot", bench_startup },
+    { "complete", "bench complete [entries] - TAB latency in a large directory, scan vs index", bench_complete },
+    { "history", "bench history [entries] - Ctrl-R search latency, scan vs trigram index", bench_history },
+    { "ls", "bench ls [entries]   - ll on a large directory, old loop vs engine vs coreutils", bench_ls },
+    { "grep", "bench grep [dir] [pattern] - grep -r, serial walk vs parallel walker vs system grep", bench_grep },
+    { "cache", "bench cache [MB]     - wordfreq full scan vs result cache hit vs resume after append", bench_cache },
+    { "stats", "bench stats [count]  - Per-command instrumentation overhead on a trivial builtin", bench_stats },
+    { "parse", "bench parse [count]  - Command line parsing, string splitting vs arena parser", bench_parse },
+    { "alias", "bench alias [count]  - Alias lookup and expansion, ordered map vs flat table", bench_alias },
+};
+
+void runBenchmark(const Args& args) {
+    if (args.size() < 2 || args[1] == "list") {
+        cout << "Benchmarks:\n";
+        for (const auto& c : bench_cases) cout << "  " << c.usage << "\n";
+        return;
+    }
+    for (const auto& c : bench_cases) {
+        if (args[1] == c.name) {
+            try {
+                c.run(args);
+            } catch (const exception& e) {
+                cerr << "bench " << c.name << ": " << e.what() << endl;
+            }
+            return;
+        }
+    }
+    cerr << "Unknown benchmark '" << args[1] << "'. Use 'bench list'.\n";
+}
+
 void print_help() {
-    cout << "Custom Shell Help:\n"
-         << "  help       - Show this help message\n"
-         << "  cd <dir>   - Change directory\n"
-         << "  pwd        - Print working directory\n"
-         << "  clear      - Clear the screen\n"
-         << "  history    - Show command history\n"
-         << "  ls [dir]   - List directory contents (short format)\n"
-         << "  ll [dir]   - List directory contents (long format with details)\n"
-         << "  dir [dir]  - List directory contents (Windows style)\n"
-         << "  mkdir <dir>- Create a directory\n"
-         << "  touch <file>- Create/update a file\n"
-         << "  rm <file>  - Delete a file\n"
-         << "  cat <file> - Display contents of a file\n"
-         << "  cp <src> <dst>- Copy file from src to dst\n"
-         << "  mv <src> <dst>- Move (rename) file from src to dst\n"
-         << "  time       - Show current time\n"
-         << "  exit       - Exit the shell\n"
-         << "\nCustom Commands:\n"
-         << "  count <file> <word>    - Count occurrences of word in file\n"
-         << "  wordfreq <file>        - Show word frequency in file (top 10)\n"
-         << "  calc <num1> <op> <num2>- Calculator (+, -, *, /, %, ^)\n"
-         << "  jobs       - List all background jobs\n"
-         << "  fg <jobid> - Bring background job to foreground\n"
-         << "  kill <jobid> - Kill a background job\n"
-         << "  alias [name='command'] - Create or list aliases\n"
-         << "  lock       - Lock the shell (requires password to unlock)\n"
-         << "  note add <text> - Add a note to shell notes\n"
-         << "  note view   - View all shell notes\n"
-         << "  ping <host> - Ping a host to check connectivity\n"
-         << "  schedule <cmd> at <seconds> - Schedule a command to run after delay\n"
-         << "  run <cmd>   - Run a command in background\n"
-         << "\nHindi Commands:\n"
-         << "  banao <file>     - Create/update a file\n"
-         << "  hatao <file>     - Delete a file\n"
-         << "  dikhhao <file>   - Display file contents\n"
-         << "  badlo <old> <new>- Rename file\n"
-         << "\nShell Features:\n"
-         << "  Tab Completion  - Press TAB to autocomplete commands and filenames\n"
+    static const char* section_titles[] = { "Custom Shell Help:", "Custom Commands:", "Hindi Commands:" };
+    for (int section = SECTION_GENERAL; section <= SECTION_HINDI; section++) {
+        cout << (section == SECTION_GENERAL ? "" : "\n") << section_titles[section] << "\n";
+        for (const Builtin* b = builtins_begin(); b != builtins_end(); ++b) {
+            if (b->section != section) continue;
+            cout << "  " << setw(37) << left << b->usage << "- " << b->help << "\n";
+        }
+    }
+    cout << "\nShell Features:\n"
+         << "  Tab Completion  - Press TAB to autocomplete commands, PATH programs and paths;\n"
+         << "                    press TAB again to cycle through the other matches\n"
          << "  Command History - Use UP/DOWN arrow keys to navigate through command history\n"
+         << "                    Ctrl-R searches it (again for older matches, Enter runs, Ctrl-G cancels)\n"
+         << "                    Saved in ~/.shell_history (or $SHELL_HISTORY), shared by all shells\n"
          << "  Aliases        - Create shortcuts for commands using 'alias name=command'\n"
          << "                   Example: alias ll='ls -l'\n"
          << "                   Type 'alias' to see all defined aliases\n"
+         << "                   'alias -s' saves them to ~/.shell_aliases, loaded at startup\n"
+         << "  Startup File   - ~/.shellrc (or $SHELL_RC) is read at startup: lines of alias, export,\n"
+         << "                   function NAME { COMMANDS }, prompt, notes and password\n"
+         << "                   'shell --startup-profile' shows where start-up time went\n"
          << "  Redirection    - Redirect input/output using > and < operators\n"
          << "                   Example: dir > output.txt (save output to file)\n"
          << "                   Example: sort < input.txt (read input from file)\n"
          << "  Piping        - Pipe output of one command to another using |\n"
          << "                   Example: dir | findstr .txt (filter directory listing)\n"
+         << "                   Any number of stages; 'pipestatus' shows each stage's exit code\n"
+         << "                   'pipesize <bytes>' (or SHELL_PIPE_SIZE) sets the pipe buffer size\n"
+         << "  Command Lists - Chain commands with ; && || and start them in the background with &\n"
+         << "                   Example: make && echo ok || echo failed\n"
+         << "  Quoting       - \"...\" and '...' keep spaces in one argument; # starts a comment\n"
+         << "  Batch Mode    - shell -c 'cmd', shell script.sh or shell < cmds.txt run without\n"
+         << "                   prompts and exit with the status of the last command\n"
          << "  Interrupts    - Use Ctrl+C to interrupt running commands\n"
          << "  Background Jobs:\n"
          << "    - Use 'run' command to start background processes\n"
          << "    - Use 'jobs' to list running background jobs\n"
          << "    - Use 'fg' to bring a job to foreground\n"
-         << "    - Use 'kill' to terminate a background job\n"
+         << "    - Use 'kill' to terminate a background job (kill -STOP / bg to pause and resume)\n"
+         << "    - Use 'wait' to wait for background jobs; 'cmd &' also starts one\n"
          << "  Shell Security:\n"
          << "    - Shell requires password authentication on startup\n"
          << "    - Use 'lock' command to temporarily lock the shell\n"
@@ -647,348 +8917,1464 @@ void print_help() {
          << "    - View notes using 'note view'\n"
          << "    - Notes are stored in shell_notes.txt\n"
          << "  Command Scheduling:\n"
-         << "    - Schedule commands to run after a delay\n"
-         << "    - Format: schedule <command> at <seconds>\n"
-         << "    - Example: schedule dir at 5 (runs dir after 5 seconds)\n";
+         << "    - Schedule commands to run after a delay, at a time of day or repeatedly\n"
+         << "    - Format: schedule <command> at <seconds|HH:MM[:SS]>\n"
+         << "              schedule <command> every <seconds>\n"
+         << "    - Example: schedule dir at 5 (runs dir after 5 seconds)\n"
+         << "    - 'schedule list' shows pending commands, 'schedule cancel <id>' removes one\n"
+         << "    - Scheduled commands run as background jobs, so the prompt stays usable\n";
 }
 
-void execute_command(const vector<string>& args) {
-    if (args.empty()) return;
-    string command = args[0];
-    command.erase(0, command.find_first_not_of(" \n\r\t"));
-    command.erase(command.find_last_not_of(" \n\r\t") + 1);
-    for (auto &c : command) c = tolower(c);
-    cout << "[DEBUG] Running command: '" << command << "'" << endl;
-    
-    if (command == "alias") {
-        handle_alias_command(args);
+// Builtin command handlers. Argument counts are checked by the dispatcher
+// against the builtin table before a handler runs.
+string join_args(const Args& args, size_t first, size_t last) {
+    string joined;
+    for (size_t i = first; i < last; ++i) {
+        joined.append(args[i]).append(" ");
+    }
+    return joined;
+}
+
+void builtin_alias(const Args& args) {
+    handle_alias_command(args);
+}
+
+void builtin_unalias(const Args& args) {
+    unalias_command(args);
+}
+
+void builtin_jobs(const Args&) {
+    listJobs();
+}
+
+// Job IDs may be written as in other shells, with a leading '%'.
+int parse_job_id(string_view word) {
+    if (!word.empty() && word[0] == '%') word.remove_prefix(1);
+    return stoi(string(word));
+}
+
+// Signal given to kill as -9, -KILL or -SIGKILL.
+int parse_signal(string_view name) {
+    if (!name.empty() && isdigit((unsigned char)name[0])) return stoi(string(name));
+    if (name.substr(0, 3) == "SIG") name.remove_prefix(3);
+    static const pair<const char*, int> signals[] = {
+        { "INT", SIGINT }, { "TERM", SIGTERM },
+#ifndef _WIN32
+        { "HUP", SIGHUP }, { "KILL", SIGKILL }, { "STOP", SIGSTOP },
+        { "TSTP", SIGTSTP }, { "CONT", SIGCONT }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+#endif
+    };
+    for (const auto& sig : signals) {
+        if (name == sig.first) return sig.second;
+    }
+    throw invalid_argument("unknown signal");
+}
+
+void builtin_fg(const Args& args) {
+    fg(parse_job_id(args[1]));
+}
+
+void builtin_bg(const Args& args) {
+    bg(parse_job_id(args[1]));
+}
+
+void builtin_wait(const Args& args) {
+    if (args.size() == 1) {
+        vector<int> ids;
+        {
+            lock_guard<mutex> lock(job_mutex);
+            for (const auto& job : jobTable) {
+                if (job) ids.push_back(job->id);
+            }
+        }
+        last_status = 0;
+        for (int id : ids) last_status = waitJob(id);
+        return;
+    }
+    for (size_t i = 1; i < args.size(); i++) {
+        last_status = waitJob(parse_job_id(args[i]));
+        if (last_status == 127) cerr << "wait: no such job: " << args[i] << endl;
+    }
+}
+
+void builtin_kill(const Args& args) {
+    int sig = SIGTERM;
+    size_t first = 1;
+    if (args[1].size() > 1 && args[1][0] == '-') {
+        sig = parse_signal(args[1].substr(1));
+        first = 2;
+    }
+    if (first >= args.size()) throw invalid_argument("missing job id");
+    for (size_t i = first; i < args.size(); i++) killJob(parse_job_id(args[i]), sig);
+}
+
+void builtin_parallel(const Args& args) {
+    parallel_command(args);
+}
+
+// cache [clear | on | off | max MB]: the wordfreq/count result cache.
+void builtin_cache(const Args& args) {
+    ResultCache& cache = result_cache();
+    if (args.size() > 1) {
+        if (args[1] == "clear") cache.clear();
+        else if (args[1] == "on" || args[1] == "off") cache.enabled = args[1] == "on" && !cache.dir.empty();
+        else if (args[1] == "max" && args.size() > 2) {
+            cache.max_bytes = stoull(args.str(2)) << 20;
+            cache.evict();
+        } else throw invalid_argument("unknown option");
+        return;
+    }
+    ResultCache::Usage usage = cache.usage();
+    OutputSink& sink = out();
+    sink << "Result cache: " << (cache.enabled ? "on" : "off") << ", " << cache.dir << '\n';
+    sink << "  entries  " << (unsigned long long)usage.entries << '\n';
+    sink.printf("  size     %.1f of %.0f MiB\n", usage.bytes / 1048576.0, cache.max_bytes / 1048576.0);
+    sink << "  hits " << (unsigned long long)cache.hits.load() << ", resumed " << (unsigned long long)cache.resumes.load()
+         << ", misses " << (unsigned long long)cache.misses.load() << '\n';
+}
+
+void builtin_find(const Args& args) {
+    find_command(args);
+}
+
+void builtin_grep(const Args& args) {
+    grep_command(args);
+}
+
+void builtin_run(const Args& args) {
+    launchBackgroundProcess(args.from(1).to_vector(), join_args(args, 1, args.size()));
+}
+
+void builtin_ping(const Args& args) {
+    runPingCommand(args.str(1));
+}
+
+// schedule <cmd> at <seconds|HH:MM[:SS]>, schedule <cmd> every <seconds>,
+// schedule list, schedule cancel <id>
+void builtin_schedule(const Args& args) {
+    if (args[1] == "list" && args.size() == 2) {
+        auto now = chrono::steady_clock::now();
+        for (const auto& task : scheduler().snapshot()) {
+            long in = (long)ceil(chrono::duration<double>(task.due - now).count());
+            cout << "[" << task.id << "] in " << max(in, 0L) << "s";
+            if (task.interval > 0) cout << ", every " << task.interval << "s (" << task.runs << " runs)";
+            cout << ": " << task.command << "\n";
+        }
+        return;
+    }
+    if (args[1] == "cancel" && args.size() == 3) {
+        int id = stoi(args.str(2));
+        if (scheduler().cancel(id)) {
+            cout << "Cancelled scheduled command [" << id << "].\n";
+        } else {
+            cerr << "schedule: no such task: " << id << endl;
+            last_status = 1;
+        }
         return;
     }
-    else if (command == "jobs") {
-        listJobs();
+
+    const string_view& keyword = args[args.size() - 2];
+    if (args.size() < 4 || (keyword != "at" && keyword != "every")) {
+        throw invalid_argument("bad schedule");
+    }
+    string command;
+    for (size_t i = 1; i < args.size() - 2; i++) {
+        if (i > 1) command += ' ';
+        command += shell_quote(args[i]);
+    }
+
+    // A clock time must be a valid one; anything else is whole seconds.
+    string when = args.str(args.size() - 1);
+    long delay;
+    if (keyword == "at" && when.find(':') != string::npos) {
+        delay = seconds_until(when);
+        if (delay < 0) throw invalid_argument("bad time");
+    } else {
+        size_t used = 0;
+        delay = stol(when, &used);
+        if (used != when.size()) throw invalid_argument("bad delay");
+    }
+    if (delay < 0 || (keyword == "every" && delay == 0)) throw invalid_argument("bad delay");
+
+    int interval = (keyword == "every") ? (int)delay : 0;
+    int id = scheduler().add(command, chrono::steady_clock::now() + chrono::seconds(delay), interval);
+    cout << "Scheduled [" << id << "]: \"" << command << "\" "
+         << (interval ? "every " : "in ") << delay << " seconds.\n";
+}
+
+void builtin_note(const Args& args) {
+    if (args.size() > 2 && args[1] == "add") {
+        addNote(join_args(args, 2, args.size()));
+    }
+    else if (args[1] == "view") {
+        viewNotes();
+    }
+}
+
+void builtin_lock(const Args&) {
+    lockShell();
+}
+
+void builtin_count(const Args& args) {
+    count_command(args);
+}
+
+void builtin_wordfreq(const Args& args) {
+    word_frequency_command(args);
+}
+
+void builtin_calc(const Args& args) {
+    calc_command(args);
+}
+
+void builtin_cd(const Args& args) {
+    if (args.size() < 2) {
+        char current_dir[4096];
+        if (getcwd(current_dir, sizeof(current_dir))) {
+            cout << current_dir << endl;
+        }
+    } else {
+        if (chdir(args.str(1).c_str()) != 0) {
+            cerr << "Error changing directory" << endl;
+        }
+    }
+}
+
+void builtin_hatao(const Args& args) {
+    if (remove(args.str(1).c_str()) == 0) {
+        cout << "File deleted successfully (via hatao)" << endl;
+    } else {
+        cerr << "Error deleting file (via hatao)" << endl;
+    }
+}
+
+void builtin_banao(const Args& args) {
+    ofstream file(args.str(1), ios::app);
+    if (file) {
+        file.close();
+        cout << "File created/updated successfully (via banao)" << endl;
+    } else {
+        cerr << "Error creating/updating file (via banao)" << endl;
+    }
+}
+
+void builtin_dikhhao(const Args& args) {
+    CatResult result = cat_file(args.str(1));
+    if (result == CAT_OPEN_FAILED || (result == CAT_COPY_FAILED && errno != EPIPE)) {
+        cerr << "Error reading file (via dikhhao)" << endl;
+    }
+}
+
+void builtin_badlo(const Args& args) {
+    if (rename(args.str(1).c_str(), args.str(2).c_str()) == 0) {
+        cout << "File renamed from '" << args[1] << "' to '" << args[2] << "' (via badlo)" << endl;
+    } else {
+        cerr << "Error renaming file (via badlo)" << endl;
+    }
+}
+
+void builtin_clear(const Args&) {
+#ifdef _WIN32
+    system("cls");
+#else
+    cout << "\033[H\033[2J" << flush;
+#endif
+}
+
+void builtin_pwd(const Args&) {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd))) {
+        cout << cwd << endl;
+    }
+}
+
+void builtin_history(const Args& args) {
+    size_t count = (args.size() > 1) ? stoul(args.str(1)) : 10;
+    OutputSink& sink = out();
+    sink << "Command history (last " << count << " commands):\n";
+    for (const auto& entry : history_log().tail(count)) {
+        sink << "  " << entry.first << ": " << entry.second << '\n';
+    }
+}
+
+void builtin_help(const Args&) {
+    print_help();
+}
+
+void builtin_ls(const Args& args) {
+    list_command(args, false);
+}
+
+void builtin_ll(const Args& args) {
+    list_command(args, true);
+}
+
+void builtin_mkdir(const Args& args) {
+#ifdef _WIN32
+    int rc = _mkdir(args.str(1).c_str());
+#else
+    int rc = mkdir(args.str(1).c_str(), 0777);
+#endif
+    if (rc == 0) {
+        cout << "Directory '" << args[1] << "' created successfully.\n";
+    } else {
+        cerr << "Error: Could not create directory '" << args[1] << "'.\n";
+        if (errno == EEXIST) {
+            cerr << "Directory already exists.\n";
+        }
+    }
+}
+
+void builtin_touch(const Args& args) {
+    ofstream file(args.str(1), ios::app);
+    if (file) {
+        file.close();
+        cout << "File '" << args[1] << "' created/updated successfully.\n";
+    } else {
+        cerr << "Error: Failed to create or modify file '" << args[1] << "'.\n";
+    }
+}
+
+void builtin_rm(const Args& args) {
+    if (remove(args.str(1).c_str()) == 0) {
+        cout << "File '" << args[1] << "' deleted successfully.\n";
+    } else {
+        cerr << "Error: Could not delete file '" << args[1] << "'.\n";
+        if (errno == ENOENT) {
+            cerr << "File does not exist.\n";
+        }
+    }
+}
+
+void builtin_cat(const Args& args) {
+    if (args.size() == 1) {
+        InputSource& source = in();
+        if (source.fd() >= 0) {
+            copy_to_output(source.fd());
+            return;
+        }
+        char block[65536];
+        long n;
+        while ((n = source.read(block, sizeof(block))) > 0) out().write(block, n);
         return;
     }
-    else if (command == "fg" && args.size() > 1) {
-        fg(stoi(args[1]));
+    for (size_t i = 1; i < args.size(); i++) {
+        CatResult result = cat_file(args.str(i));
+        if (result == CAT_OPEN_FAILED) {
+            cerr << "Error: Cannot open file '" << args[i] << "'.\n";
+            last_status = 1;
+        } else if (result == CAT_COPY_FAILED) {
+            // The reader went away: stop quietly, as cat does on SIGPIPE.
+            if (errno == EPIPE) return;
+            cerr << "Error: Cannot copy file '" << args[i] << "': " << strerror(errno) << ".\n";
+            last_status = 1;
+        }
+    }
+}
+
+void builtin_cp(const Args& args) {
+    copy_command(args);
+}
+
+void builtin_mv(const Args& args) {
+    if (rename(args.str(1).c_str(), args.str(2).c_str()) == 0) {
+        cout << "File moved from '" << args[1] << "' to '" << args[2] << "'.\n";
+    } else {
+        cerr << "Error: Could not move file.\n";
+    }
+}
+
+// time: the clock. time <command>: runs it and reports its resource usage
+// (pipelines are timed as a whole by execute_pipeline).
+void builtin_time(const Args& args) {
+    if (args.size() > 1) {
+        TimeReport report;
+        execute_command(args.from(1));
         return;
     }
-    else if (command == "kill" && args.size() > 1) {
-        killJob(stoi(args[1]));
+    time_t now = time(nullptr);
+    tm* local = localtime(&now);
+    out().printf("Current time: %02d:%02d:%02d\n", local->tm_hour, local->tm_min, local->tm_sec);
+}
+
+void builtin_exit(const Args& args) {
+    if (args.size() > 1) last_status = stoi(args.str(1));
+    exit_requested = true;
+}
+
+// hash [-r] [name...]: lists the command hash, clears it, or adds names.
+void builtin_hash(const Args& args) {
+    if (args.size() == 2 && args[1] == "-r") {
+        command_hash().clear();
         return;
     }
-    else if (command == "run" && args.size() > 1) {
-        string cmd;
-        for (size_t i = 1; i < args.size(); ++i) {
-            cmd += args[i] + " ";
+    last_status = 0;
+    if (args.size() > 1) {
+        for (size_t i = 1; i < args.size(); i++) {
+            string name = args.str(i);
+            if (find_builtin(to_lower(name))) continue;
+            if (name.find('/') != string::npos || command_hash().lookup(name, false).empty()) {
+                cerr << "hash: " << name << ": not found\n";
+                last_status = 1;
+            }
         }
-        launchBackgroundProcess(cmd);
         return;
     }
-    else if (command == "ping" && args.size() > 1) {
-        runPingCommand(args[1]);
+    auto entries = command_hash().entries();
+    if (entries.empty()) {
+        cout << "hash: hash table empty\n";
         return;
     }
-    else if (command == "schedule" && args.size() > 3 && args[args.size()-2] == "at") {
-        string cmd;
-        for (size_t i = 1; i < args.size() - 2; ++i) {
-            cmd += args[i] + " ";
+    OutputSink& sink = out();
+    sink << "hits    command\n";
+    for (const auto& entry : entries) sink.printf("%4lu    %s\n", entry.second.hits, entry.second.path.c_str());
+}
+
+// type <name...>: says how each name would be run.
+void builtin_type(const Args& args) {
+    last_status = 0;
+    OutputSink& sink = out();
+    for (size_t i = 1; i < args.size(); i++) {
+        string name = args.str(i);
+        const AliasTable::Alias* alias = aliases.find(name);
+        if (alias) {
+            sink << name << " is aliased to '" << alias->value << "'\n";
+        } else if (find_builtin(to_lower(name))) {
+            sink << name << " is a shell builtin\n";
+        } else if (shell_functions.count(name)) {
+            sink << name << " is a function: { " << shell_functions[name] << " }\n";
+        } else if (command_hash().contains(name)) {
+            sink << name << " is hashed (" << command_hash().lookup(name, false) << ")\n";
+        } else {
+            string path = (name.find('/') != string::npos) ? resolve_executable(name) : search_path(name);
+            if (path.empty()) {
+                flush_output();
+                cerr << "type: " << name << ": not found\n";
+                last_status = 1;
+            } else {
+                sink << name << " is " << path << '\n';
+            }
         }
-        int delay = stoi(args.back());
-        scheduleCommand(cmd, delay);
-        return;
     }
-    else if (command == "note") {
-        if (args.size() > 2 && args[1] == "add") {
-            string note;
-            for (size_t i = 2; i < args.size(); ++i) {
-                note += args[i] + " ";
+}
+
+void builtin_pipestatus(const Args&) {
+    for (size_t i = 0; i < pipe_status.size(); i++) {
+        cout << (i ? " " : "") << pipe_status[i];
+    }
+    cout << endl;
+}
+
+// stats: output counters and per-command latency. stats <command> shows
+// one histogram, stats --trace <file> writes the trace, stats on|off
+// toggles instrumentation and stats -r resets it.
+void builtin_stats(const Args& args) {
+    if (args.size() > 1) {
+        if (args[1] == "on" || args[1] == "off") {
+            command_stats_enabled = args[1] == "on";
+        } else if (args[1] == "-r") {
+            reset_command_stats();
+        } else if (args[1] == "--trace" && args.size() > 2) {
+            if (!write_command_trace(args.str(2))) {
+                cerr << "stats: cannot write '" << args[2] << "'" << endl;
+                last_status = 1;
             }
-            addNote(note);
-        }
-        else if (args.size() > 1 && args[1] == "view") {
-            viewNotes();
+        } else if (!print_command_histogram(out(), args.str(1))) {
+            flush_output();
+            cerr << "stats: no calls of '" << args[1] << "' recorded" << endl;
+            last_status = 1;
         }
         return;
     }
-    else if (command == "lock") {
-        lockShell();
-        return;
+    FdWriter& writer = stdout_writer();
+    const OutputStats& stats = writer.stats;
+    OutputSink& sink = out();
+    sink << "Output: " << (unsigned long)(writer.buffer_size() / 1024) << " KiB buffer, "
+         << (writer.is_line_buffered() ? "line buffered (terminal)" : "block buffered") << '\n';
+    sink << "  bytes written     " << stats.bytes.load() << '\n';
+    sink << "  write() calls     " << stats.writes.load() << '\n';
+    sink << "  flushes: full     " << stats.full.load() << '\n';
+    sink << "           line     " << stats.lines.load() << '\n';
+    sink << "           explicit " << stats.explicit_.load() << '\n';
+    sink << "  endl/flush with nothing to write " << stats.hints.load() << '\n';
+    print_command_stats(sink);
+}
+
+void builtin_pipesize(const Args& args) {
+    if (args.size() > 1) pipe_buffer_size = stol(args.str(1));
+    cout << "Pipe buffer size: ";
+    if (pipe_buffer_size > 0) cout << pipe_buffer_size << " bytes" << endl;
+    else cout << "system default" << endl;
+}
+
+void builtin_bench(const Args& args) {
+    runBenchmark(args);
+}
+
+void builtin_verbose(const Args& args) {
+    if (args.size() > 1) verbosity = stoi(args.str(1));
+    cout << "Verbosity: " << verbosity << endl;
+}
+
+// Builtin table. Lookup goes through a perfect hash computed at compile
+// time, so resolving any command name costs one hash and one compare.
+constexpr Builtin builtin_table[] = {
+    { "help", builtin_help, 0, "help", "Show this help message", SECTION_GENERAL, COMPLETE_NONE },
+    { "cd", builtin_cd, 0, "cd <dir>", "Change directory", SECTION_GENERAL, COMPLETE_DIRS },
+    { "pwd", builtin_pwd, 0, "pwd", "Print working directory", SECTION_GENERAL, COMPLETE_NONE },
+    { "clear", builtin_clear, 0, "clear", "Clear the screen", SECTION_GENERAL, COMPLETE_NONE },
+    { "history", builtin_history, 0, "history [count]", "Show recent command history", SECTION_GENERAL, COMPLETE_NONE },
+    { "ls", builtin_ls, 0, "ls [-lRSt] [dir]", "List directory contents (-R recurse, -S size, -t time)", SECTION_GENERAL, COMPLETE_DIRS },
+    { "ll", builtin_ll, 0, "ll [-RSt] [dir]", "List directory contents (long format with details)", SECTION_GENERAL, COMPLETE_DIRS },
+    { "mkdir", builtin_mkdir, 1, "mkdir <dir>", "Create a directory", SECTION_GENERAL, COMPLETE_DIRS },
+    { "touch", builtin_touch, 1, "touch <file>", "Create/update a file", SECTION_GENERAL, COMPLETE_FILES },
+    { "rm", builtin_rm, 1, "rm <file>", "Delete a file", SECTION_GENERAL, COMPLETE_FILES },
+    { "cat", builtin_cat, 0, "cat [file]...", "Display contents of files (or standard input)", SECTION_GENERAL, COMPLETE_FILES },
+    { "cp", builtin_cp, 2, "cp [-r] <src> <dst>", "Copy file (or directory with -r) from src to dst", SECTION_GENERAL, COMPLETE_FILES },
+    { "mv", builtin_mv, 2, "mv <src> <dst>", "Move (rename) file from src to dst", SECTION_GENERAL, COMPLETE_FILES },
+    { "time", builtin_time, 0, "time [command]", "Show current time, or run a command and report its resource use", SECTION_GENERAL, COMPLETE_COMMANDS },
+    { "exit", builtin_exit, 0, "exit [status]", "Exit the shell", SECTION_GENERAL, COMPLETE_NONE },
+    { "verbose", builtin_verbose, 0, "verbose [level]", "Show or set debug tracing (0 = off)", SECTION_GENERAL, COMPLETE_NONE },
+    { "count", builtin_count, 2, "count [-s] <file|dir>... <word>", "Count occurrences of word (-s: substring, -e: several words)", SECTION_CUSTOM, COMPLETE_FILES },
+    { "cache", builtin_cache, 0, "cache [clear | on | off | max MB]", "Show or manage the wordfreq/count result cache", SECTION_CUSTOM, COMPLETE_NONE },
+    { "find", builtin_find, 0, "find [dir...] [-name GLOB] [-type T]", "Walk directory trees in parallel (--gitignore, --sort, -j N)", SECTION_CUSTOM, COMPLETE_DIRS },
+    { "grep", builtin_grep, 1, "grep [-rinvclF] <pattern> [path...]", "Search files, trees (-r) or standard input for a pattern", SECTION_CUSTOM, COMPLETE_FILES },
+    { "wordfreq", builtin_wordfreq, 1, "wordfreq [-k N] [-j THREADS] <file>", "Show the N most frequent words (default 10)", SECTION_CUSTOM, COMPLETE_FILES },
+    { "calc", builtin_calc, 0, "calc [-i | -b] <expression>", "Calculator: precedence, variables, functions; -f file or stdin for batches", SECTION_CUSTOM, COMPLETE_NONE },
+    { "jobs", builtin_jobs, 0, "jobs", "List all background jobs", SECTION_CUSTOM, COMPLETE_NONE },
+    { "fg", builtin_fg, 1, "fg <jobid>", "Bring background job to foreground", SECTION_CUSTOM, COMPLETE_NONE },
+    { "bg", builtin_bg, 1, "bg <jobid>", "Resume a stopped job in the background", SECTION_CUSTOM, COMPLETE_NONE },
+    { "wait", builtin_wait, 0, "wait [jobid]...", "Wait for background jobs to finish", SECTION_CUSTOM, COMPLETE_NONE },
+    { "kill", builtin_kill, 1, "kill [-signal] <jobid>...", "Send a signal (default TERM) to a job", SECTION_CUSTOM, COMPLETE_NONE },
+    { "alias", builtin_alias, 0, "alias [name='command'] [-s [file]]", "Create, list or save aliases", SECTION_CUSTOM, COMPLETE_COMMANDS },
+    { "unalias", builtin_unalias, 1, "unalias <name...> | -a", "Remove aliases", SECTION_CUSTOM, COMPLETE_COMMANDS },
+    { "lock", builtin_lock, 0, "lock", "Lock the shell (requires password to unlock)", SECTION_CUSTOM, COMPLETE_NONE },
+    { "note", builtin_note, 1, "note add <text> | note view", "Add a note or view all shell notes", SECTION_CUSTOM, COMPLETE_NONE },
+    { "ping", builtin_ping, 1, "ping <host>", "Ping a host to check connectivity", SECTION_CUSTOM, COMPLETE_NONE },
+    { "schedule", builtin_schedule, 1, "schedule <cmd> at|every <time>", "Run a command later or repeatedly (list, cancel <id>)", SECTION_CUSTOM, COMPLETE_COMMANDS },
+    { "run", builtin_run, 1, "run <cmd>", "Run a command in background", SECTION_CUSTOM, COMPLETE_COMMANDS },
+    { "parallel", builtin_parallel, 1, "parallel [-j N] <cmd> [::: args]", "Run cmd once per argument (or stdin line), N at a time", SECTION_CUSTOM, COMPLETE_COMMANDS },
+    { "bench", builtin_bench, 0, "bench <case> [args]", "Run a micro-benchmark (bench list for cases)", SECTION_CUSTOM, COMPLETE_NONE },
+    { "stats", builtin_stats, 0, "stats [command | --trace file | on | off | -r]", "Show output counters and per-command latency", SECTION_GENERAL, COMPLETE_COMMANDS },
+    { "hash", builtin_hash, 0, "hash [-r] [name...]", "Show, fill or clear (-r) the command path cache", SECTION_GENERAL, COMPLETE_COMMANDS },
+    { "type", builtin_type, 1, "type <name...>", "Tell whether a name is an alias, builtin or program", SECTION_GENERAL, COMPLETE_COMMANDS },
+    { "pipestatus", builtin_pipestatus, 0, "pipestatus", "Show exit status of each stage of the last pipeline", SECTION_CUSTOM, COMPLETE_NONE },
+    { "pipesize", builtin_pipesize, 0, "pipesize [bytes]", "Show or set the pipe buffer size for pipelines", SECTION_CUSTOM, COMPLETE_NONE },
+    { "banao", builtin_banao, 1, "banao <file>", "Create/update a file", SECTION_HINDI, COMPLETE_FILES },
+    { "hatao", builtin_hatao, 1, "hatao <file>", "Delete a file", SECTION_HINDI, COMPLETE_FILES },
+    { "dikhhao", builtin_dikhhao, 1, "dikhhao <file>", "Display file contents", SECTION_HINDI, COMPLETE_FILES },
+    { "badlo", builtin_badlo, 2, "badlo <old> <new>", "Rename file", SECTION_HINDI, COMPLETE_FILES },
+};
+
+constexpr size_t BUILTIN_COUNT = sizeof(builtin_table) / sizeof(builtin_table[0]);
+constexpr size_t BUILTIN_SLOTS = 256;
+static_assert(BUILTIN_COUNT <= MAX_BUILTINS, "raise MAX_BUILTINS for the command counters");
+static_assert(BUILTIN_COUNT < 128, "builtin slot indices are stored as signed char");
+
+constexpr size_t const_strlen(const char* s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+constexpr uint32_t builtin_hash(const char* s, size_t n, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
     }
-    else if (command == "count") {
-        cout << "[DEBUG] Entered 'count' handler\n";
-        if (args.size() < 3) {
-            cerr << "Usage: count <filename> <word>" << endl;
-            cerr << "Example: count myfile.txt hello" << endl;
-        } else {
-            count_word_in_file(args[1], args[2]);
+    return h ^ (h >> 16);
+}
+
+// Smallest seed for which every builtin name lands in its own slot.
+constexpr uint32_t find_builtin_seed() {
+    for (uint32_t seed = 0; seed < 65536; seed++) {
+        bool used[BUILTIN_SLOTS] = {};
+        bool collision = false;
+        for (const auto& b : builtin_table) {
+            size_t slot = builtin_hash(b.name, const_strlen(b.name), seed) % BUILTIN_SLOTS;
+            if (used[slot]) {
+                collision = true;
+                break;
+            }
+            used[slot] = true;
         }
-        return;
+        if (!collision) return seed;
     }
-    else if (command == "wordfreq") {
-        if (args.size() < 2) {
-            cerr << "Usage: wordfreq <filename>" << endl;
-            cerr << "Example: wordfreq myfile.txt" << endl;
-        } else {
-            word_frequency(args[1]);
+    return UINT32_MAX;
+}
+
+constexpr uint32_t builtin_seed = find_builtin_seed();
+static_assert(builtin_seed != UINT32_MAX, "no perfect hash seed for the builtin names");
+
+struct BuiltinSlots {
+    signed char index[BUILTIN_SLOTS];
+};
+
+constexpr BuiltinSlots build_builtin_slots() {
+    BuiltinSlots slots = {};
+    for (size_t i = 0; i < BUILTIN_SLOTS; i++) slots.index[i] = -1;
+    for (size_t i = 0; i < BUILTIN_COUNT; i++) {
+        const char* name = builtin_table[i].name;
+        slots.index[builtin_hash(name, const_strlen(name), builtin_seed) % BUILTIN_SLOTS] = (signed char)i;
+    }
+    return slots;
+}
+
+constexpr BuiltinSlots builtin_slots = build_builtin_slots();
+
+const Builtin* find_builtin(const string& name) {
+    int index = builtin_slots.index[builtin_hash(name.data(), name.size(), builtin_seed) % BUILTIN_SLOTS];
+    if (index < 0 || name != builtin_table[index].name) return nullptr;
+    return &builtin_table[index];
+}
+
+const Builtin* builtins_begin() {
+    return builtin_table;
+}
+
+const Builtin* builtins_end() {
+    return builtin_table + BUILTIN_COUNT;
+}
+
+void execute_command(const Args& args, const SpawnIO& io) {
+    if (args.empty()) return;
+    string command(args[0]);
+    command.erase(0, command.find_first_not_of(" \n\r\t"));
+    command.erase(command.find_last_not_of(" \n\r\t") + 1);
+    for (auto &c : command) c = tolower(c);
+    if (verbosity > 0) cerr << "[DEBUG] Running command: '" << command << "'" << endl;
+
+    const Builtin* builtin = find_builtin(command);
+    const string* function = nullptr;
+    if (!builtin && !shell_functions.empty()) {
+        auto it = shell_functions.find(string(args[0]));
+        if (it != shell_functions.end()) function = &it->second;
+    }
+    if (builtin || function) {
+        if (builtin && (int)args.size() - 1 < builtin->min_args) {
+            cerr << "Usage: " << builtin->usage << endl;
+            last_status = 2;
+            return;
+        }
+        // Redirections only retarget this thread's sinks and source, which
+        // leaves other threads and an enclosing $(...) alone.
+        unique_ptr<FdWriter> writer, error_writer;
+        unique_ptr<FdSource> source;
+        int fd;
+        if (io.out != NO_IO && (fd = dup_handle_fd(io.out)) >= 0) {
+            writer.reset(new FdWriter(fd, REDIRECT_BUFFER_SIZE, true));
+        }
+        if (io.err != NO_IO && (fd = dup_handle_fd(io.err)) >= 0) {
+            error_writer.reset(new FdWriter(fd, REDIRECT_BUFFER_SIZE, true));
+        }
+        if (io.in != NO_IO && (fd = dup_handle_fd(io.in)) >= 0) source.reset(new FdSource(fd, true));
+        OutputSink* original_out = &out();
+        OutputSink* original_err = &err();
+        IoScope scope(writer.get(), source.get(), error_writer.get());
+        if (io.err_to_out) current_error = io.out != NO_IO ? original_out : &out();
+        else if (io.out_to_err) current_output = io.err != NO_IO ? original_err : &err();
+        if (function) {
+            CommandTimer timer(command_stats().program(string(args[0])), "function");
+            run_function(*function, args);
+            return;
+        }
+        CommandTimer timer(command_stats().builtins[builtin - builtin_table], "builtin");
+        try {
+            builtin->handler(args);
+        } catch (const exception&) {
+            cerr << "Error: Invalid argument. Usage: " << builtin->usage << endl;
+            last_status = 2;
         }
         return;
     }
-    else if (command == "calc") {
-        if (args.size() < 4) {
-            cerr << "Usage: calc <num1> <operator> <num2>" << endl;
-            cerr << "Example: calc 10 + 5" << endl;
-            cerr << "Operators: +, -, *, /, %, ^ (or **)" << endl;
-        } else {
-            calculator(args[1], args[2], args[3]);
-        }
+
+    CommandTimer timer(command_stats().program(string(args[0])), "program");
+#ifdef _WIN32
+    if (io.in != NO_IO || io.out != NO_IO || io.err != NO_IO || io.err_to_out || io.out_to_err ||
+        current_output || current_input || current_error) {
+        last_status = runExternal(args.to_vector(), io);
         return;
     }
-    else if (command == "cd") {
-        if (args.size() < 2) {
-            char current_dir[MAX_PATH];
-            if (GetCurrentDirectoryA(MAX_PATH, current_dir)) {
-                cout << current_dir << endl;
-            }
-        } else {
-            if (_chdir(args[1].c_str()) != 0) {
-                cerr << "Error changing directory" << endl;
+
+    string cmd;
+    for (const auto& arg : args) cmd.append(arg).append(" ");
+
+    if (cmd.find(".exe") != string::npos || command == "notepad" || command == "calc") {
+        system(("start \"\" " + cmd).c_str());
+    } else {
+        system(cmd.c_str());
+    }
+#else
+    last_status = runExternal(args.to_vector(), io);
+#endif
+}
+
+// Runs a command line with its output kept in memory: builtins append to
+// the string directly and programs are read through a pipe, so $(...)
+// needs neither a temporary file nor, for a builtin, a process. Trailing
+// newlines are dropped.
+string capture_output(string_view line) {
+    StringSink sink;
+    {
+        IoScope scope(&sink, nullptr);
+        run_command_line(line);
+    }
+    string& text = sink.text;
+    while (!text.empty() && (text.back() == '\n' || text.back() == '\r')) text.pop_back();
+    return move(text);
+}
+
+// Expands a word the lexer flagged: quotes are removed by the same rules,
+// each $(...) is replaced by its output, and the output of an unquoted one
+// is split into separate words at whitespace.
+void expand_word(string_view raw, vector<string>& fields) {
+    string field;
+    bool have = false;      // quotes make an empty word count
+    auto substitute = [&](size_t& i, bool quoted) {
+        size_t end = Lexer::substitution_end(raw, i);
+        string output = capture_output(raw.substr(i + 2, end - i - 3));
+        i = end - 1;
+        if (quoted) {
+            field += output;
+            return;
+        }
+        for (char c : output) {
+            if (!isspace((unsigned char)c)) {
+                field += c;
+                have = true;
+            } else if (have) {
+                fields.push_back(move(field));
+                field.clear();
+                have = false;
             }
         }
-        return;
-    }
-    else if (command == "hatao") {
-        if (args.size() < 2) {
-            cerr << "Error: hatao requires a filename" << endl;
-        } else {
-            if (remove(args[1].c_str()) == 0) {
-                cout << "File deleted successfully (via hatao)" << endl;
-            } else {
-                cerr << "Error deleting file (via hatao)" << endl;
+    };
+    for (size_t i = 0; i < raw.size(); i++) {
+        char c = raw[i];
+        if (c == '$' && i + 1 < raw.size() && raw[i + 1] == '(') {
+            substitute(i, false);
+        } else if (c == '\'') {
+            have = true;
+            while (raw[++i] != '\'') field += raw[i];
+        } else if (c == '"') {
+            have = true;
+            while (raw[++i] != '"') {
+                if (raw[i] == '$' && raw[i + 1] == '(') {
+                    substitute(i, true);
+                    continue;
+                }
+                if (raw[i] == '\\' && i + 1 < raw.size() &&
+                    (raw[i + 1] == '"' || raw[i + 1] == '\\' || raw[i + 1] == '$')) i++;
+                field += raw[i];
             }
+        } else if (c == '\\' && Lexer::backslash_escapes && i + 1 < raw.size()) {
+            field += raw[++i];
+            have = true;
+        } else {
+            field += c;
+            have = true;
         }
-        return;
     }
-    else if (command == "banao") {
-        if (args.size() < 2) {
-            cerr << "Error: banao requires a filename" << endl;
-        } else {
-            ofstream file(args[1], ios::app);
-            if (file) {
-                file.close();
-                cout << "File created/updated successfully (via banao)" << endl;
-            } else {
-                cerr << "Error creating/updating file (via banao)" << endl;
-            }
+    if (have) fields.push_back(move(field));
+}
+
+// The words of one command after expansion. Unflagged words stay views into
+// the parse arena; expanded ones are kept in storage.
+void expand_words(const SimpleCommand& command, vector<string_view>& words, deque<string>& storage) {
+    words.clear();
+    for (size_t i = 0; i < command.word_count; i++) {
+        if (!command.expand || !command.expand[i]) {
+            words.push_back(command.words[i]);
+            continue;
+        }
+        vector<string> fields;
+        expand_word(command.words[i], fields);
+        for (auto& field : fields) {
+            storage.push_back(move(field));
+            words.push_back(storage.back());
         }
-        return;
     }
-    else if (command == "dikhhao") {
-        if (args.size() < 2) {
-            cerr << "Error: dikhhao requires a filename" << endl;
-        } else {
-            ifstream file(args[1]);
-            if (file) {
-                string line;
-                while (getline(file, line)) {
-                    cout << line << endl;
-                }
-                file.close();
+}
+
+// Feeds a here-string through a pipe. Text that fits in the pipe is written
+// at once; anything longer is written by a thread while the command reads.
+IoHandle here_string(string text) {
+    IoHandle readEnd, writeEnd;
+    if (!createPipe(readEnd, writeEnd)) return NO_IO;
+    if (text.size() <= 4096) {
+        writeIo(writeEnd, text.data(), text.size());
+        closeIo(writeEnd);
+    } else {
+        thread([writeEnd](string text) {
+            writeIo(writeEnd, text.data(), text.size());
+            closeIo(writeEnd);
+        }, move(text)).detach();
+    }
+    return readEnd;
+}
+
+// Opens the redirections of one command, in order, so "> file 2>&1" sends
+// both streams to the file. When a stream is redirected more than once the
+// last redirection wins, as in other shells. Nothing is copied: a child gets
+// the descriptors with dup2, a builtin gets a writer on them.
+bool open_redirects(const Redirect* redirect, SpawnIO& io) {
+    for (; redirect; redirect = redirect->next) {
+        IoHandle* slots[3] = { &io.in, &io.out, &io.err };
+        IoHandle& slot = *slots[redirect->fd];
+        if (redirect->kind == REDIRECT_DUP) {
+            int from = redirect->target[0] - '0';
+            if (from == redirect->fd) continue;
+            closeIo(slot);
+            slot = NO_IO;
+            io.err_to_out = io.out_to_err = false;
+            if (*slots[from] != NO_IO) {
+                slot = duplicateIo(*slots[from]);
+            } else if (redirect->fd == 2 && from == 1) {
+                io.err_to_out = true;
+            } else if (redirect->fd == 1 && from == 2) {
+                io.out_to_err = true;
             } else {
-                cerr << "Error reading file (via dikhhao)" << endl;
+                cerr << "Error: cannot duplicate descriptor " << from << " onto " << redirect->fd << endl;
+                return false;
             }
+            continue;
         }
-        return;
-    }
-    else if (command == "badlo") {
-        if (args.size() < 3) {
-            cerr << "Error: badlo requires source and destination filenames" << endl;
-        } else {
-            if (rename(args[1].c_str(), args[2].c_str()) == 0) {
-                cout << "File renamed from '" << args[1] << "' to '" << args[2] << "' (via badlo)" << endl;
+
+        string target(redirect->target);
+        if (redirect->expand) {
+            vector<string> fields;
+            expand_word(redirect->target, fields);
+            if (redirect->kind == REDIRECT_HERE_STRING) {
+                target.clear();
+                for (const auto& field : fields) target += (target.empty() ? "" : " ") + field;
+            } else if (fields.size() != 1) {
+                cerr << "Error: ambiguous redirect '" << redirect->target << "'" << endl;
+                return false;
             } else {
-                cerr << "Error renaming file (via badlo)" << endl;
+                target = move(fields[0]);
             }
         }
-        return;
+        bool output = (redirect->kind == REDIRECT_OUT || redirect->kind == REDIRECT_APPEND);
+        IoHandle h = (redirect->kind == REDIRECT_HERE_STRING) ? here_string(target + "\n")
+                   : openRedirect(target, output, redirect->kind == REDIRECT_APPEND);
+        if (h == NO_IO) {
+            cerr << "Error: cannot open '" << target << "' for " << (output ? "writing" : "reading") << endl;
+            return false;
+        }
+        closeIo(slot);
+        slot = h;
+        if (redirect->fd == 1) io.out_to_err = false;
+        if (redirect->fd == 2) io.err_to_out = false;
     }
-    else if (command == "clear") {
-        system("cls");
-        return;
+    return true;
+}
+
+void close_redirects(vector<SpawnIO>& io) {
+    for (auto& stage : io) {
+        closeIo(stage.in);
+        closeIo(stage.out);
+        closeIo(stage.err);
     }
-    else if (command == "pwd") {
-        char cwd[1024];
-        if (_getcwd(cwd, sizeof(cwd))) {
-            cout << cwd << endl;
+}
+
+// Runs a foreground pipeline that builtins take part in, or one whose ends
+// belong to an in-memory sink or source. Builtin stages run in this process,
+// each on a thread of its own except a builtin last stage, which runs on the
+// calling thread. Two adjacent builtins are joined by a RingBuffer and a
+// builtin and a program by a pipe, so a pipeline of builtins starts no
+// process at all. Returns the status of each stage.
+vector<int> run_stages(const vector<vector<string_view>>& words, const vector<SpawnIO>& io) {
+    size_t n = words.size();
+    vector<bool> builtin(n);
+    for (size_t i = 0; i < n; i++) {
+        builtin[i] = !words[i].empty() && runs_in_shell(string(words[i][0]));
+    }
+
+    // Stage i writes into rings[i] or writeEnds[i]; stage i + 1 reads it.
+    vector<unique_ptr<RingBuffer>> rings(n);
+    vector<IoHandle> readEnds(n, NO_IO), writeEnds(n, NO_IO);
+    auto close_pipes = [&]() {
+        for (size_t i = 0; i < n; i++) {
+            closeIo(readEnds[i]);
+            closeIo(writeEnds[i]);
+            readEnds[i] = writeEnds[i] = NO_IO;
+        }
+    };
+    for (size_t i = 0; i + 1 < n; i++) {
+        if (builtin[i] && builtin[i + 1]) {
+            rings[i].reset(new RingBuffer());
+        } else if (!createPipe(readEnds[i], writeEnds[i])) {
+            cerr << "Error creating pipe.\n";
+            close_pipes();
+            return vector<int>(n, 1);
         }
-        return;
     }
-    else if (command == "history") {
-        cout << "Command history (last 10 commands):\n";
-        int start = (command_history.size() > 10) ? command_history.size() - 10 : 0;
-        for (size_t i = start; i < command_history.size(); i++) {
-            cout << "  " << i + 1 << ": " << command_history[i] << endl;
+
+    // Every builtin stage gets its sink and source here, before anything
+    // starts, so the pipe ends can be closed as soon as the programs run.
+    // The ends of the pipeline keep this thread's own sink and source, and
+    // execute_command puts the stage's redirections on top.
+    OutputSink* caller_output = current_output;
+    InputSource* caller_input = current_input;
+    OutputSink* caller_error = current_error;
+    vector<unique_ptr<OutputSink>> sinks(n);
+    vector<unique_ptr<InputSource>> sources(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!builtin[i]) continue;
+        int fd;
+        if (rings[i]) {
+            sinks[i].reset(new RingSink(*rings[i]));
+        } else if (i + 1 < n && (fd = dup_handle_fd(writeEnds[i])) >= 0) {
+            sinks[i].reset(new FdWriter(fd, 64 * 1024, true));
+        }
+        if (i > 0 && rings[i - 1]) {
+            sources[i].reset(new RingSource(*rings[i - 1]));
+        } else if (i > 0 && (fd = dup_handle_fd(readEnds[i - 1])) >= 0) {
+            sources[i].reset(new FdSource(fd, true));
         }
-        return;
     }
-    else if (command == "help") {
-        print_help();
-        return;
+
+    vector<int> statuses(n, 127);
+    vector<ProcHandle> handles(n);
+    vector<ProcId> pids(n);
+    vector<bool> started(n, false);
+    ChildStreams ends;
+    for (size_t i = 0; i < n; i++) {
+        if (builtin[i]) continue;
+        SpawnIO stage_io;
+        stage_io.in = (io[i].in != NO_IO) ? io[i].in : (i > 0) ? readEnds[i - 1] : NO_IO;
+        stage_io.out = (io[i].out != NO_IO) ? io[i].out : (i + 1 < n) ? writeEnds[i] : NO_IO;
+        stage_io.err = io[i].err;
+        stage_io.err_to_out = io[i].err_to_out;
+        stage_io.out_to_err = io[i].out_to_err;
+        keep_original_streams(stage_io, io[i], (i + 1 < n) ? writeEnds[i] : NO_IO);
+        if (i == 0) ends.attach_input(stage_io.in);
+        if (i + 1 == n) ends.attach_output(stage_io.out);
+        if (i + 1 == n) ends.attach_kept_error(stage_io, io[i]);
+        ends.attach_error(stage_io);
+        if (words[i].empty()) continue;
+        vector<string> argv(words[i].begin(), words[i].end());
+        started[i] = spawnProcess(argv, stage_io, handles[i], pids[i]);
     }
-    else if (command == "ls" || command == "ll") {
-        string path = (args.size() > 1) ? args[1] : ".";
-        bool long_format = (command == "ll");
 
-        wstring wpath;
-        if (path.back() != '\\' && path.back() != '/') {
-            wpath = wstring(path.begin(), path.end()) + L"\\*";
-        } else {
-            wpath = wstring(path.begin(), path.end()) + L"*";
+    auto run_builtin = [&](size_t i) {
+        {
+            IoScope scope(sinks[i] ? sinks[i].get() : caller_output, sources[i] ? sources[i].get() : caller_input,
+                          caller_error);
+            last_status = 0;
+            execute_command(Args(words[i].data(), words[i].size()), io[i]);
+            flush_output();
+            statuses[i] = last_status;
         }
+        // Closing the ends is the next stage's end of input, or tells the
+        // previous one to stop.
+        sinks[i].reset();
+        sources[i].reset();
+    };
+    vector<thread> threads;
+    for (size_t i = 0; i + 1 < n; i++) {
+        if (builtin[i]) threads.emplace_back(run_builtin, i);
+    }
+    close_pipes();
 
-        WIN32_FIND_DATAW findFileData;
-        HANDLE hFind = FindFirstFileW(wpath.c_str(), &findFileData);
+    ends.start();
+    if (builtin[n - 1]) run_builtin(n - 1);
+    ends.finish();
+    for (auto& t : threads) t.join();
+    reapAsTheyExit(handles, started, statuses);
+    return statuses;
+}
 
-        if (hFind == INVALID_HANDLE_VALUE) {
-            DWORD err = GetLastError();
-            if (err != ERROR_FILE_NOT_FOUND) {
-                cerr << "Error: Cannot access directory (code " << err << ").\n";
-            }
+// Builtins that change the shell itself (directory, aliases, jobs,
+// settings) run in the shell even with &; a copy of the shell would change
+// only itself.
+bool changes_shell_state(const string& name) {
+    static const char* const names[] = {
+        "cd", "exit", "alias", "unalias", "verbose", "cache", "stats", "hash", "pipesize",
+        "jobs", "fg", "bg", "wait", "kill", "schedule", "lock",
+    };
+    string command = to_lower(name);
+    for (const char* state : names) {
+        if (command == state) return true;
+    }
+    return false;
+}
+
+void execute_pipeline(const Pipeline& pipeline, bool background) {
+    size_t n = pipeline.stage_count;
+    vector<vector<string_view>> words(n);
+    deque<string> expanded;
+    for (size_t i = 0; i < n; i++) expand_words(pipeline.stages[i], words[i], expanded);
+
+    // "time" in front of a foreground pipeline times all of it, as in sh.
+    unique_ptr<TimeReport> report;
+    if (!background && words[0].size() > 1 && words[0][0] == "time") {
+        words[0].erase(words[0].begin());
+        report.reset(new TimeReport());
+    }
+
+    vector<SpawnIO> io(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!open_redirects(pipeline.stages[i].redirects, io[i])) {
+            close_redirects(io);
+            last_status = 1;
+            pipe_status.assign(1, last_status);
             return;
         }
+    }
 
-        do {
-            string filename = wide_to_narrow(findFileData.cFileName);
-            if (filename == "." || filename == "..") continue;
-
-            if (long_format) {
-                cout << ((findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? "[D] " : "[F] ");
-                cout << setw(30) << left << filename;
-                
-                if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-                    cout << " " << setw(10) << right 
-                         << (findFileData.nFileSizeLow / 1024) << " KB";
-                }
-                cout << endl;
-            } else {
-                cout << filename << "  ";
-            }
-        } while (FindNextFileW(hFind, &findFileData) != 0);
+    Args first_args(words[0].data(), words[0].size());
+    if (n == 1 && (!background || first_args.empty() || changes_shell_state(first_args.str(0)))) {
+        // A bare redirection ("> file") only creates or truncates the file.
+        last_status = 0;
+        execute_command(first_args, io[0]);
+        close_redirects(io);
+        pipe_status.assign(1, last_status);
+        return;
+    }
 
-        FindClose(hFind);
-        if (!long_format) cout << endl;
+    bool any_builtin = false;
+    for (size_t i = 0; i < n; i++) {
+        any_builtin |= !words[i].empty() && runs_in_shell(string(words[i][0]));
+    }
+    if (!background && (any_builtin || current_output || current_input)) {
+        pipe_status = run_stages(words, io);
+        last_status = pipe_status.back();
+        close_redirects(io);
         return;
     }
-    else if (command == "mkdir") {
-        if (args.size() < 2) {
-            cerr << "Error: mkdir requires a directory name.\n";
-        } else {
-            if (_mkdir(args[1].c_str()) == 0) {
-                cout << "Directory '" << args[1] << "' created successfully.\n";
-            } else {
-                cerr << "Error: Could not create directory '" << args[1] << "'.\n";
-                if (errno == EEXIST) {
-                    cerr << "Directory already exists.\n";
-                }
+
+    // A background job outlives this call, so its builtins, a lone one
+    // included, become copies of the shell like the stages of parallel.
+    vector<vector<string>> stages(n);
+    string text;
+    for (size_t i = 0; i < n; i++) {
+        Args args(words[i].data(), words[i].size());
+        stages[i] = shell_argv(args.to_vector());
+        if (i > 0) text += "| ";
+        text += join_args(args, 0, args.size());
+    }
+
+    if (background) {
+        vector<ProcHandle> handles;
+        vector<ProcId> pids;
+        vector<bool> started;
+        if (startPipeline(stages, io, handles, pids, started)) {
+            vector<ProcHandle> job_handles;
+            vector<ProcId> job_pids;
+            for (size_t i = 0; i < n; i++) {
+                if (!started[i]) continue;
+                job_handles.push_back(handles[i]);
+                job_pids.push_back(pids[i]);
             }
+            if (!job_handles.empty()) addJob(text, job_handles, job_pids);
         }
-        return;
+        last_status = 0;
+    } else {
+        pipe_status = runPipeline(stages, io);
+        last_status = pipe_status.back();
     }
-    else if (command == "touch") {
-        if (args.size() < 2) {
-            cerr << "Error: touch requires a filename.\n";
-        } else {
-            ofstream file(args[1], ios::app);
-            if (file) {
-                file.close();
-                cout << "File '" << args[1] << "' created/updated successfully.\n";
-            } else {
-                cerr << "Error: Failed to create or modify file '" << args[1] << "'.\n";
-            }
+    close_redirects(io);
+}
+
+// Runs a parsed list: "a && b" runs b only if a succeeded, "a || b" only if
+// it failed, "a; b" always and "a &" starts a in the background.
+void execute_list(const CommandList& list) {
+    for (size_t i = 0; i < list.count && !exit_requested; i++) {
+        const ListItem& item = list.items[i];
+        if (item.connector == CONNECT_AND && last_status != 0) continue;
+        if (item.connector == CONNECT_OR && last_status == 0) continue;
+        execute_pipeline(item.pipeline, item.background);
+    }
+}
+
+// Parses and runs one command line. Each nesting level (a command line run
+// from inside another one) gets its own arena, reused from line to line.
+void run_command_line(string_view line) {
+    static thread_local vector<unique_ptr<Arena>> arenas;
+    static thread_local size_t depth = 0;
+
+    struct Level {
+        Arena& arena;
+        Level() : arena(acquire()) {}
+        ~Level() {
+            arena.reset();
+            depth--;
         }
+        static Arena& acquire() {
+            if (depth == arenas.size()) arenas.emplace_back(new Arena());
+            return *arenas[depth++];
+        }
+    } level;
+
+    Parser parser(line, level.arena);
+    CommandList list;
+    if (!parser.parse(list)) {
+        cerr << parser.error << endl;
+        last_status = 2;
+        pipe_status.assign(1, last_status);
         return;
     }
-    else if (command == "rm") {
-        if (args.size() < 2) {
-            cerr << "Error: rm requires a filename.\n";
-        } else {
-            if (remove(args[1].c_str()) == 0) {
-                cout << "File '" << args[1] << "' deleted successfully.\n";
+    execute_list(list);
+}
+
+// Batch mode (-c, a script or piped input): runs one line without
+// prompting, echoing or touching the history. Aliases still apply.
+void run_script_line(string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (aliases.empty()) {
+        run_command_line(line);
+    } else {
+        run_command_line(resolve_alias(string(line)));
+    }
+}
+
+// Runs every line read from fd until end of input or "exit". Input is read
+// in 64 KiB blocks and lines are run straight out of the block; only a line
+// that spans two blocks is copied.
+void run_script(int fd) {
+    const size_t BLOCK_SIZE = 64 * 1024;
+    unique_ptr<char[]> block(new char[BLOCK_SIZE]);
+    string pending;
+    while (!exit_requested) {
+        long n = read(fd, block.get(), BLOCK_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        const char* p = block.get();
+        const char* end = p + n;
+        while (p < end && !exit_requested) {
+            const char* newline = (const char*)memchr(p, '\n', end - p);
+            if (!newline) {
+                pending.append(p, end);
+                break;
+            }
+            if (pending.empty()) {
+                run_script_line(string_view(p, newline - p));
             } else {
-                cerr << "Error: Could not delete file '" << args[1] << "'.\n";
-                if (errno == ENOENT) {
-                    cerr << "File does not exist.\n";
-                }
+                pending.append(p, newline);
+                run_script_line(pending);
+                pending.clear();
             }
+            p = newline + 1;
         }
-        return;
     }
-    else if (command == "cat") {
-        if (args.size() < 2) {
-            cerr << "Error: cat requires a filename.\n";
-        } else {
-            ifstream file(args[1]);
-            if (!file) {
-                cerr << "Error: Cannot open file '" << args[1] << "'.\n";
-            } else {
-                string line;
-                while (getline(file, line)) {
-                    cout << line << endl;
-                }
-                file.close();
-            }
+    if (!pending.empty() && !exit_requested) run_script_line(pending);
+}
+
+bool stdin_is_terminal() {
+#ifdef _WIN32
+    return _isatty(_fileno(stdin)) != 0;
+#else
+    return isatty(STDIN_FILENO) != 0;
+#endif
+}
+
+// Usage: shell               interactive (or batch when stdin is not a terminal)
+//        shell -c <command>  run one command line
+//        shell <script>      run a script file
+#ifdef SHELL_BENCH_MAIN
+// shell_bench: the shell's hot paths timed in-process, so two builds can be
+// compared before one is rolled out. Each case runs in growing batches
+// until one batch takes at least --min-time seconds. Results are printed
+// as a table, or with --json in Google Benchmark's JSON layout so that its
+// compare.py (or a plain JSON diff) can compare two runs.
+struct SuiteCase {
+    const char* name;
+    function<void(long iterations)> run;
+};
+
+struct SuiteResult {
+    string name;
+    long iterations;
+    double real_ns;         // per iteration
+    double cpu_ns;          // shell and foreground children, per iteration
+};
+
+volatile size_t suite_sink;     // keeps results the compiler could drop
+
+SuiteResult suite_measure(const SuiteCase& c, double min_time) {
+    for (long n = 1;; ) {
+        ResourceSnapshot before = ResourceSnapshot::take();
+        c.run(n);
+        ResourceSnapshot after = ResourceSnapshot::take();
+        double seconds = chrono::duration<double>(after.wall - before.wall).count();
+        if (seconds >= min_time || n >= 1000000000L) {
+            double cpu_us = (double)(after.user_us - before.user_us) + (double)(after.sys_us - before.sys_us);
+            return { c.name, n, seconds * 1e9 / n, cpu_us * 1e3 / n };
         }
-        return;
+        double scale = seconds > 0 ? min_time * 1.4 / seconds : 100;
+        n = (long)min(1e9, max(n + 1.0, n * min(scale, 100.0)));
     }
-    else if (command == "cp") {
-        if (args.size() < 3) {
-            cerr << "Error: cp requires source and destination filenames.\n";
-        } else {
-            ifstream src(args[1], ios::binary);
-            ofstream dst(args[2], ios::binary);
-            if (!src || !dst) {
-                cerr << "Error: Could not copy file.\n";
-            } else {
-                dst << src.rdbuf();
-                cout << "File copied from '" << args[1] << "' to '" << args[2] << "'.\n";
-            }
+}
+
+string json_escape(string_view text) {
+    string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if ((unsigned char)c >= 0x20) escaped += c;
+    }
+    return escaped;
+}
+
+void suite_print_json(const vector<SuiteResult>& results, const char* executable) {
+    time_t now = time(nullptr);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    OutputSink& sink = out();
+    sink << "{\n  \"context\": {\n";
+    sink << "    \"date\": \"" << date << "\",\n";
+    sink << "    \"executable\": \"" << json_escape(executable) << "\",\n";
+    sink << "    \"num_cpus\": " << (unsigned long)max(1u, thread::hardware_concurrency()) << ",\n";
+    sink << "    \"scan_kernel\": \"" << scan_kernel.name << "\",\n";
+#ifdef NDEBUG
+    sink << "    \"library_build_type\": \"release\"\n";
+#else
+    sink << "    \"library_build_type\": \"debug\"\n";
+#endif
+    sink << "  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const SuiteResult& r = results[i];
+        string name = json_escape(r.name);
+        sink << (i ? ",\n" : "\n") << "    {\"name\": \"" << name << "\", \"run_name\": \"" << name
+             << "\", \"run_type\": \"iteration\", \"repetitions\": 1, \"repetition_index\": 0, \"threads\": 1, "
+             << "\"iterations\": " << (long long)r.iterations << ", ";
+        sink.printf("\"real_time\": %.3f, \"cpu_time\": %.3f, \"time_unit\": \"ns\"}", r.real_ns, r.cpu_ns);
+    }
+    sink << "\n  ]\n}\n";
+}
+
+int run_bench_suite(int argc, char* argv[]) {
+    install_output();
+    init_signals();
+    double min_time = 0.2;
+    bool json = false, list = false;
+    string filter;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--json") json = true;
+        else if (option == "--list") list = true;
+        else if (option == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if (option == "--min-time" && i + 1 < argc) min_time = atof(argv[++i]);
+        else {
+            cerr << "Usage: shell_bench [--filter TEXT] [--min-time SECONDS] [--json] [--list]\n";
+            return 2;
         }
-        return;
     }
-    else if (command == "mv") {
-        if (args.size() < 3) {
-            cerr << "Error: mv requires source and destination filenames.\n";
-        } else {
-            if (rename(args[1].c_str(), args[2].c_str()) == 0) {
-                cout << "File moved from '" << args[1] << "' to '" << args[2] << "'.\n";
-            } else {
-                cerr << "Error: Could not move file.\n";
+
+    // Fixtures: an 8 MiB text file, a directory of 1000 files, a few dozen
+    // aliases and an rc file of 5000 settings.
+    const long long TEXT_BYTES = 8 << 20;
+    const long DIR_ENTRIES = 1000;
+    string text_path = bench_temp_path("shell_bench_suite.txt");
+    string dir_path = bench_temp_path("shell_bench_suite_dir");
+    string rc_path = bench_temp_path("shell_bench_suite.shellrc");
+    string snapshot_path = bench_temp_path("shell_bench_suite.snap");
+    if (!bench_make_file(text_path, TEXT_BYTES) || !bench_make_directory(dir_path, DIR_ENTRIES) ||
+        !bench_make_rc(rc_path, 5000)) {
+        cerr << "shell_bench: cannot create fixtures under " << bench_temp_path("") << endl;
+        return 1;
+    }
+    MappedFile text;
+    text.open(text_path);
+    for (int i = 0; i < 40; i++) aliases.define("alias" + to_string(i), "ls -l --color=auto dir" + to_string(i));
+    aliases.define("ll", "ls -l");
+
+    const string line = "cat access.log | grep \"GET /index\" | sort | uniq -c > 'top hits.txt' && echo done";
+    const string_view cd_words[] = { "cd", "." };
+    const string_view true_words[] = { "true" };
+    const vector<string> true_argv = { "true" };
+    StringSink discard;
+    auto quiet = [&](const function<void()>& body) {
+        IoScope scope(&discard, nullptr);
+        body();
+        discard.text.clear();
+    };
+
+    const SuiteCase cases[] = {
+        { "parse/pipeline_line", [&](long n) {
+            Arena arena;
+            for (long i = 0; i < n; i++) {
+                Parser parser(line, arena);
+                CommandList list;
+                if (parser.parse(list)) suite_sink = suite_sink + list.count;
+                arena.reset();
+            }
+        } },
+        { "tokenize/pipeline_line", [&](long n) {
+            for (long i = 0; i < n; i++) suite_sink = suite_sink + tokenize(line).size();
+        } },
+        { "resolve_alias/hit", [&](long n) {
+            const string input = "alias17 -R";
+            for (long i = 0; i < n; i++) suite_sink = suite_sink + resolve_alias(input).size();
+        } },
+        { "resolve_alias/miss", [&](long n) {
+            const string input = "grep -rn needle src";
+            for (long i = 0; i < n; i++) suite_sink = suite_sink + resolve_alias(input).size();
+        } },
+        // count_pattern_range replaced split_words; whole-word mode keeps its rules.
+        { "split_words/whole_word_8MiB", [&](long n) {
+            for (long i = 0; i < n; i++) {
+                suite_sink = suite_sink + count_pattern_range(text.data, text.data, text.data + text.size, text.data + text.size,
+                                                              "fox", COUNT_WHOLE_WORD, scan_kernel.find);
+            }
+        } },
+        { "word_frequency/8MiB_1_thread", [&](long n) {
+            for (long i = 0; i < n; i++) {
+                WordCountTable table;
+                count_words_range(text.data, text.data + text.size, table);
+                suite_sink = suite_sink + top_k_words(table, 10).size();
             }
+        } },
+        { "count_word_in_file/8MiB_1_thread", [&](long n) {
+            quiet([&]() {
+                for (long i = 0; i < n; i++) count_word_in_file({ text_path }, { "fox" }, COUNT_WHOLE_WORD, 1, scan_kernel.find);
+            });
+        } },
+        { "autocomplete/command", [&](long n) {
+            quiet([&]() {
+                for (long i = 0; i < n; i++) {
+                    string input = "gr";
+                    autocomplete(input);
+                    suite_sink = suite_sink + input.size();
+                }
+            });
+        } },
+        { "autocomplete/path_1000_entries", [&](long n) {
+            quiet([&]() {
+                for (long i = 0; i < n; i++) {
+                    string input = "cat " + dir_path + "/f00005";
+                    autocomplete(input);
+                    suite_sink = suite_sink + input.size();
+                }
+            });
+        } },
+        { "execute_command/builtin", [&](long n) {
+            for (long i = 0; i < n; i++) execute_command(Args(cd_words, 2));
+        } },
+        { "run_command_line/builtin", [&](long n) {
+            for (long i = 0; i < n; i++) run_command_line("cd .");
+        } },
+        { "spawn/true", [&](long n) {
+            for (long i = 0; i < n; i++) runExternal(true_argv);
+        } },
+        { "execute_command/program", [&](long n) {
+            for (long i = 0; i < n; i++) execute_command(Args(true_words, 1));
+        } },
+        { "pipeline/true_true", [&](long n) {
+            for (long i = 0; i < n; i++) run_command_line("true | true");
+        } },
+        { "pipeline/builtin_3_stages", [&](long n) {
+            quiet([&]() {
+                for (long i = 0; i < n; i++) run_command_line("pwd | cat | cat");
+            });
+        } },
+        // These two replace the aliases above with the rc file's.
+        { "load_rc/parsed_5000_lines", [&](long n) {
+            set_environment("SHELL_RC", rc_path);
+            set_environment("SHELL_RC_SNAPSHOT", "0");
+            for (long i = 0; i < n; i++) {
+                aliases.clear();
+                suite_sink = suite_sink + load_rc().settings;
+            }
+        } },
+        { "load_rc/snapshot_5000_lines", [&](long n) {
+            set_environment("SHELL_RC", rc_path);
+            set_environment("SHELL_RC_SNAPSHOT", snapshot_path);
+            load_rc();
+            for (long i = 0; i < n; i++) {
+                aliases.clear();
+                suite_sink = suite_sink + load_rc().settings;
+            }
+        } },
+    };
+
+    vector<SuiteResult> results;
+    for (const auto& c : cases) {
+        if (!filter.empty() && string(c.name).find(filter) == string::npos) continue;
+        if (list) {
+            cout << c.name << '\n';
+            continue;
         }
-        return;
+        results.push_back(suite_measure(c, min_time));
     }
-    else if (command == "time") {
-        SYSTEMTIME st;
-        GetLocalTime(&st);
-        printf("Current time: %02d:%02d:%02d\n", st.wHour, st.wMinute, st.wSecond);
-        return;
-    }
-    else {
-        string cmd;
-        for (const auto& arg : args) cmd += arg + " ";
+    text.close();
+    remove(text_path.c_str());
+    bench_remove_directory(dir_path, DIR_ENTRIES);
+    remove(rc_path.c_str());
+    remove(snapshot_path.c_str());
 
-        if (cmd.find(".exe") != string::npos || command == "notepad" || command == "calc") {
-            system(("start \"\" " + cmd).c_str());
-        } else {
-            system(cmd.c_str());
+    if (json) {
+        suite_print_json(results, argv[0]);
+    } else if (!list) {
+        out().printf("%-34s %12s %14s %14s\n", "case", "iterations", "real ns/op", "cpu ns/op");
+        for (const auto& r : results) {
+            out().printf("%-34s %12ld %14.1f %14.1f\n", r.name.c_str(), r.iterations, r.real_ns, r.cpu_ns);
         }
     }
+    flush_output();
+    return 0;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    return run_bench_suite(argc, argv);
+}
+#else
+int main(int argc, char* argv[]) {
     string input;
-    vector<string> args;
-    
+
+    install_output();
     init_signals();
+    if (const char* size = getenv("SHELL_PIPE_SIZE")) pipe_buffer_size = atol(size);
+    if (const char* level = getenv("SHELL_VERBOSE")) verbosity = atoi(level);
+    if (argc > 1 && strcmp(argv[1], "--startup-profile") == 0) {
+        startup_profile.enabled = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    startup_profile.mark("init");
+    RcLoad rc = load_rc();
+    startup_profile.mark("rc " + string(rc.source) + " (" + to_string(rc.settings) + " settings)");
+
+    if (argc > 1) {
+        string option = argv[1];
+        if (option == "-c") {
+            if (argc < 3) {
+                cerr << "shell: -c requires an argument\n";
+                return 2;
+            }
+            aliases.load(alias_file_path());
+            startup_profile.mark("alias file");
+            startup_profile.print();
+            run_script_line(argv[2]);
+            return last_status;
+        }
+        if (option.size() > 1 && option[0] == '-') {
+            cerr << "Usage: shell [--startup-profile] [-c command | script]\n";
+            return 2;
+        }
+        int fd = open(argv[1], O_RDONLY | O_BINARY);
+        if (fd < 0) {
+            cerr << "shell: cannot open '" << argv[1] << "': " << strerror(errno) << endl;
+            return 127;
+        }
+        aliases.load(alias_file_path());
+        startup_profile.mark("alias file");
+        startup_profile.print();
+        run_script(fd);
+        close(fd);
+        return last_status;
+    }
+
+    aliases.load(alias_file_path());
+    startup_profile.mark("alias file");
+    startup_profile.print();
+    if (!stdin_is_terminal()) {
+        run_script(0);
+        return last_status;
+    }
 
     if (!authenticateShell()) {
         cout << "Incorrect password. Exiting shell.\n";
@@ -998,43 +10384,17 @@ int main() {
     cout << "Custom Shell (type 'help' for commands)\n";
 
     while (true) {
-        cout << "\nShell> ";
+        reportFinishedJobs();
+        cout << "\n" << shellPrompt;
+        flush_output();
 
         input = get_input_with_features();
         if (input.empty()) continue;
-        if (input == "exit") break;
 
-        // Check for pipe or redirection
-        if (input.find('|') != string::npos) {
-            runPipedCommand(input);
-            continue;
-        }
-        if (input.find('>') != string::npos || input.find('<') != string::npos) {
-            runWithRedirection(input);
-            continue;
-        }
-
-        args.clear();
-        bool in_quotes = false;
-        string current;
-        for (char c : input) {
-            if (c == '"') {
-                in_quotes = !in_quotes;
-                continue;
-            }
-            if (isspace(c) && !in_quotes) {
-                if (!current.empty()) {
-                    args.push_back(current);
-                    current.clear();
-                }
-            } else {
-                current += c;
-            }
-        }
-        if (!current.empty()) args.push_back(current);
-
-        execute_command(args);
+        run_command_line(input);
+        if (exit_requested) break;
     }
 
-    return 0;
-} 
\ No newline at end of file
+    return last_status;
+}
+#endif
@@ -0,0 +1,253 @@
+#!/bin/sh
+# Golden-output checks run through "shell -c" (and piped input where a
+# feature only exists there). Usage: shell_checks.sh path/to/shell
+set -u
+SHELL_BIN=$1
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failures=0
+
+# Keep the user's history, aliases, rc file and cache out of it.
+HOME=$WORK
+SHELL_RC=$WORK/no-rc
+SHELL_RC_SNAPSHOT=0
+SHELL_CACHE_DIR=$WORK/cache
+export HOME SHELL_RC SHELL_RC_SNAPSHOT SHELL_CACHE_DIR
+unset SHELL_ALIASES SHELL_HISTORY
+
+# check NAME EXPECTED ACTUAL
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        echo "  expected: $2"
+        echo "  actual:   $3"
+        failures=$((failures + 1))
+    fi
+}
+
+# run NAME EXPECTED COMMAND: what "shell -c COMMAND" prints on both streams
+run() {
+    check "$1" "$2" "$("$SHELL_BIN" -c "$3" 2>&1)"
+}
+
+# status NAME EXPECTED COMMAND: the exit status of "shell -c COMMAND"
+status() {
+    "$SHELL_BIN" -c "$3" > /dev/null 2>&1
+    check "$1" "$2" "$?"
+}
+
+# Parser
+run "quotes and escapes" "a b it's \"q\"" "echo a\\ b \"it's\" '\"q\"'"
+run "comment" "x" "echo x # comment"
+run "nested \$(...)" "a b" 'echo $(echo a $(echo b))'
+run "\$(...) inside quotes" "xyz" 'echo "x$(echo y)z"'
+run "unterminated quote" "syntax error: unterminated quote" 'echo "open'
+run "pipe at end" "syntax error: unexpected end of line" "echo a |"
+run "leading pipe" "syntax error: unexpected token '|'" "| echo"
+run "doubled &&" "syntax error: unexpected token '&&'" "echo a && && echo b"
+status "syntax error status" 2 "echo a >"
+run "unknown command" "nosuchcmd_xyz: command not found" "nosuchcmd_xyz"
+status "unknown command status" 127 "nosuchcmd_xyz"
+status "exit status" 7 "exit 7"
+
+# Lists
+run ";" "a
+b" "echo a; echo b"
+run "&& after success" "yes" "true && echo yes || echo no"
+run "|| after failure" "no" "false && echo yes || echo no"
+run "|| chain" "third" "false || false || echo third"
+run "&& stops the chain" "next" "true && false && echo no; echo next"
+
+# Redirection
+run "> then >>" "one
+two" "echo one > f; echo two >> f; cat f"
+run "2>" "err" 'sh -c "echo err >&2" 2> e; cat e'
+run "&>" "out
+err" 'sh -c "echo out; echo err >&2" &> both; cat both'
+run "<<<" "here string" 'cat <<< "here string"'
+run "< and pipe to file" "HI" "echo hi | tr a-z A-Z > up; cat < up"
+check "2>&1 > file under \$(...)" "[err]" \
+    "$("$SHELL_BIN" -c 'echo "[$(sh -c "echo out; echo err >&2" 2>&1 > out.txt)]"' 2>/dev/null)"
+check "2>&1 > file stdout" "out" "$(cat out.txt)"
+run "> file 2>&1" "" 'sh -c "echo out; echo err >&2" > both2.txt 2>&1'
+check "> file 2>&1 file" "out
+err" "$(cat both2.txt)"
+
+# Pipelines
+run "builtin and program stages" "piped" "echo piped | cat | cat"
+run "pipestatus" "0 1 0" "true | false | true; pipestatus"
+run "pipestatus of a failed stage" "3 0" 'sh -c "exit 3" | true; pipestatus'
+run "pipestatus of a missing command" "nosuchcmd_xyz: command not found
+127 0" "nosuchcmd_xyz | true; pipestatus"
+seq 1 200000 > big.txt
+run "cat into a closed pipe is quiet" "1" "cat big.txt | head -n 1"
+
+# calc: double by default, -i 64-bit integers, -b big integers
+run "calc precedence" "7" "calc 1 + 2 * 3"
+run "calc parentheses" "9" 'calc "(1 + 2) * 3"'
+run "calc ^ is right-associative" "512" "calc 2 ^ 3 ^ 2"
+run "calc unary minus below ^" "-2 ^ 2 = -4" "calc -2 ^ 2"
+run "calc a op b form" "7 / 2 = 3.5" "calc 7 / 2"
+run "calc functions" "9" "calc 'sqrt(16) + max(1, 5)'"
+run "calc -i division" "3" "calc -i 7 / 2"
+run "calc -i remainder" "1" "calc -i 7 % 3"
+run "calc -i overflow" "Error: Integer overflow" "calc -i 9223372036854775807 + 1"
+run "calc -b power" "1267650600228229401496703205376" "calc -b 2 ^ 100"
+run "calc -b precedence" "14" 'calc -b "(10 - 4) * 3 - 20 / 5"'
+run "calc division by zero" "Error: Division by zero" "calc 1 / 0"
+run "calc syntax error" "Error: unexpected end of expression at column 4" 'calc "1 +"'
+printf '1 2\n3 4\n' > nums
+run "calc columns from a file" "3
+7" 'calc -f nums "$1 + $2"'
+run "calc columns from stdin" "2
+12" 'calc -f - "$1 * $2" < nums'
+run "calc -s sum" "14" 'calc -s -f nums "$1 * $2"'
+run "calc lines from stdin" "2
+6" 'printf "1+1\n2*3\n" | calc'
+
+# wordfreq and count against known counts
+printf 'the cat the dog\nThe end, the.\n' > words1
+run "wordfreq" "Top 2 most frequent words in 'words1':
+the            : 4
+cat            : 1" "wordfreq -k 2 words1"
+run "count whole word" "Word 'the' appears 4 times in 'words1'" "count words1 the"
+run "count substring" "Substring 'he' appears 4 times in 'words1'" "count -s words1 he"
+run "count several words" "words1: 'the' 4, 'dog' 1" "count -e the -e dog words1"
+run "count word with punctuation" "Word 'th-e' appears 0 times in 'words1'" "count words1 th-e"
+
+# count: "ab\n" repeated puts a word across the 1 MiB block edge.
+yes ab | head -n 400000 > edge.txt
+run "count across a block edge" "Word 'ab' appears 400000 times in 'edge.txt'" "count edge.txt ab"
+run "substring count across a block edge" "Substring 'ab' appears 400000 times in 'edge.txt'" "count -s edge.txt ab"
+
+# Result cache: a truncated entry is a miss, not a read past its end.
+yes "alpha beta gamma beta" | head -n 2000 > words2
+expected=$("$SHELL_BIN" -c 'wordfreq -k 3 words2')
+for entry in "$WORK"/cache/*.rc; do
+    head -c 90 "$entry" > "$entry.cut" && mv "$entry.cut" "$entry"
+done
+run "truncated cache entry" "$expected" "wordfreq -k 3 words2"
+
+# Jobs
+status "wait returns the job's status" 4 'sh -c "exit 4" & wait 1'
+status "kill" 143 "sleep 5 & kill 1; wait 1"
+check "jobs" "[N] N started in background
+Active Background Jobs:
+[N] PID: N Command: sleep N  Status: Running" \
+    "$("$SHELL_BIN" -c 'sleep 1 & jobs' | sed 's/[0-9][0-9]*/N/g')"
+run "wait for no such job" "wait: no such job: 3" "wait 3"
+run "fg for no such job" "Error: Job ID not found." "fg 3"
+
+# schedule
+run "schedule and cancel" "Scheduled [1]: \"echo hi\" in 30 seconds.
+[1] in 30s: echo hi
+Cancelled scheduled command [1]." "schedule echo hi at 30; schedule list; schedule cancel 1; schedule list"
+run "schedule every" "Scheduled [1]: \"echo hi\" every 10 seconds." "schedule echo hi every 10"
+run "schedule cancel unknown" "schedule: no such task: 9" "schedule cancel 9"
+for bad in "at 25:00" "at 12:61" "at 12:30x" "at 5s" "at 1.5" "at -3" "every 0"; do
+    run "schedule rejects $bad" "Error: Invalid argument. Usage: schedule <cmd> at|every <time>" "schedule echo hi $bad"
+done
+
+# parallel: input order by default, finishing order with --completed
+run "parallel keeps input order" "6
+1
+3" 'parallel -j 3 sh -c "sleep 0.$0; echo $0" ::: 6 1 3'
+run "parallel --completed" "1
+3
+6" 'parallel -j 3 --completed sh -c "sleep 0.$0; echo $0" ::: 6 1 3'
+run "parallel {}" "a x
+b x" "parallel echo {} x ::: a b"
+run "parallel from stdin" "got x
+got y" 'printf "x\ny\n" | parallel echo got'
+run "parallel failures" "parallel: 2 of 3 tasks failed" 'parallel sh -c "exit $0" ::: 0 1 2'
+run "parallel --retries" "try
+try
+try" "parallel --retries 2 sh -c 'echo try >> tries; [ \$(wc -l < tries) -ge 3 ]' ::: a; cat tries"
+
+# find and grep
+mkdir -p tree/a/b tree/c
+: > tree/a/one.txt
+echo "needle here" > tree/a/b/two.txt
+echo "no" > tree/c/three.log
+echo "Needle top" > tree/top.txt
+run "find" "tree
+tree/a
+tree/a/b
+tree/a/b/two.txt
+tree/a/one.txt
+tree/c
+tree/c/three.log
+tree/top.txt" "find tree --sort"
+run "find -name" "tree/a/b/two.txt
+tree/a/one.txt
+tree/top.txt" 'find tree -name "*.txt" --sort'
+run "find -type d" "tree
+tree/a
+tree/a/b
+tree/c" "find tree -type d --sort"
+run "find -maxdepth" "tree
+tree/a
+tree/c
+tree/top.txt" "find tree -maxdepth 1 --sort"
+run "grep -r" "tree/a/b/two.txt:needle here" "grep -r --sort needle tree"
+run "grep -ri" "tree/a/b/two.txt:needle here
+tree/top.txt:Needle top" "grep -ri --sort needle tree"
+run "grep -rc" "tree/a/b/two.txt:1
+tree/a/one.txt:0
+tree/c/three.log:0
+tree/top.txt:0" "grep -rc --sort needle tree"
+run "grep -r on one file has no names" "needle here" "grep -r needle tree/a/b/two.txt"
+run "grep -n on two files" "tree/a/b/two.txt:1:needle here" "grep -n here tree/a/b/two.txt tree/top.txt"
+run "grep stdin" "abc" "echo abc | grep b"
+run "grep -v" "no" "grep -v x tree/c/three.log"
+status "grep without a match" 1 "grep zzz tree/top.txt"
+check "grep -r with no path" "a/b/two.txt:needle here" "$(cd tree && "$SHELL_BIN" -c 'grep -r needle')"
+
+# ls
+run "ls" "a  c  top.txt  " "ls tree"
+run "ls -R" "tree:
+a  c  top.txt  
+
+tree/a:
+b  one.txt  
+
+tree/a/b:
+two.txt  
+
+tree/c:
+three.log  " "ls -R tree"
+
+# history
+printf 'ls\necho one\necho two\ngrep x\n' > history.txt
+check "history" "Command history (last 2 commands):
+  3: echo two
+  4: grep x" "$(SHELL_HISTORY="$WORK/history.txt" "$SHELL_BIN" -c 'history 2')"
+
+# Aliases: defined on one line, used on the next; the alias file applies
+# to -c, scripts and piped input alike.
+printf 'alias g="echo hi"\ng there\n' > alias-lines
+check "alias from piped input" "hi there" "$("$SHELL_BIN" < alias-lines)"
+run "alias list and unalias" "alias g='echo hi'" "alias g='echo hi'; alias; unalias g; alias"
+run "type" "a2 is aliased to 'a1 y'
+a1 is aliased to 'echo x'
+cd is a shell builtin" "alias a1='echo x'; alias a2='a1 y'; type a2 a1 cd"
+echo 'e1=echo from the alias file' > aliases.txt
+check "alias file under -c" "from the alias file" "$(SHELL_ALIASES="$WORK/aliases.txt" "$SHELL_BIN" -c 'e1')"
+echo e1 > script.sh
+check "alias file in a script" "from the alias file" "$(SHELL_ALIASES="$WORK/aliases.txt" "$SHELL_BIN" script.sh)"
+
+# rc snapshot: parsed on the first start, mapped on the second, same aliases.
+echo 'alias hi=echo hello from rc' > rc
+for run in parsed snapshot; do
+    check "rc $run" "hello from rc" \
+        "$(echo hi | SHELL_RC="$WORK/rc" SHELL_RC_SNAPSHOT="$WORK/rc.snap" "$SHELL_BIN")"
+done
+check "rc snapshot written" "yes" "$([ -s rc.snap ] && echo yes)"
+check "rc snapshot used" "1" \
+    "$(SHELL_RC="$WORK/rc" SHELL_RC_SNAPSHOT="$WORK/rc.snap" "$SHELL_BIN" --startup-profile < /dev/null 2>&1 |
+       grep -c 'rc snapshot')"
+
+[ "$failures" -eq 0 ]